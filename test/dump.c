@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <xml.h>
+
+#include "dump.h"
+
+/**
+ * Dump arguments of given XML element
+ *
+ * @param out - output stream
+ * @param e - XML element
+ */
+void dump_arguments(FILE *out, struct xml_element *e) {
+	struct xml_attribute *a = e->first_attribute;
+
+	for (; a; a = a->next) {
+		fprintf(out, " %s=\"%s\"", a->key, a->value);
+	}
+}
+
+/**
+ * Dump XML
+ *
+ * @param out - output stream
+ * @param e - XML element
+ */
+void dump_xml(FILE *out, struct xml_element *e) {
+	if (!e) {
+		return;
+	}
+
+	if (!e->value) {
+		struct xml_element *c;
+
+		if (e->key) {
+			fprintf(out, "<%s", e->key);
+			dump_arguments(out, e);
+
+			if (*e->key == '?' || *e->key == '!') {
+				fprintf(out, ">");
+				return;
+			}
+
+			if (!e->first_child) {
+				fprintf(out, "/>");
+				return;
+			}
+
+			fprintf(out, ">");
+		}
+
+		for (c = e->first_child; c; c = c->next) {
+			dump_xml(out, c);
+		}
+
+		if (e->key) {
+			fprintf(out, "</%s>", e->key);
+		}
+	} else {
+		fprintf(out, "%s", xml_value(e));
+	}
+}
+
+/**
+ * Dump XML as string
+ *
+ * @param out - output stream
+ * @param e - XML element
+ */
+void dump_string(FILE *out, struct xml_element *e) {
+	char *s = xml_content(e);
+
+	if (s) {
+		fprintf(out, "%s\n", s);
+		free(s);
+	}
+}
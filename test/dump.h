@@ -0,0 +1,14 @@
+#ifndef _dump_h_
+#define _dump_h_
+
+#include <stdio.h>
+
+#include <xml.h>
+
+/* dump functions shared by the test programs */
+
+void dump_arguments(FILE *, struct xml_element *);
+void dump_xml(FILE *, struct xml_element *);
+void dump_string(FILE *, struct xml_element *);
+
+#endif
@@ -1,170 +1,1247 @@
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <xml.h>
+#include <xml_adaptive.h>
+#include <xml_binary.h>
+#include <xml_cache.h>
+#include <xml_compress.h>
+#include <xml_flatten.h>
+#include <xml_fulltext.h>
+#include <xml_image.h>
+#include <xml_include.h>
+#include <xml_mapped.h>
+#include <xml_prefilter.h>
+#include <xml_rcu.h>
+#include <xml_schema.h>
+#include <xml_skeleton.h>
+#include <xml_store.h>
+#include <xml_template.h>
+
+#include "dump.h"
 
 struct search {
 	struct search *next;
 	char *pattern;
 };
 
-/**
- * Dump arguments of given XML element
- *
- * @param e - XML element
- */
-void dump_arguments(struct xml_element *e) {
-	struct xml_attribute *a = e->first_attribute;
+struct job {
+	/* XML string or file name and the options in effect for it */
+	const char *d;
+	struct search *s;
+	void (*dump)(FILE *, struct xml_element *);
+
+	/* full-text query, may be NULL */
+	const char *query;
+
+	/* round trip parsed documents through the binary token format */
+	int binary;
+
+	/* read files in binary token format instead of XML */
+	int decode;
+
+	/* skip files that can't contain any search path */
+	int prefilter;
+
+	/* look up search paths in a mapped image of the tree */
+	int image;
+
+	/* parse into a file-backed arena instead of malloc() */
+	int mapped;
+
+	/* parse into buffers of the size counted beforehand */
+	int counted;
+
+	/* skeleton to parse documents speculatively with, may be NULL */
+	struct xml_skeleton *skeleton;
+
+	/* print the work done for every search path */
+	int explain;
+
+	/* print the document from a builder instead of parsing a tree */
+	int build;
+
+	/* index search paths that visited this many elements, 0 to
+	 * always scan, and bytes paths and indexes may take */
+	size_t adaptive;
+	size_t adaptive_limit;
+
+	/* compress character data of at least this many bytes */
+	size_t compress;
+
+	/* resolve include elements on this many threads, 0 to keep them */
+	int include;
+
+	/* shared cache to load plain files from, may be NULL */
+	struct xml_cache *cache;
+
+	/* schema to validate against, may be NULL */
+	struct xml_schema *schema;
+
+	/* template to render instead of dumping, may be NULL */
+	struct xml_template *template;
+
+	/* output stream and, for parallel jobs, its buffer */
+	FILE *out;
+	char *buffer;
+	size_t length;
+
+	/* statistics */
+	size_t bytes;
+	double seconds;
+	int result;
+	int done;
+};
+
+/* builder that prints the document back without building a tree */
+struct echo {
+	/* must be first so the builder can be cast back */
+	struct xml_builder builder;
+
+	FILE *out;
+
+	/* start tag still needs its '>' */
+	int pending;
+};
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	struct job *jobs;
+	size_t count;
+	size_t next;
+};
+
+/**
+ * Print (path, value) row
+ *
+ * @param path - path
+ * @param path_len - length of path
+ * @param value - value
+ * @param value_len - length of value
+ * @param user - output stream
+ */
+int print_row(
+		const char *path,
+		size_t path_len,
+		const char *value,
+		size_t value_len,
+		void *user) {
+	fprintf(user, "%.*s = %.*s\n", (int) path_len, path,
+		(int) value_len, value);
+
+	return 0;
+}
+
+/**
+ * Dump XML as (path, value) rows
+ *
+ * @param out - output stream
+ * @param e - XML element
+ */
+void dump_flat(FILE *out, struct xml_element *e) {
+	struct xml_flatten *f = xml_flatten_create(print_row, out);
+
+	if (f) {
+		xml_flatten_tree(f, e);
+		xml_flatten_free(f);
+	}
+}
+
+/**
+ * Finish start tag of last element if it has content
+ *
+ * @param e - echo builder
+ */
+void echo_content(struct echo *e) {
+	if (e->pending) {
+		fprintf(e->out, ">");
+		e->pending = 0;
+	}
+}
+
+/**
+ * Print start tag
+ *
+ * @param b - echo builder
+ * @param name - tag name
+ * @param len - length of name
+ */
+int echo_open(struct xml_builder *b, const char *name, size_t len) {
+	struct echo *e = (struct echo *) b;
+
+	echo_content(e);
+	fprintf(e->out, "<%.*s", (int) len, name);
+	e->pending = 1;
+
+	return 0;
+}
+
+/**
+ * Print attribute
+ *
+ * @param b - echo builder
+ * @param key - attribute key
+ * @param key_len - length of key
+ * @param value - attribute value, may be NULL
+ * @param value_len - length of value
+ */
+int echo_attribute(
+		struct xml_builder *b,
+		const char *key,
+		size_t key_len,
+		const char *value,
+		size_t value_len) {
+	struct echo *e = (struct echo *) b;
+
+	fprintf(e->out, " %.*s", (int) key_len, key);
+
+	if (value) {
+		fprintf(e->out, "=\"%.*s\"", (int) value_len, value);
+	}
+
+	return 0;
+}
+
+/**
+ * Print end tag or end of empty element
+ *
+ * @param b - echo builder
+ * @param name - tag name
+ * @param len - length of name
+ */
+int echo_close(struct xml_builder *b, const char *name, size_t len) {
+	struct echo *e = (struct echo *) b;
+
+	if (e->pending) {
+		fprintf(e->out, "/>");
+		e->pending = 0;
+	} else {
+		fprintf(e->out, "</%.*s>", (int) len, name);
+	}
+
+	return 0;
+}
+
+/**
+ * Print character data
+ *
+ * @param b - echo builder
+ * @param s - data
+ * @param len - length of data
+ */
+int echo_text(struct xml_builder *b, const char *s, size_t len) {
+	struct echo *e = (struct echo *) b;
+
+	echo_content(e);
+	fprintf(e->out, "%.*s", (int) len, s);
+
+	return 0;
+}
+
+/**
+ * Print special tag
+ *
+ * @param b - echo builder
+ * @param s - tag data
+ * @param len - length of data
+ */
+int echo_special(struct xml_builder *b, const char *s, size_t len) {
+	struct echo *e = (struct echo *) b;
+
+	echo_content(e);
+	fprintf(e->out, "<%.*s>", (int) len, s);
+
+	return 0;
+}
+
+/**
+ * Dump only matching elements
+ *
+ * @param out - output stream
+ * @param e - root element
+ * @param s - search elements
+ * @param dump - dump function
+ */
+void dump_matching(
+		FILE *out,
+		struct xml_element *root,
+		struct search *s,
+		void (*dump)(FILE *, struct xml_element *)) {
+	struct xml_element *e;
+
+	for (; s; s = s->next) {
+		for (e = xml_find(root, s->pattern);
+				e;
+				e = xml_find_next(e, s->pattern)) {
+			dump(out, e);
+		}
+	}
+}
+
+/**
+ * Dump elements whose character data matches a full-text query
+ *
+ * @param out - output stream
+ * @param root - root element
+ * @param query - terms and "quoted phrases"
+ * @param dump - dump function
+ */
+void dump_fulltext(
+		FILE *out,
+		struct xml_element *root,
+		const char *query,
+		void (*dump)(FILE *, struct xml_element *)) {
+	struct xml_fulltext *ft = xml_fulltext_create(root);
+	struct xml_element **hits;
+	size_t n;
+	size_t i;
+
+	if (!ft) {
+		fprintf(stderr, "error: cannot index document\n");
+		return;
+	}
+
+	if ((n = xml_fulltext_search(ft, query, NULL, 0)) > 0 &&
+			(hits = malloc(n * sizeof(struct xml_element *)))) {
+		xml_fulltext_search(ft, query, hits, n);
+
+		for (i = 0; i < n; ++i) {
+			dump(out, hits[i]);
+		}
+
+		free(hits);
+	}
+
+	xml_fulltext_free(ft);
+}
+
+/**
+ * Return copy of parsed character data with predefined entities
+ * replaced since the template escapes values again
+ *
+ * @param s - character data, may be NULL
+ */
+char *unescape(const char *s) {
+	static const char *entities[][2] = {
+		{"&amp;", "&"},
+		{"&lt;", "<"},
+		{"&gt;", ">"},
+		{"&quot;", "\""},
+		{"&apos;", "'"},
+		{NULL, NULL}
+	};
+	char *r;
+	char *t;
+
+	if (!s || !(t = r = malloc(strlen(s) + 1))) {
+		return NULL;
+	}
+
+	while (*s) {
+		int i;
+
+		for (i = 0; entities[i][0]; ++i) {
+			size_t l = strlen(entities[i][0]);
+
+			if (!strncmp(s, entities[i][0], l)) {
+				*t++ = *entities[i][1];
+				s += l;
+				break;
+			}
+		}
+
+		if (!entities[i][0]) {
+			*t++ = *s++;
+		}
+	}
+
+	*t = 0;
+
+	return r;
+}
+
+/**
+ * Render template with attributes of element and its character data
+ * for slot "."
+ *
+ * @param out - output stream
+ * @param e - XML element
+ * @param t - template
+ */
+void dump_template(FILE *out, struct xml_element *e, struct xml_template *t) {
+	size_t n = xml_template_slot_count(t);
+	char **values = calloc(n + 1, sizeof(char *));
+	int fd = fileno(out);
+	size_t i;
+
+	if (!values) {
+		return;
+	}
+
+	for (i = 0; i < n; ++i) {
+		const char *name = xml_template_slot_name(t, i);
+		struct xml_attribute *a;
+
+		if (!strcmp(name, ".")) {
+			char *content = xml_content(e);
+
+			values[i] = unescape(content);
+			free(content);
+		} else if ((a = xml_find_attribute(e->first_attribute, name))) {
+			values[i] = unescape(a->value);
+		}
+	}
+
+	if (fd > -1) {
+		/* write directly to the file descriptor */
+		fflush(out);
+		xml_template_write(t, fd, (const char **) values);
+	} else {
+		size_t l = xml_template_render(t, (const char **) values, NULL, 0);
+		char *buf = malloc(l + 1);
+
+		if (buf) {
+			xml_template_render(t, (const char **) values, buf, l + 1);
+			fwrite(buf, 1, l, out);
+			free(buf);
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		free(values[i]);
+	}
+
+	free(values);
+}
+
+/**
+ * Render template for matching elements or the document element
+ *
+ * @param out - output stream
+ * @param root - root element
+ * @param s - search elements
+ * @param t - template
+ */
+void dump_templates(
+		FILE *out,
+		struct xml_element *root,
+		struct search *s,
+		struct xml_template *t) {
+	struct xml_element *e;
+
+	if (!s) {
+		for (e = root->first_child; e; e = e->next) {
+			if (e->key && *e->key != '?' && *e->key != '!') {
+				dump_template(out, e, t);
+				break;
+			}
+		}
+	}
+
+	for (; s; s = s->next) {
+		for (e = xml_find(root, s->pattern);
+				e;
+				e = xml_find_next(e, s->pattern)) {
+			dump_template(out, e, t);
+		}
+	}
+}
+
+/**
+ * Return true if file may contain any of the searched paths
+ *
+ * @param fd - file descriptor, rewound afterwards
+ * @param s - search patterns
+ */
+int candidate(int fd, struct search *s) {
+	struct xml_prefilter *pf = xml_prefilter_create();
+	char buf[65536];
+	int bytes;
+	int r = 0;
+
+	if (!pf) {
+		return 1;
+	}
+
+	for (; s; s = s->next) {
+		if (xml_prefilter_add(pf, s->pattern)) {
+			xml_prefilter_free(pf);
+			return 1;
+		}
+	}
+
+	xml_prefilter_reset(pf);
+
+	while (!r && (bytes = read(fd, buf, sizeof(buf))) > 0) {
+		r = xml_prefilter_feed(pf, buf, bytes);
+	}
+
+	xml_prefilter_free(pf);
+	lseek(fd, 0, SEEK_SET);
+
+	return r != 0;
+}
+
+/**
+ * Report parse error
+ *
+ * @param v - validator, may be NULL
+ */
+void parse_error(struct xml_validator *v) {
+	size_t offset;
+	const char *error = v ? xml_validator_error(v, &offset) : NULL;
+
+	if (error) {
+		fprintf(stderr, "error: %s at byte %lu\n",
+			error,
+			(unsigned long) offset);
+	} else {
+		perror("xml_parse");
+	}
+}
+
+/**
+ * Print character data of image node
+ *
+ * @param out - output stream
+ * @param img - image
+ * @param n - node
+ */
+void dump_image_string(
+		FILE *out,
+		const struct xml_image *img,
+		const struct xml_image_node *n) {
+	char *s = xml_image_content(img, n);
+
+	if (s) {
+		fprintf(out, "%s\n", s);
+		free(s);
+	}
+}
+
+/**
+ * Write tree into an image, map it and print the character data of
+ * all matching nodes or of the whole image without search paths
+ *
+ * @param out - output stream
+ * @param root - root element
+ * @param s - search elements
+ */
+void image_matching(FILE *out, struct xml_element *root, struct search *s) {
+	const struct xml_image *img;
+	const struct xml_image_node *n;
+	int fd;
+
+	if ((fd = xml_image_create(root)) < 0) {
+		fprintf(stderr, "error: cannot create image\n");
+		return;
+	}
+
+	img = xml_image_map(fd);
+	close(fd);
+
+	if (!img) {
+		fprintf(stderr, "error: cannot map image\n");
+		return;
+	}
+
+	if (!s) {
+		dump_image_string(out, img, xml_image_root(img));
+	}
+
+	for (; s; s = s->next) {
+		for (n = xml_image_find(img, xml_image_root(img), s->pattern);
+				n;
+				n = xml_image_find_next(img, n, s->pattern)) {
+			dump_image_string(out, img, n);
+		}
+	}
+
+	xml_image_unmap(img);
+}
+
+/**
+ * Dump matching elements followed by a table of the work the search
+ * took for every path step
+ *
+ * @param out - output stream
+ * @param root - root element
+ * @param s - search list
+ * @param dump - dump function
+ */
+void explain_matching(
+		FILE *out,
+		struct xml_element *root,
+		struct search *s,
+		void (*dump)(FILE *, struct xml_element *)) {
+	for (; s; s = s->next) {
+		struct xml_explain x;
+		struct xml_element *e;
+		size_t len;
+		char *buf;
+
+		memset(&x, 0, sizeof(x));
+
+		for (e = xml_find_explain(root, s->pattern, &x);
+				e;
+				e = xml_find_next_explain(e, s->pattern, &x)) {
+			dump(out, e);
+		}
+
+		len = xml_explain_format(&x, s->pattern, NULL, 0);
+
+		if ((buf = malloc(len + 1))) {
+			xml_explain_format(&x, s->pattern, buf, len + 1);
+			fprintf(out, "explain ?%s\n%s", s->pattern, buf);
+			free(buf);
+		}
+	}
+}
+
+struct adaptive_dump {
+	FILE *out;
+	void (*dump)(FILE *, struct xml_element *);
+};
+
+/**
+ * Dump element found by adaptive query
+ *
+ * @param e - XML element
+ * @param user - output stream and dump function
+ */
+int adaptive_dump(struct xml_element *e, void *user) {
+	struct adaptive_dump *d = user;
+
+	d->dump(d->out, e);
+
+	return 0;
+}
+
+/**
+ * Dump matching elements through adaptive indexes; waits for indexes
+ * after every search to be reproducible
+ *
+ * @param out - output stream
+ * @param root - root element
+ * @param s - search list
+ * @param dump - dump function
+ * @param threshold - cost after which paths are indexed
+ * @param limit - bytes paths and indexes may take
+ */
+void adaptive_matching(
+		FILE *out,
+		struct xml_element *root,
+		struct search *s,
+		void (*dump)(FILE *, struct xml_element *),
+		size_t threshold,
+		size_t limit) {
+	struct xml_adaptive *a = xml_adaptive_create(root, threshold, limit);
+	struct adaptive_dump d;
+	size_t scans;
+	size_t indexed;
+	size_t indexes;
+	size_t size;
+
+	if (!a) {
+		perror("xml_adaptive_create");
+		return;
+	}
+
+	d.out = out;
+	d.dump = dump;
+
+	for (; s; s = s->next) {
+		xml_adaptive_find(a, s->pattern, adaptive_dump, &d);
+		xml_adaptive_wait(a);
+	}
+
+	xml_adaptive_stats(a, &scans, &indexed, &indexes, &size);
+	fprintf(stderr, "adaptive: %lu scans, %lu indexed, "
+		"%lu indexes, %lu bytes\n",
+		(unsigned long) scans,
+		(unsigned long) indexed,
+		(unsigned long) indexes,
+		(unsigned long) size);
+	xml_adaptive_free(a);
+}
+
+/**
+ * Dump document according to job options
+ *
+ * @param j - job
+ * @param root - root element
+ */
+void dump_document(struct job *j, struct xml_element *root) {
+	if (j->image) {
+		image_matching(j->out, root, j->s);
+	} else if (j->template) {
+		dump_templates(j->out, root, j->s, j->template);
+	} else if (j->query) {
+		dump_fulltext(j->out, root, j->query, j->dump);
+	} else if (j->s && j->adaptive) {
+		adaptive_matching(j->out, root, j->s, j->dump, j->adaptive,
+			j->adaptive_limit);
+	} else if (j->s && j->explain) {
+		explain_matching(j->out, root, j->s, j->dump);
+	} else if (j->s) {
+		dump_matching(j->out, root, j->s, j->dump);
+	} else {
+		j->dump(j->out, root);
+	}
+}
+
+/**
+ * Return contents of file as string
+ *
+ * @param file - file name
+ */
+char *load(const char *file) {
+	char *source = NULL;
+	FILE *fp;
+	long size;
+
+	if (!(fp = fopen(file, "rb"))) {
+		perror("fopen");
+		return NULL;
+	}
+
+	if (!fseek(fp, 0, SEEK_END) &&
+			(size = ftell(fp)) > -1 &&
+			!fseek(fp, 0, SEEK_SET) &&
+			(source = malloc(size + 1))) {
+		if (fread(source, 1, size, fp) == (size_t) size) {
+			source[size] = 0;
+		} else {
+			free(source);
+			source = NULL;
+		}
+	}
+
+	fclose(fp);
+
+	return source;
+}
+
+/**
+ * Parse document speculatively with a skeleton and dump it
+ *
+ * @param j - job with XML string or file name
+ */
+int skeleton_document(struct job *j) {
+	struct xml_element *root;
+	char *data = NULL;
+
+	if (*j->d != '<' && !(data = load(j->d))) {
+		return -1;
+	}
+
+	root = xml_skeleton_parse(j->skeleton, data ? data : j->d);
+	j->bytes = strlen(data ? data : j->d);
+	free(data);
+
+	if (!root) {
+		fprintf(stderr, "error: malformed XML document");
+		return -1;
+	}
+
+	dump_document(j, root);
+	xml_free(root);
+
+	return 0;
+}
+
+/**
+ * Dump tree passed by xml_parse_with()
+ *
+ * @param root - root element
+ * @param user - job
+ */
+int dump_with(struct xml_element *root, void *user) {
+	dump_document(user, root);
+
+	/* must be passed through by xml_parse_with() */
+	return 1;
+}
+
+/**
+ * Decode file in binary token format and dump it
+ *
+ * @param j - job with file name
+ */
+int decode_document(struct job *j) {
+	struct xml_element *root = NULL;
+	char *data = NULL;
+	FILE *fp;
+	long size;
+
+	if (!(fp = fopen(j->d, "rb"))) {
+		perror("fopen");
+		return -1;
+	}
+
+	if (!fseek(fp, 0, SEEK_END) &&
+			(size = ftell(fp)) > -1 &&
+			!fseek(fp, 0, SEEK_SET) &&
+			(data = malloc(size ? size : 1)) &&
+			fread(data, 1, size, fp) == (size_t) size) {
+		root = xml_decode(data, size);
+	}
+
+	fclose(fp);
+	free(data);
+
+	if (!root) {
+		fprintf(stderr, "error: can't decode %s\n", j->d);
+		return -1;
+	}
+
+	dump_document(j, root);
+	xml_free(root);
+
+	return 0;
+}
+
+/**
+ * Check that the size xml_parse_size() counts is exactly what
+ * xml_parse_into() needs, then dump the tree xml_parse_with() builds
+ *
+ * @param j - job with XML string or file name
+ */
+int buffer_document(struct job *j) {
+	struct xml_element *root;
+	char *data = NULL;
+	const char *d = j->d;
+	size_t size;
+	size_t needed;
+	void *buf;
+	int r = -1;
+
+	if (*d != '<' && !(d = data = load(j->d))) {
+		return -1;
+	}
+
+	j->bytes = strlen(d);
+
+	if (!(size = xml_parse_size(d, j->bytes)) || !(buf = malloc(size))) {
+		fprintf(stderr, "error: cannot count %s\n", j->d);
+		free(data);
+		return -1;
+	}
+
+	if (xml_parse_into(buf, size - 1, d, j->bytes, &needed) ||
+			needed != size) {
+		fprintf(stderr, "error: %lu bytes are enough, %lu needed\n",
+			(unsigned long) size - 1, (unsigned long) needed);
+	} else if (!(root = xml_parse_into(buf, size, d, j->bytes,
+			&needed)) || needed != size) {
+		fprintf(stderr, "error: %lu bytes aren't enough\n",
+			(unsigned long) size);
+	} else {
+		r = xml_parse_with(d, j->bytes, dump_with, j) == 1 ? 0 : -1;
+
+		if (r) {
+			fprintf(stderr, "error: xml_parse_with() failed\n");
+		}
+	}
+
+	free(buf);
+	free(data);
+
+	return r;
+}
+
+/**
+ * Free tree parsed with malloc() or into an arena
+ *
+ * @param root - root element
+ * @param m - arena, NULL for malloc()
+ */
+void free_tree(struct xml_element *root, struct xml_mapped *m) {
+	if (m) {
+		xml_mapped_free(m);
+	} else {
+		xml_free(root);
+	}
+}
+
+/**
+ * Load file from cache and dump it
+ *
+ * @param j - job with file name
+ */
+int load_document(struct job *j) {
+	struct xml_element *root;
+	struct stat sb;
+
+	if (!stat(j->d, &sb)) {
+		j->bytes = sb.st_size;
+	}
+
+	if (!(root = xml_cache_load(j->cache, j->d))) {
+		fprintf(stderr, "error: cannot load %s\n", j->d);
+		return -1;
+	}
+
+	dump_document(j, root);
+	xml_cache_release(j->cache, root);
+
+	return 0;
+}
+
+/**
+ * Parse XML data
+ *
+ * @param j - job with XML string or file name or URL
+ * @param v - validator, may be NULL
+ */
+int parse_document(struct job *j, struct xml_validator *v) {
+	const char *d = j->d;
+	struct search *s = j->s;
+	struct xml_state st;
+	struct xml_mapped *m = NULL;
+	struct echo echo;
+
+	memset(&st, 0, sizeof(st));
+	st.compress = j->compress;
+	st.validator = v;
+
+	if (j->mapped && !j->build) {
+		if (!(m = xml_mapped_create(NULL, 0))) {
+			perror("xml_mapped_create");
+			return -1;
+		}
+
+		st.allocator = xml_mapped_allocator(m);
+	}
+
+	if (j->build) {
+		memset(&echo, 0, sizeof(echo));
+		echo.builder.open = echo_open;
+		echo.builder.attribute = echo_attribute;
+		echo.builder.close = echo_close;
+		echo.builder.text = echo_text;
+		echo.builder.special = echo_special;
+		echo.out = j->out;
+
+		/* round trips build a tree first and decode into the
+		 * builder */
+		if (!j->binary) {
+			st.builder = &echo.builder;
+		}
+	}
+
+	if (*d == '<') {
+		j->bytes = strlen(d);
+
+		if (xml_parse_chunk(&st, d)) {
+			free_tree(st.root, m);
+
+			parse_error(v);
+			return -1;
+		}
+	} else {
+		int fd;
+		int bytes;
+		char buf[96];
+		int len = sizeof(buf) - 1;
+
+		struct stat sb;
+
+		if ((fd = open(d, O_RDONLY)) < 0) {
+			perror("open");
+			xml_mapped_free(m);
+			return -1;
+		}
+
+		if (!fstat(fd, &sb)) {
+			j->bytes = sb.st_size;
+		}
+
+		if (j->prefilter && s && !candidate(fd, s)) {
+			close(fd);
+			xml_mapped_free(m);
+			return 0;
+		}
+
+		while ((bytes = read(fd, buf, len)) > 0) {
+			/* terminate input string */
+			buf[bytes] = 0;
+
+			if (xml_parse_chunk(&st, buf)) {
+				free_tree(st.root, m);
+				close(fd);
+
+				parse_error(v);
+				return -1;
+			}
+		}
+
+		close(fd);
+	}
+
+	if (st.builder) {
+		/* left if the document ends inside a tag */
+		free(st.token);
+		return 0;
+	}
+
+	if (!st.root) {
+		fprintf(stderr, "error: malformed XML document");
+		xml_mapped_free(m);
+		return -1;
+	}
+
+	if (v && xml_validator_finish(v)) {
+		free_tree(st.root, m);
+		parse_error(v);
+		return -1;
+	}
+
+	/* included trees are allocated with malloc() and can't be
+	 * spliced into an arena */
+	if (j->include > 0 && !m) {
+		char *error;
+
+		if (xml_include(st.root, *d == '<' ? NULL : d, j->include,
+				&error)) {
+			fprintf(stderr, "error: %s\n",
+				error ? error : "out of memory");
+			free(error);
+			free_tree(st.root, m);
+			return -1;
+		}
+	}
+
+	if (j->binary) {
+		size_t len;
+		void *b = xml_encode(st.root, &len);
+
+		free_tree(st.root, m);
+		m = NULL;
 
-	for (; a; a = a->next) {
-		printf(" %s=\"%s\"", a->key, a->value);
+		memset(&st, 0, sizeof(st));
+		st.compress = j->compress;
+
+		if (j->build) {
+			st.builder = &echo.builder;
+		}
+
+		if (!b || xml_decode_state(&st, b, len)) {
+			free(b);
+			xml_free(st.root);
+			fprintf(stderr, "error: binary round trip failed");
+			return -1;
+		}
+
+		free(b);
+
+		if (j->build) {
+			return 0;
+		}
 	}
+
+	dump_document(j, st.root);
+	free_tree(st.root, m);
+
+	return 0;
 }
 
 /**
- * Dump XML
+ * Parse XML data and validate it if there's a schema
  *
- * @param e - XML element
+ * @param j - job with XML string or file name or URL
  */
-void dump_xml(struct xml_element *e) {
-	if (!e) {
-		return;
+int parse(struct job *j) {
+	struct xml_validator *v = NULL;
+	int r;
+
+	if (j->skeleton) {
+		return skeleton_document(j);
+	}
+
+	if (j->counted) {
+		return buffer_document(j);
 	}
 
-	if (!e->value) {
-		struct xml_element *c;
+	if (j->decode) {
+		return decode_document(j);
+	}
 
-		if (e->key) {
-			printf("<%s", e->key);
-			dump_arguments(e);
+	/* cached trees are shared and read only */
+	if (j->cache && *j->d != '<' && !j->schema && !j->binary &&
+			!j->compress && !j->include && !j->prefilter &&
+			!j->build && !j->mapped) {
+		return load_document(j);
+	}
 
-			if (*e->key == '?' || *e->key == '!') {
-				printf(">");
-				return;
-			}
+	if (j->schema && !(v = xml_validator_create(j->schema))) {
+		perror("xml_validator_create");
+		return -1;
+	}
 
-			if (!e->first_child) {
-				printf("/>");
-				return;
-			}
+	r = parse_document(j, v);
+	xml_validator_free(v);
 
-			printf(">");
-		}
+	return r;
+}
 
-		for (c = e->first_child; c; c = c->next) {
-			dump_xml(c);
-		}
+/**
+ * Return monotonic time in seconds
+ */
+double now(void) {
+	struct timespec ts;
 
-		if (e->key) {
-			printf("</%s>", e->key);
-		}
-	} else {
-		printf("%s", e->value);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 /**
- * Dump XML as string
+ * Run job into its own output buffer
  *
- * @param e - XML element
+ * @param j - job
  */
-void dump_string(struct xml_element *e) {
-	char *s = xml_content(e);
+void run(struct job *j) {
+	double start = now();
 
-	if (s) {
-		printf("%s\n", s);
-		free(s);
+	if (!(j->out = open_memstream(&j->buffer, &j->length))) {
+		perror("open_memstream");
+		j->result = -1;
+		return;
 	}
+
+	j->result = parse(j);
+	fclose(j->out);
+
+	j->seconds = now() - start;
 }
 
 /**
- * Dump only matching elements
+ * Take jobs from the pool until there are none left
  *
- * @param e - root element
- * @param s - search elements
- * @param dump - dump function
+ * @param p - pool
  */
-void dump_matching(
-		struct xml_element *root,
-		struct search *s,
-		void (*dump)(struct xml_element *)) {
-	struct xml_element *e;
+void *work(void *p) {
+	struct pool *pool = p;
 
-	for (; s; s = s->next) {
-		for (e = xml_find(root, s->pattern);
-				e;
-				e = xml_find_next(e, s->pattern)) {
-			dump(e);
+	for (;;) {
+		struct job *j;
+
+		pthread_mutex_lock(&pool->lock);
+
+		if (pool->next >= pool->count) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
 		}
+
+		j = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		run(j);
+
+		pthread_mutex_lock(&pool->lock);
+		j->done = 1;
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
 	}
+
+	xml_compress_cache_free();
+
+	return NULL;
 }
 
 /**
- * Parse XML data
+ * Run jobs on a pool of threads, write their output in order and
+ * print throughput statistics to stderr
  *
- * @param d - XML string or file name or URL
- * @param s - search patterns (may be NULL)
- * @param dump - dump function
+ * @param jobs - jobs
+ * @param count - number of jobs
+ * @param threads - number of threads
  */
-int parse(
-		const char *d,
-		struct search *s,
-		void (*dump)(struct xml_element *)) {
-	struct xml_state st;
+void run_parallel(struct job *jobs, size_t count, int threads) {
+	struct pool pool;
+	pthread_t *tids;
+	double start = now();
+	double seconds;
+	size_t bytes = 0;
+	size_t i;
+	int n;
 
-	memset(&st, 0, sizeof(st));
+	if (!(tids = calloc(threads, sizeof(pthread_t)))) {
+		return;
+	}
 
-	if (*d == '<') {
-		if (xml_parse_chunk(&st, d)) {
-			xml_free(st.root);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	pool.jobs = jobs;
+	pool.count = count;
+	pool.next = 0;
 
-			perror("xml_parse");
-			return -1;
+	for (n = 0; n < threads; ++n) {
+		if (pthread_create(&tids[n], NULL, work, &pool)) {
+			break;
 		}
-	} else {
-		int fd;
-		int bytes;
-		char buf[96];
-		int len = sizeof(buf) - 1;
+	}
 
-		if ((fd = open(d, O_RDONLY)) < 0) {
-			perror("open");
-			return -1;
-		}
+	/* work here too if no thread could be started */
+	if (!n) {
+		work(&pool);
+	}
 
-		while ((bytes = read(fd, buf, len)) > 0) {
-			/* terminate input string */
-			buf[bytes] = 0;
+	/* flush output in argument order as soon as it's there */
+	for (i = 0; i < count; ++i) {
+		struct job *j = &jobs[i];
 
-			if (xml_parse_chunk(&st, buf)) {
-				xml_free(st.root);
-				close(fd);
+		pthread_mutex_lock(&pool.lock);
 
-				perror("xml_parse");
-				return -1;
-			}
+		while (!j->done) {
+			pthread_cond_wait(&pool.done, &pool.lock);
 		}
 
-		close(fd);
+		pthread_mutex_unlock(&pool.lock);
+
+		fwrite(j->buffer, 1, j->length, stdout);
+		free(j->buffer);
+		j->buffer = NULL;
 	}
 
-	if (!st.root) {
-		fprintf(stderr, "error: malformed XML document");
-		return -1;
+	while (n-- > 0) {
+		pthread_join(tids[n], NULL);
 	}
 
-	if (s) {
-		dump_matching(st.root, s, dump);
-	} else {
-		dump(st.root);
+	seconds = now() - start;
+
+	for (i = 0; i < count; ++i) {
+		struct job *j = &jobs[i];
+
+		bytes += j->bytes;
+
+		fprintf(stderr, "%s: %zu bytes in %.3f ms, %.1f MB/s%s\n",
+			*j->d == '<' ? "<string>" : j->d,
+			j->bytes,
+			j->seconds * 1000,
+			j->seconds > 0 ? j->bytes / j->seconds / 1e6 : 0,
+			j->result ? " (failed)" : "");
 	}
 
-	xml_free(st.root);
+	fprintf(stderr, "total: %zu files, %zu bytes in %.3f ms, "
+			"%.1f MB/s on %d threads\n",
+		count,
+		bytes,
+		seconds * 1000,
+		seconds > 0 ? bytes / seconds / 1e6 : 0,
+		threads);
 
-	return 0;
+	pthread_cond_destroy(&pool.done);
+	pthread_mutex_destroy(&pool.lock);
+	free(tids);
 }
 
 /**
@@ -188,6 +1265,42 @@ struct search *search_add(
 	return s;
 }
 
+/**
+ * Load and compile schema
+ *
+ * @param file - file name of schema
+ */
+struct xml_schema *schema_load(const char *file) {
+	char *source = load(file);
+	struct xml_schema *schema = xml_schema_compile(source);
+
+	free(source);
+
+	if (!schema) {
+		fprintf(stderr, "error: invalid schema %s\n", file);
+	}
+
+	return schema;
+}
+
+/**
+ * Load and compile template
+ *
+ * @param file - file name of template
+ */
+struct xml_template *template_load(const char *file) {
+	char *source = load(file);
+	struct xml_template *template = xml_template_compile(source);
+
+	free(source);
+
+	if (!template) {
+		fprintf(stderr, "error: invalid template %s\n", file);
+	}
+
+	return template;
+}
+
 /**
  * Free search list
  *
@@ -202,6 +1315,244 @@ void search_free(struct search *s) {
 	}
 }
 
+/**
+ * Parse file for the document store
+ *
+ * @param file - file name
+ */
+struct xml_element *store_parse(const char *file) {
+	char *source = load(file);
+	struct xml_element *root = source ? xml_parse(source) : NULL;
+
+	free(source);
+
+	if (!root) {
+		fprintf(stderr, "error: cannot parse %s\n", file);
+	}
+
+	return root;
+}
+
+/**
+ * Print hits of a document store query
+ *
+ * @param out - output stream
+ * @param st - document store
+ * @param name - element name
+ * @param attribute - attribute name, may be NULL
+ * @param value - attribute value, may be NULL
+ */
+void store_query(
+		FILE *out,
+		struct xml_store *st,
+		const char *name,
+		const char *attribute,
+		const char *value) {
+	struct xml_store_hit hits[64];
+	size_t n = xml_store_query(st, name, attribute, value, hits, 64);
+	size_t i;
+
+	for (i = 0; i < n && i < 64; ++i) {
+		fprintf(out, "%ld <%s", hits[i].document, hits[i].element->key);
+		dump_arguments(out, hits[i].element);
+		fprintf(out, ">\n");
+	}
+
+	fprintf(out, "%lu hits\n", (unsigned long) n);
+}
+
+/**
+ * Run document store commands from a file, one per line:
+ * "add FILE", "remove ID", "replace ID FILE", "query NAME [ATTR
+ * [VALUE]]" and "stats"
+ *
+ * @param out - output stream
+ * @param file - file name of commands or "-" for stdin
+ */
+int store_run(FILE *out, const char *file) {
+	FILE *fp = strcmp(file, "-") ? fopen(file, "r") : stdin;
+	struct xml_store *st;
+	char line[1024];
+	long ids = 0;
+	long id = -1;
+
+	if (!fp) {
+		perror("fopen");
+		return -1;
+	}
+
+	if (!(st = xml_store_create())) {
+		perror("xml_store_create");
+		if (fp != stdin) {
+			fclose(fp);
+		}
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *command = strtok(line, " \t\r\n");
+		char *a = strtok(NULL, " \t\r\n");
+		char *b = strtok(NULL, " \t\r\n");
+		char *c = strtok(NULL, " \t\r\n");
+		struct xml_element *root;
+
+		if (!command) {
+			continue;
+		} else if (!strcmp(command, "add") && a) {
+			id = -1;
+
+			if ((root = store_parse(a)) &&
+					(id = xml_store_add(st, root)) < 0) {
+				xml_free(root);
+			}
+
+			if (id >= ids) {
+				ids = id + 1;
+			}
+
+			fprintf(out, "%ld\n", id);
+		} else if (!strcmp(command, "remove") && a) {
+			root = xml_store_remove(st, atol(a));
+			fprintf(out, "%s\n", root ? "ok" : "error");
+			xml_free(root);
+		} else if (!strcmp(command, "replace") && a && b) {
+			struct xml_element *old = NULL;
+
+			if ((root = store_parse(b)) &&
+					!(old = xml_store_replace(st, atol(a), root))) {
+				xml_free(root);
+			}
+
+			fprintf(out, "%s\n", old ? "ok" : "error");
+			xml_free(old);
+		} else if (!strcmp(command, "query") && a) {
+			store_query(out, st, a, b, c);
+		} else if (!strcmp(command, "stats")) {
+			size_t keys;
+			size_t live;
+			size_t stale;
+
+			xml_store_stats(st, &keys, &live, &stale);
+			fprintf(out, "%lu keys, %lu live, %lu stale\n",
+				(unsigned long) keys,
+				(unsigned long) live,
+				(unsigned long) stale);
+		} else {
+			fprintf(stderr, "error: invalid command %s\n", command);
+		}
+	}
+
+	/* the store doesn't own documents */
+	for (id = 0; id < ids; ++id) {
+		xml_free(xml_store_remove(st, id));
+	}
+
+	xml_store_free(st);
+
+	if (fp != stdin) {
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+/**
+ * Return name of document element
+ *
+ * @param root - root element
+ */
+const char *document_name(struct xml_element *root) {
+	struct xml_element *e = root->first_child;
+
+	for (; e && (!e->key || *e->key == '?' || *e->key == '!'); e = e->next);
+
+	return e ? e->key : "";
+}
+
+/**
+ * Print name of a replaced tree when it's freed
+ *
+ * @param root - root element
+ */
+void rcu_release(struct xml_element *root) {
+	printf("released %s\n", document_name(root));
+	xml_free(root);
+}
+
+/**
+ * Run commands on a published tree with one reader on this thread from
+ * a file, one per line: "publish FILE", "lock", "unlock" and "wait";
+ * "lock" prints the name of the tree it returns and "unlock" the name
+ * of the tree that was locked, which must still be valid
+ *
+ * @param file - file name of commands or "-" for stdin
+ */
+int rcu_run(const char *file) {
+	FILE *fp = strcmp(file, "-") ? fopen(file, "r") : stdin;
+	struct xml_rcu *rcu = NULL;
+	struct xml_rcu_reader *r = NULL;
+	struct xml_element *locked[16];
+	size_t depth = 0;
+	char line[1024];
+
+	if (!fp) {
+		perror("fopen");
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *command = strtok(line, " \t\r\n");
+		char *a = strtok(NULL, " \t\r\n");
+		struct xml_element *root;
+
+		if (!command) {
+			continue;
+		} else if (!strcmp(command, "publish") && a) {
+			if (!(root = store_parse(a))) {
+				continue;
+			}
+
+			/* trees that are released by publishing show up
+			 * after this */
+			printf("published %s\n", document_name(root));
+
+			if (rcu) {
+				xml_rcu_publish(rcu, root);
+			} else if (!(rcu = xml_rcu_create(root, rcu_release)) ||
+					!(r = xml_rcu_register(rcu))) {
+				perror("xml_rcu_create");
+				break;
+			}
+		} else if (!rcu) {
+			fprintf(stderr, "error: nothing published\n");
+		} else if (!strcmp(command, "lock") && depth < 16) {
+			locked[depth] = xml_rcu_lock(r);
+			printf("locked %s\n", document_name(locked[depth++]));
+		} else if (!strcmp(command, "unlock") && depth > 0) {
+			printf("unlocked %s\n", document_name(locked[--depth]));
+			xml_rcu_unlock(r);
+		} else if (!strcmp(command, "wait") && !depth) {
+			xml_rcu_wait(rcu);
+			printf("waited\n");
+		} else {
+			fprintf(stderr, "error: invalid command %s\n", command);
+		}
+	}
+
+	while (depth-- > 0) {
+		xml_rcu_unlock(r);
+	}
+
+	xml_rcu_unregister(r);
+	xml_rcu_free(rcu);
+
+	if (fp != stdin) {
+		fclose(fp);
+	}
+
+	return 0;
+}
+
 /**
  * Process command line arguments
  *
@@ -209,22 +1560,198 @@ void search_free(struct search *s) {
  * @param argv - XML string or file name or URL
  */
 int main(int argc, char **argv) {
-	struct search *s = NULL;
-	void *d = dump_xml;
+	struct job opts;
+	struct job *jobs = NULL;
+	size_t count = 0;
+	struct xml_skeleton *skeleton = NULL;
+	struct xml_schema **schemas = NULL;
+	size_t schema_count = 0;
+	struct xml_template **templates = NULL;
+	size_t template_count = 0;
+	struct xml_cache *cache = NULL;
+	int threads = 0;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.dump = dump_xml;
+	opts.out = stdout;
 
 	while (--argc && ++argv) {
 		if (**argv == '?') {
-			s = search_add(s, *argv + 1);
+			opts.s = search_add(opts.s, *argv + 1);
+		} else if (**argv == '~') {
+			opts.query = *argv + 1;
+		} else if (!strcmp(*argv, "-b")) {
+			opts.binary = 1;
+		} else if (!strcmp(*argv, "-d")) {
+			opts.decode = 1;
+		} else if (!strcmp(*argv, "-p")) {
+			opts.prefilter = 1;
+		} else if (!strcmp(*argv, "-I")) {
+			opts.image = 1;
+		} else if (!strcmp(*argv, "-M")) {
+			opts.mapped = 1;
+		} else if (!strcmp(*argv, "-P")) {
+			opts.counted = 1;
+		} else if (!strcmp(*argv, "-k") && argc > 1) {
+			--argc;
+			++argv;
+
+			if (!skeleton &&
+					!(skeleton = xml_skeleton_create(atoi(*argv)))) {
+				perror("xml_skeleton_create");
+				break;
+			}
+
+			opts.skeleton = skeleton;
+		} else if (!strcmp(*argv, "-x")) {
+			opts.explain = 1;
+		} else if (!strcmp(*argv, "-F")) {
+			opts.dump = dump_flat;
+		} else if (!strcmp(*argv, "-B")) {
+			opts.build = 1;
+		} else if (!strcmp(*argv, "-a") && argc > 1) {
+			char *limit;
+
+			--argc;
+			opts.adaptive = strtoul(*++argv, &limit, 10);
+			opts.adaptive_limit = *limit == ':' ?
+				strtoul(limit + 1, NULL, 10) :
+				1 << 20;
+		} else if (!strcmp(*argv, "-R") && argc > 1) {
+			--argc;
+			rcu_run(*++argv);
+		} else if (!strcmp(*argv, "-j") && argc > 1) {
+			--argc;
+			threads = atoi(*++argv);
+		} else if (!strcmp(*argv, "-c") && argc > 1) {
+			--argc;
+			opts.compress = atoi(*++argv);
+		} else if (!strcmp(*argv, "-D") && argc > 1) {
+			--argc;
+			store_run(opts.out, *++argv);
+		} else if (!strcmp(*argv, "-l") && argc > 1) {
+			--argc;
+			++argv;
+
+			if (!cache && !(cache = xml_cache_create(atol(*argv)))) {
+				perror("xml_cache_create");
+				break;
+			}
+
+			opts.cache = cache;
+		} else if (!strcmp(*argv, "-i") && argc > 1) {
+			--argc;
+			opts.include = atoi(*++argv);
+		} else if (!strcmp(*argv, "-s") && argc > 1) {
+			struct xml_schema **n = realloc(
+				schemas,
+				(schema_count + 1) * sizeof(*n));
+
+			if (!n) {
+				perror("realloc");
+				break;
+			}
+
+			schemas = n;
+			--argc;
+
+			if (!(opts.schema = schema_load(*++argv))) {
+				break;
+			}
+
+			schemas[schema_count++] = opts.schema;
+		} else if (!strcmp(*argv, "-t") && argc > 1) {
+			struct xml_template **n = realloc(
+				templates,
+				(template_count + 1) * sizeof(*n));
+
+			if (!n) {
+				perror("realloc");
+				break;
+			}
+
+			templates = n;
+			--argc;
+
+			if (!(opts.template = template_load(*++argv))) {
+				break;
+			}
+
+			templates[template_count++] = opts.template;
 		} else if (**argv == '-') {
-			d = dump_string;
+			opts.dump = dump_string;
 		} else if (**argv == '=') {
-			d = dump_arguments;
+			opts.dump = dump_arguments;
+		} else if (threads > 0) {
+			/* options are copied so they apply to this file only
+			 * like in sequential mode */
+			struct job *n = realloc(jobs, (count + 1) * sizeof(*n));
+
+			if (!n) {
+				perror("realloc");
+				break;
+			}
+
+			jobs = n;
+			jobs[count] = opts;
+			jobs[count].d = *argv;
+
+			/* skeletons learn from consecutive documents on
+			 * one thread */
+			jobs[count++].skeleton = NULL;
 		} else {
-			parse(*argv, s, d);
+			opts.d = *argv;
+			parse(&opts);
 		}
 	}
 
-	search_free(s);
+	if (count > 0) {
+		run_parallel(jobs, count, threads);
+	}
+
+	free(jobs);
+	search_free(opts.s);
+
+	if (skeleton) {
+		size_t learning;
+		size_t matched;
+		size_t diverged;
+
+		xml_skeleton_stats(skeleton, &learning, &matched, &diverged);
+		fprintf(stderr, "skeleton: %lu learning, %lu matched, "
+			"%lu diverged\n",
+			(unsigned long) learning,
+			(unsigned long) matched,
+			(unsigned long) diverged);
+		xml_skeleton_free(skeleton);
+	}
+
+	while (schema_count > 0) {
+		xml_schema_free(schemas[--schema_count]);
+	}
+
+	free(schemas);
+
+	while (template_count > 0) {
+		xml_template_free(templates[--template_count]);
+	}
+
+	free(templates);
+
+	if (cache) {
+		size_t hits;
+		size_t misses;
+		size_t size;
+
+		xml_cache_stats(cache, &hits, &misses, &size);
+		fprintf(stderr, "cache: %lu hits, %lu misses, %lu bytes\n",
+			(unsigned long) hits,
+			(unsigned long) misses,
+			(unsigned long) size);
+		xml_cache_free(cache);
+	}
+
+	xml_compress_cache_free();
 
 	return 0;
 }
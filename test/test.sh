@@ -10,20 +10,664 @@ test_files() {
 	done
 }
 
+test_binary() {
+	local F
+
+	for F in ${@:-samples/*}
+	do
+		echo ">> round trip $F"
+		$BIN -b $F | diff - $F || exit $?
+
+		# decoded tokens go through builders and compression too
+		$BIN -b -B $F | diff - $F || exit $?
+		$BIN -b -c 16 $F | diff - $F || exit $?
+	done
+
+	local D='<?x?><a b='"'1'"'><e/><!-- f --><g>h</g></a>'
+	diff <($BIN -b -B "$D") <($BIN -B "$D") || exit $?
+
+	# an empty text literal doesn't make an element
+	F=decoded.bin
+	printf 'XMLB\1\1\0\1a\0\3\1\0\2\0' > $F
+	diff <($BIN -d $F) <(printf '<a/>') || exit $?
+	rm -f $F
+}
+
+test_skeleton() {
+	local A=skeleton/a1.xml B=skeleton/b1.xml
+	local S="$A skeleton/a2.xml skeleton/a3.xml $A $B skeleton/b2.xml \
+		skeleton/b3.xml $B $A"
+
+	# learn from a1 and a2, match a3 and a1, diverge at b1 and b2 and
+	# learn from b2 and b3 instead, match b1, diverge at a1
+	diff <($BIN -k 2 $S 2>/dev/null) <($BIN $S) || exit $?
+	diff <($BIN -k 2 $S 2>&1 >/dev/null) - <<EOF || exit $?
+skeleton: 3 learning, 3 matched, 3 diverged
+EOF
+	diff <($BIN -k 1 samples/* 2>/dev/null) <($BIN samples/*) || exit $?
+}
+
+test_image() {
+	local F P
+
+	for F in ${@:-samples/*}
+	do
+		echo ">> image $F"
+		diff <($BIN -I $F) <($BIN - $F) || exit $?
+
+		for P in hello/world/country?name=England/city \
+			hello/world/country/city hello/world?name=Moon \
+			PLAY/ACT/SCENE/SPEECH/SPEAKER PLAY/ACT/SCENE/TITLE \
+			manifest/application/activity?android:name \
+			ACTIONS/ACTION?NAME=range-comment/CODE ACTIONS/ACTION/CODE
+		do
+			diff <($BIN -I "?$P" $F) <($BIN - "?$P" $F) || exit $?
+		done
+	done
+}
+
+test_mapped() {
+	local F
+
+	for F in ${@:-samples/*}
+	do
+		echo ">> mapped $F"
+		$BIN -M $F | diff - $F || exit $?
+		$BIN -M -c 16 $F | diff - $F || exit $?
+		diff <($BIN -M - '?PLAY/ACT/SCENE/SPEECH/SPEAKER' \
+			'?hello/world/country?name=England/city' $F) \
+			<($BIN - '?PLAY/ACT/SCENE/SPEECH/SPEAKER' \
+			'?hello/world/country?name=England/city' $F) || exit $?
+	done
+}
+
+test_buffer() {
+	local F
+
+	# the counted size fits exactly and one byte less doesn't, small
+	# documents are parsed on the stack and large ones on the heap
+	for F in ${@:-samples/*}
+	do
+		echo ">> buffer $F"
+		$BIN -P $F 2>&1 | diff - $F || exit $?
+		$BIN -P - '?hello/world/country/city' $F 2>&1 |
+			diff - <($BIN - '?hello/world/country/city' $F) ||
+			exit $?
+	done
+
+	$BIN -P '<a><b x="1">c</b><d/></a>' 2>&1 | diff - <(
+		echo -n '<a><b x="1">c</b><d/></a>') || exit $?
+
+	# the path to the current element may not fit on the stack while
+	# counting, with long character data or deep nesting
+	local D
+	for D in "<a>$(printf '%06000d' 0)</a>" \
+		"$(printf '<a>%.0s' {1..100})b$(printf '</a>%.0s' {1..100})"
+	do
+		$BIN -P "$D" 2>&1 | diff - <(echo -n "$D") || exit $?
+	done
+}
+
+test_compress() {
+	local F
+
+	for F in ${@:-samples/*}
+	do
+		echo ">> compressed $F"
+		$BIN -c 16 $F | diff - $F || exit $?
+		$BIN -c 16 -b $F | diff - $F || exit $?
+	done
+
+	# the second arena is mapped where the first one was, so cached
+	# values must not be taken for the ones at the same addresses
+	local A="<a>$(printf 'a%.0s' {1..64})</a>"
+	local B="<a>$(printf 'b%.0s' {1..64})</a>"
+	diff <($BIN -M -c 16 "$A" "$B") <($BIN "$A" "$B") || exit $?
+}
+
+test_prefilter() {
+	local F P
+
+	for F in ${@:-samples/*}
+	do
+		echo ">> prefilter $F"
+		for P in hello/world/country?name=England/city \
+			HELLO/world nothing/here manifest/application
+		do
+			diff <($BIN -p - "?$P" $F) <($BIN - "?$P" $F) || exit $?
+		done
+	done
+}
+
+test_grep() {
+	local F P
+
+	for F in ${@:-samples/*}
+	do
+		echo ">> grep $F"
+		for P in hello/world/country?name=England/city \
+			hello/world/country/city PLAY/ACT/SCENE/SPEECH/SPEAKER \
+			manifest/application
+		do
+			diff <($GREP - "?$P" $F) <($BIN - "?$P" $F) || exit $?
+		done
+	done
+}
+
+test_parallel() {
+	echo ">> parallel ${@:-samples/*}"
+	diff <($BIN -j 4 ${@:-samples/* samples/*}) \
+		<($BIN ${@:-samples/* samples/*}) || exit $?
+}
+
+test_fulltext() {
+	local F=samples/hello.xml
+
+	diff <($BIN - '~bridge' $F '~"new york"' $F '~york new' $F \
+		'~"york new"' $F '~miami WELCOME' $F) - <<EOF || exit $?
+Boston Bridge
+London Bridge
+New York
+New York, New York
+New York
+New York, New York
+New York, New York
+Welcome to Miami
+EOF
+}
+
+test_schema() {
+	local S=schemas/hello.schema
+
+	$BIN -s $S samples/hello.xml | diff - samples/hello.xml || exit $?
+	$BIN -s schemas/dream.schema samples/dream.xml |
+		diff - samples/dream.xml || exit $?
+
+	diff <($BIN -s $S '<hello><world/></hello>' \
+		'<hello><world name="x"><city/></world></hello>' \
+		'<hello>oops</hello>' \
+		'<hello><![CDATA[ y]]></hello>' \
+		'<hello><world name="x">' \
+		'<world name="x"/>' 2>&1) - <<EOF || exit $?
+error: missing required attribute at byte 14
+error: unexpected element at byte 29
+error: unexpected character data at byte 7
+error: unexpected character data at byte 17
+error: incomplete document at byte 22
+error: unexpected root element at byte 16
+EOF
+}
+
+test_sort() {
+	local F=samples/actions.xml
+	local P='?ACTIONS/ACTION'
+
+	names() {
+		$GREP = "$P" "$1" | sed 's/^ NAME="\([^"]*\)".*/\1/'
+	}
+
+	$SORT "$P" NAME $F > sorted.xml || exit $?
+	$BIN sorted.xml | diff - sorted.xml || exit $?
+	diff <(names sorted.xml) <(names $F | LC_ALL=C sort) || exit $?
+
+	# spill runs to temporary files and merge them
+	$SORT -m 4K "$P" NAME $F | cmp - sorted.xml || exit $?
+
+	# records must share one parent
+	$SORT ?PLAY/ACT/SCENE/SPEECH SPEAKER samples/dream.xml &>/dev/null &&
+		exit 1
+
+	rm -f sorted.xml
+}
+
+test_template() {
+	local T=templates/action.xml
+	local F=samples/actions.xml
+	local P='?ACTIONS/ACTION'
+
+	$BIN -t $T "$P" $F > rendered.xml || exit $?
+	$BIN rendered.xml > /dev/null || exit $?
+	diff <(sed -n 's/^<action name="\([^"]*\)".*/\1/p' rendered.xml) \
+		<($GREP = "$P" $F | sed 's/^ NAME="\([^"]*\)".*/\1/') ||
+		exit $?
+	$BIN -j 4 -t $T "$P" $F $F 2>/dev/null | cmp - <(cat rendered.xml rendered.xml) ||
+		exit $?
+
+	# values are escaped again after parsing
+	diff <($BIN -t $T '<a NAME="x&quot;y&apos;">a &amp; b &lt;c&gt;</a>' \
+		'<a>{{NAME}}</a>') - <<EOF || exit $?
+<action name="x&quot;y&apos;" record="">a &amp; b &lt;c&gt;</action>
+<action name="" record="">{{NAME}}</action>
+EOF
+
+	# placeholders in tag names are rejected
+	$BIN -t <(echo '<{{x}}/>') '<a/>' 2>&1 |
+		grep -q '^error: invalid template' || exit $?
+
+	rm -f rendered.xml
+}
+
+test_follow() {
+	local F=follow.xml
+	local PID
+
+	printf '<log>\n<rec id="1"/>\n' > $F
+	$GREP -f = '?log/rec' $F > followed.txt &
+	PID=$!
+
+	# wait for the records that were there before
+	while ! [ -s followed.txt ]
+	do
+		sleep .1
+	done
+
+	printf '<rec id="2"/>\n<rec id="3">' >> $F
+	printf 'text</rec>\n' >> $F
+	rm $F
+	wait $PID || exit $?
+
+	diff followed.txt - <<EOF || exit $?
+ id="1"
+ id="2"
+ id="3"
+EOF
+
+	rm -f followed.txt
+}
+
+test_include() {
+	diff <($BIN -i 4 includes/main.xml) - <<EOF || exit $?
+<config>
+	<network>
+	<host name="gateway"/>
+</network>
+	<users>
+	<user name="root"/>
+	<user name="guest"/>
+</users>
+</config>
+EOF
+
+	diff <($BIN -i 4 includes/cycle.xml \
+		'<a><include href="includes/missing.xml"/></a>' \
+		'<a><include/></a>' 2>&1) - <<EOF || exit $?
+error: includes/parts/../cycle.xml: include cycle
+error: includes/missing.xml: cannot open file
+error: -: include without href
+EOF
+}
+
+test_cache() {
+	local F=cached.xml
+
+	cp samples/hello.xml $F
+	diff <($BIN -l 1000000 $F $F 2>&1 >/dev/null) - <<EOF || exit $?
+cache: 1 hits, 1 misses, 4856 bytes
+EOF
+	diff <($BIN -l 1000000 samples/hello.xml $F samples/dream.xml $F \
+		2>/dev/null) <(cat samples/hello.xml $F samples/dream.xml $F) ||
+		exit $?
+
+	# unreferenced trees are evicted at once
+	diff <($BIN -l 0 $F $F 2>&1 >/dev/null) - <<EOF || exit $?
+cache: 0 hits, 2 misses, 0 bytes
+EOF
+
+	# blocks take what the tree needs, not a guess from the length
+	local B
+	printf '<a>%06000d</a>' 0 > $F
+	B=$($BIN -l 1000000 $F 2>&1 >/dev/null | sed 's/.* \([0-9]*\) bytes/\1/')
+	(( B > 6000 && B < 7000 )) || exit 1
+
+	rm -f $F
+}
+
+test_explain() {
+	diff <($BIN -x - '?hello/world/country?name=England/city' \
+		samples/hello.xml) - <<EOF || exit $?
+London Bridge
+explain ?hello/world/country?name=England/city
+step  segment                   visited compared  predic.  attrib.   allocs  matches
+   1  hello                           4        2        0        0        0        1
+   2  world                           3        1        0        0        0        1
+   3  country?name=England           13        6        5        6        2        1
+   4  city                            3        1        0        0        0        1
+EOF
+}
+
+test_bench() {
+	local R
+
+	$BENCH -t 0 &>/dev/null && exit 1
+
+	# two rows for 1 and 2 threads each after the headers, plus the
+	# same with a tree that is reloaded while it's read; every row must
+	# have served requests and ordered latencies
+	for R in '' -r
+	do
+		$BENCH $R -t 2 -n 200 | awk '
+			NR > 2 && !($3 > 0 && $4 <= $5 && $5 <= $6 && $6 <= $7) {
+				print "bad row: " $0
+				bad = 1
+			}
+			END { exit bad || NR != 6 }' || exit 1
+	done
+}
+
+test_adaptive() {
+	local F=samples/dream.xml
+	local P='?PLAY/ACT/SCENE/SPEECH/SPEAKER'
+
+	diff <($BIN -a 100 - $P $P $P $F 2>/dev/null) <($BIN - $P $P $P $F) ||
+		exit $?
+
+	# the first scan is expensive enough to index the path; the size
+	# depends on the size of pointers
+	diff <($BIN -a 100 - $P $P $P $F 2>&1 >/dev/null |
+		sed 's/, [0-9]* bytes$//') - <<EOF || exit $?
+adaptive: 1 scans, 2 indexed, 1 indexes
+EOF
+	diff <($BIN -a 100000 - $P $P $F 2>&1 >/dev/null |
+		sed 's/, [0-9]* bytes$//') - <<EOF || exit $?
+adaptive: 2 scans, 0 indexed, 0 indexes
+EOF
+
+	# paths are evicted with their indexes to stay within the limit,
+	# which the index for $P alone exceeds
+	P="$P $P ?PLAY/TITLE ?PLAY/ACT/TITLE ?PLAY/PERSONAE/PERSONA"
+	diff <($BIN -a 100:1000 - $P $F 2>/dev/null) <($BIN - $P $F) ||
+		exit $?
+	$BIN -a 100:1000 - $P $F 2>&1 >/dev/null | awk '
+		{ exit !($2 == 5 && $4 == 0 && $6 == 0 && $8 <= 1000) }' ||
+		exit 1
+}
+
+test_wide() {
+	local W
+
+	W=$(printf '<wide>'
+	printf '<a/><b/>%.0s' {1..300}
+	printf '<c n="1">first</c>'
+	printf '<a/><b/>%.0s' {1..300}
+	printf '<c n="2">second</c></wide>')
+
+	# queries run last to first; the first scan indexes the children
+	# and everything after it is looked up
+	diff <($BIN -x - '?wide/C?n=2' '?wide/c' <(echo "$W")) - <<EOF ||
+first
+second
+explain ?wide/c
+step  segment                   visited compared  predic.  attrib.   allocs  matches
+   1  wide                            2        1        0        0        0        1
+   2  c                             602      601        0        0        0        2
+second
+explain ?wide/C?n=2
+step  segment                   visited compared  predic.  attrib.   allocs  matches
+   1  wide                            2        1        0        0        0        1
+   2  C?n=2                           2        0        2        2        2        1
+EOF
+		exit $?
+
+	# trees in arenas never get an index, so both lookups scan
+	diff <($BIN -M -x - '?wide/C?n=2' '?wide/c' <(echo "$W") |
+		grep '^   2') - <<EOF || exit $?
+   2  c                            1202     1202        0        0        0        2
+   2  C?n=2                        1202     1202        2        2        2        1
+EOF
+}
+
+test_aggregate() {
+	local F=samples/dream.xml
+	local O=aggregate/orders.xml
+
+	# speeches per speaker, like counting the speakers one by one
+	diff <($GREP -e 'count()' -g SPEAKER '?PLAY/ACT/SCENE/SPEECH' $F |
+		sort) <($GREP - '?PLAY/ACT/SCENE/SPEECH/SPEAKER' $F |
+		sort | uniq -c | sed 's/^ *\([0-9]*\) \(.*\)/\2\t\1/') ||
+		exit $?
+
+	diff <($GREP -e 'count()' -e 'sum(item/price)' -e 'min(item/price)' \
+		-e 'max(item@quantity)' -e 'avg(item@quantity)' \
+		-g @customer '?orders/order' $O) - <<EOF || exit $?
+alice	2	14.5	4	2	1.33333333333333
+bob	1	10.5	10.5	5	5
+	1	100	100	3	3
+EOF
+	diff <($GREP -e 'count(price)' -e 'sum(@quantity)' -g @sku \
+		'?orders/order/item' $O $O) - <<EOF || exit $?
+a	4	14
+b	2	2
+c	4	8
+EOF
+	$GREP -e 'sum()' '?orders/order' $O 2>/dev/null
+	[ $? = 2 ] || exit 1
+}
+
+test_flatten() {
+	local F
+
+	# parsing into rows gives the same rows as flattening the tree
+	for F in samples/*.xml
+	do
+		diff <($GREP -F $F) <($BIN -F $F) || exit $?
+	done
+
+	diff <($BIN -F '?hello/world/country?name=England' \
+		samples/hello.xml) - <<EOF || exit $?
+country@name = England
+country/city@name = London
+country/city = London Bridge
+EOF
+}
+
+test_builder() {
+	local F
+
+	for F in ${@:-samples/*}
+	do
+		echo ">> builder $F"
+		$BIN -B $F | diff - $F || exit $?
+	done
+
+	# builders see the same document as the tree
+	local D='<?x?><a b='"'1'"' c = "d"><e  /><f>g</f ><![CDATA[<h>]]></a>'
+	diff <($BIN -B "$D") <($BIN "$D") || exit $?
+}
+
 test_find() {
 	$BIN - ${@:-?hello/world/country?name=England/city samples/hello.xml}
 	$BIN - ${@:-?hello/world/country/city samples/hello.xml}
 }
 
+test_store() {
+	# ids of removed documents are reused and keys without postings
+	# are dropped once removed documents make up half of the index
+	diff <($BIN -D - 2>/dev/null <<END_OF_COMMANDS
+add skeleton/a1.xml
+add skeleton/a2.xml
+add skeleton/b1.xml
+query item sku
+query ITEM sku d
+replace 1 skeleton/a3.xml
+query item sku bb
+query item sku c
+replace 7 skeleton/a3.xml
+replace 1 missing.xml
+remove 0
+remove 0
+query order
+add skeleton/b2.xml
+query order id 55
+replace 2 skeleton/b3.xml
+replace 2 skeleton/b1.xml
+replace 2 skeleton/b3.xml
+stats
+remove 0
+remove 1
+remove 2
+stats
+END_OF_COMMANDS
+) - <<END_OF_OUTPUT || exit $?
+0
+1
+2
+0 <item sku="a">
+1 <item sku="bb">
+2 <item sku="d">
+2 <item sku="e">
+4 hits
+2 <item sku="d">
+1 hits
+ok
+0 hits
+1 <item sku="c">
+1 hits
+error
+error
+ok
+error
+2 <order id="4">
+1 <order id="333">
+2 hits
+0
+0 <order id="55">
+1 hits
+ok
+ok
+ok
+16 keys, 25 live, 9 stale
+ok
+ok
+ok
+0 keys, 0 live, 0 stale
+END_OF_OUTPUT
+}
+
+test_rcu() {
+	# replaced trees stay valid while a reader holds them, aren't
+	# released by unlocking, only by waiting or publishing again
+	diff <($BIN -R - <<END_OF_COMMANDS
+publish samples/hello.xml
+lock
+publish samples/android.xml
+lock
+publish samples/dream.xml
+unlock
+unlock
+wait
+lock
+publish samples/actions.xml
+unlock
+publish samples/hello.xml
+END_OF_COMMANDS
+) - <<END_OF_OUTPUT || exit $?
+published hello
+locked hello
+published manifest
+locked manifest
+published PLAY
+unlocked manifest
+unlocked hello
+released hello
+released manifest
+waited
+locked PLAY
+published ACTIONS
+unlocked PLAY
+published hello
+released PLAY
+released ACTIONS
+released hello
+END_OF_OUTPUT
+}
+
 all() {
 	echo '-- test_find --------------------------------------'
 	test_find
 
 	echo '-- test_files -------------------------------------'
 	test_files
+
+	echo '-- test_binary ------------------------------------'
+	test_binary
+
+	echo '-- test_prefilter ---------------------------------'
+	test_prefilter
+
+	echo '-- test_skeleton ----------------------------------'
+	test_skeleton
+
+	echo '-- test_image -------------------------------------'
+	test_image
+
+	echo '-- test_mapped ------------------------------------'
+	test_mapped
+
+	echo '-- test_buffer ------------------------------------'
+	test_buffer
+
+	echo '-- test_grep --------------------------------------'
+	test_grep
+
+	echo '-- test_parallel ----------------------------------'
+	test_parallel
+
+	echo '-- test_fulltext ----------------------------------'
+	test_fulltext
+
+	echo '-- test_compress ----------------------------------'
+	test_compress
+
+	echo '-- test_schema ------------------------------------'
+	test_schema
+
+	echo '-- test_sort --------------------------------------'
+	test_sort
+
+	echo '-- test_template ----------------------------------'
+	test_template
+
+	echo '-- test_follow ------------------------------------'
+	test_follow
+
+	echo '-- test_include -----------------------------------'
+	test_include
+
+	echo '-- test_cache -------------------------------------'
+	test_cache
+
+	echo '-- test_explain -----------------------------------'
+	test_explain
+
+	echo '-- test_bench -------------------------------------'
+	test_bench
+
+	echo '-- test_adaptive ----------------------------------'
+	test_adaptive
+
+	echo '-- test_wide --------------------------------------'
+	test_wide
+
+	echo '-- test_aggregate ---------------------------------'
+	test_aggregate
+
+	echo '-- test_flatten -----------------------------------'
+	test_flatten
+
+	echo '-- test_builder -----------------------------------'
+	test_builder
+
+	echo '-- test_rcu ---------------------------------------'
+	test_rcu
 }
 
 readonly BIN='./xmlparse'
+readonly GREP='./xmlgrep'
+readonly SORT='./xmlsort'
+readonly BENCH='./xmlbench'
 
 (cd .. && make clean && make) && make clean && make || exit $?
 ${@:-all}
+
+	echo '-- test_store -------------------------------------'
+	test_store
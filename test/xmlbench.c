@@ -0,0 +1,663 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <xml.h>
+#include <xml_rcu.h>
+
+/* number of distinct request documents */
+#define DOCUMENTS 1024
+
+/* per thread arena for parsing without malloc() */
+#define ARENA (8 << 20)
+
+/* pause between reloads in nanoseconds */
+#define RELOAD_INTERVAL 1000000
+
+#define MODE_MALLOC 0
+#define MODE_ARENA 1
+#define MODE_RCU 2
+#define MODE_RWLOCK 3
+
+static const char *mode_names[] = {"malloc", "arena", "rcu", "rwlock"};
+
+struct bench {
+	/* request documents and their lengths */
+	char **documents;
+	size_t *lengths;
+
+	int mode;
+	size_t requests;
+
+	/* shared tree that is replaced while workers read it */
+	struct xml_rcu *rcu;
+	pthread_rwlock_t rwlock;
+	struct xml_element *root;
+	int done;
+};
+
+struct worker {
+	pthread_t thread;
+	struct bench *bench;
+	unsigned long long seed;
+
+	/* latency of every request in nanoseconds */
+	unsigned long long *latencies;
+	size_t count;
+
+	/* number of failed requests */
+	size_t errors;
+
+	/* keeps lookups from being optimized away */
+	size_t found;
+};
+
+/**
+ * Return next pseudo random number (xorshift64*)
+ *
+ * @param s - state, must not be 0
+ */
+unsigned long long next_random(unsigned long long *s) {
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+
+	return *s * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Return number of items of a request; most requests are small and
+ * few are large, like order or configuration requests with a long
+ * tail
+ *
+ * @param s - random state
+ */
+size_t item_count(unsigned long long *s) {
+	size_t n = 1;
+
+	/* geometric with a mean of about 4 and rare runs of doubling */
+	while (next_random(s) % 4 && n < 64) {
+		++n;
+	}
+
+	while (next_random(s) % 32 == 0 && n < 2048) {
+		n <<= 1;
+	}
+
+	return n;
+}
+
+/**
+ * Append formatted text to growing buffer
+ *
+ * @param buf - buffer
+ * @param len - length of text in buffer
+ * @param size - size of buffer
+ * @param fmt - format
+ */
+int append(char **buf, size_t *len, size_t *size, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+		va_end(ap);
+
+		if (n < 0) {
+			return -1;
+		}
+
+		if (*len + n < *size) {
+			*len += n;
+			return 0;
+		}
+
+		{
+			size_t s = (*size + n) * 2;
+			char *b = realloc(*buf, s);
+
+			if (!b) {
+				return -1;
+			}
+
+			*buf = b;
+			*size = s;
+		}
+	}
+}
+
+/**
+ * Generate a request document
+ *
+ * @param s - random state
+ * @param len - receives length of document
+ */
+char *generate(unsigned long long *s, size_t *len) {
+	size_t size = 1024;
+	char *buf = malloc(size);
+	size_t items = item_count(s);
+	size_t i;
+	int r;
+
+	if (!buf) {
+		return NULL;
+	}
+
+	*len = 0;
+
+	r = append(&buf, len, &size,
+		"<?xml version=\"1.0\"?>\n"
+		"<request id=\"%llu\" version=\"2\">\n"
+		"\t<header>\n"
+		"\t\t<user id=\"%llu\">user%llu@example.com</user>\n"
+		"\t\t<session>%016llx</session>\n"
+		"\t</header>\n"
+		"\t<items count=\"%lu\">\n",
+		next_random(s) % 1000000,
+		next_random(s) % 10000,
+		next_random(s) % 10000,
+		next_random(s),
+		(unsigned long) items);
+
+	for (i = 0; !r && i < items; ++i) {
+		r = append(&buf, len, &size,
+			"\t\t<item sku=\"%lu\" quantity=\"%llu\">"
+			"<name>Article %llu</name>"
+			"<price currency=\"EUR\">%llu.%02llu</price>"
+			"</item>\n",
+			(unsigned long) i,
+			next_random(s) % 10 + 1,
+			next_random(s) % 100000,
+			next_random(s) % 1000,
+			next_random(s) % 100);
+	}
+
+	if (!r) {
+		r = append(&buf, len, &size,
+			"\t</items>\n"
+			"\t<note>Please deliver between %llu and %llu o'clock "
+			"&amp; ring twice.</note>\n"
+			"</request>\n",
+			next_random(s) % 12 + 6,
+			next_random(s) % 6 + 18);
+	}
+
+	if (r) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/**
+ * Run the lookups of a request and return what was found
+ *
+ * @param root - root element
+ */
+size_t handle(struct xml_element *root) {
+	struct xml_element *e;
+	struct xml_element *items;
+	char *content;
+	char sku[64];
+	size_t found = 0;
+
+	if ((e = xml_find(root, "request/header/user"))) {
+		++found;
+	}
+
+	if ((e = xml_find(root, "request/header/session"))) {
+		++found;
+	}
+
+	if ((items = xml_find(root, "request/items"))) {
+		struct xml_attribute *a = xml_find_attribute(
+			items->first_attribute,
+			"count");
+		unsigned long n = a ? strtoul(a->value, NULL, 10) : 0;
+
+		/* look up the last item by attribute */
+		snprintf(sku, sizeof(sku), "request/items/item?sku=%lu",
+			n > 0 ? n - 1 : 0);
+
+		if ((e = xml_find(root, sku))) {
+			++found;
+		}
+	}
+
+	if ((content = xml_content_find(root, "request/note"))) {
+		found += strlen(content);
+		free(content);
+	}
+
+	return found;
+}
+
+/**
+ * Return monotonic time in nanoseconds
+ */
+unsigned long long now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Query the shared tree while it's being replaced
+ *
+ * @param w - worker
+ */
+void read_shared(struct worker *w) {
+	struct bench *b = w->bench;
+	struct xml_rcu_reader *r = NULL;
+	size_t count = 0;
+	size_t found = 0;
+	size_t i;
+
+	if (b->mode == MODE_RCU && !(r = xml_rcu_register(b->rcu))) {
+		w->errors = b->requests;
+		return;
+	}
+
+	for (i = 0; i < b->requests; ++i) {
+		unsigned long long start = now();
+
+		if (b->mode == MODE_RCU) {
+			found += handle(xml_rcu_lock(r));
+			xml_rcu_unlock(r);
+		} else {
+			pthread_rwlock_rdlock(&b->rwlock);
+			found += handle(b->root);
+			pthread_rwlock_unlock(&b->rwlock);
+		}
+
+		w->latencies[count++] = now() - start;
+	}
+
+	xml_rcu_unregister(r);
+
+	w->count = count;
+	w->found = found;
+}
+
+/**
+ * Replace the shared tree with a random document until all workers
+ * are done
+ *
+ * @param p - benchmark
+ */
+void *reload(void *p) {
+	struct bench *b = p;
+	struct timespec ts = {0, RELOAD_INTERVAL};
+	unsigned long long seed = 0x2545f4914f6cdd1dULL;
+
+	while (!__atomic_load_n(&b->done, __ATOMIC_ACQUIRE)) {
+		size_t d = next_random(&seed) % DOCUMENTS;
+		struct xml_element *root = xml_parse(b->documents[d]);
+
+		if (!root) {
+			continue;
+		}
+
+		if (b->mode == MODE_RCU) {
+			xml_rcu_publish(b->rcu, root);
+		} else {
+			struct xml_element *old;
+
+			pthread_rwlock_wrlock(&b->rwlock);
+			old = b->root;
+			b->root = root;
+			pthread_rwlock_unlock(&b->rwlock);
+
+			xml_free(old);
+		}
+
+		nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+/**
+ * Parse, query and free random requests
+ *
+ * @param p - worker
+ */
+void *work(void *p) {
+	struct worker *w = p;
+	struct bench *b = w->bench;
+	unsigned long long seed = w->seed;
+	char *arena = NULL;
+	size_t count = 0;
+	size_t errors = 0;
+	size_t found = 0;
+	size_t i;
+
+	if (b->mode == MODE_RCU || b->mode == MODE_RWLOCK) {
+		read_shared(w);
+		return NULL;
+	}
+
+	if (b->mode == MODE_ARENA && !(arena = malloc(ARENA))) {
+		w->errors = b->requests;
+		return NULL;
+	}
+
+	for (i = 0; i < b->requests; ++i) {
+		size_t d = next_random(&seed) % DOCUMENTS;
+		unsigned long long start = now();
+		struct xml_element *root;
+
+		if (b->mode == MODE_ARENA) {
+			root = xml_parse_into(arena, ARENA, b->documents[d],
+				b->lengths[d], NULL);
+		} else {
+			root = xml_parse(b->documents[d]);
+		}
+
+		if (!root) {
+			++errors;
+			continue;
+		}
+
+		found += handle(root);
+
+		/* trees in the arena are released by reusing it */
+		if (b->mode == MODE_MALLOC) {
+			xml_free(root);
+		}
+
+		w->latencies[count++] = now() - start;
+	}
+
+	free(arena);
+
+	/* workers lie next to each other, so they're only written once
+	 * to not share cache lines while measuring */
+	w->count = count;
+	w->errors = errors;
+	w->found = found;
+
+	return NULL;
+}
+
+/**
+ * Compare latencies
+ *
+ * @param a - latency
+ * @param b - latency
+ */
+int compare(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Return latency at given fraction of sorted latencies in
+ * microseconds
+ *
+ * @param l - sorted latencies
+ * @param n - number of latencies
+ * @param q - fraction
+ */
+double percentile(unsigned long long *l, size_t n, double q) {
+	size_t i = (size_t) (q * n);
+
+	if (!n) {
+		return 0;
+	}
+
+	return l[i < n ? i : n - 1] / 1000.0;
+}
+
+/**
+ * Parse the first shared tree
+ *
+ * @param b - benchmark
+ */
+int setup_shared(struct bench *b) {
+	struct xml_element *root;
+
+	if (!(root = xml_parse(b->documents[0]))) {
+		fprintf(stderr, "error: cannot parse shared tree\n");
+		return -1;
+	}
+
+	b->done = 0;
+
+	if (b->mode == MODE_RCU) {
+		if (!(b->rcu = xml_rcu_create(root, NULL))) {
+			perror("xml_rcu_create");
+			xml_free(root);
+			return -1;
+		}
+	} else {
+		pthread_rwlock_init(&b->rwlock, NULL);
+		b->root = root;
+	}
+
+	return 0;
+}
+
+/**
+ * Free the shared tree and all replaced trees
+ *
+ * @param b - benchmark
+ */
+void free_shared(struct bench *b) {
+	if (b->mode == MODE_RCU) {
+		xml_rcu_free(b->rcu);
+		b->rcu = NULL;
+	} else {
+		pthread_rwlock_destroy(&b->rwlock);
+		xml_free(b->root);
+		b->root = NULL;
+	}
+}
+
+/**
+ * Run benchmark on given number of threads and print a row
+ *
+ * @param b - benchmark
+ * @param threads - number of threads
+ */
+int run(struct bench *b, int threads) {
+	struct worker *workers = calloc(threads, sizeof(*workers));
+	int shared = b->mode == MODE_RCU || b->mode == MODE_RWLOCK;
+	pthread_t writer;
+	int writing = 0;
+	unsigned long long *all;
+	unsigned long long start;
+	unsigned long long elapsed;
+	size_t count = 0;
+	size_t errors = 0;
+	int started;
+	int i;
+
+	if (!workers) {
+		perror("calloc");
+		return -1;
+	}
+
+	if (!(all = malloc(threads * b->requests * sizeof(*all)))) {
+		perror("malloc");
+		free(workers);
+		return -1;
+	}
+
+	/* workers write into disjoint parts of one array */
+	for (i = 0; i < threads; ++i) {
+		workers[i].bench = b;
+		workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		workers[i].latencies = all + i * b->requests;
+	}
+
+	if (shared && setup_shared(b)) {
+		free(all);
+		free(workers);
+		return -1;
+	}
+
+	start = now();
+
+	for (started = 0; started < threads; ++started) {
+		if (pthread_create(&workers[started].thread, NULL, work,
+				&workers[started])) {
+			perror("pthread_create");
+			break;
+		}
+	}
+
+	if (shared) {
+		if (pthread_create(&writer, NULL, reload, b)) {
+			perror("pthread_create");
+		} else {
+			writing = 1;
+		}
+	}
+
+	for (i = 0; i < started; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	elapsed = now() - start;
+
+	if (shared) {
+		__atomic_store_n(&b->done, 1, __ATOMIC_RELEASE);
+
+		if (writing) {
+			pthread_join(writer, NULL);
+		}
+
+		free_shared(b);
+	}
+
+	/* close gaps of failed requests */
+	for (i = 0; i < started; ++i) {
+		memmove(all + count, workers[i].latencies,
+			workers[i].count * sizeof(*all));
+		count += workers[i].count;
+		errors += workers[i].errors;
+	}
+
+	qsort(all, count, sizeof(*all), compare);
+
+	printf("%7d  %-6s %10.0f %9.1f %9.1f %9.1f %9.1f\n",
+		threads,
+		mode_names[b->mode],
+		elapsed ? count * 1e9 / elapsed : 0,
+		percentile(all, count, .5),
+		percentile(all, count, .99),
+		percentile(all, count, .999),
+		count ? all[count - 1] / 1000.0 : 0);
+
+	free(all);
+	free(workers);
+
+	if (errors) {
+		fprintf(stderr, "error: %lu requests failed\n",
+			(unsigned long) errors);
+		return -1;
+	}
+
+	return started < threads || (shared && !writing) ? -1 : 0;
+}
+
+/**
+ * Measure request latency for 1 to N threads; every request parses a
+ * generated document, runs a few lookups and frees the tree, either
+ * with malloc() or in a per thread arena to tell allocator contention
+ * from parsing; with "-r" every request runs the lookups on one shared
+ * tree that another thread keeps reloading, either published with
+ * xml_rcu or guarded by a read-write lock
+ *
+ * @param argc - number of arguments
+ * @param argv - "-t THREADS", "-n REQUESTS" per thread, "-s SEED", "-r"
+ */
+int main(int argc, char **argv) {
+	struct bench b;
+	unsigned long long seed = 1;
+	size_t total = 0;
+	int threads = 4;
+	int shared = 0;
+	int errors = 0;
+	int i;
+
+	memset(&b, 0, sizeof(b));
+	b.requests = 10000;
+
+	while (--argc && ++argv) {
+		if (!strcmp(*argv, "-t") && argc > 1) {
+			--argc;
+			threads = atoi(*++argv);
+		} else if (!strcmp(*argv, "-n") && argc > 1) {
+			--argc;
+			b.requests = strtoul(*++argv, NULL, 10);
+		} else if (!strcmp(*argv, "-s") && argc > 1) {
+			--argc;
+			seed = strtoull(*++argv, NULL, 10);
+		} else if (!strcmp(*argv, "-r")) {
+			shared = 1;
+		} else {
+			break;
+		}
+	}
+
+	if (argc || threads < 1 || !b.requests || !seed) {
+		fprintf(stderr,
+			"usage: xmlbench [-t THREADS] [-n REQUESTS] [-s SEED] [-r]\n");
+		return 2;
+	}
+
+	if (!(b.documents = calloc(DOCUMENTS, sizeof(*b.documents))) ||
+			!(b.lengths = calloc(DOCUMENTS, sizeof(*b.lengths)))) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < DOCUMENTS; ++i) {
+		if (!(b.documents[i] = generate(&seed, &b.lengths[i]))) {
+			perror("generate");
+			return 1;
+		}
+
+		total += b.lengths[i];
+	}
+
+	printf("%d documents, %lu bytes on average\n",
+		DOCUMENTS,
+		(unsigned long) (total / DOCUMENTS));
+	printf("%7s  %-6s %10s %9s %9s %9s %9s\n",
+		"threads", "mode", "req/s", "p50 us", "p99 us", "p999 us",
+		"max us");
+
+	/* double the number of threads up to the given one */
+	for (i = 1; ; i = i * 2 < threads ? i * 2 : threads) {
+		b.mode = shared ? MODE_RCU : MODE_MALLOC;
+		errors += run(&b, i) != 0;
+
+		b.mode = shared ? MODE_RWLOCK : MODE_ARENA;
+		errors += run(&b, i) != 0;
+
+		if (i == threads) {
+			break;
+		}
+	}
+
+	for (i = 0; i < DOCUMENTS; ++i) {
+		free(b.documents[i]);
+	}
+
+	free(b.documents);
+	free(b.lengths);
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,611 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <xml.h>
+#include <xml_aggregate.h>
+#include <xml_flatten.h>
+
+#include "dump.h"
+
+/* size of slices handed to the tokenizer */
+#define SLICE (1 << 20)
+
+struct search {
+	struct search *next;
+	char *pattern;
+};
+
+struct grep {
+	struct search *searches;
+	void (*dump)(struct xml_element *);
+
+	/* number of open elements that are going to be printed */
+	int selected;
+
+	/* number of printed elements */
+	size_t matches;
+
+	/* keep parsing what's appended to the file */
+	int follow;
+
+	/* aggregate records instead of printing them */
+	struct xml_aggregate *aggregate;
+	size_t columns;
+	int grouped;
+
+	/* print (path, value) rows of whole documents instead */
+	struct xml_flatten *flatten;
+};
+
+/**
+ * Dump matching element as XML
+ *
+ * @param e - XML element
+ */
+void dump_element(struct xml_element *e) {
+	dump_xml(stdout, e);
+	printf("\n");
+}
+
+/**
+ * Dump matching element as string
+ *
+ * @param e - XML element
+ */
+void dump_content(struct xml_element *e) {
+	dump_string(stdout, e);
+}
+
+/**
+ * Dump attributes of matching element
+ *
+ * @param e - XML element
+ */
+void dump_attributes(struct xml_element *e) {
+	dump_arguments(stdout, e);
+	printf("\n");
+}
+
+/**
+ * Return true if element matches any search
+ *
+ * @param e - XML element
+ * @param s - search patterns
+ */
+int matches(struct xml_element *e, struct search *s) {
+	for (; s; s = s->next) {
+		if (xml_match(e, s->pattern)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Count start tags of elements that are going to be printed
+ *
+ * @param st - parser state
+ * @param e - XML element
+ */
+int element_open(struct xml_state *st, struct xml_element *e) {
+	struct grep *g = st->user;
+
+	if (matches(e, g->searches)) {
+		++g->selected;
+	}
+
+	return 0;
+}
+
+/**
+ * Print element if it matches and drop it unless an open
+ * ancestor is going to be printed
+ *
+ * @param st - parser state
+ * @param e - XML element
+ */
+int element_close(struct xml_state *st, struct xml_element *e) {
+	struct grep *g = st->user;
+	struct xml_element *p = e->parent;
+
+	if (e->key && matches(e, g->searches)) {
+		g->dump(e);
+		++g->matches;
+
+		/* there's no start notification for special tags */
+		if (g->selected > 0) {
+			--g->selected;
+		}
+	}
+
+	if (g->selected > 0) {
+		return 0;
+	}
+
+	/* all previous siblings have already been dropped */
+	p->first_child = p->last_child = NULL;
+	e->parent = NULL;
+	xml_free(e);
+
+	return 0;
+}
+
+/**
+ * Feed data to parser in slices
+ *
+ * @param st - parser state
+ * @param d - XML data
+ * @param len - length of data
+ */
+int feed(struct xml_state *st, const char *d, size_t len) {
+	while (len > 0) {
+		size_t n = len < SLICE ? len : SLICE;
+
+		if (xml_parse_chunk_len(st, d, n)) {
+			return -1;
+		}
+
+		d += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse file descriptor through a read only mapping or, if it can't
+ * be mapped, with large reads
+ *
+ * @param st - parser state
+ * @param fd - file descriptor
+ */
+int parse_fd(struct xml_state *st, int fd) {
+	struct stat sb;
+	char *buf;
+	ssize_t bytes;
+
+	if (!fstat(fd, &sb) && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		char *d = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (d != MAP_FAILED) {
+			size_t off;
+			int r = 0;
+
+			madvise(d, sb.st_size, MADV_SEQUENTIAL);
+
+			for (off = 0; !r && off < (size_t) sb.st_size; off += SLICE) {
+				size_t n = sb.st_size - off;
+
+				if (n > SLICE) {
+					n = SLICE;
+				}
+
+				r = feed(st, d + off, n);
+
+				/* give back pages that have been parsed */
+				madvise(d + off, n, MADV_DONTNEED);
+			}
+
+			munmap(d, sb.st_size);
+
+			/* continue after the mapped bytes when following */
+			if (!r && lseek(fd, sb.st_size, SEEK_SET) < 0) {
+				r = -1;
+			}
+
+			return r;
+		}
+	}
+
+	if (!(buf = malloc(SLICE))) {
+		return -1;
+	}
+
+	while ((bytes = read(fd, buf, SLICE)) > 0) {
+		if (feed(st, buf, bytes)) {
+			free(buf);
+			return -1;
+		}
+	}
+
+	free(buf);
+
+	return bytes < 0 ? -1 : 0;
+}
+
+/**
+ * Wait until file changes; uses inotify where available and
+ * polls every second otherwise
+ *
+ * @param in - inotify descriptor or -1
+ */
+int wait_for_change(int in) {
+#ifdef __linux__
+	char events[4096] __attribute__((aligned(
+		__alignof__(struct inotify_event))));
+
+	if (in > -1) {
+		/* the events themselves don't matter since the file is
+		 * checked after every change anyway */
+		while (read(in, events, sizeof(events)) < 0) {
+			if (errno != EINTR) {
+				return -1;
+			}
+		}
+
+		return 0;
+	}
+#else
+	(void) in;
+#endif
+
+	sleep(1);
+
+	return 0;
+}
+
+/**
+ * Keep parsing data that is appended to file, like "tail -f", until
+ * the file is removed; parsed records are flushed right away; returns
+ * -2 if the file got truncated
+ *
+ * @param st - parser state
+ * @param fd - file descriptor positioned after parsed data
+ * @param file - file name
+ */
+int follow(struct xml_state *st, int fd, const char *file) {
+	char *buf;
+	int in = -1;
+	int r = 0;
+
+	if (!(buf = malloc(SLICE))) {
+		return -1;
+	}
+
+#ifdef __linux__
+	if ((in = inotify_init1(IN_CLOEXEC)) > -1 &&
+			inotify_add_watch(in, file,
+				IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF) < 0) {
+		close(in);
+		in = -1;
+	}
+#endif
+
+	for (;;) {
+		struct stat sb;
+		ssize_t bytes;
+		off_t offset;
+
+		/* read only what has been appended since last time */
+		while ((bytes = read(fd, buf, SLICE)) > 0) {
+			if (feed(st, buf, bytes)) {
+				r = -1;
+				break;
+			}
+		}
+
+		fflush(stdout);
+
+		if (r || bytes < 0 ||
+				fstat(fd, &sb) ||
+				(offset = lseek(fd, 0, SEEK_CUR)) < 0) {
+			r = -1;
+			break;
+		}
+
+		if (sb.st_size < offset) {
+			fprintf(stderr, "xmlgrep: %s: file truncated\n", file);
+			r = -2;
+			break;
+		}
+
+		/* appended after the last read, maybe right before the
+		 * file was removed */
+		if (sb.st_size > offset) {
+			continue;
+		}
+
+		/* stop once the file has been removed and everything
+		 * written before has been read */
+		if (!sb.st_nlink) {
+			break;
+		}
+
+		if (wait_for_change(in)) {
+			r = -1;
+			break;
+		}
+	}
+
+	if (in > -1) {
+		close(in);
+	}
+
+	free(buf);
+
+	return r;
+}
+
+/**
+ * Search file
+ *
+ * @param g - grep state
+ * @param file - file name or NULL for stdin
+ */
+int grep(struct grep *g, const char *file) {
+	struct xml_state st;
+	int fd = STDIN_FILENO;
+	int r;
+
+	if (file && (fd = open(file, O_RDONLY)) < 0) {
+		perror(file);
+		return -1;
+	}
+
+	memset(&st, 0, sizeof(st));
+
+	if (g->aggregate) {
+		xml_aggregate_attach(g->aggregate, &st);
+	} else if (g->flatten) {
+		xml_flatten_attach(g->flatten, &st);
+	} else {
+		st.open = element_open;
+		st.close = element_close;
+		st.user = g;
+		g->selected = 0;
+	}
+
+	r = parse_fd(&st, fd);
+
+	if (!r && g->follow && file) {
+		r = follow(&st, fd, file);
+	}
+
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+
+	xml_free(st.root);
+
+	if (r == -1) {
+		fprintf(stderr, "xmlgrep: %s: malformed XML document\n",
+			file ? file : "-");
+	}
+
+	return r;
+}
+
+/**
+ * Add another search to list
+ *
+ * @param sibling - existing search item (may be NULL)
+ * @param pattern - search pattern
+ */
+struct search *search_add(
+	struct search *sibling,
+	char *pattern) {
+	struct search *s = malloc(sizeof(struct search));
+
+	if (!s) {
+		return NULL;
+	}
+
+	s->pattern = pattern;
+	s->next = sibling;
+
+	return s;
+}
+
+/**
+ * Free search list
+ *
+ * @param s - first search item
+ */
+void search_free(struct search *s) {
+	struct search *n;
+
+	for (; s; s = n) {
+		n = s->next;
+		free(s);
+	}
+}
+
+/**
+ * Print (path, value) row
+ *
+ * @param path - path
+ * @param path_len - length of path
+ * @param value - value
+ * @param value_len - length of value
+ * @param user - grep state
+ */
+int print_row(
+		const char *path,
+		size_t path_len,
+		const char *value,
+		size_t value_len,
+		void *user) {
+	struct grep *g = user;
+
+	printf("%.*s = %.*s\n", (int) path_len, path,
+		(int) value_len, value);
+	++g->matches;
+
+	return 0;
+}
+
+/**
+ * Print one line per group with its key, if grouped, and results
+ *
+ * @param g - grep state
+ */
+void print_groups(struct grep *g) {
+	size_t i, j;
+
+	for (i = 0; i < xml_aggregate_groups(g->aggregate); ++i) {
+		if (g->grouped) {
+			printf("%s\t", xml_aggregate_key(g->aggregate, i));
+		}
+
+		for (j = 0; j < g->columns; ++j) {
+			printf(j ? "\t%.15g" : "%.15g",
+				xml_aggregate_result(g->aggregate, i, j));
+		}
+
+		printf("\n");
+	}
+
+	g->matches = xml_aggregate_groups(g->aggregate);
+}
+
+/**
+ * Process command line arguments; prints elements matching any
+ * "?path" as XML, text ("-") or attributes ("=") as soon as they are
+ * complete, with "-f" also those appended to the file later on; with
+ * "-e" prints aggregates over the elements matching the one "?path"
+ * instead, one line per "-g" group; with "-F" prints whole documents
+ * as (path, value) rows; exits with 0 if something matched, 1 if
+ * nothing matched and 2 on errors
+ *
+ * @param argc - number of arguments
+ * @param argv - "?path", "-", "=", "-f", "-e EXPR", "-g GROUP", "-F"
+ *               and file names
+ */
+int main(int argc, char **argv) {
+	struct grep g;
+	const char *group = NULL;
+	int aggregates = 0;
+	int flat = 0;
+	int searches = 0;
+	int files = 0;
+	int errors = 0;
+
+	memset(&g, 0, sizeof(g));
+	g.dump = dump_element;
+
+	/* collect searches and options first since files may come first */
+	{
+		int i;
+
+		for (i = 1; i < argc; ++i) {
+			if (*argv[i] == '?') {
+				g.searches = search_add(g.searches, argv[i] + 1);
+				++searches;
+			} else if (!strcmp(argv[i], "-f")) {
+				g.follow = 1;
+			} else if (!strcmp(argv[i], "-F")) {
+				flat = 1;
+			} else if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+				++aggregates;
+				++i;
+			} else if (!strcmp(argv[i], "-g") && i + 1 < argc) {
+				group = argv[++i];
+			} else if (strcmp(argv[i], "-") && strcmp(argv[i], "=")) {
+				++files;
+			}
+		}
+	}
+
+	/* following never ends so there can only be one file, and
+	 * aggregates would never be printed */
+	if (!g.searches == !flat || (g.follow && files != 1) ||
+			(aggregates && (searches != 1 || g.follow)) ||
+			(group && !aggregates)) {
+		fprintf(stderr,
+			"usage: xmlgrep [-|=] ?PATH... [FILE...]\n"
+			"       xmlgrep -f [-|=] ?PATH... FILE\n"
+			"       xmlgrep -e EXPR... [-g GROUP] ?PATH [FILE...]\n"
+			"       xmlgrep -F [FILE...]\n"
+			"       xmlgrep -f -F FILE\n");
+		search_free(g.searches);
+		return 2;
+	}
+
+	if (flat && !(g.flatten = xml_flatten_create(print_row, &g))) {
+		perror("xml_flatten_create");
+		return 2;
+	}
+
+	if (aggregates) {
+		int i;
+
+		if (!(g.aggregate = xml_aggregate_create(g.searches->pattern,
+				group))) {
+			if (group) {
+				fprintf(stderr, "xmlgrep: invalid group %s\n",
+					group);
+			} else {
+				fprintf(stderr, "xmlgrep: invalid pattern %s\n",
+					g.searches->pattern);
+			}
+
+			search_free(g.searches);
+			return 2;
+		}
+
+		for (i = 1; i < argc; ++i) {
+			if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+				if (xml_aggregate_add(g.aggregate, argv[++i]) < 0) {
+					fprintf(stderr, "xmlgrep: invalid aggregate %s\n",
+						argv[i]);
+					xml_aggregate_free(g.aggregate);
+					search_free(g.searches);
+					return 2;
+				}
+			} else if (!strcmp(argv[i], "-g") && i + 1 < argc) {
+				++i;
+			}
+		}
+
+		g.columns = aggregates;
+		g.grouped = group != NULL;
+	}
+
+	while (--argc && ++argv) {
+		if (**argv == '?') {
+			continue;
+		} else if (!strcmp(*argv, "-")) {
+			g.dump = dump_content;
+		} else if (!strcmp(*argv, "=")) {
+			g.dump = dump_attributes;
+		} else if (!strcmp(*argv, "-f") || !strcmp(*argv, "-F")) {
+			continue;
+		} else if ((!strcmp(*argv, "-e") || !strcmp(*argv, "-g")) &&
+				argc > 1) {
+			--argc;
+			++argv;
+		} else {
+			errors += grep(&g, *argv) != 0;
+		}
+	}
+
+	if (!files) {
+		errors += grep(&g, NULL) != 0;
+	}
+
+	if (g.aggregate) {
+		print_groups(&g);
+		xml_aggregate_free(g.aggregate);
+	}
+
+	xml_flatten_free(g.flatten);
+
+	search_free(g.searches);
+
+	if (errors) {
+		return 2;
+	}
+
+	return g.matches ? 0 : 1;
+}
@@ -0,0 +1,748 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <xml.h>
+
+/* size of slices handed to the tokenizer */
+#define SLICE (1 << 20)
+
+/* default memory budget for records */
+#define BUDGET (64 << 20)
+
+struct record {
+	/* first bytes of key in big endian order to compare most keys
+	 * without touching the sort buffer */
+	unsigned long long prefix;
+
+	/* key and data are stored back to back in the sort buffer */
+	size_t offset;
+	size_t key_length;
+	size_t length;
+
+	/* position in input to keep records with equal keys in order */
+	size_t sequence;
+};
+
+struct run {
+	/* reading end of temporary file */
+	FILE *fp;
+
+	/* current record */
+	char *buffer;
+	size_t size;
+	size_t key_length;
+	size_t length;
+};
+
+struct sorter {
+	/* path of records and name of key attribute */
+	const char *path;
+	const char *key;
+	const char *tmpdir;
+
+	/* mapped input */
+	const char *input;
+	size_t input_length;
+
+	/* sort buffer with data growing up and records growing down */
+	char *buffer;
+	size_t budget;
+	size_t used;
+	size_t count;
+	size_t sequence;
+
+	/* sorted runs in temporary files */
+	FILE **runs;
+	size_t run_count;
+
+	/* open record and parent of all records */
+	struct xml_element *record;
+	struct xml_element *parent;
+	int sealed;
+
+	/* start of the next record, end of the last one */
+	size_t mark;
+};
+
+/*****************************************************************************
+ * RUNS
+ ****************************************************************************/
+
+/**
+ * Write bytes to stream
+ *
+ * @param fp - stream
+ * @param d - data
+ * @param l - length of data
+ */
+int put(FILE *fp, const void *d, size_t l) {
+	return l > 0 && fwrite(d, 1, l, fp) != l ? -1 : 0;
+}
+
+/**
+ * Return records of sort buffer
+ *
+ * @param s - sorter
+ */
+struct record *records(struct sorter *s) {
+	return (struct record *) (s->buffer + s->budget) - s->count;
+}
+
+/* output buffer */
+static char output[SLICE];
+
+/* sort buffer for record_compare() */
+static const char *sorting;
+
+/**
+ * Compare two records by key and position
+ *
+ * @param a - record
+ * @param b - record
+ */
+int record_compare(const void *a, const void *b) {
+	const struct record *ra = a;
+	const struct record *rb = b;
+	size_t l;
+	int r;
+
+	if (ra->prefix != rb->prefix) {
+		return ra->prefix < rb->prefix ? -1 : 1;
+	}
+
+	l = ra->key_length < rb->key_length ? ra->key_length : rb->key_length;
+	r = memcmp(sorting + ra->offset, sorting + rb->offset, l);
+
+	if (r) {
+		return r;
+	}
+
+	if (ra->key_length != rb->key_length) {
+		return ra->key_length < rb->key_length ? -1 : 1;
+	}
+
+	return ra->sequence < rb->sequence ? -1 : 1;
+}
+
+/**
+ * Open an anonymous temporary file
+ *
+ * @param dir - directory
+ */
+FILE *temporary(const char *dir) {
+	char *name;
+	FILE *fp = NULL;
+	int fd;
+
+	if (!(name = malloc(strlen(dir) + 16))) {
+		return NULL;
+	}
+
+	sprintf(name, "%s/xmlsortXXXXXX", dir);
+
+	if ((fd = mkstemp(name)) > -1) {
+		unlink(name);
+
+		if (!(fp = fdopen(fd, "w+"))) {
+			close(fd);
+		}
+	}
+
+	free(name);
+
+	return fp;
+}
+
+/**
+ * Write one record of a run
+ *
+ * @param fp - stream
+ * @param key - key
+ * @param key_length - length of key
+ * @param d - data
+ * @param length - length of data
+ */
+int run_put(
+		FILE *fp,
+		const char *key,
+		size_t key_length,
+		const char *d,
+		size_t length) {
+	return put(fp, &key_length, sizeof(key_length)) ||
+		put(fp, &length, sizeof(length)) ||
+		put(fp, key, key_length) ||
+		put(fp, d, length);
+}
+
+/**
+ * Sort records in buffer and write them to stdout if this is the only
+ * run or to a new temporary file otherwise
+ *
+ * @param s - sorter
+ * @param last - true if there are no more records
+ */
+int spill(struct sorter *s, int last) {
+	struct record *r = records(s);
+	FILE *fp = stdout;
+	size_t i;
+
+	sorting = s->buffer;
+	qsort(r, s->count, sizeof(struct record), record_compare);
+
+	if (!last || s->run_count > 0) {
+		FILE **runs = realloc(s->runs, (s->run_count + 1) * sizeof(FILE *));
+
+		if (!runs) {
+			return -1;
+		}
+
+		s->runs = runs;
+
+		if (!(fp = temporary(s->tmpdir))) {
+			perror("xmlsort: temporary file");
+			return -1;
+		}
+
+		s->runs[s->run_count++] = fp;
+	}
+
+	for (i = 0; i < s->count; ++i) {
+		const char *key = s->buffer + r[i].offset;
+		const char *d = key + r[i].key_length;
+
+		if (fp == stdout ?
+				put(fp, d, r[i].length) :
+				run_put(fp, key, r[i].key_length, d, r[i].length)) {
+			return -1;
+		}
+	}
+
+	s->used = 0;
+	s->count = 0;
+
+	return 0;
+}
+
+/**
+ * Read next record of a run; returns 1 at the end of the run
+ *
+ * @param r - run
+ */
+int run_next(struct run *r) {
+	size_t size;
+
+	if (fread(&r->key_length, sizeof(size_t), 1, r->fp) != 1) {
+		return feof(r->fp) ? 1 : -1;
+	}
+
+	if (fread(&r->length, sizeof(size_t), 1, r->fp) != 1) {
+		return -1;
+	}
+
+	if ((size = r->key_length + r->length) > r->size) {
+		char *b = realloc(r->buffer, size);
+
+		if (!b) {
+			return -1;
+		}
+
+		r->buffer = b;
+		r->size = size;
+	}
+
+	return size > 0 && fread(r->buffer, 1, size, r->fp) != size ? -1 : 0;
+}
+
+/**
+ * Return true if run a comes before run b
+ *
+ * @param runs - runs
+ * @param a - index of run
+ * @param b - index of run
+ */
+int run_less(struct run *runs, size_t a, size_t b) {
+	struct run *ra = runs + a;
+	struct run *rb = runs + b;
+	size_t l = ra->key_length < rb->key_length ?
+		ra->key_length : rb->key_length;
+	int r = memcmp(ra->buffer, rb->buffer, l);
+
+	if (r) {
+		return r < 0;
+	}
+
+	if (ra->key_length != rb->key_length) {
+		return ra->key_length < rb->key_length;
+	}
+
+	/* earlier runs hold earlier records */
+	return a < b;
+}
+
+/**
+ * Restore heap order below given position
+ *
+ * @param runs - runs
+ * @param heap - heap of run indices
+ * @param n - number of entries in heap
+ * @param i - position
+ */
+void sift_down(struct run *runs, size_t *heap, size_t n, size_t i) {
+	for (;;) {
+		size_t c = i * 2 + 1;
+		size_t t;
+
+		if (c >= n) {
+			break;
+		}
+
+		if (c + 1 < n && run_less(runs, heap[c + 1], heap[c])) {
+			++c;
+		}
+
+		if (!run_less(runs, heap[c], heap[i])) {
+			break;
+		}
+
+		t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+		i = c;
+	}
+}
+
+/**
+ * Merge all runs into stdout
+ *
+ * @param s - sorter
+ */
+int merge(struct sorter *s) {
+	struct run *runs;
+	size_t *heap;
+	char *buffers;
+	size_t n = 0;
+	size_t buffer = s->budget / s->run_count;
+	size_t i;
+	int next;
+	int r = 0;
+
+	if (buffer < 4096) {
+		buffer = 4096;
+	}
+
+	runs = calloc(s->run_count, sizeof(struct run));
+	heap = calloc(s->run_count, sizeof(size_t));
+	buffers = malloc(s->run_count * buffer);
+
+	if (!runs || !heap || !buffers) {
+		free(runs);
+		free(heap);
+		free(buffers);
+		return -1;
+	}
+
+	for (i = 0; !r && i < s->run_count; ++i) {
+		int fd;
+
+		/* read through a stream of its own to set its buffer */
+		if (fflush(s->runs[i]) || (fd = dup(fileno(s->runs[i]))) < 0) {
+			r = -1;
+			break;
+		}
+
+		if (lseek(fd, 0, SEEK_SET) || !(runs[i].fp = fdopen(fd, "r"))) {
+			close(fd);
+			r = -1;
+			break;
+		}
+
+		setvbuf(runs[i].fp, buffers + i * buffer, _IOFBF, buffer);
+
+		if ((next = run_next(runs + i)) < 0) {
+			r = -1;
+		} else if (!next) {
+			heap[n++] = i;
+		}
+	}
+
+	for (i = n / 2; i-- > 0;) {
+		sift_down(runs, heap, n, i);
+	}
+
+	while (!r && n > 0) {
+		struct run *top = runs + heap[0];
+
+		if (put(stdout, top->buffer + top->key_length, top->length) ||
+				(next = run_next(top)) < 0) {
+			r = -1;
+			break;
+		}
+
+		if (next > 0) {
+			heap[0] = heap[--n];
+		}
+
+		sift_down(runs, heap, n, 0);
+	}
+
+	for (i = 0; i < s->run_count; ++i) {
+		if (runs[i].fp) {
+			fclose(runs[i].fp);
+		}
+
+		free(runs[i].buffer);
+	}
+
+	free(runs);
+	free(heap);
+	free(buffers);
+
+	return r;
+}
+
+/*****************************************************************************
+ * RECORDS
+ ****************************************************************************/
+
+/**
+ * Add complete record to sort buffer
+ *
+ * @param s - sorter
+ * @param e - record element
+ * @param end - offset of first byte after record
+ */
+int add(struct sorter *s, struct xml_element *e, size_t end) {
+	struct xml_attribute *a = xml_find_attribute(e->first_attribute, s->key);
+	const char *key = a && a->value ? a->value : "";
+	size_t key_length = strlen(key);
+	size_t length = end - s->mark;
+	size_t need = key_length + length + sizeof(struct record);
+	struct record *r;
+	size_t i;
+
+	if (s->used + need + s->count * sizeof(struct record) > s->budget &&
+			s->count > 0 &&
+			spill(s, 0)) {
+		return -1;
+	}
+
+	/* records larger than the budget make a run of their own */
+	if (need > s->budget) {
+		FILE *fp;
+		FILE **runs = realloc(s->runs, (s->run_count + 1) * sizeof(FILE *));
+
+		if (!runs) {
+			return -1;
+		}
+
+		s->runs = runs;
+
+		if (!(fp = temporary(s->tmpdir))) {
+			perror("xmlsort: temporary file");
+			return -1;
+		}
+
+		s->runs[s->run_count++] = fp;
+		++s->sequence;
+
+		return run_put(fp, key, key_length, s->input + s->mark, length);
+	}
+
+	++s->count;
+	r = records(s);
+	r->prefix = 0;
+
+	for (i = 0; i < sizeof(r->prefix); ++i) {
+		r->prefix <<= 8;
+
+		if (i < key_length) {
+			r->prefix |= (unsigned char) key[i];
+		}
+	}
+
+	r->offset = s->used;
+	r->key_length = key_length;
+	r->length = length;
+	r->sequence = s->sequence++;
+
+	memcpy(s->buffer + s->used, key, key_length);
+	memcpy(s->buffer + s->used + key_length, s->input + s->mark, length);
+	s->used += key_length + length;
+
+	return 0;
+}
+
+/**
+ * Remember start of record or the end of the header
+ *
+ * @param st - parser state
+ * @param e - XML element
+ */
+int element_open(struct xml_state *st, struct xml_element *e) {
+	struct sorter *s = st->user;
+
+	if (s->record) {
+		return 0;
+	}
+
+	if (!xml_match(e, s->path)) {
+		/* the header ends with the last start tag before the
+		 * first record, anything after that belongs to it */
+		if (!s->parent) {
+			s->mark = st->offset + 1;
+		}
+
+		return 0;
+	}
+
+	if (!s->parent) {
+		s->parent = e->parent;
+
+		if (put(stdout, s->input, s->mark)) {
+			return -1;
+		}
+	} else if (e->parent != s->parent || s->sealed) {
+		fprintf(stderr, "xmlsort: records must be siblings\n");
+		return -1;
+	}
+
+	s->record = e;
+
+	return 0;
+}
+
+/**
+ * Add record when it's complete and drop elements outside of records
+ *
+ * @param st - parser state
+ * @param e - XML element
+ */
+int element_close(struct xml_state *st, struct xml_element *e) {
+	struct sorter *s = st->user;
+	struct xml_element *p = e->parent;
+
+	if (s->record) {
+		if (e != s->record) {
+			return 0;
+		}
+
+		s->record = NULL;
+
+		if (add(s, e, st->offset + 1)) {
+			return -1;
+		}
+
+		s->mark = st->offset + 1;
+	} else if (e == s->parent) {
+		s->sealed = 1;
+	}
+
+	/* all previous siblings have already been dropped */
+	p->first_child = p->last_child = NULL;
+	e->parent = NULL;
+	xml_free(e);
+
+	return 0;
+}
+
+/**
+ * Parse mapped input in slices and give back pages that aren't
+ * needed anymore
+ *
+ * @param s - sorter
+ * @param st - parser state
+ */
+int parse(struct sorter *s, struct xml_state *st) {
+	long page = sysconf(_SC_PAGESIZE);
+	size_t released = 0;
+	size_t off;
+
+	for (off = 0; off < s->input_length; off += SLICE) {
+		size_t n = s->input_length - off;
+		size_t keep;
+
+		if (n > SLICE) {
+			n = SLICE;
+		}
+
+		if (xml_parse_chunk_len(st, s->input + off, n)) {
+			return -1;
+		}
+
+		/* bytes before the next record have been copied unless
+		 * the header is still pending */
+		keep = s->parent ? s->mark / page * page : 0;
+
+		if (keep > released) {
+			madvise((char *) s->input + released,
+				keep - released,
+				MADV_DONTNEED);
+			released = keep;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Sort records of file
+ *
+ * @param s - sorter
+ * @param file - file name
+ */
+int sort(struct sorter *s, const char *file) {
+	struct xml_state st;
+	struct stat sb;
+	void *d;
+	int fd;
+	int r;
+
+	if ((fd = open(file, O_RDONLY)) < 0) {
+		perror(file);
+		return -1;
+	}
+
+	if (fstat(fd, &sb) || !S_ISREG(sb.st_mode) || sb.st_size < 1 ||
+			(d = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+				MAP_FAILED) {
+		fprintf(stderr, "xmlsort: %s: can't map file\n", file);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	madvise(d, sb.st_size, MADV_SEQUENTIAL);
+
+	s->input = d;
+	s->input_length = sb.st_size;
+
+	memset(&st, 0, sizeof(st));
+	st.open = element_open;
+	st.close = element_close;
+	st.user = s;
+
+	r = parse(s, &st);
+	xml_free(st.root);
+
+	if (r || s->record) {
+		fprintf(stderr, "xmlsort: %s: malformed XML document\n", file);
+		r = -1;
+	} else if (!s->parent) {
+		/* no records, nothing to sort */
+		r = put(stdout, s->input, s->input_length);
+	} else {
+		r = spill(s, 1);
+
+		/* merge buffers take the place of the sort buffer */
+		free(s->buffer);
+		s->buffer = NULL;
+
+		r = r ||
+			(s->run_count > 0 && merge(s)) ||
+			put(stdout, s->input + s->mark, s->input_length - s->mark);
+	}
+
+	munmap(d, sb.st_size);
+
+	return r;
+}
+
+/**
+ * Parse size with optional K, M or G suffix
+ *
+ * @param s - size
+ */
+size_t parse_size(const char *s) {
+	char *end;
+	size_t n = strtoul(s, &end, 10);
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		n <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		n <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		n <<= 10;
+		break;
+	}
+
+	return n;
+}
+
+/**
+ * Process command line arguments; writes the file with all elements
+ * matching "?path" ordered by the given attribute to stdout and exits
+ * with 2 on errors
+ *
+ * @param argc - number of arguments
+ * @param argv - "-m SIZE", "-T DIR", "?path", attribute and file name
+ */
+int main(int argc, char **argv) {
+	struct sorter s;
+	const char *file = NULL;
+	size_t i;
+	int r;
+
+	memset(&s, 0, sizeof(s));
+	s.budget = BUDGET;
+
+	if (!(s.tmpdir = getenv("TMPDIR"))) {
+		s.tmpdir = "/tmp";
+	}
+
+	while (--argc && ++argv) {
+		if (!strcmp(*argv, "-m") && argc > 1) {
+			--argc;
+			s.budget = parse_size(*++argv);
+		} else if (!strcmp(*argv, "-T") && argc > 1) {
+			--argc;
+			s.tmpdir = *++argv;
+		} else if (**argv == '?') {
+			s.path = *argv + 1;
+		} else if (!s.key) {
+			s.key = *argv;
+		} else {
+			file = *argv;
+		}
+	}
+
+	if (!s.path || !s.key || !file || s.budget < 4096) {
+		fprintf(stderr,
+			"usage: xmlsort [-m SIZE] [-T DIR] ?PATH ATTRIBUTE FILE\n");
+		return 2;
+	}
+
+	/* keep records aligned at the end of the buffer */
+	s.budget -= s.budget % sizeof(struct record);
+
+	if (!(s.buffer = malloc(s.budget))) {
+		perror("malloc");
+		return 2;
+	}
+
+	setvbuf(stdout, output, _IOFBF, sizeof(output));
+	r = sort(&s, file);
+
+	for (i = 0; i < s.run_count; ++i) {
+		fclose(s.runs[i]);
+	}
+
+	free(s.runs);
+	free(s.buffer);
+
+	if (fflush(stdout)) {
+		r = -1;
+	}
+
+	return r ? 2 : 0;
+}
@@ -1,7 +1,12 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "xml.h"
+#include "xml_private.h"
 
 #define WHITESPACE " \t\r\n"
 
@@ -12,17 +17,6 @@
 #define TAG_COMMENT 5
 #define TAG_CDATA 6
 
-struct xml_path_segment {
-	size_t tag_len;
-	struct xml_query_string {
-		const char *key;
-		size_t key_len;
-		const char *value;
-		size_t value_len;
-		struct xml_query_string *next;
-	} *query;
-};
-
 struct xml_tag_pattern {
 	int type;
 	const char *open;
@@ -84,15 +78,70 @@ static char *strndup(const char *s, size_t n) {
 }
 #endif
 
+/*****************************************************************************
+ * MEMORY ALLOCATION
+ ****************************************************************************/
+
+/**
+ * Allocate zero-filled memory
+ *
+ * @param a - allocator, may be NULL for malloc()
+ * @param size - number of bytes
+ */
+void *xml_alloc(struct xml_allocator *a, size_t size) {
+	if (a) {
+		return a->alloc(a, size);
+	}
+
+	return calloc(1, size);
+}
+
+/**
+ * Resize memory block; only new memory is zero-filled for allocators
+ * that zero-fill
+ *
+ * @param a - allocator, may be NULL for malloc()
+ * @param p - memory block
+ * @param old_size - current size of block
+ * @param size - new size of block
+ */
+void *xml_resize(
+		struct xml_allocator *a,
+		void *p,
+		size_t old_size,
+		size_t size) {
+	if (a) {
+		return a->resize(a, p, old_size, size);
+	}
+
+	return realloc(p, size);
+}
+
+/**
+ * Release memory block
+ *
+ * @param a - allocator, may be NULL for malloc()
+ * @param p - memory block
+ */
+void xml_release(struct xml_allocator *a, void *p) {
+	if (!a) {
+		free(p);
+	} else if (a->release) {
+		a->release(a, p);
+	}
+}
+
 /**
  * Append string
  *
+ * @param a - allocator, may be NULL for malloc()
  * @param dest - address of string to append to
  * @param dest_len - address of length of string
  * @param src - string to append
  * @param src_len - length of string to append
  */
-static char *xml_string_append(
+char *xml_string_append(
+		struct xml_allocator *a,
 		char **dest,
 		size_t *dest_len,
 		const char *src,
@@ -103,11 +152,20 @@ static char *xml_string_append(
 		return *dest;
 	}
 
-	if (!*dest) {
+	if (a && !*dest) {
+		if ((*dest = a->alloc(a, src_len + 1))) {
+			strncat(*dest, src, src_len);
+			*dest_len += src_len;
+		}
+	} else if (!*dest) {
 		if ((*dest = strndup(src, src_len))) {
 			*dest_len += src_len;
 		}
-	} else if ((n = realloc(*dest, *dest_len + src_len + 1))) {
+	} else if ((n = xml_resize(
+			a,
+			*dest,
+			*dest_len + 1,
+			*dest_len + src_len + 1))) {
 		*dest = n;
 		n += *dest_len;
 
@@ -120,6 +178,450 @@ static char *xml_string_append(
 	return *dest;
 }
 
+/*****************************************************************************
+ * HASHING
+ ****************************************************************************/
+
+/**
+ * Return hash of string (FNV-1a)
+ *
+ * @param s - string, doesn't need to be null-terminated
+ * @param l - length of string
+ */
+size_t xml_hash(const char *s, size_t l) {
+	size_t h = 2166136261u;
+
+	while (l--) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/**
+ * Return hash of string ignoring case (FNV-1a)
+ *
+ * @param s - string, doesn't need to be null-terminated
+ * @param l - length of string
+ */
+size_t xml_hash_case(const char *s, size_t l) {
+	size_t h = 2166136261u;
+
+	while (l--) {
+		h ^= (unsigned char) tolower((unsigned char) *s++);
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/**
+ * Make room for the given number of entries; tables start with 1024
+ * slots and double to stay at most half full
+ *
+ * @param t - table
+ * @param count - number of entries
+ */
+int xml_table_reserve(struct xml_table *t, size_t count) {
+	struct xml_table n;
+	size_t i;
+
+	if (count * 2 <= t->size) {
+		return 0;
+	}
+
+	for (n.size = t->size ? t->size << 1 : 1024; count * 2 > n.size;
+			n.size <<= 1);
+
+	if (!(n.slots = calloc(n.size, sizeof(struct xml_table_slot)))) {
+		return -1;
+	}
+
+	/* slots keep their hash so entries don't need to be touched */
+	for (i = 0; i < t->size; ++i) {
+		struct xml_table_slot *s = &t->slots[i];
+		size_t probe = 0;
+
+		if (s->entry) {
+			while (xml_table_next(&n, s->hash, &probe));
+			xml_table_set(&n, s->hash, probe, s->entry);
+		}
+	}
+
+	free(t->slots);
+	*t = n;
+
+	return 0;
+}
+
+/**
+ * Return next entry with the given hash, plus one, or 0 if there's
+ * none; probe must be 0 for the first call and is left at a free slot
+ * for xml_table_set() when 0 is returned
+ *
+ * @param t - table
+ * @param hash - hash of entry
+ * @param probe - number of slots probed so far
+ */
+size_t xml_table_next(
+		const struct xml_table *t,
+		size_t hash,
+		size_t *probe) {
+	size_t mask = t->size - 1;
+
+	if (!t->size) {
+		return 0;
+	}
+
+	for (;;) {
+		struct xml_table_slot *s = &t->slots[(hash + *probe) & mask];
+
+		if (!s->entry) {
+			return 0;
+		}
+
+		++*probe;
+
+		if (s->hash == hash) {
+			return s->entry;
+		}
+	}
+}
+
+/**
+ * Put entry into the free slot found by xml_table_next()
+ *
+ * @param t - table
+ * @param hash - hash of entry
+ * @param probe - probe returned by xml_table_next()
+ * @param entry - entry plus one
+ */
+void xml_table_set(
+		struct xml_table *t,
+		size_t hash,
+		size_t probe,
+		size_t entry) {
+	struct xml_table_slot *s = &t->slots[(hash + probe) & (t->size - 1)];
+
+	s->entry = entry;
+	s->hash = hash;
+}
+
+/**
+ * Remove the entry xml_table_next() returned last and move following
+ * entries back so they can still be found
+ *
+ * @param t - table
+ * @param hash - hash of entry
+ * @param probe - probe as left by xml_table_next()
+ */
+void xml_table_remove(struct xml_table *t, size_t hash, size_t probe) {
+	size_t mask = t->size - 1;
+	size_t hole = (hash + probe - 1) & mask;
+	size_t i = hole;
+
+	for (;;) {
+		struct xml_table_slot *s;
+
+		i = (i + 1) & mask;
+		s = &t->slots[i];
+
+		if (!s->entry) {
+			break;
+		}
+
+		/* entries may only move towards their first slot */
+		if (((i - s->hash) & mask) >= ((i - hole) & mask)) {
+			t->slots[hole] = *s;
+			hole = i;
+		}
+	}
+
+	t->slots[hole].entry = 0;
+}
+
+/**
+ * Free all slots but keep their memory
+ *
+ * @param t - table
+ */
+void xml_table_clear(struct xml_table *t) {
+	if (t->slots) {
+		memset(t->slots, 0, t->size * sizeof(struct xml_table_slot));
+	}
+}
+
+/**
+ * Free slots of table
+ *
+ * @param t - table
+ */
+void xml_table_free(struct xml_table *t) {
+	free(t->slots);
+	t->slots = NULL;
+	t->size = 0;
+}
+
+/*****************************************************************************
+ * CHILD INDEX
+ ****************************************************************************/
+
+/* number of children a lookup has to walk before their parent gets
+ * an index */
+#define XML_CHILD_INDEX_MIN 256
+
+/* indexes are built lazily by lookups that may run in parallel on
+ * shared trees, so they're published atomically */
+#if defined(__GNUC__)
+#define XML_INDEX_LOAD(e) __atomic_load_n(&(e)->index, __ATOMIC_ACQUIRE)
+#define XML_INDEX_PUBLISH(e, old, ix) __atomic_compare_exchange_n(\
+	&(e)->index, &(old), (ix), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+#define XML_INDEX_LOAD(e) ((e)->index)
+#define XML_INDEX_PUBLISH(e, old, ix) ((e)->index == (old) ?\
+	((e)->index = (ix), 1) : 0)
+#endif
+
+struct xml_child_index {
+	/* child list the index was built for */
+	struct xml_element *first_child;
+	struct xml_element *last_child;
+
+	/* first child of every name, by case insensitive hash of name */
+	struct xml_child_name {
+		struct xml_element *child;
+		size_t hash;
+	} *names;
+
+	/* next child with the same name for every child, by address */
+	struct xml_child_link {
+		struct xml_element *child;
+		struct xml_element *next;
+	} *links;
+
+	/* size of both tables minus one */
+	size_t mask;
+};
+
+/* marks elements of trees built with a custom allocator, which never
+ * get an index so they can be released with their memory */
+static struct xml_child_index xml_child_index_none;
+#define XML_CHILD_INDEX_NONE (&xml_child_index_none)
+
+/**
+ * Return slot of element in table of links
+ *
+ * @param e - element
+ * @param mask - size of table minus one
+ */
+static size_t xml_child_link_slot(struct xml_element *e, size_t mask) {
+	uintptr_t p = (uintptr_t) e;
+
+	return (size_t) ((p ^ (p >> 17)) * 0x9e3779b97f4a7c15ULL >> 16) & mask;
+}
+
+/**
+ * Return link of child
+ *
+ * @param index - child index
+ * @param e - child element with a name
+ */
+static struct xml_child_link *xml_child_link(
+		struct xml_child_index *index,
+		struct xml_element *e) {
+	size_t i = xml_child_link_slot(e, index->mask);
+
+	while (index->links[i].child && index->links[i].child != e) {
+		i = (i + 1) & index->mask;
+	}
+
+	return &index->links[i];
+}
+
+/**
+ * Return first child with given name or NULL
+ *
+ * @param index - child index
+ * @param name - name, doesn't need to be null-terminated
+ * @param len - length of name
+ */
+static struct xml_element *xml_child_index_first(
+		struct xml_child_index *index,
+		const char *name,
+		size_t len) {
+	size_t hash = xml_hash_case(name, len);
+	size_t i;
+
+	for (i = hash & index->mask;
+			index->names[i].child;
+			i = (i + 1) & index->mask) {
+		struct xml_element *c = index->names[i].child;
+
+		if (index->names[i].hash == hash &&
+				strlen(c->key) == len &&
+				!strncasecmp(c->key, name, len)) {
+			return c;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Return next child with the same name or NULL
+ *
+ * @param index - child index
+ * @param e - child element with a name
+ */
+static struct xml_element *xml_child_index_next(
+		struct xml_child_index *index,
+		struct xml_element *e) {
+	return xml_child_link(index, e)->next;
+}
+
+/**
+ * Return index of element if it's still valid
+ *
+ * @param e - element
+ */
+static struct xml_child_index *xml_child_index_get(struct xml_element *e) {
+	struct xml_child_index *index = XML_INDEX_LOAD(e);
+
+	/* child lists that have been changed directly invalidate the
+	 * index too, as long as the ends changed */
+	if (index == XML_CHILD_INDEX_NONE ||
+			(index && (index->first_child != e->first_child ||
+			index->last_child != e->last_child))) {
+		return NULL;
+	}
+
+	return index;
+}
+
+/**
+ * Build index of children of element; keeps going without one if
+ * there's no memory
+ *
+ * @param e - element
+ */
+static void xml_child_index_build(struct xml_element *e) {
+	struct xml_child_index *old = XML_INDEX_LOAD(e);
+	struct xml_child_index *index;
+	struct xml_child_link **tails;
+	struct xml_element *c;
+	size_t size = 16;
+	size_t n = 0;
+
+	if (old == XML_CHILD_INDEX_NONE) {
+		return;
+	}
+
+	for (c = e->first_child; c; c = c->next) {
+		n += c->key != NULL;
+	}
+
+	/* keep tables at most half full */
+	while (size < n * 2) {
+		size <<= 1;
+	}
+
+	if (!(index = calloc(1, sizeof(*index) +
+			size * sizeof(*index->names) +
+			size * sizeof(*index->links)))) {
+		return;
+	}
+
+	/* last child of every name so far, parallel to names */
+	if (!(tails = calloc(size, sizeof(*tails)))) {
+		free(index);
+		return;
+	}
+
+	index->first_child = e->first_child;
+	index->last_child = e->last_child;
+	index->names = (struct xml_child_name *) (index + 1);
+	index->links = (struct xml_child_link *) (index->names + size);
+	index->mask = size - 1;
+
+	for (c = e->first_child; c; c = c->next) {
+		struct xml_child_link *link;
+		size_t len, hash, i;
+
+		if (!c->key) {
+			continue;
+		}
+
+		link = xml_child_link(index, c);
+		link->child = c;
+
+		len = strlen(c->key);
+		hash = xml_hash_case(c->key, len);
+
+		for (i = hash & index->mask;
+				index->names[i].child;
+				i = (i + 1) & index->mask) {
+			if (index->names[i].hash == hash &&
+					strlen(index->names[i].child->key) == len &&
+					!strncasecmp(index->names[i].child->key,
+						c->key, len)) {
+				break;
+			}
+		}
+
+		if (index->names[i].child) {
+			tails[i]->next = c;
+		} else {
+			index->names[i].child = c;
+			index->names[i].hash = hash;
+		}
+
+		tails[i] = link;
+	}
+
+	free(tails);
+
+	/* another thread may have been faster, stale indexes are only
+	 * replaced when the tree isn't shared */
+	if (XML_INDEX_PUBLISH(e, old, index)) {
+		free(old);
+	} else {
+		free(index);
+	}
+}
+
+/**
+ * Drop index of element after its children have changed
+ *
+ * @param e - element
+ */
+void xml_child_index_drop(struct xml_element *e) {
+	if (e->index != XML_CHILD_INDEX_NONE) {
+		free(e->index);
+		e->index = NULL;
+	}
+}
+
+/**
+ * Free child indexes of a tree after child lists have been changed
+ * directly; trees built with a custom allocator have none
+ *
+ * @param e - root element
+ */
+void xml_unindex(struct xml_element *e) {
+	struct xml_element *c;
+
+	if (!e) {
+		return;
+	}
+
+	for (c = e->first_child; c; c = c->next) {
+		xml_unindex(c);
+	}
+
+	xml_child_index_drop(e);
+}
+
 /*****************************************************************************
  * CREATING AND MODIFYING ELEMENTS
  ****************************************************************************/
@@ -135,6 +637,10 @@ static void xml_element_add(
 		struct xml_element *c) {
 	c->parent = p;
 
+	if (p->index) {
+		xml_child_index_drop(p);
+	}
+
 	if (p->first_child) {
 		p->last_child->next = c;
 		p->last_child = c;
@@ -146,15 +652,22 @@ static void xml_element_add(
 /**
  * Create a new element
  *
+ * @param a - allocator, may be NULL for malloc()
  * @param parent - parent element
  */
-static struct xml_element *xml_element_create(struct xml_element *parent) {
+struct xml_element *xml_element_create(
+		struct xml_allocator *a,
+		struct xml_element *parent) {
 	struct xml_element *e;
 
-	if (!(e = calloc(1, sizeof(struct xml_element)))) {
+	if (!(e = xml_alloc(a, sizeof(struct xml_element)))) {
 		return NULL;
 	}
 
+	if (a) {
+		e->index = XML_CHILD_INDEX_NONE;
+	}
+
 	if (parent) {
 		xml_element_add(parent, e);
 	}
@@ -186,13 +699,15 @@ static void xml_attribute_add(
 /**
  * Create a new attribute
  *
+ * @param al - allocator, may be NULL for malloc()
  * @param parent - parent element
  */
-static struct xml_attribute *xml_attribute_create(
+struct xml_attribute *xml_attribute_create(
+		struct xml_allocator *al,
 		struct xml_element *parent) {
 	struct xml_attribute *a;
 
-	if (!(a = calloc(1, sizeof(struct xml_attribute)))) {
+	if (!(a = xml_alloc(al, sizeof(struct xml_attribute)))) {
 		return NULL;
 	}
 
@@ -204,9 +719,57 @@ static struct xml_attribute *xml_attribute_create(
 }
 
 /*****************************************************************************
- * APPENDING KEY/VALUE
+ * BUILDING TREES
  ****************************************************************************/
 
+/* The tokenizer passes everything it finds to a set of events. The
+ * tree of xml_element is made by the built-in tree builder below and
+ * an xml_builder is called through the second set of events. The tree
+ * builder keeps its own events since it appends tag data right to the
+ * key of the element and attributes point into that key, which spares
+ * copying names and keeps the size of a tree predictable, and since
+ * it notifies "open" and the validator after the attributes. Events
+ * that may be NULL are marked as optional. */
+struct xml_events {
+	/* character data */
+	int (*text)(struct xml_state *, const char *, size_t);
+
+	/* beginning of a tag after its type is known, optional */
+	int (*start)(struct xml_state *, const char *);
+
+	/* tag data */
+	int (*data)(struct xml_state *, const char *, size_t);
+
+	/* complete tag data, NULL if there is none */
+	char *(*tag)(struct xml_state *);
+
+	/* start tag name, followed by attributes, optional */
+	int (*open)(struct xml_state *, const char *, size_t);
+	int (*attribute)(
+		struct xml_state *,
+		const char *,
+		size_t,
+		const char *,
+		size_t);
+
+	/* complete start tag, optional */
+	int (*opened)(struct xml_state *);
+
+	/* end tag, end of empty element, special tag or the end of
+	 * character data */
+	int (*close)(struct xml_state *, const char *);
+};
+
+/**
+ * Return offset of given position in the document
+ *
+ * @param st - state
+ * @param p - position in current chunk
+ */
+static size_t xml_offset(struct xml_state *st, const char *p) {
+	return st->parsed + (size_t) (p - st->chunk);
+}
+
 /**
  * Append character data to current element
  *
@@ -214,13 +777,21 @@ static struct xml_attribute *xml_attribute_create(
  * @param d - begin of data
  * @param l - length of data
  */
-static int xml_value_append(struct xml_state *st, const char *d, size_t l) {
+static int xml_tree_text(struct xml_state *st, const char *d, size_t l) {
+	if (st->validator &&
+			xml_validator_text(st->validator, d, l, xml_offset(st, d))) {
+		return -1;
+	}
+
 	if (!st->length &&
-			!(st->current = xml_element_create(st->current))) {
+			!(st->current = xml_element_create(
+				st->allocator,
+				st->current))) {
 		return -1;
 	}
 
 	if (!xml_string_append(
+			st->allocator,
 			&st->current->value,
 			&st->length,
 			d,
@@ -232,57 +803,342 @@ static int xml_value_append(struct xml_state *st, const char *d, size_t l) {
 }
 
 /**
- * Append tag data to current element
+ * Close element
  *
  * @param st - state
- * @param d - begin of data
- * @param l - length of data
+ * @param end - last character of tag, ignored for character data
  */
-static int xml_key_append(struct xml_state *st, const char *d, size_t l) {
-	if (!st->current) {
-		return -1;
+static int xml_tree_close(struct xml_state *st, const char *end) {
+	struct xml_element *e = st->current;
+
+	st->current = e->parent;
+
+	if (!e->value) {
+		st->offset = xml_offset(st, end);
 	}
 
-	/* ignore data for closing elements */
-	if (st->tag->type == TAG_ELEMENT_CLOSE) {
-		return 0;
+	if (st->compress && e->value &&
+			xml_value_compress(st->allocator, e, st->compress)) {
+		return -1;
 	}
 
-	/* append start of pattern for special tag types */
-	if (!st->length &&
-			st->tag->open_len > 1 &&
-			!xml_string_append(
-				&st->current->key,
-				&st->length,
-				st->tag->open + 1,
-				st->tag->open_len - 1)) {
+	if (st->validator && e->parent &&
+			xml_validator_close(st->validator, e, st->offset)) {
 		return -1;
 	}
 
-	if (!xml_string_append(
-			&st->current->key,
-			&st->length,
-			d,
-			l)) {
+	if (st->close && e->parent && st->close(st, e) < 0) {
 		return -1;
 	}
 
 	return 0;
 }
 
-/*****************************************************************************
- * PARSING ATTRIBUTES
+/**
+ * Close pending character data and create an element for a new tag
+ *
+ * @param st - state
+ * @param d - first character after the opening pattern
+ */
+static int xml_tree_start(struct xml_state *st, const char *d) {
+	if (st->length > 0 && xml_tree_close(st, d)) {
+		return -1;
+	}
+
+	if (st->tag->type != TAG_ELEMENT_CLOSE &&
+			!(st->current = xml_element_create(
+				st->allocator,
+				st->current))) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Append tag data to the key of the current element
+ *
+ * @param st - state
+ * @param d - begin of data
+ * @param l - length of data
+ */
+static int xml_tree_data(struct xml_state *st, const char *d, size_t l) {
+	if (!st->current) {
+		return -1;
+	}
+
+	/* ignore data for closing elements */
+	if (st->tag->type == TAG_ELEMENT_CLOSE) {
+		return 0;
+	}
+
+	return xml_string_append(
+		st->allocator,
+		&st->current->key,
+		&st->length,
+		d,
+		l) ? 0 : -1;
+}
+
+/**
+ * Return key of current element
+ *
+ * @param st - state
+ */
+static char *xml_tree_tag(struct xml_state *st) {
+	return st->current->key;
+}
+
+/**
+ * Add attribute to current element; key and value stay in the key
+ * of the element
+ *
+ * @param st - state
+ * @param key - attribute name
+ * @param key_len - length of attribute name
+ * @param value - attribute value, may be NULL
+ * @param value_len - length of attribute value
+ */
+static int xml_tree_attribute(
+		struct xml_state *st,
+		const char *key,
+		size_t key_len,
+		const char *value,
+		size_t value_len) {
+	struct xml_attribute *a;
+
+	(void) key_len;
+	(void) value_len;
+
+	if (!(a = xml_attribute_create(st->allocator, st->current))) {
+		return -1;
+	}
+
+	a->key = (char *) key;
+	a->value = (char *) value;
+
+	return 0;
+}
+
+/**
+ * Notify about complete start tag
+ *
+ * @param st - state
+ */
+static int xml_tree_opened(struct xml_state *st) {
+	if (st->validator &&
+			xml_validator_open(st->validator, st->current, st->offset)) {
+		return -1;
+	}
+
+	if (st->open && st->open(st, st->current) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static const struct xml_events xml_tree_events = {
+	xml_tree_text,
+	xml_tree_start,
+	xml_tree_data,
+	xml_tree_tag,
+	NULL,
+	xml_tree_attribute,
+	xml_tree_opened,
+	xml_tree_close
+};
+
+/*****************************************************************************
+ * CALLING BUILDERS
+ ****************************************************************************/
+
+/**
+ * Pass character data to builder
+ *
+ * @param st - state
+ * @param d - begin of data
+ * @param l - length of data
+ */
+static int xml_build_text(struct xml_state *st, const char *d, size_t l) {
+	st->length += l;
+
+	return st->builder->text &&
+		st->builder->text(st->builder, d, l) < 0 ? -1 : 0;
+}
+
+/**
+ * Append tag data to the tag buffer
+ *
+ * @param st - state
+ * @param d - begin of data
+ * @param l - length of data
+ */
+static int xml_token_append(struct xml_state *st, const char *d, size_t l) {
+	size_t need = st->length + l + 1;
+
+	if (need > st->token_size) {
+		size_t size = st->token_size ? st->token_size : 256;
+		char *n;
+
+		while (size < need) {
+			size <<= 1;
+		}
+
+		if (!(n = realloc(st->token, size))) {
+			return -1;
+		}
+
+		st->token = n;
+		st->token_size = size;
+	}
+
+	memcpy(st->token + st->length, d, l);
+	st->length += l;
+	st->token[st->length] = 0;
+
+	return 0;
+}
+
+/**
+ * Free tag buffer of builder
+ *
+ * @param st - state
+ */
+static void xml_token_free(struct xml_state *st) {
+	free(st->token);
+	st->token = NULL;
+	st->token_size = 0;
+}
+
+/**
+ * Return tag buffer
+ *
+ * @param st - state
+ */
+static char *xml_build_tag(struct xml_state *st) {
+	return st->length ? st->token : NULL;
+}
+
+/**
+ * Pass start tag name to builder
+ *
+ * @param st - state
+ * @param name - tag name
+ * @param len - length of tag name
+ */
+static int xml_build_open(struct xml_state *st, const char *name, size_t len) {
+	return st->builder->open &&
+		st->builder->open(st->builder, name, len) < 0 ? -1 : 0;
+}
+
+/**
+ * Pass attribute to builder
+ *
+ * @param st - state
+ * @param key - attribute name
+ * @param key_len - length of attribute name
+ * @param value - attribute value, may be NULL
+ * @param value_len - length of attribute value
+ */
+static int xml_build_attribute(
+		struct xml_state *st,
+		const char *key,
+		size_t key_len,
+		const char *value,
+		size_t value_len) {
+	return st->builder->attribute &&
+		st->builder->attribute(st->builder,
+			key, key_len,
+			value, value_len) < 0 ? -1 : 0;
+}
+
+/**
+ * Pass end tag, end of empty element or special tag to builder
+ *
+ * @param st - state
+ * @param end - last character of tag, unused
+ */
+static int xml_build_end(struct xml_state *st, const char *end) {
+	struct xml_builder *b = st->builder;
+	const char *token = st->token ? st->token : "";
+	size_t len = st->length;
+
+	(void) end;
+
+	if (st->tag->type == TAG_ELEMENT_OPEN) {
+		/* name has been terminated before the attributes */
+		return b->close &&
+			b->close(b, token, strlen(token)) < 0 ? -1 : 0;
+	}
+
+	if (st->tag->type == TAG_ELEMENT_CLOSE) {
+		/* ignore trailing white space like for start tags */
+		while (len > 0 && strchr(WHITESPACE, token[len - 1])) {
+			--len;
+		}
+
+		if (st->token) {
+			st->token[len] = 0;
+		}
+
+		return b->close && b->close(b, token, len) < 0 ? -1 : 0;
+	}
+
+	return b->special && b->special(b, token, len) < 0 ? -1 : 0;
+}
+
+/* builders get character data as it comes, so nothing is pending
+ * when a tag starts and nothing is left to do after a start tag */
+static const struct xml_events xml_builder_events = {
+	xml_build_text,
+	NULL,
+	xml_token_append,
+	xml_build_tag,
+	xml_build_open,
+	xml_build_attribute,
+	NULL,
+	xml_build_end
+};
+
+/*****************************************************************************
+ * APPENDING TAG DATA
+ ****************************************************************************/
+
+/**
+ * Append tag data to current tag
+ *
+ * @param st - state
+ * @param d - begin of data
+ * @param l - length of data
+ */
+static int xml_key_append(struct xml_state *st, const char *d, size_t l) {
+	/* append start of pattern for special tag types */
+	if (st->tag->type != TAG_ELEMENT_CLOSE &&
+			!st->length &&
+			st->tag->open_len > 1 &&
+			st->events->data(
+				st,
+				st->tag->open + 1,
+				st->tag->open_len - 1)) {
+		return -1;
+	}
+
+	return st->events->data(st, d, l);
+}
+
+/*****************************************************************************
+ * PARSING ATTRIBUTES
  ****************************************************************************/
 
 /**
  * Parse attributes
  *
- * @param e - element
+ * @param st - state
  * @param from - first character after tag name
  */
-static int xml_parse_attributes(struct xml_element *e, char *from) {
+static int xml_parse_attributes(struct xml_state *st, char *from) {
 	while (*from) {
-		struct xml_attribute *a;
 		size_t p;
 		char *key = NULL;
 		char *value = NULL;
@@ -335,18 +1191,18 @@ static int xml_parse_attributes(struct xml_element *e, char *from) {
 			}
 		}
 
-		if (!(a = xml_attribute_create(e))) {
-			return -1;
-		}
-
 		if (key) {
 			*(key + key_len) = 0;
-			a->key = key;
 		}
 
 		if (value) {
 			*(value + value_len) = 0;
-			a->value = value;
+		}
+
+		if (st->events->attribute(st,
+				key, key_len,
+				value, value_len)) {
+			return -1;
 		}
 	}
 
@@ -358,15 +1214,21 @@ static int xml_parse_attributes(struct xml_element *e, char *from) {
  ****************************************************************************/
 
 /* forward declarations */
-static const char *xml_parse_content(struct xml_state *, const char *);
+static const char *xml_parse_content(
+		struct xml_state *,
+		const char *,
+		const char *);
 
 /**
- * Close element
+ * Notify about complete start tag
  *
  * @param st - state
+ * @param end - last character of tag
  */
-static void xml_close_element(struct xml_state *st) {
-	st->current = st->current->parent;
+static int xml_open_element(struct xml_state *st, const char *end) {
+	st->offset = xml_offset(st, end);
+
+	return st->events->opened ? st->events->opened(st) : 0;
 }
 
 /**
@@ -386,11 +1248,12 @@ static void xml_close_tag(struct xml_state *st) {
  * Parse end of tag name for empty element marker
  *
  * @param st - state
+ * @param key - tag data
  */
-static void xml_check_empty(struct xml_state *st) {
-	char *p = st->current->key + strlen(st->current->key) - 1;
+static void xml_check_empty(struct xml_state *st, char *key) {
+	char *p = key + strlen(key) - 1;
 
-	for (; p >= st->current->key; --p) {
+	for (; p >= key; --p) {
 		/* ignore trailing white space; this isn't required
 		 * by the spec but probably better to have */
 		if (strchr(WHITESPACE, *p)) {
@@ -412,21 +1275,27 @@ static void xml_check_empty(struct xml_state *st) {
  * @param st - state
  */
 static int xml_parse_tag_name(struct xml_state *st) {
-	char *p = st->current->key;
+	char *key = st->events->tag(st);
+	char *p;
 
-	xml_check_empty(st);
-	p += strcspn(p, WHITESPACE);
+	if (!key) {
+		return -1;
+	}
 
-	if (!*p) {
-		/* key ends with the name */
-		return 0;
+	xml_check_empty(st, key);
+	p = key + strcspn(key, WHITESPACE);
+
+	if (*p) {
+		/* terminate name and skip further white space */
+		*p++ = 0;
+		p += strspn(p, WHITESPACE);
 	}
 
-	/* terminate name and skip further white space */
-	*p++ = 0;
-	p += strspn(p, WHITESPACE);
+	if (st->events->open && st->events->open(st, key, strlen(key))) {
+		return -1;
+	}
 
-	if (*p && xml_parse_attributes(st->current, p)) {
+	if (*p && xml_parse_attributes(st, p)) {
 		return -1;
 	}
 
@@ -438,14 +1307,18 @@ static int xml_parse_tag_name(struct xml_state *st) {
  *
  * @param st - state
  * @param d - XML data
+ * @param end - end of XML data
  */
-static const char *xml_parse_tag_body(struct xml_state *st, const char *d) {
-	while (*d) {
+static const char *xml_parse_tag_body(
+		struct xml_state *st,
+		const char *d,
+		const char *end) {
+	while (d < end) {
 		const char *m = NULL;
 
 		if (!st->cursor) {
 			/* find first character of terminating pattern */
-			m = strchr(d, st->tag->close[0]);
+			m = memchr(d, st->tag->close[0], end - d);
 		} else {
 			/* find next character of terminating pattern */
 			for (;;) {
@@ -491,22 +1364,23 @@ static const char *xml_parse_tag_body(struct xml_state *st, const char *d) {
 			if (!st->tag->close[st->cursor]) {
 				/* append termination pattern for special tag types */
 				if (st->cursor > 1 &&
-						!xml_string_append(
-							&st->current->key,
-							&st->length,
+						st->events->data(
+							st,
 							st->tag->close,
 							st->cursor - 1)) {
 					return NULL;
 				}
 
 				if (st->tag->type == TAG_ELEMENT_OPEN &&
-						xml_parse_tag_name(st)) {
+						(xml_parse_tag_name(st) ||
+							xml_open_element(st, d - 1))) {
 					return NULL;
 				}
 
-				if (st->tag->type != TAG_ELEMENT_OPEN ||
-						st->empty) {
-					xml_close_element(st);
+				if ((st->tag->type != TAG_ELEMENT_OPEN ||
+						st->empty) &&
+						st->events->close(st, d - 1)) {
+					return NULL;
 				}
 
 				xml_close_tag(st);
@@ -514,7 +1388,7 @@ static const char *xml_parse_tag_body(struct xml_state *st, const char *d) {
 			}
 		} else {
 			/* append all the rest */
-			size_t l = strlen(d);
+			size_t l = end - d;
 
 			if (xml_key_append(st, d, l)) {
 				return NULL;
@@ -535,10 +1409,13 @@ static const char *xml_parse_tag_body(struct xml_state *st, const char *d) {
  *
  * @param st - state
  * @param d - XML data
+ * @param end - end of XML data
  */
-static const char *xml_parse_tag_opening(struct xml_state *st,
-		const char *d) {
-	for (; *d; ++d) {
+static const char *xml_parse_tag_opening(
+		struct xml_state *st,
+		const char *d,
+		const char *end) {
+	for (; d < end; ++d) {
 		struct xml_tag_pattern *p = xml_tag_patterns;
 
 		/* check character against all opening patterns */
@@ -569,20 +1446,14 @@ static const char *xml_parse_tag_opening(struct xml_state *st,
 				return NULL;
 			}
 
-			if (st->length > 0) {
-				xml_close_element(st);
+			if (st->events->start && st->events->start(st, d)) {
+				return NULL;
 			}
 
 			st->length = 0;
 			st->cursor = 0;
 			st->parser = xml_parse_tag_body;
 
-			/* create child element */
-			if (st->tag->type != TAG_ELEMENT_CLOSE &&
-					!(st->current = xml_element_create(st->current))) {
-				return NULL;
-			}
-
 			break;
 		}
 
@@ -598,64 +1469,673 @@ static const char *xml_parse_tag_opening(struct xml_state *st,
  *
  * @param st - state
  * @param d - XML data
+ * @param end - end of XML data
+ */
+static const char *xml_parse_content(
+		struct xml_state *st,
+		const char *d,
+		const char *end) {
+	const char *lt = memchr(d, '<', end - d);
+
+	if (!lt) {
+		lt = end;
+	}
+
+	if (lt > d && st->events->text(st, d, lt - d)) {
+		return NULL;
+	}
+
+	if (lt < end) {
+		st->parser = xml_parse_tag_opening;
+	}
+
+	return lt;
+}
+
+/**
+ * Select events and create the root element if there's none yet
+ *
+ * @param st - state
+ */
+static void xml_begin(struct xml_state *st) {
+	if (st->builder) {
+		st->events = &xml_builder_events;
+	} else {
+		st->events = &xml_tree_events;
+
+		if (!st->root) {
+			st->current = st->root = xml_element_create(
+				st->allocator,
+				NULL);
+		}
+	}
+}
+
+/*****************************************************************************
+ * FEEDING TOKENS
+ ****************************************************************************/
+
+/**
+ * Prepare state for tokens that have been decoded from something else
+ * than XML text; positions passed to the other xml_feed_ functions
+ * are offsets from the given chunk
+ *
+ * @param st - state
+ * @param chunk - decoded data
+ */
+int xml_feed_begin(struct xml_state *st, const char *chunk) {
+	xml_begin(st);
+	xml_close_tag(st);
+	st->chunk = chunk;
+
+	return st->builder || st->root ? 0 : -1;
+}
+
+/**
+ * Start tag with given pattern and put data into it
+ *
+ * @param st - state
+ * @param tag - tag pattern
+ * @param at - position of tag
+ * @param d - tag data
+ * @param l - length of tag data
+ */
+static int xml_feed_tag(
+		struct xml_state *st,
+		struct xml_tag_pattern *tag,
+		const char *at,
+		const char *d,
+		size_t l) {
+	st->tag = tag;
+
+	if (st->events->start && st->events->start(st, at)) {
+		return -1;
+	}
+
+	st->length = 0;
+
+	return st->events->data(st, d, l);
+}
+
+/**
+ * Pass character data
+ *
+ * @param st - state
+ * @param d - character data
+ * @param l - length of character data
+ */
+int xml_feed_text(struct xml_state *st, const char *d, size_t l) {
+	return l > 0 ? st->events->text(st, d, l) : 0;
+}
+
+/**
+ * Pass start tag with attributes
+ *
+ * @param st - state
+ * @param at - position of tag
+ * @param name - tag name
+ * @param attributes - key and value of every attribute, values are
+ *                     NULL without '='
+ * @param count - number of attributes
+ */
+int xml_feed_open(
+		struct xml_state *st,
+		const char *at,
+		const struct xml_string *name,
+		const struct xml_string *attributes,
+		size_t count) {
+	const struct xml_string *a;
+	const struct xml_string *end = attributes + count * 2;
+	char *key;
+	char *p;
+
+	/* attributes follow the name in the same buffer like when they
+	 * are parsed, separated by blanks that are terminated below */
+	if (!name->length ||
+			xml_feed_tag(st, &xml_tag_patterns[0], at, name->s,
+				name->length)) {
+		return -1;
+	}
+
+	for (a = attributes; a < end; a += 2) {
+		if (!a->length ||
+				st->events->data(st, " ", 1) ||
+				st->events->data(st, a->s, a->length) ||
+				(a[1].s &&
+					(st->events->data(st, " ", 1) ||
+					st->events->data(st, a[1].s,
+						a[1].length)))) {
+			return -1;
+		}
+	}
+
+	if (!(key = st->events->tag(st))) {
+		return -1;
+	}
+
+	p = key + name->length;
+	*p++ = 0;
+
+	if (st->events->open && st->events->open(st, key, name->length)) {
+		return -1;
+	}
+
+	for (a = attributes; a < end; a += 2) {
+		char *k = p;
+		char *v = NULL;
+
+		p += a->length;
+		*p++ = 0;
+
+		if (a[1].s) {
+			v = p;
+			p += a[1].length;
+			*p++ = 0;
+		}
+
+		if (st->events->attribute(st, k, a->length, v, a[1].length)) {
+			return -1;
+		}
+	}
+
+	st->offset = xml_offset(st, at);
+
+	if (st->events->opened && st->events->opened(st)) {
+		return -1;
+	}
+
+	xml_close_tag(st);
+
+	return 0;
+}
+
+/**
+ * Pass end tag
+ *
+ * @param st - state
+ * @param at - position of tag
+ * @param name - tag name
+ */
+int xml_feed_close(
+		struct xml_state *st,
+		const char *at,
+		const struct xml_string *name) {
+	if (xml_feed_tag(st, &xml_tag_patterns[1], at, name->s,
+				name->length) ||
+			st->events->close(st, at)) {
+		return -1;
+	}
+
+	xml_close_tag(st);
+
+	return 0;
+}
+
+/**
+ * Pass special tag like a comment or processing instruction
+ *
+ * @param st - state
+ * @param at - position of tag
+ * @param key - complete tag without '<' and '>', e.g. "!-- x --"
+ */
+int xml_feed_special(
+		struct xml_state *st,
+		const char *at,
+		const struct xml_string *key) {
+	struct xml_tag_pattern *tag = NULL;
+	struct xml_tag_pattern *p;
+
+	/* take the longest opening pattern like the tokenizer does */
+	for (p = xml_tag_patterns + 2; p->type; ++p) {
+		if (p->open_len - 1 <= key->length &&
+				!memcmp(p->open + 1, key->s, p->open_len - 1) &&
+				(!tag || p->open_len > tag->open_len)) {
+			tag = p;
+		}
+	}
+
+	if (!tag || !key->length ||
+			xml_feed_tag(st, tag, at, key->s, key->length) ||
+			st->events->close(st, at)) {
+		return -1;
+	}
+
+	xml_close_tag(st);
+
+	return 0;
+}
+
+/**
+ * Complete pending character data and free the tag buffer
+ *
+ * @param st - state
+ * @param at - end of data
+ */
+int xml_feed_end(struct xml_state *st, const char *at) {
+	int r = 0;
+
+	/* closing tags only complete what's pending */
+	if (st->length > 0) {
+		st->tag = &xml_tag_patterns[1];
+		r = st->events->start && st->events->start(st, at) ? -1 : 0;
+		xml_close_tag(st);
+	}
+
+	xml_token_free(st);
+
+	return r;
+}
+
+/**
+ * Parse (next) chunk of a XML document of given length
+ *
+ * @param st - parsing status
+ * @param d - XML chunk, doesn't need to be zero terminated
+ * @param len - length of chunk
+ */
+int xml_parse_chunk_len(struct xml_state *st, const char *d, size_t len) {
+	const char *end = d + len;
+
+	if (!d) {
+		return -1;
+	}
+
+	xml_begin(st);
+
+	if (!st->parser) {
+		xml_close_tag(st);
+	}
+
+	st->chunk = d;
+
+	while (d < end) {
+		if (!(d = st->parser(st, d, end))) {
+			xml_token_free(st);
+			return -1;
+		}
+	}
+
+	/* the tag buffer is only kept while a tag spans chunks */
+	if (st->parser != xml_parse_tag_body) {
+		xml_token_free(st);
+	}
+
+	st->parsed += len;
+
+	return 0;
+}
+
+/**
+ * Parse (next) chunk of a XML document
+ *
+ * @param st - parsing status
+ * @param d - XML chunk
+ */
+int xml_parse_chunk(struct xml_state *st, const char *d) {
+	if (!d) {
+		return -1;
+	}
+
+	return xml_parse_chunk_len(st, d, strlen(d));
+}
+
+/**
+ * Parse XML document
+ *
+ * @param data - XML string
+ */
+struct xml_element *xml_parse(const char *data) {
+	struct xml_state st;
+
+	memset(&st, 0, sizeof(st));
+
+	if (!xml_parse_chunk(&st, data) && st.root) {
+		return st.root;
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************
+ * PARSING INTO BUFFERS
+ ****************************************************************************/
+
+/* size of stack buffers for xml_parse_size() and xml_parse_with() */
+#define XML_STACK_BUFFER 4096
+
+#define XML_BUFFER_ALIGN(n) (((n) + sizeof(void *) - 1) & \
+	~(sizeof(void *) - 1))
+
+struct xml_buffer {
+	/* must be first so the allocator can be cast back */
+	struct xml_allocator allocator;
+
+	char *base;
+	size_t size;
+
+	/* allocated bytes */
+	size_t used;
+
+	/* bytes given back while counting */
+	size_t released;
+
+	/* last allocation, may be grown in place */
+	char *last;
+
+	/* set if an allocation didn't fit */
+	int overflow;
+};
+
+/**
+ * Allocate zero-filled memory from buffer
+ *
+ * @param a - allocator
+ * @param size - number of bytes
  */
-static const char *xml_parse_content(struct xml_state *st, const char *d) {
-	const char *end = d + strcspn(d, "<");
+static void *xml_buffer_alloc(struct xml_allocator *a, size_t size) {
+	struct xml_buffer *b = (struct xml_buffer *) a;
+	size_t n = XML_BUFFER_ALIGN(size);
 
-	if (end > d && xml_value_append(st, d, end - d)) {
+	if (n > b->size - b->used) {
+		b->overflow = 1;
 		return NULL;
 	}
 
-	if (*end == '<') {
-		st->parser = xml_parse_tag_opening;
-	}
+	b->last = b->base + b->used;
+	memset(b->last, 0, n);
+	b->used += n;
+
+	return b->last;
+}
+
+/**
+ * Resize memory block; the last block grows in place
+ *
+ * @param a - allocator
+ * @param p - memory block
+ * @param old_size - current size of block
+ * @param size - new size of block
+ */
+static void *xml_buffer_resize(
+		struct xml_allocator *a,
+		void *p,
+		size_t old_size,
+		size_t size) {
+	struct xml_buffer *b = (struct xml_buffer *) a;
+	void *n;
+
+	if (p && p == b->last) {
+		size_t end = b->last - b->base + XML_BUFFER_ALIGN(size);
+
+		if (end > b->size) {
+			b->overflow = 1;
+			return NULL;
+		}
+
+		if (end > b->used) {
+			memset(b->base + b->used, 0, end - b->used);
+		}
+
+		b->used = end;
+
+		return p;
+	}
+
+	if ((n = xml_buffer_alloc(a, size))) {
+		memcpy(n, p, old_size < size ? old_size : size);
+	}
+
+	return n;
+}
+
+/**
+ * Initialize buffer allocator
+ *
+ * @param b - buffer allocator
+ * @param buf - memory, should be aligned to pointer size
+ * @param cap - size of memory
+ */
+static void xml_buffer_init(struct xml_buffer *b, void *buf, size_t cap) {
+	size_t pad = (sizeof(void *) - (size_t) buf % sizeof(void *)) %
+		sizeof(void *);
+
+	memset(b, 0, sizeof(struct xml_buffer));
+	b->allocator.alloc = xml_buffer_alloc;
+	b->allocator.resize = xml_buffer_resize;
+
+	if (cap > pad) {
+		b->base = (char *) buf + pad;
+		b->size = cap - pad;
+	}
+}
+
+/**
+ * Give back everything allocated after the start tag of an element
+ * since names and attributes aren't required to count
+ *
+ * @param st - state
+ * @param e - element
+ */
+static int xml_count_open(struct xml_state *st, struct xml_element *e) {
+	struct xml_buffer *b = (struct xml_buffer *) st->allocator;
+	size_t end = (char *) e - b->base +
+		XML_BUFFER_ALIGN(sizeof(struct xml_element));
+
+	e->key = NULL;
+	e->first_attribute = e->last_attribute = NULL;
+	b->released += b->used - end;
+	b->used = end;
+	b->last = NULL;
+
+	return 0;
+}
+
+/**
+ * Give back a complete element
+ *
+ * @param st - state
+ * @param e - element
+ */
+static int xml_count_close(struct xml_state *st, struct xml_element *e) {
+	struct xml_buffer *b = (struct xml_buffer *) st->allocator;
+
+	/* children are allocated after their parent so the last
+	 * complete child always sits at the end of the buffer */
+	e->parent->first_child = e->parent->last_child = NULL;
+	b->released += b->used - ((char *) e - b->base);
+	b->used = (char *) e - b->base;
+	b->last = NULL;
+
+	return 0;
+}
+
+/**
+ * Run the tokenizer over a document, keeping only the path from the
+ * root to the current element, to determine how many bytes the tree
+ * requires; sets overflow if the path didn't fit into scratch
+ *
+ * @param input - XML data
+ * @param len - length of XML data
+ * @param scratch - memory for the current path
+ * @param scratch_size - size of scratch memory
+ * @param overflow - receives non-zero if scratch was too small
+ */
+static size_t xml_count_path(
+		const char *input,
+		size_t len,
+		void *scratch,
+		size_t scratch_size,
+		int *overflow) {
+	struct xml_state st;
+	struct xml_buffer b;
+
+	xml_buffer_init(&b, scratch, scratch_size);
+
+	memset(&st, 0, sizeof(st));
+	st.allocator = &b.allocator;
+	st.open = xml_count_open;
+	st.close = xml_count_close;
+
+	*overflow = 0;
+
+	if (xml_parse_chunk_len(&st, input, len) || !st.root) {
+		*overflow = b.overflow;
+		return 0;
+	}
+
+	return b.released + b.used;
+}
+
+/**
+ * Count the bytes a tree requires in the given scratch memory and,
+ * if the path doesn't fit because of deep nesting or long character
+ * data, again in heap memory of twice the size until it does
+ *
+ * @param input - XML data
+ * @param len - length of XML data
+ * @param scratch - memory for the current path
+ * @param scratch_size - size of scratch memory
+ */
+static size_t xml_count(
+		const char *input,
+		size_t len,
+		void *scratch,
+		size_t scratch_size) {
+	size_t size;
+	int overflow;
+
+	size = xml_count_path(input, len, scratch, scratch_size, &overflow);
+
+	while (overflow && scratch_size <= ((size_t) -1) / 2) {
+		void *heap;
+
+		scratch_size *= 2;
+
+		if (!(heap = malloc(scratch_size))) {
+			return 0;
+		}
+
+		size = xml_count_path(input, len, heap, scratch_size,
+			&overflow);
+		free(heap);
+	}
+
+	return size;
+}
+
+/**
+ * Return the exact number of bytes xml_parse_into() needs for a
+ * document or 0 if the document is malformed or memory to count it
+ * can't be allocated; this is a full pass of the tokenizer that only
+ * keeps the path to the current element, so it costs about as much
+ * time as parsing, plus another pass each time the path outgrows the
+ * memory it is counted in
+ *
+ * @param input - XML data
+ * @param len - length of XML data
+ */
+size_t xml_parse_size(const char *input, size_t len) {
+	union {
+		char data[XML_STACK_BUFFER];
+		void *align;
+	} scratch;
 
-	return end;
+	return xml_count(input, len, scratch.data, sizeof(scratch.data));
 }
 
 /**
- * Parse (next) chunk of a XML document
+ * Parse XML document into a caller supplied buffer without calling
+ * malloc(); the tree lives as long as the buffer and must not be
+ * passed to xml_free()
  *
- * @param st - parsing status
- * @param d - XML chunk
+ * @param buf - memory, should be aligned to pointer size
+ * @param cap - size of memory
+ * @param input - XML data, doesn't need to be zero terminated
+ * @param len - length of XML data
+ * @param needed - optional, receives the number of bytes used or,
+ *                 if the tree doesn't fit, required; 0 on errors
  */
-int xml_parse_chunk(struct xml_state *st, const char *d) {
-	if (!d) {
-		return -1;
-	}
+struct xml_element *xml_parse_into(
+		void *buf,
+		size_t cap,
+		const char *input,
+		size_t len,
+		size_t *needed) {
+	struct xml_state st;
+	struct xml_buffer b;
 
-	if (!st->root) {
-		st->current = st->root = xml_element_create(NULL);
-	}
+	xml_buffer_init(&b, buf, cap);
 
-	if (!st->parser) {
-		xml_close_tag(st);
+	memset(&st, 0, sizeof(st));
+	st.allocator = &b.allocator;
+
+	if (!xml_parse_chunk_len(&st, input, len) && st.root) {
+		if (needed) {
+			*needed = b.used;
+		}
+
+		return st.root;
 	}
 
-	while (*d) {
-		if (!(d = st->parser(st, d))) {
-			return -1;
+	if (needed) {
+		*needed = 0;
+
+		if (b.overflow) {
+			/* count in the larger of the given and the stack
+			 * buffer since the tree didn't fit anyway */
+			*needed = cap > XML_STACK_BUFFER ?
+				xml_count(input, len, buf, cap) :
+				xml_parse_size(input, len);
 		}
 	}
 
-	return 0;
+	return NULL;
 }
 
 /**
- * Parse XML document
+ * Parse XML document into a buffer on the stack and pass the tree to
+ * a callback; falls back to a single heap buffer of the exact size if
+ * the document doesn't fit
  *
- * @param data - XML string
+ * @param input - XML data, doesn't need to be zero terminated
+ * @param len - length of XML data
+ * @param fn - callback, the tree is only valid during the call
+ * @param user - user data for callback
  */
-struct xml_element *xml_parse(const char *data) {
-	struct xml_state st;
-
-	memset(&st, 0, sizeof(st));
+int xml_parse_with(
+		const char *input,
+		size_t len,
+		int (*fn)(struct xml_element *, void *),
+		void *user) {
+	union {
+		char data[XML_STACK_BUFFER];
+		void *align;
+	} stack;
+	struct xml_element *root;
+	size_t needed;
+	void *heap;
+	int r;
+
+	if ((root = xml_parse_into(
+			stack.data,
+			sizeof(stack.data),
+			input,
+			len,
+			&needed))) {
+		return fn(root, user);
+	}
 
-	if (!xml_parse_chunk(&st, data) && st.root) {
-		return st.root;
+	if (!needed || !(heap = malloc(needed))) {
+		return -1;
 	}
 
-	return NULL;
+	r = (root = xml_parse_into(heap, needed, input, len, NULL)) ?
+		fn(root, user) :
+		-1;
+
+	free(heap);
+
+	return r;
 }
 
 /*****************************************************************************
@@ -692,6 +2172,7 @@ void xml_free(struct xml_element *e) {
 		}
 	}
 
+	xml_child_index_drop(e);
 	free(e->key);
 	free(e->value);
 	free(e);
@@ -723,17 +2204,101 @@ struct xml_attribute *xml_find_attribute(
  * ELEMENT LOCATION
  ****************************************************************************/
 
+/**
+ * Returns true if tag name matches given name
+ *
+ * @param key - tag name
+ * @param name - name, doesn't need to be null-terminated
+ * @param len - length of name
+ */
+int xml_tag_match(const char *key, const char *name, size_t len) {
+	/* check length first to not match against words that begin
+	 * with name */
+	return strlen(key) == len && !strncasecmp(key, name, len);
+}
+
+/**
+ * Returns true if attributes satisfy all predicates of a path segment;
+ * shared by trees and images
+ *
+ * @param seg - path segment
+ * @param attributes - attributes of node
+ * @param x - counters, may be NULL
+ * @param i - path step of segment
+ */
+int xml_segment_match(
+		struct xml_path_segment *seg,
+		struct xml_attribute_cursor *attributes,
+		struct xml_explain *x,
+		size_t i) {
+	struct xml_query_string *q;
+
+	for (q = seg->query; q; q = q->next) {
+		struct xml_attribute_cursor c = *attributes;
+		const char *key;
+		const char *value;
+
+		XML_EXPLAIN(x, i, predicates);
+
+		for (;;) {
+			if (!c.next(&c, &key, &value)) {
+				return 0;
+			}
+
+			XML_EXPLAIN(x, i, attributes);
+
+			if (strlen(key) == q->key_len &&
+					!strncmp(key, q->key, q->key_len) &&
+					(!q->value || (value &&
+						strlen(value) == q->value_len &&
+						!strncmp(value, q->value,
+							q->value_len)))) {
+				break;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Return key and value of next attribute of element
+ *
+ * @param c - cursor
+ * @param key - receives key
+ * @param value - receives value
+ */
+static int xml_attribute_next(
+		struct xml_attribute_cursor *c,
+		const char **key,
+		const char **value) {
+	const struct xml_attribute *a = c->at;
+
+	if (!a) {
+		return 0;
+	}
+
+	*key = a->key;
+	*value = a->value;
+	c->at = a->next;
+
+	return 1;
+}
+
 /**
  * Returns true if element has a matching argument
  *
  * @param e - element
  * @param seg - path segment
+ * @param x - counters, may be NULL
+ * @param i - path step of segment
  */
 static int xml_attribute_match(
 		struct xml_element *e,
-		struct xml_path_segment *seg) {
-	struct xml_attribute *a;
-	struct xml_query_string *q;
+		struct xml_path_segment *seg,
+		struct xml_explain *x,
+		size_t i) {
+	struct xml_attribute_cursor c;
 
 	if (!e) {
 		return 0;
@@ -743,27 +2308,10 @@ static int xml_attribute_match(
 		return 1;
 	}
 
-	for (q = seg->query; q; q = q->next) {
-		for (a = e->first_attribute; a; a = a->next) {
-			if (strlen(a->key) == q->key_len &&
-					!strncmp(a->key, q->key, q->key_len)) {
-				if (!q->value) {
-					break;
-				}
-
-				if (strlen(a->value) == q->value_len &&
-						!strncmp(a->value, q->value, q->value_len)) {
-					break;
-				}
-			}
-		}
-
-		if (!a) {
-			return 0;
-		}
-	}
+	c.next = xml_attribute_next;
+	c.at = e->first_attribute;
 
-	return 1;
+	return xml_segment_match(seg, &c, x, i);
 }
 
 /**
@@ -797,7 +2345,7 @@ static struct xml_query_string *xml_add_query_string(
  *
  * @param seg - path segment
  */
-static void xml_free_query_strings(struct xml_path_segment *seg) {
+void xml_free_query_strings(struct xml_path_segment *seg) {
 	struct xml_query_string *q, *n;
 
 	for (q = seg->query; q; q = n) {
@@ -816,7 +2364,7 @@ static void xml_free_query_strings(struct xml_path_segment *seg) {
  * @param path - slash seperated element path with optional
  *               "?key=value" restriction for attributes
  */
-static const char *xml_first_path_segment(
+const char *xml_first_path_segment(
 		struct xml_path_segment *seg,
 		const char *path) {
 	const char *next = strchr(path, '/');
@@ -873,7 +2421,7 @@ static const char *xml_first_path_segment(
  * @param path - slash seperated element path with optional
  *               "?key=value" restriction for attributes
  */
-static const char *xml_last_path_segment(
+const char *xml_last_path_segment(
 		struct xml_path_segment *seg,
 		const char *path,
 		const char *prev) {
@@ -899,15 +2447,139 @@ static const char *xml_last_path_segment(
 }
 
 /**
- * Find first matching XML element
+ * Set number of steps of path
  *
- * @param e - root element
- * @param path - slash seperated element path with optional
- *               "?key=value" restriction for attributes
+ * @param x - counters, may be NULL
+ * @param path - slash seperated element path
  */
-struct xml_element *xml_find(struct xml_element *e, const char *path) {
+void xml_explain_path(struct xml_explain *x, const char *path) {
+	size_t steps = 1;
+
+	if (!x || !path) {
+		return;
+	}
+
+	for (; *path; ++path) {
+		steps += *path == '/';
+	}
+
+	if (steps > x->steps) {
+		x->steps = steps;
+	}
+}
+
+/**
+ * Return index of the path step a segment starts in
+ *
+ * @param path - slash seperated element path
+ * @param prev - position returned by xml_last_path_segment()
+ */
+size_t xml_explain_index(const char *path, const char *prev) {
+	size_t i = 0;
+
+	for (; path <= prev && *path; ++path) {
+		i += *path == '/';
+	}
+
+	return i;
+}
+
+/**
+ * Count restrictions allocated for path segment
+ *
+ * @param x - counters, may be NULL
+ * @param i - path step of segment
+ * @param seg - path segment
+ */
+void xml_explain_segment(
+		struct xml_explain *x,
+		size_t i,
+		struct xml_path_segment *seg) {
+	struct xml_query_string *q;
+
+	for (q = seg->query; x && q; q = q->next) {
+		XML_EXPLAIN(x, i, allocations);
+	}
+}
+
+/**
+ * Find next child of parent with given name that matches restrictions;
+ * walks the index of the parent if there is one and builds it if the
+ * parent turns out to have many children
+ *
+ * @param p - parent element, may be NULL if after isn't
+ * @param after - child to start after, NULL to start at the first child
+ * @param name - tag name, doesn't need to be null-terminated
+ * @param len - length of tag name
+ * @param seg - path segment with restrictions
+ * @param x - counters, may be NULL
+ * @param i - path step
+ */
+static struct xml_element *xml_find_child(
+		struct xml_element *p,
+		struct xml_element *after,
+		const char *name,
+		size_t len,
+		struct xml_path_segment *seg,
+		struct xml_explain *x,
+		size_t i) {
+	struct xml_child_index *index = p ? xml_child_index_get(p) : NULL;
+	struct xml_element *e;
+	size_t scanned = 0;
+
+	if (index) {
+		e = after ?
+			xml_child_index_next(index, after) :
+			xml_child_index_first(index, name, len);
+	} else {
+		e = after ? after->next : p->first_child;
+	}
+
+	for (; e; e = index ? xml_child_index_next(index, e) : e->next) {
+		XML_EXPLAIN(x, i, visited);
+
+		/* children of an index have the right name already */
+		if (!index) {
+			if (++scanned == XML_CHILD_INDEX_MIN && p) {
+				xml_child_index_build(p);
+			}
+
+			if (!e->key) {
+				continue;
+			}
+
+			XML_EXPLAIN(x, i, compared);
+
+			if (!xml_tag_match(e->key, name, len)) {
+				continue;
+			}
+		}
+
+		if (xml_attribute_match(e, seg, x, i)) {
+			XML_EXPLAIN(x, i, matches);
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Find first matching XML element for given path step
+ *
+ * @param e - parent element
+ * @param path - remaining path
+ * @param x - counters, may be NULL
+ * @param i - path step
+ */
+static struct xml_element *xml_find_step(
+		struct xml_element *e,
+		const char *path,
+		struct xml_explain *x,
+		size_t i) {
 #define FREE xml_free_query_strings(&seg);
 	struct xml_path_segment seg = {0, NULL};
+	struct xml_element *c = NULL;
 	const char *next;
 
 	if (!path || !*path) {
@@ -915,31 +2587,54 @@ struct xml_element *xml_find(struct xml_element *e, const char *path) {
 	}
 
 	next = xml_first_path_segment(&seg, path);
+	xml_explain_segment(x, i, &seg);
 
-	for (e = e->first_child; e; e = e->next)
-		if (e->key &&
-				/* check length first to not match against
-				 * words that begin with path */
-				strlen(e->key) == seg.tag_len &&
-				!strncasecmp(e->key, path, seg.tag_len) &&
-				xml_attribute_match(e, &seg)) {
-			struct xml_element *c;
-
-			if (!next) {
-				FREE
-				return e;
-			}
+	while ((c = xml_find_child(e, c, path, seg.tag_len, &seg, x, i))) {
+		struct xml_element *m;
 
-			if ((c = xml_find(e, next))) {
-				FREE
-				return c;
-			}
+		if (!next) {
+			FREE
+			return c;
+		}
+
+		if ((m = xml_find_step(c, next, x, i + 1))) {
+			FREE
+			return m;
 		}
+	}
 
 	FREE
 	return NULL;
 }
 
+/**
+ * Find first matching XML element
+ *
+ * @param e - root element
+ * @param path - slash seperated element path with optional
+ *               "?key=value" restriction for attributes
+ */
+struct xml_element *xml_find(struct xml_element *e, const char *path) {
+	return xml_find_step(e, path, NULL, 0);
+}
+
+/**
+ * Find first matching XML element and count the work done
+ *
+ * @param e - root element
+ * @param path - slash seperated element path with optional
+ *               "?key=value" restriction for attributes
+ * @param x - counters to add to
+ */
+struct xml_element *xml_find_explain(
+		struct xml_element *e,
+		const char *path,
+		struct xml_explain *x) {
+	xml_explain_path(x, path);
+
+	return xml_find_step(e, path, x, 0);
+}
+
 /**
  * Find next element
  *
@@ -947,24 +2642,24 @@ struct xml_element *xml_find(struct xml_element *e, const char *path) {
  * @param path - slash seperated element path with optional
  *               "?key=value" restriction for attributes, may be NULL
  * @param prev - previous position in path, may be NULL
+ * @param x - counters, may be NULL
  */
 static struct xml_element *xml_find_next_from(
 		struct xml_element *last,
 		const char *path,
-		const char *prev) {
+		const char *prev,
+		struct xml_explain *x) {
 #define FREE xml_free_query_strings(&seg);
-#define FIND(from) \
-		for (e = from; e; e = e->next) {\
-			if (e->key &&\
-				!strcasecmp(e->key, last->key) &&\
-				xml_attribute_match(e, &seg)) {\
-				FREE\
-				return e;\
-			}\
+#define FIND(parent, after) \
+		if ((e = xml_find_child(parent, after, last->key,\
+				strlen(last->key), &seg, x, i))) {\
+			FREE\
+			return e;\
 		}
 
 	struct xml_element *e;
 	struct xml_path_segment seg = {0, NULL};
+	size_t i = 0;
 
 	if (!last) {
 		return NULL;
@@ -972,17 +2667,22 @@ static struct xml_element *xml_find_next_from(
 
 	if (path) {
 		prev = xml_last_path_segment(&seg, path, prev);
+
+		if (x) {
+			i = xml_explain_index(path, prev);
+			xml_explain_segment(x, i, &seg);
+		}
 	}
 
-	FIND(last->next)
+	FIND(last->parent, last)
 
 	/* try other branches */
 	struct xml_element *p = last->parent;
 	/* The temporary variable in for is supported by C99, and if -std=c99 
 	is added, the strndup function is not included to strndup cause an error */
 	for ( ; p && p->key;) {
-		if ((p = xml_find_next_from(p, path, prev))) {
-			FIND(p->first_child)
+		if ((p = xml_find_next_from(p, path, prev, x))) {
+			FIND(p, NULL)
 		}
 	}
 
@@ -1000,7 +2700,151 @@ static struct xml_element *xml_find_next_from(
 struct xml_element *xml_find_next(
 		struct xml_element *last,
 		const char *path) {
-	return xml_find_next_from(last, path, NULL);
+	return xml_find_next_from(last, path, NULL, NULL);
+}
+
+/**
+ * Find next element and count the work done
+ *
+ * @param last - last matched element
+ * @param path - slash seperated element path with optional
+ *               "?key=value" restriction for attributes, may be NULL
+ * @param x - counters to add to
+ */
+struct xml_element *xml_find_next_explain(
+		struct xml_element *last,
+		const char *path,
+		struct xml_explain *x) {
+	xml_explain_path(x, path);
+
+	return xml_find_next_from(last, path, NULL, x);
+}
+
+/**
+ * Append formatted text like snprintf()
+ *
+ * @param buf - buffer, may be NULL
+ * @param size - size of buffer
+ * @param len - length of text so far
+ * @param fmt - format
+ */
+static size_t xml_explain_printf(
+		char *buf,
+		size_t size,
+		size_t len,
+		const char *fmt,
+		...) {
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = len < size ?
+		vsnprintf(buf + len, size - len, fmt, ap) :
+		vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	return n > 0 ? len + n : len;
+}
+
+/**
+ * Format counters as a table with one row per path step; works like
+ * snprintf() and returns the length of the whole table
+ *
+ * @param x - counters
+ * @param path - path that was explained, may be NULL
+ * @param buf - buffer, may be NULL if size is 0
+ * @param size - size of buffer
+ */
+size_t xml_explain_format(
+		const struct xml_explain *x,
+		const char *path,
+		char *buf,
+		size_t size) {
+	size_t steps = x->steps < XML_EXPLAIN_STEPS ?
+		x->steps : XML_EXPLAIN_STEPS;
+	size_t len = 0;
+	size_t i;
+
+	len = xml_explain_printf(buf, size, len,
+		"%4s  %-24s %8s %8s %8s %8s %8s %8s\n",
+		"step", "segment", "visited", "compared", "predic.",
+		"attrib.", "allocs", "matches");
+
+	for (i = 0; i < steps; ++i) {
+		const struct xml_explain_step *s = &x->step[i];
+		size_t n = 0;
+
+		/* the last row also holds all deeper steps */
+		if (path) {
+			n = i + 1 < XML_EXPLAIN_STEPS ?
+				strcspn(path, "/") : strlen(path);
+		}
+
+		len = xml_explain_printf(buf, size, len,
+			"%4lu  %-24.*s %8lu %8lu %8lu %8lu %8lu %8lu\n",
+			(unsigned long) i + 1,
+			(int) n, path ? path : "",
+			(unsigned long) s->visited,
+			(unsigned long) s->compared,
+			(unsigned long) s->predicates,
+			(unsigned long) s->attributes,
+			(unsigned long) s->allocations,
+			(unsigned long) s->matches);
+
+		if (path) {
+			path = path[n] ? path + n + 1 : NULL;
+		}
+	}
+
+	return len;
+}
+
+/**
+ * Match ancestors of element and element itself against the leading
+ * segments of path
+ *
+ * @param e - element
+ * @param path - address of remaining path, NULL when it's exhausted
+ */
+static int xml_match_path(struct xml_element *e, const char **path) {
+	struct xml_path_segment seg = {0, NULL};
+	const char *p;
+	int r;
+
+	/* the root element doesn't take part in paths */
+	if (!e->parent) {
+		return 1;
+	}
+
+	if (!xml_match_path(e->parent, path) || !(p = *path)) {
+		return 0;
+	}
+
+	*path = xml_first_path_segment(&seg, p);
+
+	r = e->key &&
+		xml_tag_match(e->key, p, seg.tag_len) &&
+		xml_attribute_match(e, &seg, NULL, 0);
+
+	xml_free_query_strings(&seg);
+
+	return r;
+}
+
+/**
+ * Return true if element is found by given path; only requires the
+ * ancestors of the element, not its siblings or children
+ *
+ * @param e - element
+ * @param path - slash seperated element path with optional
+ *               "?key=value" restriction for attributes
+ */
+int xml_match(struct xml_element *e, const char *path) {
+	if (!e || !path || !*path) {
+		return 0;
+	}
+
+	return xml_match_path(e, &path) && !path;
 }
 
 /*****************************************************************************
@@ -1017,7 +2861,7 @@ static size_t xml_content_len(struct xml_element *e) {
 
 	for (e = e->first_child; e; e = e->next) {
 		if (e->value) {
-			s += strlen(e->value);
+			s += xml_value_length(e);
 		} else {
 			s += xml_content_len(e);
 		}
@@ -1032,15 +2876,20 @@ static size_t xml_content_len(struct xml_element *e) {
  * @param e - element
  * @param t - target
  */
-static void xml_content_cpy(struct xml_element *e, char **t) {
+static int xml_content_cpy(struct xml_element *e, char **t) {
 	for (e = e->first_child; e; e = e->next) {
 		if (e->value) {
-			strcpy(*t, e->value);
-			*t += strlen(e->value);
-		} else {
-			xml_content_cpy(e, t);
+			if (xml_value_copy(e, *t)) {
+				return -1;
+			}
+
+			*t += xml_value_length(e);
+		} else if (xml_content_cpy(e, t)) {
+			return -1;
 		}
 	}
+
+	return 0;
 }
 
 /**
@@ -1060,7 +2909,13 @@ char *xml_content(struct xml_element *e) {
 	}
 
 	t = s;
-	xml_content_cpy(e, &t);
+
+	if (xml_content_cpy(e, &t)) {
+		free(s);
+		return NULL;
+	}
+
+	*t = 0;
 
 	return s;
 }
@@ -1,6 +1,8 @@
 #ifndef _xml_h_
 #define _xml_h_
 
+#include <stddef.h>
+
 struct xml_element {
 	/* The tag name if this is a tag element or NULL if this
 	 * element represents character data. */
@@ -36,24 +38,152 @@ struct xml_element {
 		/* Pointer to next argument. May be NULL. */
 		struct xml_attribute *next;
 	} *first_attribute, *last_attribute;
+
+	/* Index of children by name, built by path lookups under
+	 * elements with many children of trees built with malloc().
+	 * Internal, see xml_unindex(). */
+	struct xml_child_index *index;
+
+	/* Non-zero if "value" is kept compressed. Internal, use
+	 * xml_value() to read character data of such elements. */
+	int compressed;
+};
+
+/* Custom memory allocator for elements, attributes and strings.
+ * "alloc" must return zero-filled memory. "release" may be NULL for
+ * arenas that free all their memory at once. Trees built with a custom
+ * allocator must not be passed to xml_free(); they are released with
+ * their memory. Lookups don't build child indexes for them since that
+ * would need malloc(). */
+struct xml_allocator {
+	void *(*alloc)(struct xml_allocator *, size_t);
+	void *(*resize)(struct xml_allocator *, void *, size_t, size_t);
+	void (*release)(struct xml_allocator *, void *);
+};
+
+/* Builder for parsing into something else than a tree of xml_element,
+ * like nodes of your own, a compact tree or nothing at all. The
+ * tokenizer calls into the builder instead of creating elements. Embed
+ * it as first member to get back to your data. All functions may be
+ * NULL; a negative return value aborts parsing.
+ *
+ * Names, attribute keys and values are null-terminated and only valid
+ * during the call; attribute values are NULL without '='. Character
+ * data is raw, points into the parsed chunk and isn't terminated; one
+ * run of it may come in pieces. Special tags are passed like the key
+ * of special elements, e.g. "!-- comment --" or "?xml version=...?". */
+struct xml_builder {
+	/* start tag, followed by calls for its attributes */
+	int (*open)(struct xml_builder *, const char *, size_t);
+	int (*attribute)(
+		struct xml_builder *,
+		const char *,
+		size_t,
+		const char *,
+		size_t);
+
+	/* end tag or end of empty element */
+	int (*close)(struct xml_builder *, const char *, size_t);
+
+	int (*text)(struct xml_builder *, const char *, size_t);
+	int (*special)(struct xml_builder *, const char *, size_t);
 };
 
 struct xml_state {
 	/* the root element */
 	struct xml_element *root;
 
+	/* allocator, NULL to use malloc() */
+	struct xml_allocator *allocator;
+
+	/* optional notifications, may be NULL; "open" is called when a
+	 * start tag is complete, "close" when an element (including
+	 * character data) is complete and has been left; a negative
+	 * return value aborts parsing */
+	int (*open)(struct xml_state *, struct xml_element *);
+	int (*close)(struct xml_state *, struct xml_element *);
+	void *user;
+
+	/* offset of the '>' that completed the last tag in the document,
+	 * valid while "open" and "close" are called for tag elements */
+	size_t offset;
+
+	/* keep character data of at least this many bytes compressed,
+	 * 0 to disable (see xml_compress.h) */
+	size_t compress;
+
+	/* optional validator, may be NULL (see xml_schema.h) */
+	struct xml_validator *validator;
+
+	/* optional builder, NULL to build a tree of xml_element; with a
+	 * builder "root" stays NULL and "allocator", "open", "close",
+	 * "compress" and "validator" are unused; tags that span chunks
+	 * are kept in "token", which must be passed to free() if the
+	 * document ends inside a tag */
+	struct xml_builder *builder;
+
 	/* internal state variables */
+	const struct xml_events *events;
 	struct xml_element *current;
 	struct xml_tag_pattern *tag;
+	char *token;
+	size_t token_size;
 	size_t length;
 	size_t cursor;
 	int empty;
-	const char *(*parser)(struct xml_state *, const char *);
+	const char *chunk;
+	size_t parsed;
+	const char *(*parser)(struct xml_state *, const char *, const char *);
+};
+
+/* Counters of the work xml_find_explain() and xml_find_next_explain()
+ * do for every step of a path, to see which paths need an index or a
+ * rewrite. Counters add up over calls, so clear the struct first.
+ * Steps beyond XML_EXPLAIN_STEPS are counted in the last one. */
+#define XML_EXPLAIN_STEPS 16
+
+struct xml_explain {
+	/* number of steps of the longest path */
+	size_t steps;
+
+	struct xml_explain_step {
+		/* elements looked at */
+		size_t visited;
+
+		/* tag names compared */
+		size_t compared;
+
+		/* "?key=value" restrictions evaluated */
+		size_t predicates;
+
+		/* attributes looked at for restrictions */
+		size_t attributes;
+
+		/* restrictions allocated while splitting the path */
+		size_t allocations;
+
+		/* elements that matched the step */
+		size_t matches;
+	} step[XML_EXPLAIN_STEPS];
 };
 
 int xml_parse_chunk(struct xml_state *, const char *);
+int xml_parse_chunk_len(struct xml_state *, const char *, size_t);
 struct xml_element *xml_parse(const char *);
+struct xml_element *xml_parse_into(
+	void *,
+	size_t,
+	const char *,
+	size_t,
+	size_t *);
+size_t xml_parse_size(const char *, size_t);
+int xml_parse_with(
+	const char *,
+	size_t,
+	int (*)(struct xml_element *, void *),
+	void *);
 void xml_free(struct xml_element *);
+void xml_unindex(struct xml_element *);
 
 struct xml_attribute *xml_find_attribute(
 	struct xml_attribute *,
@@ -61,7 +191,23 @@ struct xml_attribute *xml_find_attribute(
 
 struct xml_element *xml_find(struct xml_element *, const char *);
 struct xml_element *xml_find_next(struct xml_element *, const char *);
-
+int xml_match(struct xml_element *, const char *);
+
+struct xml_element *xml_find_explain(
+	struct xml_element *,
+	const char *,
+	struct xml_explain *);
+struct xml_element *xml_find_next_explain(
+	struct xml_element *,
+	const char *,
+	struct xml_explain *);
+size_t xml_explain_format(
+	const struct xml_explain *,
+	const char *,
+	char *,
+	size_t);
+
+const char *xml_value(struct xml_element *);
 char *xml_content(struct xml_element *);
 char *xml_content_find(struct xml_element *, const char *);
 
@@ -0,0 +1,639 @@
+#ifndef WIN32
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_adaptive.h"
+#include "xml_compress.h"
+
+struct xml_adaptive_path {
+	/* next path waiting for an index */
+	struct xml_adaptive_path *queued;
+
+	/* neighbours in order of use, most recent first */
+	struct xml_adaptive_path *prev_used;
+	struct xml_adaptive_path *next_used;
+
+	char *path;
+	size_t length;
+	size_t hash;
+
+	/* position in the list of paths */
+	size_t number;
+
+	/* elements visited by scans since the last index was dropped */
+	size_t cost;
+
+	/* matches in order of xml_find() and xml_find_next(), NULL if
+	 * there's no index */
+	struct xml_element **index;
+	size_t count;
+
+	/* number of queries using the path */
+	size_t refs;
+
+	/* set while waiting for or being indexed */
+	int pending;
+};
+
+struct xml_adaptive {
+	struct xml_element *root;
+
+	/* cost after which a path gets indexed */
+	size_t threshold;
+
+	/* maximum and current size of all paths and indexes */
+	size_t limit;
+	size_t size;
+
+	pthread_mutex_t lock;
+
+	/* signals queued paths to the builder and finished builds to
+	 * xml_adaptive_wait() */
+	pthread_cond_t queued;
+	pthread_cond_t built;
+
+	pthread_t builder;
+	int running;
+	int stop;
+
+	/* paths that have been queried and not evicted since */
+	struct xml_adaptive_path **paths;
+	size_t path_count;
+	size_t path_size;
+	struct xml_table table;
+
+	/* paths in order of use */
+	struct xml_adaptive_path *first_used;
+	struct xml_adaptive_path *last_used;
+	size_t indexes;
+
+	/* paths waiting for an index and the one being indexed */
+	struct xml_adaptive_path *first;
+	struct xml_adaptive_path *last;
+	struct xml_adaptive_path *building;
+
+	/* incremented by invalidation to discard builds in progress */
+	unsigned long generation;
+
+	size_t scans;
+	size_t indexed;
+};
+
+/**
+ * Collect all matches of path
+ *
+ * @param root - root element
+ * @param path - element path
+ * @param count - receives number of matches
+ */
+static struct xml_element **xml_adaptive_collect(
+		struct xml_element *root,
+		const char *path,
+		size_t *count) {
+	struct xml_element **index = NULL;
+	struct xml_element *e;
+	size_t size = 0;
+
+	*count = 0;
+
+	for (e = xml_find(root, path); e; e = xml_find_next(e, path)) {
+		if (*count >= size) {
+			struct xml_element **n;
+
+			size = size ? size << 1 : 16;
+
+			if (!(n = realloc(index, size * sizeof(*n)))) {
+				free(index);
+				return NULL;
+			}
+
+			index = n;
+		}
+
+		index[(*count)++] = e;
+	}
+
+	/* an index without matches is still an index */
+	if (!index) {
+		index = malloc(sizeof(*index));
+	}
+
+	return index;
+}
+
+/**
+ * Return number of bytes a path takes without its index
+ *
+ * @param p - path
+ */
+static size_t xml_adaptive_path_size(struct xml_adaptive_path *p) {
+	return sizeof(*p) + p->length + 1;
+}
+
+/**
+ * Drop index of path
+ *
+ * @param a - adaptive object
+ * @param p - path
+ */
+static void xml_adaptive_drop(
+		struct xml_adaptive *a,
+		struct xml_adaptive_path *p) {
+	a->size -= p->count * sizeof(*p->index);
+	--a->indexes;
+	free(p->index);
+	p->index = NULL;
+	p->count = 0;
+	p->cost = 0;
+}
+
+/**
+ * Take path out of the order of use
+ *
+ * @param a - adaptive object
+ * @param p - path
+ */
+static void xml_adaptive_unlink(
+		struct xml_adaptive *a,
+		struct xml_adaptive_path *p) {
+	if (p->prev_used) {
+		p->prev_used->next_used = p->next_used;
+	} else {
+		a->first_used = p->next_used;
+	}
+
+	if (p->next_used) {
+		p->next_used->prev_used = p->prev_used;
+	} else {
+		a->last_used = p->prev_used;
+	}
+
+	p->prev_used = p->next_used = NULL;
+}
+
+/**
+ * Make path the most recently used one
+ *
+ * @param a - adaptive object
+ * @param p - path
+ */
+static void xml_adaptive_touch(
+		struct xml_adaptive *a,
+		struct xml_adaptive_path *p) {
+	if (a->first_used == p) {
+		return;
+	}
+
+	if (p->prev_used || p->next_used || a->last_used == p) {
+		xml_adaptive_unlink(a, p);
+	}
+
+	if ((p->next_used = a->first_used)) {
+		a->first_used->prev_used = p;
+	} else {
+		a->last_used = p;
+	}
+
+	a->first_used = p;
+}
+
+/**
+ * Remove path with its index from table and free it
+ *
+ * @param a - adaptive object
+ * @param p - path
+ */
+static void xml_adaptive_remove(
+		struct xml_adaptive *a,
+		struct xml_adaptive_path *p) {
+	size_t probe = 0;
+
+	while (xml_table_next(&a->table, p->hash, &probe) != p->number + 1);
+	xml_table_remove(&a->table, p->hash, probe);
+
+	/* the last path takes its place */
+	if (p->number < --a->path_count) {
+		struct xml_adaptive_path *last = a->paths[a->path_count];
+
+		probe = 0;
+		while (xml_table_next(&a->table, last->hash, &probe) !=
+				last->number + 1);
+		xml_table_set(&a->table, last->hash, probe - 1, p->number + 1);
+
+		last->number = p->number;
+		a->paths[p->number] = last;
+	}
+
+	if (p->index) {
+		xml_adaptive_drop(a, p);
+	}
+
+	xml_adaptive_unlink(a, p);
+	a->size -= xml_adaptive_path_size(p);
+	free(p->path);
+	free(p);
+}
+
+/**
+ * Evict least recently used paths along with their indexes until all
+ * paths and indexes fit into the limit; paths that are in use or
+ * waiting for an index stay
+ *
+ * @param a - adaptive object
+ */
+static void xml_adaptive_evict(struct xml_adaptive *a) {
+	struct xml_adaptive_path *p, *prev;
+
+	for (p = a->last_used; p && a->size > a->limit; p = prev) {
+		prev = p->prev_used;
+
+		if (!p->refs && !p->pending) {
+			xml_adaptive_remove(a, p);
+		}
+	}
+}
+
+/**
+ * Build indexes for queued paths in the background
+ *
+ * @param arg - adaptive object
+ */
+static void *xml_adaptive_build(void *arg) {
+	struct xml_adaptive *a = arg;
+
+	pthread_mutex_lock(&a->lock);
+
+	for (;;) {
+		struct xml_adaptive_path *p;
+		struct xml_element **index;
+		unsigned long generation;
+		size_t count;
+
+		while (!a->stop && !a->first) {
+			pthread_cond_wait(&a->queued, &a->lock);
+		}
+
+		if (a->stop) {
+			break;
+		}
+
+		p = a->first;
+
+		if (!(a->first = p->queued)) {
+			a->last = NULL;
+		}
+
+		p->queued = NULL;
+		a->building = p;
+		generation = a->generation;
+		pthread_mutex_unlock(&a->lock);
+
+		/* queries keep scanning meanwhile */
+		index = xml_adaptive_collect(a->root, p->path, &count);
+
+		pthread_mutex_lock(&a->lock);
+		a->building = NULL;
+		p->pending = 0;
+
+		if (!index || generation != a->generation) {
+			free(index);
+		} else {
+			p->index = index;
+			p->count = count;
+			a->size += count * sizeof(*index);
+			++a->indexes;
+			xml_adaptive_evict(a);
+		}
+
+		pthread_cond_broadcast(&a->built);
+	}
+
+	pthread_mutex_unlock(&a->lock);
+
+	/* this only runs on the thread started for it, so nobody else
+	 * holds values from its cache */
+	xml_compress_cache_free();
+
+	return NULL;
+}
+
+/**
+ * Create adaptive object for tree
+ *
+ * @param root - root element
+ * @param threshold - number of visited elements after which a path
+ *                    gets indexed
+ * @param limit - number of bytes all paths and indexes may take
+ */
+struct xml_adaptive *xml_adaptive_create(
+		struct xml_element *root,
+		size_t threshold,
+		size_t limit) {
+	struct xml_adaptive *a;
+
+	if (!root || !(a = calloc(1, sizeof(*a)))) {
+		return NULL;
+	}
+
+	a->root = root;
+	a->threshold = threshold;
+	a->limit = limit;
+
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->queued, NULL);
+	pthread_cond_init(&a->built, NULL);
+
+	/* without a builder, paths are just scanned */
+	a->running = !pthread_create(&a->builder, NULL,
+		xml_adaptive_build, a);
+
+	return a;
+}
+
+/**
+ * Stop builder and free all indexes
+ *
+ * @param a - adaptive object
+ */
+void xml_adaptive_free(struct xml_adaptive *a) {
+	struct xml_adaptive_path *p, *n;
+
+	if (!a) {
+		return;
+	}
+
+	if (a->running) {
+		pthread_mutex_lock(&a->lock);
+		a->stop = 1;
+		pthread_cond_signal(&a->queued);
+		pthread_mutex_unlock(&a->lock);
+		pthread_join(a->builder, NULL);
+	}
+
+	for (p = a->first_used; p; p = n) {
+		n = p->next_used;
+		free(p->index);
+		free(p->path);
+		free(p);
+	}
+
+	free(a->paths);
+	xml_table_free(&a->table);
+
+	pthread_cond_destroy(&a->built);
+	pthread_cond_destroy(&a->queued);
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+}
+
+/**
+ * Return entry for path and create it if necessary; the entry becomes
+ * the most recently used one
+ *
+ * @param a - adaptive object
+ * @param path - element path
+ */
+static struct xml_adaptive_path *xml_adaptive_path(
+		struct xml_adaptive *a,
+		const char *path) {
+	size_t hash = xml_hash(path, strlen(path));
+	struct xml_adaptive_path *p;
+	size_t probe = 0;
+	size_t n;
+
+	if (xml_table_reserve(&a->table, a->path_count + 1)) {
+		return NULL;
+	}
+
+	while ((n = xml_table_next(&a->table, hash, &probe))) {
+		p = a->paths[n - 1];
+
+		if (!strcmp(p->path, path)) {
+			xml_adaptive_touch(a, p);
+			return p;
+		}
+	}
+
+	if (a->path_count >= a->path_size) {
+		size_t size = a->path_size ? a->path_size << 1 : 64;
+		struct xml_adaptive_path **paths;
+
+		if (!(paths = realloc(a->paths, size * sizeof(*paths)))) {
+			return NULL;
+		}
+
+		a->paths = paths;
+		a->path_size = size;
+	}
+
+	if (!(p = calloc(1, sizeof(*p)))) {
+		return NULL;
+	}
+
+	if (!(p->path = strdup(path))) {
+		free(p);
+		return NULL;
+	}
+
+	p->length = strlen(path);
+	p->hash = hash;
+	p->number = a->path_count;
+
+	a->paths[a->path_count++] = p;
+	xml_table_set(&a->table, hash, probe, a->path_count);
+
+	xml_adaptive_touch(a, p);
+	a->size += xml_adaptive_path_size(p);
+
+	return p;
+}
+
+/**
+ * Pass all elements matching path to callback; uses an index if there
+ * is one and counts the cost of the path otherwise
+ *
+ * @param a - adaptive object
+ * @param path - slash seperated element path with optional
+ *               "?key=value" restriction for attributes
+ * @param fn - callback, a non-zero return value stops the query
+ * @param user - user data for callback
+ */
+size_t xml_adaptive_find(
+		struct xml_adaptive *a,
+		const char *path,
+		int (*fn)(struct xml_element *, void *),
+		void *user) {
+	struct xml_adaptive_path *p;
+	struct xml_explain x;
+	struct xml_element *e;
+	size_t matches = 0;
+	size_t cost = 0;
+	size_t i;
+
+	if (!a || !path || !fn) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&a->lock);
+
+	/* the path can't be evicted while it's referenced */
+	if ((p = xml_adaptive_path(a, path))) {
+		++p->refs;
+		xml_adaptive_evict(a);
+	}
+
+	if (p && p->index) {
+		struct xml_element **index = p->index;
+		size_t count = p->count;
+
+		++a->indexed;
+		pthread_mutex_unlock(&a->lock);
+
+		for (i = 0; i < count; ++i) {
+			++matches;
+
+			if (fn(index[i], user)) {
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&a->lock);
+		--p->refs;
+		pthread_mutex_unlock(&a->lock);
+
+		return matches;
+	}
+
+	++a->scans;
+	pthread_mutex_unlock(&a->lock);
+
+	memset(&x, 0, sizeof(x));
+
+	for (e = xml_find_explain(a->root, path, &x);
+			e;
+			e = xml_find_next_explain(e, path, &x)) {
+		++matches;
+
+		if (fn(e, user)) {
+			break;
+		}
+	}
+
+	for (i = 0; i < XML_EXPLAIN_STEPS; ++i) {
+		cost += x.step[i].visited;
+	}
+
+	if (!p) {
+		return matches;
+	}
+
+	pthread_mutex_lock(&a->lock);
+	--p->refs;
+
+	/* hot enough to be indexed */
+	if ((p->cost += cost) >= a->threshold &&
+			a->running && !p->index && !p->pending) {
+		p->pending = 1;
+
+		if (a->last) {
+			a->last->queued = p;
+		} else {
+			a->first = p;
+		}
+
+		a->last = p;
+		pthread_cond_signal(&a->queued);
+	}
+
+	pthread_mutex_unlock(&a->lock);
+
+	return matches;
+}
+
+/**
+ * Drop all indexes after the tree has changed
+ *
+ * @param a - adaptive object
+ */
+void xml_adaptive_invalidate(struct xml_adaptive *a) {
+	struct xml_adaptive_path *p;
+
+	if (!a) {
+		return;
+	}
+
+	pthread_mutex_lock(&a->lock);
+
+	/* a build in progress is discarded when it's done */
+	++a->generation;
+
+	for (p = a->first_used; p; p = p->next_used) {
+		if (p->index) {
+			xml_adaptive_drop(a, p);
+		}
+
+		p->cost = 0;
+	}
+
+	pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * Wait until all queued paths are indexed
+ *
+ * @param a - adaptive object
+ */
+void xml_adaptive_wait(struct xml_adaptive *a) {
+	if (!a) {
+		return;
+	}
+
+	pthread_mutex_lock(&a->lock);
+
+	while (a->running && (a->first || a->building)) {
+		pthread_cond_wait(&a->built, &a->lock);
+	}
+
+	pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * Return number of scans, number of queries answered from an index,
+ * number of indexes and bytes taken by paths and indexes
+ *
+ * @param a - adaptive object
+ * @param scans - receives number of scans, may be NULL
+ * @param indexed - receives number of indexed queries, may be NULL
+ * @param indexes - receives number of indexes, may be NULL
+ * @param size - receives bytes taken by paths and indexes, may be NULL
+ */
+void xml_adaptive_stats(
+		struct xml_adaptive *a,
+		size_t *scans,
+		size_t *indexed,
+		size_t *indexes,
+		size_t *size) {
+	pthread_mutex_lock(&a->lock);
+
+	if (scans) {
+		*scans = a->scans;
+	}
+
+	if (indexed) {
+		*indexed = a->indexed;
+	}
+
+	if (indexes) {
+		*indexes = a->indexes;
+	}
+
+	if (size) {
+		*size = a->size;
+	}
+
+	pthread_mutex_unlock(&a->lock);
+}
+#endif
@@ -0,0 +1,54 @@
+#ifndef _xml_adaptive_h_
+#define _xml_adaptive_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Indexes for hot paths that build themselves.
+ *
+ * Queries on a tree go through an xml_adaptive object that counts the
+ * elements every path had to visit. Once a path has cost more than the
+ * given threshold, a background thread materializes its matches into
+ * an index and later queries for that path just walk the index:
+ *
+ *	struct xml_adaptive *a = xml_adaptive_create(root, 10000, 1 << 20);
+ *
+ *	xml_adaptive_find(a, "PLAY/ACT/SCENE/SPEECH", print, NULL);
+ *	...
+ *	xml_adaptive_free(a);
+ *
+ * Matches are passed to the callback in the order xml_find() and
+ * xml_find_next() return them; a non-zero return value stops the
+ * query. Paths that are no longer used are evicted with their indexes
+ * in least recently used order once all paths and indexes take more
+ * than the given number of bytes.
+ *
+ * Queries may run from any number of threads. The tree must not be
+ * changed while indexes exist; call xml_adaptive_invalidate() after
+ * changing it, while no query is running. xml_adaptive_wait() waits
+ * until all pending indexes are built, which is only useful for tests
+ * and benchmarks. */
+
+struct xml_adaptive;
+
+struct xml_adaptive *xml_adaptive_create(struct xml_element *, size_t, size_t);
+void xml_adaptive_free(struct xml_adaptive *);
+
+size_t xml_adaptive_find(
+	struct xml_adaptive *,
+	const char *,
+	int (*)(struct xml_element *, void *),
+	void *);
+
+void xml_adaptive_invalidate(struct xml_adaptive *);
+void xml_adaptive_wait(struct xml_adaptive *);
+
+void xml_adaptive_stats(
+	struct xml_adaptive *,
+	size_t *,
+	size_t *,
+	size_t *,
+	size_t *);
+
+#endif
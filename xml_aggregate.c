@@ -0,0 +1,860 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_aggregate.h"
+
+#define WHITESPACE " \t\r\n"
+
+#define XML_AGGREGATE_COUNT 0
+#define XML_AGGREGATE_SUM 1
+#define XML_AGGREGATE_MIN 2
+#define XML_AGGREGATE_MAX 3
+#define XML_AGGREGATE_AVG 4
+
+/* group key or column argument relative to the record */
+struct xml_aggregate_arg {
+	/* copy of the source the names point into */
+	char *source;
+
+	/* element names from the record down, none for the record */
+	struct xml_aggregate_name {
+		const char *name;
+		size_t len;
+	} *names;
+	size_t depth;
+
+	/* attribute name or NULL for character data */
+	const char *attribute;
+};
+
+struct xml_aggregate_value {
+	/* number of values and of values that are numbers */
+	size_t count;
+	size_t numbers;
+
+	double sum;
+	double min;
+	double max;
+};
+
+struct xml_aggregate_column {
+	int fn;
+
+	/* NULL source for "count()" */
+	struct xml_aggregate_arg arg;
+};
+
+struct xml_aggregate_group {
+	char *key;
+	struct xml_aggregate_value values[];
+};
+
+struct xml_aggregate {
+	char *record;
+	struct xml_aggregate_arg group;
+
+	struct xml_aggregate_column *columns;
+	size_t column_count;
+
+	/* open record and number of open elements that are kept for
+	 * their character data */
+	struct xml_element *current;
+	size_t keep;
+
+	/* values and group key of open record */
+	struct xml_aggregate_value *values;
+	char *key;
+	size_t key_size;
+	int has_key;
+
+	/* groups in order of appearance */
+	struct xml_aggregate_group **groups;
+	size_t group_count;
+	size_t group_size;
+
+	/* groups by key */
+	struct xml_table table;
+};
+
+/*****************************************************************************
+ * NUMBERS
+ ****************************************************************************/
+
+/**
+ * Parse decimal number; numbers with up to 19 significant digits and
+ * small exponents are converted exactly without strtod()
+ *
+ * @param s - character data or attribute value
+ * @param v - receives number
+ */
+static int xml_aggregate_number(const char *s, double *v) {
+	/* all exactly representable as double */
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+		1e21, 1e22
+	};
+	const char *p = s + strspn(s, WHITESPACE);
+	uint64_t m = 0;
+	long exp = 0;
+	int digits = 0;
+	int truncated = 0;
+	int any = 0;
+	int neg = 0;
+	double d;
+
+	if (*p == '-' || *p == '+') {
+		neg = *p++ == '-';
+	}
+
+	for (; *p >= '0' && *p <= '9'; ++p, any = 1) {
+		if (digits < 19) {
+			m = m * 10 + (*p - '0');
+			digits += m > 0;
+		} else {
+			truncated |= *p != '0';
+			++exp;
+		}
+	}
+
+	if (*p == '.') {
+		for (++p; *p >= '0' && *p <= '9'; ++p, any = 1) {
+			if (digits < 19) {
+				m = m * 10 + (*p - '0');
+				digits += m > 0;
+				--exp;
+			} else {
+				truncated |= *p != '0';
+			}
+		}
+	}
+
+	if (!any) {
+		return 0;
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		long e = 0;
+		int eneg = 0;
+
+		if (*++p == '-' || *p == '+') {
+			eneg = *p++ == '-';
+		}
+
+		if (*p < '0' || *p > '9') {
+			return 0;
+		}
+
+		for (; *p >= '0' && *p <= '9'; ++p) {
+			if (e < 100000) {
+				e = e * 10 + (*p - '0');
+			}
+		}
+
+		exp += eneg ? -e : e;
+	}
+
+	if (p[strspn(p, WHITESPACE)]) {
+		return 0;
+	}
+
+	if (!truncated && m <= (1ULL << 53) && exp >= -22 && exp <= 22) {
+		d = (double) m;
+		d = exp < 0 ? d / powers[-exp] : d * powers[exp];
+		*v = neg ? -d : d;
+	} else {
+		*v = strtod(s, NULL);
+	}
+
+	return 1;
+}
+
+/*****************************************************************************
+ * ARGUMENTS
+ ****************************************************************************/
+
+/**
+ * Parse group key or column argument
+ *
+ * @param arg - argument that receives the parsed source
+ * @param s - source like "item/price" or "item@sku"
+ * @param len - length of source
+ */
+static int xml_aggregate_arg_parse(
+		struct xml_aggregate_arg *arg,
+		const char *s,
+		size_t len) {
+	char *at;
+	char *p;
+
+	memset(arg, 0, sizeof(*arg));
+
+	if (!(arg->source = malloc(len + 1))) {
+		return -1;
+	}
+
+	memcpy(arg->source, s, len);
+	arg->source[len] = 0;
+
+	if ((at = strchr(arg->source, '@'))) {
+		*at++ = 0;
+
+		if (!*at || strchr(at, '/') || strchr(at, '@')) {
+			return -1;
+		}
+
+		arg->attribute = at;
+	}
+
+	p = arg->source;
+
+	/* the record itself */
+	if (!*p || !strcmp(p, ".")) {
+		return 0;
+	}
+
+	for (;;) {
+		size_t l = strcspn(p, "/");
+		struct xml_aggregate_name *n;
+
+		if (!l) {
+			return -1;
+		}
+
+		if (!(n = realloc(arg->names,
+				(arg->depth + 1) * sizeof(*n)))) {
+			return -1;
+		}
+
+		arg->names = n;
+		n[arg->depth].name = p;
+		n[arg->depth].len = l;
+		++arg->depth;
+
+		if (!p[l]) {
+			return 0;
+		}
+
+		p += l + 1;
+	}
+}
+
+/**
+ * Free parsed argument
+ *
+ * @param arg - argument
+ */
+static void xml_aggregate_arg_free(struct xml_aggregate_arg *arg) {
+	free(arg->names);
+	free(arg->source);
+}
+
+/**
+ * Return true if element is the one argument refers to, relative to
+ * the record
+ *
+ * @param arg - argument
+ * @param record - record element
+ * @param e - element in record
+ */
+static int xml_aggregate_arg_match(
+		struct xml_aggregate_arg *arg,
+		struct xml_element *record,
+		struct xml_element *e) {
+	size_t i;
+
+	if (!arg->source) {
+		return 0;
+	}
+
+	for (i = arg->depth; i > 0; --i, e = e->parent) {
+		struct xml_aggregate_name *n = &arg->names[i - 1];
+
+		if (e == record || !e->key ||
+				strlen(e->key) != n->len ||
+				strncasecmp(e->key, n->name, n->len)) {
+			return 0;
+		}
+	}
+
+	return e == record;
+}
+
+/*****************************************************************************
+ * GROUPS
+ ****************************************************************************/
+
+/**
+ * Return group for key and create it if necessary
+ *
+ * @param a - aggregation
+ * @param key - group key
+ */
+static struct xml_aggregate_group *xml_aggregate_group(
+		struct xml_aggregate *a,
+		const char *key) {
+	size_t hash = xml_hash(key, strlen(key));
+	struct xml_aggregate_group *g;
+	size_t probe = 0;
+	size_t n;
+	size_t i;
+
+	if (xml_table_reserve(&a->table, a->group_count + 1)) {
+		return NULL;
+	}
+
+	while ((n = xml_table_next(&a->table, hash, &probe))) {
+		g = a->groups[n - 1];
+
+		if (!strcmp(g->key, key)) {
+			return g;
+		}
+	}
+
+	if (a->group_count >= a->group_size) {
+		size_t size = a->group_size ? a->group_size << 1 : 16;
+		struct xml_aggregate_group **groups;
+
+		if (!(groups = realloc(a->groups, size * sizeof(*groups)))) {
+			return NULL;
+		}
+
+		a->groups = groups;
+		a->group_size = size;
+	}
+
+	if (!(g = calloc(1, sizeof(*g) +
+			a->column_count * sizeof(*g->values)))) {
+		return NULL;
+	}
+
+	if (!(g->key = strdup(key))) {
+		free(g);
+		return NULL;
+	}
+
+	for (i = 0; i < a->column_count; ++i) {
+		g->values[i].min = HUGE_VAL;
+		g->values[i].max = -HUGE_VAL;
+	}
+
+	a->groups[a->group_count++] = g;
+	xml_table_set(&a->table, hash, probe, a->group_count);
+
+	return g;
+}
+
+/*****************************************************************************
+ * RECORDS
+ ****************************************************************************/
+
+/**
+ * Start new record
+ *
+ * @param a - aggregation
+ * @param e - record element
+ */
+static void xml_aggregate_begin(struct xml_aggregate *a, struct xml_element *e) {
+	size_t i;
+
+	a->current = e;
+	a->has_key = 0;
+
+	for (i = 0; i < a->column_count; ++i) {
+		struct xml_aggregate_value *v = &a->values[i];
+
+		v->count = v->numbers = 0;
+		v->sum = 0;
+		v->min = HUGE_VAL;
+		v->max = -HUGE_VAL;
+	}
+}
+
+/**
+ * Add values of record to its group
+ *
+ * @param a - aggregation
+ */
+static int xml_aggregate_end(struct xml_aggregate *a) {
+	struct xml_aggregate_group *g;
+	size_t i;
+
+	a->current = NULL;
+
+	if (!(g = xml_aggregate_group(a, a->has_key ? a->key : ""))) {
+		return -1;
+	}
+
+	for (i = 0; i < a->column_count; ++i) {
+		struct xml_aggregate_value *v = &a->values[i];
+		struct xml_aggregate_value *t = &g->values[i];
+
+		/* "count()" counts records */
+		if (!a->columns[i].arg.source) {
+			v->count = 1;
+		}
+
+		t->count += v->count;
+		t->numbers += v->numbers;
+		t->sum += v->sum;
+
+		if (v->min < t->min) {
+			t->min = v->min;
+		}
+
+		if (v->max > t->max) {
+			t->max = v->max;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Set group key of record unless it has one
+ *
+ * @param a - aggregation
+ * @param s - value
+ */
+static int xml_aggregate_key_set(struct xml_aggregate *a, const char *s) {
+	size_t len = strlen(s);
+
+	if (a->has_key) {
+		return 0;
+	}
+
+	if (len >= a->key_size) {
+		char *key = realloc(a->key, len + 1);
+
+		if (!key) {
+			return -1;
+		}
+
+		a->key = key;
+		a->key_size = len + 1;
+	}
+
+	memcpy(a->key, s, len + 1);
+	a->has_key = 1;
+
+	return 0;
+}
+
+/**
+ * Add value to column of record
+ *
+ * @param a - aggregation
+ * @param i - column
+ * @param s - value
+ */
+static void xml_aggregate_value(
+		struct xml_aggregate *a,
+		size_t i,
+		const char *s) {
+	struct xml_aggregate_value *v = &a->values[i];
+	double d;
+
+	++v->count;
+
+	if (a->columns[i].fn == XML_AGGREGATE_COUNT ||
+			!xml_aggregate_number(s, &d)) {
+		return;
+	}
+
+	++v->numbers;
+	v->sum += d;
+
+	if (d < v->min) {
+		v->min = d;
+	}
+
+	if (d > v->max) {
+		v->max = d;
+	}
+}
+
+/**
+ * Return true if the group key or a column refers to the character
+ * data of element
+ *
+ * @param a - aggregation
+ * @param e - element in record
+ */
+static int xml_aggregate_wants(
+		struct xml_aggregate *a,
+		struct xml_element *e) {
+	size_t i;
+
+	if (!a->group.attribute &&
+			xml_aggregate_arg_match(&a->group, a->current, e)) {
+		return 1;
+	}
+
+	for (i = 0; i < a->column_count; ++i) {
+		struct xml_aggregate_arg *arg = &a->columns[i].arg;
+
+		if (!arg->attribute &&
+				xml_aggregate_arg_match(arg, a->current, e)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Pass attributes of element to the group key and columns that refer
+ * to them
+ *
+ * @param a - aggregation
+ * @param e - element in record
+ */
+static int xml_aggregate_attributes(
+		struct xml_aggregate *a,
+		struct xml_element *e) {
+	struct xml_attribute *at;
+	size_t i;
+
+	if (a->group.attribute &&
+			xml_aggregate_arg_match(&a->group, a->current, e) &&
+			(at = xml_find_attribute(e->first_attribute,
+				a->group.attribute)) &&
+			xml_aggregate_key_set(a, at->value)) {
+		return -1;
+	}
+
+	for (i = 0; i < a->column_count; ++i) {
+		struct xml_aggregate_arg *arg = &a->columns[i].arg;
+
+		if (arg->attribute &&
+				xml_aggregate_arg_match(arg, a->current, e) &&
+				(at = xml_find_attribute(e->first_attribute,
+					arg->attribute))) {
+			xml_aggregate_value(a, i, at->value);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Pass character data of element to the group key and columns that
+ * refer to it
+ *
+ * @param a - aggregation
+ * @param e - element in record
+ */
+static int xml_aggregate_content(
+		struct xml_aggregate *a,
+		struct xml_element *e) {
+	struct xml_element *c = e->first_child;
+	char *content = NULL;
+	const char *s;
+	int r = 0;
+	size_t i;
+
+	/* most values are a single run of character data */
+	if (!c) {
+		s = "";
+	} else if (c == e->last_child && !c->key) {
+		s = xml_value(c);
+	} else {
+		s = content = xml_content(e);
+	}
+
+	if (!s) {
+		return -1;
+	}
+
+	if (!a->group.attribute &&
+			xml_aggregate_arg_match(&a->group, a->current, e)) {
+		r = xml_aggregate_key_set(a, s);
+	}
+
+	for (i = 0; i < a->column_count; ++i) {
+		struct xml_aggregate_arg *arg = &a->columns[i].arg;
+
+		if (!arg->attribute &&
+				xml_aggregate_arg_match(arg, a->current, e)) {
+			xml_aggregate_value(a, i, s);
+		}
+	}
+
+	free(content);
+
+	return r;
+}
+
+/*****************************************************************************
+ * PARSER NOTIFICATIONS
+ ****************************************************************************/
+
+/**
+ * Begin records and keep elements whose character data is required
+ *
+ * @param st - parser state
+ * @param e - element
+ */
+static int xml_aggregate_open(struct xml_state *st, struct xml_element *e) {
+	struct xml_aggregate *a = st->user;
+
+	if (!a->current) {
+		if (!xml_match(e, a->record)) {
+			return 0;
+		}
+
+		xml_aggregate_begin(a, e);
+	}
+
+	if (xml_aggregate_attributes(a, e)) {
+		return -1;
+	}
+
+	a->keep += xml_aggregate_wants(a, e);
+
+	return 0;
+}
+
+/**
+ * Collect character data, end records and drop elements that aren't
+ * required anymore
+ *
+ * @param st - parser state
+ * @param e - element
+ */
+static int xml_aggregate_close(struct xml_state *st, struct xml_element *e) {
+	struct xml_aggregate *a = st->user;
+	struct xml_element *p = e->parent;
+
+	if (a->current && e->key && xml_aggregate_wants(a, e)) {
+		--a->keep;
+
+		if (xml_aggregate_content(a, e)) {
+			return -1;
+		}
+	}
+
+	if (e == a->current && xml_aggregate_end(a)) {
+		return -1;
+	}
+
+	if (a->keep > 0 || !p) {
+		return 0;
+	}
+
+	/* all previous siblings have already been dropped */
+	p->first_child = p->last_child = NULL;
+	e->parent = NULL;
+	xml_free(e);
+
+	return 0;
+}
+
+/*****************************************************************************
+ * INTERFACE
+ ****************************************************************************/
+
+/**
+ * Create aggregation
+ *
+ * @param record - path of records like for xml_match()
+ * @param group - group key relative to record, may be NULL
+ */
+struct xml_aggregate *xml_aggregate_create(
+		const char *record,
+		const char *group) {
+	struct xml_aggregate *a;
+
+	if (!record || !*record || !(a = calloc(1, sizeof(*a)))) {
+		return NULL;
+	}
+
+	if (!(a->record = strdup(record)) ||
+			(group && *group &&
+				xml_aggregate_arg_parse(&a->group, group,
+					strlen(group)))) {
+		xml_aggregate_free(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+/**
+ * Free aggregation and its results
+ *
+ * @param a - aggregation
+ */
+void xml_aggregate_free(struct xml_aggregate *a) {
+	size_t i;
+
+	if (!a) {
+		return;
+	}
+
+	for (i = 0; i < a->group_count; ++i) {
+		free(a->groups[i]->key);
+		free(a->groups[i]);
+	}
+
+	for (i = 0; i < a->column_count; ++i) {
+		xml_aggregate_arg_free(&a->columns[i].arg);
+	}
+
+	xml_aggregate_arg_free(&a->group);
+	free(a->groups);
+	xml_table_free(&a->table);
+	free(a->columns);
+	free(a->values);
+	free(a->key);
+	free(a->record);
+	free(a);
+}
+
+/**
+ * Add column and return its number or -1 if the expression is invalid;
+ * columns must be added before any record has been aggregated
+ *
+ * @param a - aggregation
+ * @param expression - "count()", "count(ARG)", "sum(ARG)", "min(ARG)",
+ *                     "max(ARG)" or "avg(ARG)"
+ */
+long xml_aggregate_add(struct xml_aggregate *a, const char *expression) {
+	static const char *names[] = {"count", "sum", "min", "max", "avg"};
+	struct xml_aggregate_column *columns;
+	struct xml_aggregate_value *values;
+	struct xml_aggregate_column c;
+	const char *open;
+	size_t len;
+	int fn;
+
+	if (!a || !expression || a->group_count ||
+			!(open = strchr(expression, '('))) {
+		return -1;
+	}
+
+	for (fn = 0; fn < (int) (sizeof(names) / sizeof(*names)); ++fn) {
+		if (strlen(names[fn]) == (size_t) (open - expression) &&
+				!strncasecmp(names[fn], expression,
+					open - expression)) {
+			break;
+		}
+	}
+
+	len = strlen(++open);
+
+	if (fn >= (int) (sizeof(names) / sizeof(*names)) ||
+			!len || open[len - 1] != ')' ||
+			memchr(open, ')', len - 1)) {
+		return -1;
+	}
+
+	memset(&c, 0, sizeof(c));
+	c.fn = fn;
+
+	/* only "count()" goes without argument */
+	if (len == 1) {
+		if (fn != XML_AGGREGATE_COUNT) {
+			return -1;
+		}
+	} else if (xml_aggregate_arg_parse(&c.arg, open, len - 1)) {
+		xml_aggregate_arg_free(&c.arg);
+		return -1;
+	}
+
+	if (!(columns = realloc(a->columns,
+			(a->column_count + 1) * sizeof(*columns)))) {
+		xml_aggregate_arg_free(&c.arg);
+		return -1;
+	}
+
+	a->columns = columns;
+
+	if (!(values = realloc(a->values,
+			(a->column_count + 1) * sizeof(*values)))) {
+		xml_aggregate_arg_free(&c.arg);
+		return -1;
+	}
+
+	a->values = values;
+	a->columns[a->column_count] = c;
+
+	return a->column_count++;
+}
+
+/**
+ * Aggregate records of the document parsed with the given state
+ *
+ * @param a - aggregation
+ * @param st - parser state, "open", "close" and "user" are replaced
+ */
+void xml_aggregate_attach(struct xml_aggregate *a, struct xml_state *st) {
+	a->current = NULL;
+	a->keep = 0;
+
+	st->open = xml_aggregate_open;
+	st->close = xml_aggregate_close;
+	st->user = a;
+}
+
+/**
+ * Return number of groups
+ *
+ * @param a - aggregation
+ */
+size_t xml_aggregate_groups(struct xml_aggregate *a) {
+	return a ? a->group_count : 0;
+}
+
+/**
+ * Return key of group
+ *
+ * @param a - aggregation
+ * @param group - group number
+ */
+const char *xml_aggregate_key(struct xml_aggregate *a, size_t group) {
+	if (!a || group >= a->group_count) {
+		return NULL;
+	}
+
+	return a->groups[group]->key;
+}
+
+/**
+ * Return result of column for group; NAN for minimum, maximum and
+ * average if there were no numbers
+ *
+ * @param a - aggregation
+ * @param group - group number
+ * @param column - column number
+ */
+double xml_aggregate_result(
+		struct xml_aggregate *a,
+		size_t group,
+		size_t column) {
+	struct xml_aggregate_value *v;
+
+	if (!a || group >= a->group_count || column >= a->column_count) {
+		return NAN;
+	}
+
+	v = &a->groups[group]->values[column];
+
+	switch (a->columns[column].fn) {
+	case XML_AGGREGATE_COUNT:
+		return v->count;
+	case XML_AGGREGATE_SUM:
+		return v->sum;
+	case XML_AGGREGATE_MIN:
+		return v->numbers ? v->min : NAN;
+	case XML_AGGREGATE_MAX:
+		return v->numbers ? v->max : NAN;
+	default:
+		return v->numbers ? v->sum / v->numbers : NAN;
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef _xml_aggregate_h_
+#define _xml_aggregate_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Aggregates over records while parsing.
+ *
+ * An aggregation has a record path, an optional group key and any
+ * number of columns. Group keys and column arguments are relative to
+ * the record: "@id" is an attribute of the record, "item/price" the
+ * character data of descendants, "item@sku" an attribute of those and
+ * "." the character data of the record itself:
+ *
+ *	struct xml_aggregate *a = xml_aggregate_create("orders/order",
+ *		"@customer");
+ *	struct xml_state st;
+ *
+ *	xml_aggregate_add(a, "count()");
+ *	xml_aggregate_add(a, "sum(item/price)");
+ *
+ *	memset(&st, 0, sizeof(st));
+ *	xml_aggregate_attach(a, &st);
+ *	... xml_parse_chunk(&st, chunk) ...
+ *	xml_free(st.root);
+ *
+ *	for (i = 0; i < xml_aggregate_groups(a); ++i) {
+ *		printf("%s %g %g\n", xml_aggregate_key(a, i),
+ *			xml_aggregate_result(a, i, 0),
+ *			xml_aggregate_result(a, i, 1));
+ *	}
+ *
+ * Columns are "count()" for the number of records, "count(ARG)" for
+ * the number of values and "sum(ARG)", "min(ARG)", "max(ARG)" and
+ * "avg(ARG)" over the values that are numbers. Every record adds to
+ * the group of the first value of the group key, or to the group ""
+ * if there's none. Groups are kept in order of appearance.
+ *
+ * xml_aggregate_attach() takes over the "open", "close" and "user"
+ * fields of the parser state. Elements are freed as soon as they are
+ * closed and have been looked at, so only hash table state is kept,
+ * never a tree. Results add up over all documents parsed with the
+ * same aggregation. */
+
+struct xml_aggregate;
+
+struct xml_aggregate *xml_aggregate_create(const char *, const char *);
+void xml_aggregate_free(struct xml_aggregate *);
+
+long xml_aggregate_add(struct xml_aggregate *, const char *);
+void xml_aggregate_attach(struct xml_aggregate *, struct xml_state *);
+
+size_t xml_aggregate_groups(struct xml_aggregate *);
+const char *xml_aggregate_key(struct xml_aggregate *, size_t);
+double xml_aggregate_result(struct xml_aggregate *, size_t, size_t);
+
+#endif
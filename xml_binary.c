@@ -0,0 +1,688 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_binary.h"
+
+#define XML_BINARY_MAGIC "XMLB"
+#define XML_BINARY_VERSION 1
+
+#define TOKEN_END 0
+#define TOKEN_START 1
+#define TOKEN_CLOSE 2
+#define TOKEN_TEXT 3
+#define TOKEN_SPECIAL 4
+
+/* values longer than this are always written literally */
+#define XML_BINARY_VALUE_MAX 256
+
+/* maximum number of entries per string table */
+#define XML_BINARY_TABLE_MAX (1 << 20)
+
+struct xml_binary_buffer {
+	unsigned char *data;
+	size_t length;
+	size_t size;
+};
+
+struct xml_binary_table {
+	/* string table in order of appearance */
+	struct xml_string *strings;
+	size_t count;
+	size_t size;
+
+	/* strings by content, only used by the encoder */
+	struct xml_table table;
+};
+
+/*****************************************************************************
+ * STRING TABLES
+ ****************************************************************************/
+
+/**
+ * Free string table
+ *
+ * @param t - string table
+ */
+static void xml_binary_table_free(struct xml_binary_table *t) {
+	free(t->strings);
+	xml_table_free(&t->table);
+}
+
+/**
+ * Return index of string in table or -1 if it's not there
+ *
+ * @param t - string table
+ * @param s - string
+ * @param l - length of string
+ */
+static long xml_binary_table_find(
+		struct xml_binary_table *t,
+		const char *s,
+		size_t l) {
+	size_t hash = xml_hash(s, l);
+	size_t probe = 0;
+	size_t n;
+
+	while ((n = xml_table_next(&t->table, hash, &probe))) {
+		struct xml_string *e = t->strings + n - 1;
+
+		if (e->length == l && !memcmp(e->s, s, l)) {
+			return n - 1;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Append string to table; strings are referenced, not copied
+ *
+ * @param t - string table
+ * @param s - string
+ * @param l - length of string
+ * @param hash - non-zero to maintain the hash table
+ */
+static int xml_binary_table_add(
+		struct xml_binary_table *t,
+		const char *s,
+		size_t l,
+		int hash) {
+	if (t->count >= XML_BINARY_TABLE_MAX) {
+		return 0;
+	}
+
+	if (hash && xml_table_reserve(&t->table, t->count + 1)) {
+		return -1;
+	}
+
+	if (t->count >= t->size) {
+		size_t size = t->size ? t->size << 1 : 64;
+		struct xml_string *n = realloc(
+			t->strings,
+			size * sizeof(struct xml_string));
+
+		if (!n) {
+			return -1;
+		}
+
+		t->strings = n;
+		t->size = size;
+	}
+
+	t->strings[t->count].s = s;
+	t->strings[t->count].length = l;
+	++t->count;
+
+	if (hash) {
+		size_t h = xml_hash(s, l);
+		size_t probe = 0;
+
+		while (xml_table_next(&t->table, h, &probe));
+		xml_table_set(&t->table, h, probe, t->count);
+	}
+
+	return 0;
+}
+
+/*****************************************************************************
+ * ENCODING
+ ****************************************************************************/
+
+struct xml_binary_encoder {
+	struct xml_binary_buffer out;
+	struct xml_binary_table names;
+	struct xml_binary_table values;
+};
+
+/**
+ * Append bytes to output buffer
+ *
+ * @param b - buffer
+ * @param d - data
+ * @param l - length of data
+ */
+static int xml_binary_write(
+		struct xml_binary_buffer *b,
+		const void *d,
+		size_t l) {
+	if (b->length + l > b->size) {
+		size_t size = b->size ? b->size : 256;
+		unsigned char *n;
+
+		while (size < b->length + l) {
+			size <<= 1;
+		}
+
+		if (!(n = realloc(b->data, size))) {
+			return -1;
+		}
+
+		b->data = n;
+		b->size = size;
+	}
+
+	memcpy(b->data + b->length, d, l);
+	b->length += l;
+
+	return 0;
+}
+
+/**
+ * Append unsigned varint to output buffer
+ *
+ * @param b - buffer
+ * @param v - value
+ */
+static int xml_binary_write_varint(struct xml_binary_buffer *b, size_t v) {
+	unsigned char d[16];
+	size_t l = 0;
+
+	do {
+		d[l] = v & 0x7f;
+		v >>= 7;
+
+		if (v) {
+			d[l] |= 0x80;
+		}
+
+		++l;
+	} while (v);
+
+	return xml_binary_write(b, d, l);
+}
+
+/**
+ * Write string reference or literal; reference 0 introduces a literal
+ * and references above "first" point into the table
+ *
+ * @param b - buffer
+ * @param t - string table
+ * @param s - string
+ * @param first - first reference number of the table
+ * @param max - maximum length of strings entering the table
+ */
+static int xml_binary_write_string(
+		struct xml_binary_buffer *b,
+		struct xml_binary_table *t,
+		const char *s,
+		size_t first,
+		size_t max) {
+	size_t l = strlen(s);
+	long i;
+
+	if (l <= max && (i = xml_binary_table_find(t, s, l)) > -1) {
+		return xml_binary_write_varint(b, first + i);
+	}
+
+	if (xml_binary_write_varint(b, first - 1) ||
+			xml_binary_write_varint(b, l) ||
+			xml_binary_write(b, s, l)) {
+		return -1;
+	}
+
+	if (l <= max && xml_binary_table_add(t, s, l, 1)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Write name
+ *
+ * @param enc - encoder
+ * @param s - name
+ */
+static int xml_binary_write_name(
+		struct xml_binary_encoder *enc,
+		const char *s) {
+	return xml_binary_write_string(
+		&enc->out,
+		&enc->names,
+		s ? s : "",
+		1,
+		(size_t) -1);
+}
+
+/**
+ * Write value; NULL values are written as reference 0
+ *
+ * @param enc - encoder
+ * @param s - value, may be NULL
+ */
+static int xml_binary_write_value(
+		struct xml_binary_encoder *enc,
+		const char *s) {
+	if (!s) {
+		return xml_binary_write_varint(&enc->out, 0);
+	}
+
+	return xml_binary_write_string(
+		&enc->out,
+		&enc->values,
+		s,
+		2,
+		XML_BINARY_VALUE_MAX);
+}
+
+/**
+ * Encode element and all of its children
+ *
+ * @param enc - encoder
+ * @param e - element
+ */
+static int xml_binary_encode_element(
+		struct xml_binary_encoder *enc,
+		struct xml_element *e) {
+	unsigned char token;
+
+	if (XML_COMPRESSED(e)) {
+		const char *v = xml_value(e);
+
+		token = TOKEN_TEXT;
+
+		/* decompressed values don't stay put so they are always
+		 * written as literals; the decoder still adds short ones
+		 * to its table, so add an entry that can't be found to
+		 * keep the numbering in step */
+		return !v ||
+			xml_binary_write(&enc->out, &token, 1) ||
+			xml_binary_write_string(&enc->out, &enc->values, v, 2, 0) ||
+			(strlen(v) <= XML_BINARY_VALUE_MAX &&
+				xml_binary_table_add(&enc->values, NULL, 0, 0));
+	}
+
+	if (e->value) {
+		token = TOKEN_TEXT;
+
+		return xml_binary_write(&enc->out, &token, 1) ||
+			xml_binary_write_value(enc, e->value);
+	}
+
+	if (e->key && (*e->key == '?' || *e->key == '!')) {
+		token = TOKEN_SPECIAL;
+
+		return xml_binary_write(&enc->out, &token, 1) ||
+			xml_binary_write_value(enc, e->key);
+	}
+
+	if (e->key) {
+		struct xml_attribute *a;
+		size_t n = 0;
+
+		for (a = e->first_attribute; a; a = a->next) {
+			++n;
+		}
+
+		token = TOKEN_START;
+
+		if (xml_binary_write(&enc->out, &token, 1) ||
+				xml_binary_write_name(enc, e->key) ||
+				xml_binary_write_varint(&enc->out, n)) {
+			return -1;
+		}
+
+		for (a = e->first_attribute; a; a = a->next) {
+			if (xml_binary_write_name(enc, a->key) ||
+					xml_binary_write_value(enc, a->value)) {
+				return -1;
+			}
+		}
+	}
+
+	{
+		struct xml_element *c;
+
+		for (c = e->first_child; c; c = c->next) {
+			if (xml_binary_encode_element(enc, c)) {
+				return -1;
+			}
+		}
+	}
+
+	token = TOKEN_CLOSE;
+
+	return e->key && xml_binary_write(&enc->out, &token, 1);
+}
+
+/**
+ * Encode element tree into binary token format
+ * (the returned buffer must be free()'d after use)
+ *
+ * @param root - root element or any element of a tree
+ * @param len - address of length of the returned buffer
+ */
+void *xml_encode(struct xml_element *root, size_t *len) {
+	struct xml_binary_encoder enc;
+	unsigned char token;
+	int r;
+
+	if (!root || !len) {
+		return NULL;
+	}
+
+	memset(&enc, 0, sizeof(enc));
+
+	r = xml_binary_write(&enc.out, XML_BINARY_MAGIC, 4);
+
+	token = XML_BINARY_VERSION;
+	r = r || xml_binary_write(&enc.out, &token, 1);
+
+	r = r || xml_binary_encode_element(&enc, root);
+
+	token = TOKEN_END;
+	r = r || xml_binary_write(&enc.out, &token, 1);
+
+	xml_binary_table_free(&enc.names);
+	xml_binary_table_free(&enc.values);
+
+	if (r) {
+		free(enc.out.data);
+		return NULL;
+	}
+
+	*len = enc.out.length;
+
+	return enc.out.data;
+}
+
+/*****************************************************************************
+ * DECODING
+ ****************************************************************************/
+
+struct xml_binary_decoder {
+	const unsigned char *p;
+	const unsigned char *end;
+	struct xml_binary_table names;
+	struct xml_binary_table values;
+
+	/* attribute scratch space */
+	struct xml_string *attributes;
+	size_t attributes_size;
+
+	/* names of open elements for their end tags */
+	struct xml_string *open;
+	size_t open_count;
+	size_t open_size;
+};
+
+/**
+ * Read unsigned varint
+ *
+ * @param dec - decoder
+ * @param v - address of value
+ */
+static int xml_binary_read_varint(struct xml_binary_decoder *dec, size_t *v) {
+	unsigned shift = 0;
+
+	*v = 0;
+
+	while (dec->p < dec->end && shift < sizeof(size_t) * 8) {
+		unsigned char c = *dec->p++;
+
+		*v |= (size_t) (c & 0x7f) << shift;
+
+		if (!(c & 0x80)) {
+			return 0;
+		}
+
+		shift += 7;
+	}
+
+	return -1;
+}
+
+/**
+ * Read string reference or literal
+ *
+ * @param dec - decoder
+ * @param t - string table
+ * @param first - first reference number of the table
+ * @param max - maximum length of strings entering the table
+ * @param s - address of resulting string
+ */
+static int xml_binary_read_string(
+		struct xml_binary_decoder *dec,
+		struct xml_binary_table *t,
+		size_t first,
+		size_t max,
+		struct xml_string *s) {
+	size_t ref;
+
+	if (xml_binary_read_varint(dec, &ref)) {
+		return -1;
+	}
+
+	if (ref < first - 1) {
+		s->s = NULL;
+		s->length = 0;
+		return 0;
+	}
+
+	if (ref >= first) {
+		if (ref - first >= t->count) {
+			return -1;
+		}
+
+		*s = t->strings[ref - first];
+		return 0;
+	}
+
+	if (xml_binary_read_varint(dec, &s->length) ||
+			s->length > (size_t) (dec->end - dec->p)) {
+		return -1;
+	}
+
+	s->s = (const char *) dec->p;
+	dec->p += s->length;
+
+	if (s->length <= max &&
+			xml_binary_table_add(t, s->s, s->length, 0)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Read name
+ *
+ * @param dec - decoder
+ * @param s - address of resulting string
+ */
+static int xml_binary_read_name(
+		struct xml_binary_decoder *dec,
+		struct xml_string *s) {
+	return xml_binary_read_string(dec, &dec->names, 1, (size_t) -1, s);
+}
+
+/**
+ * Read value; s->s is NULL for NULL values
+ *
+ * @param dec - decoder
+ * @param s - address of resulting string
+ */
+static int xml_binary_read_value(
+		struct xml_binary_decoder *dec,
+		struct xml_string *s) {
+	return xml_binary_read_string(
+		dec,
+		&dec->values,
+		2,
+		XML_BINARY_VALUE_MAX,
+		s);
+}
+
+/**
+ * Decode start token and pass it on
+ *
+ * @param dec - decoder
+ * @param st - state
+ */
+static int xml_binary_decode_start(
+		struct xml_binary_decoder *dec,
+		struct xml_state *st) {
+	const char *at = (const char *) dec->p - 1;
+	struct xml_string name;
+	size_t count;
+	size_t i;
+
+	if (xml_binary_read_name(dec, &name) ||
+			!name.length ||
+			xml_binary_read_varint(dec, &count) ||
+			count > (size_t) (dec->end - dec->p) / 2) {
+		return -1;
+	}
+
+	if (count * 2 > dec->attributes_size) {
+		struct xml_string *n = realloc(
+			dec->attributes,
+			count * 2 * sizeof(struct xml_string));
+
+		if (!n) {
+			return -1;
+		}
+
+		dec->attributes = n;
+		dec->attributes_size = count * 2;
+	}
+
+	for (i = 0; i < count * 2; i += 2) {
+		if (xml_binary_read_name(dec, dec->attributes + i) ||
+				xml_binary_read_value(dec, dec->attributes + i + 1)) {
+			return -1;
+		}
+	}
+
+	if (dec->open_count >= dec->open_size) {
+		size_t size = dec->open_size ? dec->open_size << 1 : 16;
+		struct xml_string *n = realloc(
+			dec->open,
+			size * sizeof(struct xml_string));
+
+		if (!n) {
+			return -1;
+		}
+
+		dec->open = n;
+		dec->open_size = size;
+	}
+
+	dec->open[dec->open_count++] = name;
+
+	return xml_feed_open(st, at, &name, dec->attributes, count);
+}
+
+/**
+ * Decode token stream and pass the tokens on
+ *
+ * @param dec - decoder
+ * @param st - state
+ */
+static int xml_binary_decode_tokens(
+		struct xml_binary_decoder *dec,
+		struct xml_state *st) {
+	while (dec->p < dec->end) {
+		const char *at = (const char *) dec->p;
+		struct xml_string s;
+
+		switch (*dec->p++) {
+		case TOKEN_END:
+			return dec->open_count ? -1 : xml_feed_end(st, at);
+		case TOKEN_START:
+			if (xml_binary_decode_start(dec, st)) {
+				return -1;
+			}
+			break;
+		case TOKEN_CLOSE:
+			if (!dec->open_count ||
+					xml_feed_close(st, at,
+						&dec->open[--dec->open_count])) {
+				return -1;
+			}
+			break;
+		case TOKEN_TEXT:
+			/* empty literals don't make an element */
+			if (xml_binary_read_value(dec, &s) ||
+					!s.s ||
+					xml_feed_text(st, s.s, s.length)) {
+				return -1;
+			}
+			break;
+		case TOKEN_SPECIAL:
+			if (xml_binary_read_value(dec, &s) ||
+					!s.s ||
+					xml_feed_special(st, at, &s)) {
+				return -1;
+			}
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Decode binary token format through a parsing state, so a builder,
+ * allocator, compression and validator apply just like when parsing
+ * with xml_parse_chunk(); the state must be zero-filled apart from
+ * those settings
+ *
+ * @param st - state
+ * @param data - encoded data
+ * @param len - length of data
+ */
+int xml_decode_state(struct xml_state *st, const void *data, size_t len) {
+	struct xml_binary_decoder dec;
+	int r;
+
+	if (!st ||
+			!data ||
+			len < 5 ||
+			memcmp(data, XML_BINARY_MAGIC, 4) ||
+			((const unsigned char *) data)[4] != XML_BINARY_VERSION ||
+			xml_feed_begin(st, data)) {
+		return -1;
+	}
+
+	memset(&dec, 0, sizeof(dec));
+	dec.p = (const unsigned char *) data + 5;
+	dec.end = (const unsigned char *) data + len;
+
+	r = xml_binary_decode_tokens(&dec, st);
+
+	xml_binary_table_free(&dec.names);
+	xml_binary_table_free(&dec.values);
+	free(dec.attributes);
+	free(dec.open);
+
+	/* the tag buffer is only left over on errors */
+	free(st->token);
+	st->token = NULL;
+	st->token_size = 0;
+
+	return r;
+}
+
+/**
+ * Decode binary token format into a new element tree
+ *
+ * @param data - encoded data
+ * @param len - length of data
+ */
+struct xml_element *xml_decode(const void *data, size_t len) {
+	struct xml_state st;
+
+	memset(&st, 0, sizeof(st));
+
+	if (xml_decode_state(&st, data, len)) {
+		xml_free(st.root);
+		return NULL;
+	}
+
+	return st.root;
+}
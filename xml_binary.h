@@ -0,0 +1,32 @@
+#ifndef _xml_binary_h_
+#define _xml_binary_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Compact binary token format for exchanging element trees between
+ * processes that share the same vocabularies.
+ *
+ * The stream starts with the magic "XMLB" and a version byte followed
+ * by a sequence of structural tokens. Element and attribute names are
+ * collected in one string table, attribute values and character data
+ * in another. Every string is either written literally (and appended
+ * to its table) or as a back-reference to an earlier occurrence. All
+ * integers are unsigned LEB128 varints.
+ *
+ * Decoded tokens go through the same events as parsed XML, so
+ * xml_decode_state() takes a state with a builder, allocator,
+ * compression or validator like xml_parse_chunk() does:
+ *
+ *	struct xml_state st;
+ *
+ *	memset(&st, 0, sizeof(st));
+ *	st.builder = &my_builder;
+ *	xml_decode_state(&st, data, len); */
+
+void *xml_encode(struct xml_element *, size_t *);
+struct xml_element *xml_decode(const void *, size_t);
+int xml_decode_state(struct xml_state *, const void *, size_t);
+
+#endif
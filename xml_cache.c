@@ -0,0 +1,514 @@
+#ifndef WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "xml.h"
+#include "xml_cache.h"
+
+struct xml_cache_entry {
+	/* neighbours in order of use, most recent first */
+	struct xml_cache_entry *prev;
+	struct xml_cache_entry *next;
+
+	char *path;
+
+	/* identity of file when it was parsed or last found unchanged */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+
+	/* hash of file content */
+	uint64_t hash;
+
+	/* memory block the tree lives in */
+	void *block;
+	size_t block_size;
+	struct xml_element *root;
+
+	/* number of references, entries that are still referenced after
+	 * they've been replaced are kept in the list of stale entries */
+	size_t refs;
+	int stale;
+};
+
+struct xml_cache {
+	pthread_mutex_t lock;
+
+	/* entries in order of use and replaced entries still in use */
+	struct xml_cache_entry *first;
+	struct xml_cache_entry *last;
+	struct xml_cache_entry *stale;
+
+	/* maximum and current size of all memory blocks */
+	size_t limit;
+	size_t size;
+
+	size_t hits;
+	size_t misses;
+};
+
+/**
+ * Return hash of data; mixes a word at a time, so it's limited by
+ * memory bandwidth rather than by the number of bytes
+ *
+ * @param data - data
+ * @param len - length of data
+ */
+static uint64_t xml_cache_hash(const char *data, size_t len) {
+	const uint64_t prime = 0x9e3779b97f4a7c15ULL;
+	uint64_t h = len * prime;
+	uint64_t w;
+
+	for (; len >= sizeof(w); data += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, data, sizeof(w));
+		h = (h ^ w) * prime;
+		h ^= h >> 32;
+	}
+
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, data, len);
+		h = (h ^ w) * prime;
+		h ^= h >> 32;
+	}
+
+	h ^= h >> 29;
+	h *= prime;
+
+	return h ^ (h >> 32);
+}
+
+/**
+ * Create cache
+ *
+ * @param limit - number of bytes all trees may take; referenced trees
+ *                count too but aren't evicted, so the cache may grow
+ *                beyond the limit while they are in use
+ */
+struct xml_cache *xml_cache_create(size_t limit) {
+	struct xml_cache *c = calloc(1, sizeof(*c));
+
+	if (!c) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	c->limit = limit;
+
+	return c;
+}
+
+/**
+ * Free entry
+ *
+ * @param e - cache entry
+ */
+static void xml_cache_entry_free(struct xml_cache_entry *e) {
+	free(e->block);
+	free(e->path);
+	free(e);
+}
+
+/**
+ * Free cache and all trees, referenced or not
+ *
+ * @param c - cache
+ */
+void xml_cache_free(struct xml_cache *c) {
+	struct xml_cache_entry *e, *n;
+
+	if (!c) {
+		return;
+	}
+
+	for (e = c->first; e; e = n) {
+		n = e->next;
+		xml_cache_entry_free(e);
+	}
+
+	for (e = c->stale; e; e = n) {
+		n = e->next;
+		xml_cache_entry_free(e);
+	}
+
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+/**
+ * Remove entry from list in order of use
+ *
+ * @param c - cache
+ * @param e - cache entry
+ */
+static void xml_cache_unlink(struct xml_cache *c, struct xml_cache_entry *e) {
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		c->first = e->next;
+	}
+
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		c->last = e->prev;
+	}
+
+	e->prev = e->next = NULL;
+}
+
+/**
+ * Make entry the most recently used one
+ *
+ * @param c - cache
+ * @param e - cache entry that isn't in the list
+ */
+static void xml_cache_push(struct xml_cache *c, struct xml_cache_entry *e) {
+	e->prev = NULL;
+	e->next = c->first;
+
+	if (c->first) {
+		c->first->prev = e;
+	} else {
+		c->last = e;
+	}
+
+	c->first = e;
+}
+
+/**
+ * Find entry for path
+ *
+ * @param c - cache
+ * @param path - file name
+ */
+static struct xml_cache_entry *xml_cache_find(
+		struct xml_cache *c,
+		const char *path) {
+	struct xml_cache_entry *e;
+
+	for (e = c->first; e; e = e->next) {
+		if (!strcmp(e->path, path)) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Drop entry from cache; keep it until it's released if it's still
+ * in use
+ *
+ * @param c - cache
+ * @param e - cache entry
+ */
+static void xml_cache_drop(struct xml_cache *c, struct xml_cache_entry *e) {
+	xml_cache_unlink(c, e);
+
+	if (e->refs > 0) {
+		e->stale = 1;
+		e->next = c->stale;
+
+		if (c->stale) {
+			c->stale->prev = e;
+		}
+
+		c->stale = e;
+
+		return;
+	}
+
+	c->size -= e->block_size;
+	xml_cache_entry_free(e);
+}
+
+/**
+ * Evict least recently used entries that aren't in use until all
+ * trees fit into the limit
+ *
+ * @param c - cache
+ */
+static void xml_cache_evict(struct xml_cache *c) {
+	struct xml_cache_entry *e, *p;
+
+	for (e = c->last; e && c->size > c->limit; e = p) {
+		p = e->prev;
+
+		if (!e->refs) {
+			xml_cache_drop(c, e);
+		}
+	}
+}
+
+/**
+ * Return a new reference to entry and mark it used
+ *
+ * @param c - cache
+ * @param e - cache entry
+ * @param sb - current status of file
+ */
+static struct xml_element *xml_cache_hit(
+		struct xml_cache *c,
+		struct xml_cache_entry *e,
+		struct stat *sb) {
+	e->mtime = sb->st_mtim;
+	++e->refs;
+	++c->hits;
+
+	xml_cache_unlink(c, e);
+	xml_cache_push(c, e);
+
+	return e->root;
+}
+
+/**
+ * Return non-zero if file is still the one entry was made from
+ *
+ * @param e - cache entry
+ * @param sb - current status of file
+ */
+static int xml_cache_unchanged(struct xml_cache_entry *e, struct stat *sb) {
+	return e->dev == sb->st_dev &&
+		e->ino == sb->st_ino &&
+		e->size == sb->st_size &&
+		e->mtime.tv_sec == sb->st_mtim.tv_sec &&
+		e->mtime.tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+/**
+ * Read whole file
+ *
+ * @param fd - file descriptor
+ * @param size - size of file
+ */
+static char *xml_cache_read(int fd, size_t size) {
+	char *data = malloc(size ? size : 1);
+	size_t off = 0;
+
+	if (!data) {
+		return NULL;
+	}
+
+	while (off < size) {
+		ssize_t bytes = read(fd, data + off, size - off);
+
+		if (bytes <= 0) {
+			free(data);
+			return NULL;
+		}
+
+		off += bytes;
+	}
+
+	return data;
+}
+
+/**
+ * Parse document into a memory block of exactly the size it needs, so
+ * blocks count against the limit with what they really take
+ *
+ * @param e - cache entry that receives block and tree
+ * @param data - XML data
+ * @param len - length of XML data
+ */
+static int xml_cache_parse(
+		struct xml_cache_entry *e,
+		const char *data,
+		size_t len) {
+	size_t cap = xml_parse_size(data, len);
+
+	if (!cap || !(e->block = malloc(cap))) {
+		return -1;
+	}
+
+	if (!(e->root = xml_parse_into(e->block, cap, data, len, NULL))) {
+		free(e->block);
+		e->block = NULL;
+		return -1;
+	}
+
+	e->block_size = cap;
+
+	return 0;
+}
+
+/**
+ * Return tree of file and take a reference to it
+ *
+ * @param c - cache
+ * @param path - file name
+ */
+struct xml_element *xml_cache_load(struct xml_cache *c, const char *path) {
+	struct xml_cache_entry *e;
+	struct xml_cache_entry *n;
+	struct xml_element *root;
+	struct stat sb;
+	uint64_t hash;
+	char *data;
+	int fd;
+
+	if (!c || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &sb)) {
+		close(fd);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&c->lock);
+
+	if ((e = xml_cache_find(c, path)) && xml_cache_unchanged(e, &sb)) {
+		root = xml_cache_hit(c, e, &sb);
+		pthread_mutex_unlock(&c->lock);
+		close(fd);
+
+		return root;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	/* read and parse without holding the lock */
+	data = xml_cache_read(fd, sb.st_size);
+	close(fd);
+
+	if (!data) {
+		return NULL;
+	}
+
+	hash = xml_cache_hash(data, sb.st_size);
+
+	pthread_mutex_lock(&c->lock);
+
+	/* the file was only touched or someone else parsed it meanwhile */
+	if ((e = xml_cache_find(c, path)) && e->hash == hash &&
+			e->size == sb.st_size) {
+		e->dev = sb.st_dev;
+		e->ino = sb.st_ino;
+		root = xml_cache_hit(c, e, &sb);
+		pthread_mutex_unlock(&c->lock);
+		free(data);
+
+		return root;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	if (!(n = calloc(1, sizeof(*n))) ||
+			!(n->path = strdup(path)) ||
+			xml_cache_parse(n, data, sb.st_size)) {
+		free(data);
+
+		if (n) {
+			xml_cache_entry_free(n);
+		}
+
+		return NULL;
+	}
+
+	free(data);
+
+	n->dev = sb.st_dev;
+	n->ino = sb.st_ino;
+	n->size = sb.st_size;
+	n->mtime = sb.st_mtim;
+	n->hash = hash;
+	n->refs = 1;
+
+	pthread_mutex_lock(&c->lock);
+
+	if ((e = xml_cache_find(c, path))) {
+		xml_cache_drop(c, e);
+	}
+
+	xml_cache_push(c, n);
+	c->size += n->block_size;
+	++c->misses;
+	xml_cache_evict(c);
+
+	pthread_mutex_unlock(&c->lock);
+
+	return n->root;
+}
+
+/**
+ * Give back a reference taken by xml_cache_load()
+ *
+ * @param c - cache
+ * @param root - root element returned by xml_cache_load()
+ */
+void xml_cache_release(struct xml_cache *c, struct xml_element *root) {
+	struct xml_cache_entry *e;
+
+	if (!c || !root) {
+		return;
+	}
+
+	pthread_mutex_lock(&c->lock);
+
+	for (e = c->first; e && e->root != root; e = e->next);
+
+	if (!e) {
+		for (e = c->stale; e && e->root != root; e = e->next);
+	}
+
+	if (e && e->refs > 0 && !--e->refs) {
+		if (e->stale) {
+			if (e->prev) {
+				e->prev->next = e->next;
+			} else {
+				c->stale = e->next;
+			}
+
+			if (e->next) {
+				e->next->prev = e->prev;
+			}
+
+			c->size -= e->block_size;
+			xml_cache_entry_free(e);
+		} else {
+			xml_cache_evict(c);
+		}
+	}
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Return number of loads that found a tree, number of loads that
+ * parsed a file and bytes taken by trees
+ *
+ * @param c - cache
+ * @param hits - receives number of hits, may be NULL
+ * @param misses - receives number of misses, may be NULL
+ * @param size - receives bytes taken by trees, may be NULL
+ */
+void xml_cache_stats(
+		struct xml_cache *c,
+		size_t *hits,
+		size_t *misses,
+		size_t *size) {
+	pthread_mutex_lock(&c->lock);
+
+	if (hits) {
+		*hits = c->hits;
+	}
+
+	if (misses) {
+		*misses = c->misses;
+	}
+
+	if (size) {
+		*size = c->size;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+}
+#endif
@@ -0,0 +1,41 @@
+#ifndef _xml_cache_h_
+#define _xml_cache_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Cache of parsed documents for files that are loaded over and over.
+ *
+ * xml_cache_load() returns the tree of a file and a reference to it
+ * that must be given back with xml_cache_release():
+ *
+ *	struct xml_cache *cache = xml_cache_create(64 << 20);
+ *	struct xml_element *root = xml_cache_load(cache, "conf.xml");
+ *
+ *	... xml_find(root, path) ...
+ *	xml_cache_release(cache, root);
+ *
+ * A tree is reused as long as path, modification time and size of the
+ * file are the same. If only the modification time changed, the file
+ * is read and hashed and the tree is still reused if the content is
+ * the same. Otherwise the file is parsed again; trees that are still
+ * referenced stay valid until released.
+ *
+ * Trees are shared between all callers, from any thread, and must not
+ * be modified. Each tree is parsed into a single block of exactly the
+ * size it needs with xml_parse_into(). Trees that aren't referenced
+ * are evicted in least recently used order when the blocks of all
+ * trees, referenced or not, add up to more than the given limit. */
+
+struct xml_cache;
+
+struct xml_cache *xml_cache_create(size_t);
+void xml_cache_free(struct xml_cache *);
+
+struct xml_element *xml_cache_load(struct xml_cache *, const char *);
+void xml_cache_release(struct xml_cache *, struct xml_element *);
+
+void xml_cache_stats(struct xml_cache *, size_t *, size_t *, size_t *);
+
+#endif
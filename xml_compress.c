@@ -0,0 +1,566 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_compress.h"
+
+#if defined(__GNUC__)
+#define XML_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define XML_THREAD_LOCAL __declspec(thread)
+#else
+#define XML_THREAD_LOCAL
+#endif
+
+/* number of decompressed values kept per thread */
+#define XML_VALUE_CACHE 8
+
+#define XML_LZ_MIN_MATCH 4
+#define XML_LZ_MAX_OFFSET 65535
+#define XML_LZ_HASH_BITS 12
+
+/* the last bytes are always literals so matches never reach the end */
+#define XML_LZ_LAST_LITERALS 5
+
+/* entries are keyed by the compressed value and keep a copy of it
+ * in front of the decompressed string, so an entry can't be mistaken
+ * for a different value that was later allocated at the same address,
+ * however the old tree was released */
+struct xml_value_cache_entry {
+	const char *value;
+	size_t length;
+	char *buf;
+	size_t size;
+	unsigned long used;
+};
+
+static XML_THREAD_LOCAL struct xml_value_cache_entry
+	xml_value_cache[XML_VALUE_CACHE];
+static XML_THREAD_LOCAL unsigned long xml_value_clock;
+
+/*****************************************************************************
+ * BLOCK CODEC
+ ****************************************************************************/
+
+/**
+ * Read 32 bits in native byte order
+ *
+ * @param p - memory
+ */
+static unsigned long xml_lz_read32(const unsigned char *p) {
+	unsigned int v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+/**
+ * Write length continuation bytes; returns new output position or 0
+ * if it doesn't fit
+ *
+ * @param d - output buffer
+ * @param op - output position
+ * @param cap - size of output buffer
+ * @param l - remaining length
+ */
+static size_t xml_lz_write_length(
+		unsigned char *d,
+		size_t op,
+		size_t cap,
+		size_t l) {
+	for (; l >= 255; l -= 255) {
+		if (op >= cap) {
+			return 0;
+		}
+
+		d[op++] = 255;
+	}
+
+	if (op >= cap) {
+		return 0;
+	}
+
+	d[op++] = l;
+
+	return op;
+}
+
+/**
+ * Write a sequence of literals and an optional match; returns new
+ * output position or 0 if it doesn't fit
+ *
+ * @param d - output buffer
+ * @param op - output position
+ * @param cap - size of output buffer
+ * @param lit - literals
+ * @param lit_len - number of literals
+ * @param offset - distance of match, 0 for none
+ * @param match_len - length of match
+ */
+static size_t xml_lz_sequence(
+		unsigned char *d,
+		size_t op,
+		size_t cap,
+		const unsigned char *lit,
+		size_t lit_len,
+		size_t offset,
+		size_t match_len) {
+	size_t m = offset ? match_len - XML_LZ_MIN_MATCH : 0;
+
+	if (op >= cap) {
+		return 0;
+	}
+
+	d[op++] = (lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15);
+
+	if (lit_len >= 15 && !(op = xml_lz_write_length(d, op, cap, lit_len - 15))) {
+		return 0;
+	}
+
+	if (op + lit_len > cap) {
+		return 0;
+	}
+
+	memcpy(d + op, lit, lit_len);
+	op += lit_len;
+
+	if (!offset) {
+		return op;
+	}
+
+	if (op + 2 > cap) {
+		return 0;
+	}
+
+	d[op++] = offset & 0xff;
+	d[op++] = offset >> 8;
+
+	if (m >= 15 && !(op = xml_lz_write_length(d, op, cap, m - 15))) {
+		return 0;
+	}
+
+	return op;
+}
+
+/**
+ * Compress block; returns compressed size or 0 if it doesn't fit
+ *
+ * @param s - source
+ * @param n - size of source
+ * @param d - destination
+ * @param cap - size of destination
+ */
+static size_t xml_lz_compress(
+		const unsigned char *s,
+		size_t n,
+		unsigned char *d,
+		size_t cap) {
+	size_t table[1 << XML_LZ_HASH_BITS];
+	size_t ip = 0;
+	size_t anchor = 0;
+	size_t op = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (n > XML_LZ_LAST_LITERALS + XML_LZ_MIN_MATCH &&
+			ip + XML_LZ_MIN_MATCH <= n - XML_LZ_LAST_LITERALS) {
+		unsigned long seq = xml_lz_read32(s + ip);
+		size_t h = ((seq * 2654435761u) & 0xffffffff) >>
+			(32 - XML_LZ_HASH_BITS);
+		size_t ref = table[h];
+		size_t len;
+
+		table[h] = ip;
+
+		if (ref >= ip ||
+				ip - ref > XML_LZ_MAX_OFFSET ||
+				xml_lz_read32(s + ref) != seq) {
+			++ip;
+			continue;
+		}
+
+		for (len = XML_LZ_MIN_MATCH;
+				ip + len < n - XML_LZ_LAST_LITERALS &&
+					s[ref + len] == s[ip + len];
+				++len);
+
+		if (!(op = xml_lz_sequence(
+				d,
+				op,
+				cap,
+				s + anchor,
+				ip - anchor,
+				ip - ref,
+				len))) {
+			return 0;
+		}
+
+		ip += len;
+		anchor = ip;
+	}
+
+	return xml_lz_sequence(d, op, cap, s + anchor, n - anchor, 0, 0);
+}
+
+/**
+ * Read length continuation bytes; returns -1 on truncated input
+ *
+ * @param s - input
+ * @param ip - address of input position
+ * @param n - size of input
+ * @param l - address of length to add to
+ */
+static int xml_lz_read_length(
+		const unsigned char *s,
+		size_t *ip,
+		size_t n,
+		size_t *l) {
+	unsigned char b;
+
+	do {
+		if (*ip >= n) {
+			return -1;
+		}
+
+		b = s[(*ip)++];
+		*l += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/**
+ * Decompress block of known uncompressed size
+ *
+ * @param s - compressed data
+ * @param n - size of compressed data
+ * @param d - destination
+ * @param size - uncompressed size
+ */
+static int xml_lz_decompress(
+		const unsigned char *s,
+		size_t n,
+		unsigned char *d,
+		size_t size) {
+	size_t ip = 0;
+	size_t op = 0;
+
+	while (ip < n) {
+		unsigned char token = s[ip++];
+		size_t lit_len = token >> 4;
+		size_t match_len = token & 15;
+		size_t offset;
+
+		if ((lit_len == 15 && xml_lz_read_length(s, &ip, n, &lit_len)) ||
+				lit_len > n - ip ||
+				lit_len > size - op) {
+			return -1;
+		}
+
+		memcpy(d + op, s + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* last sequence has no match */
+		if (ip == n) {
+			break;
+		}
+
+		if (n - ip < 2) {
+			return -1;
+		}
+
+		offset = s[ip] | s[ip + 1] << 8;
+		ip += 2;
+
+		if ((match_len == 15 &&
+					xml_lz_read_length(s, &ip, n, &match_len))) {
+			return -1;
+		}
+
+		match_len += XML_LZ_MIN_MATCH;
+
+		if (!offset || offset > op || match_len > size - op) {
+			return -1;
+		}
+
+		/* matches may overlap their own output */
+		for (; match_len > 0; --match_len, ++op) {
+			d[op] = d[op - offset];
+		}
+	}
+
+	return op == size ? 0 : -1;
+}
+
+/*****************************************************************************
+ * COMPRESSED VALUES
+ ****************************************************************************/
+
+/**
+ * Write varint and return number of bytes
+ *
+ * @param d - destination
+ * @param v - value
+ */
+static size_t xml_compress_varint(unsigned char *d, size_t v) {
+	size_t l = 0;
+
+	for (; v > 0x7f; v >>= 7) {
+		d[l++] = (v & 0x7f) | 0x80;
+	}
+
+	d[l++] = v;
+
+	return l;
+}
+
+/**
+ * Read header of compressed value; returns pointer to compressed data
+ * or NULL if the header is malformed
+ *
+ * @param v - compressed value
+ * @param size - receives uncompressed size
+ * @param length - receives compressed size
+ */
+static const unsigned char *xml_compress_header(
+		const char *v,
+		size_t *size,
+		size_t *length) {
+	const unsigned char *p = (const unsigned char *) v + 1;
+	int i;
+
+	if (*v) {
+		return NULL;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		size_t *t = i ? length : size;
+		unsigned int shift = 0;
+
+		*t = 0;
+
+		do {
+			if (shift >= sizeof(size_t) * 8) {
+				return NULL;
+			}
+
+			*t |= (size_t) (*p & 0x7f) << shift;
+			shift += 7;
+		} while (*p++ & 0x80);
+	}
+
+	return p;
+}
+
+/**
+ * Replace character data by its compressed form if that's shorter;
+ * returns -1 only if memory can't be allocated
+ *
+ * @param a - allocator, may be NULL for malloc()
+ * @param e - element with character data
+ * @param threshold - minimum length of character data
+ */
+int xml_value_compress(
+		struct xml_allocator *a,
+		struct xml_element *e,
+		size_t threshold) {
+	unsigned char header[32];
+	unsigned char *buf;
+	size_t n;
+	size_t h;
+	size_t l;
+	char *v;
+
+	if (!e->value || !*e->value || (n = strlen(e->value)) < threshold) {
+		return 0;
+	}
+
+	if (!(buf = malloc(n))) {
+		return -1;
+	}
+
+	if (!(l = xml_lz_compress((unsigned char *) e->value, n, buf, n))) {
+		free(buf);
+		return 0;
+	}
+
+	*header = 0;
+	h = 1 + xml_compress_varint(header + 1, n);
+	h += xml_compress_varint(header + h, l);
+
+	/* keep values that don't get shorter */
+	if (h + l >= n + 1) {
+		free(buf);
+		return 0;
+	}
+
+	if (!(v = xml_alloc(a, h + l))) {
+		free(buf);
+		return -1;
+	}
+
+	memcpy(v, header, h);
+	memcpy(v + h, buf, l);
+	free(buf);
+
+	xml_release(a, e->value);
+	e->value = v;
+	e->compressed = 1;
+
+	return 0;
+}
+
+/**
+ * Return length of character data
+ *
+ * @param e - element with character data
+ */
+size_t xml_value_length(struct xml_element *e) {
+	size_t size;
+	size_t length;
+
+	if (!XML_COMPRESSED(e)) {
+		return strlen(e->value);
+	}
+
+	if (!xml_compress_header(e->value, &size, &length)) {
+		return 0;
+	}
+
+	return size;
+}
+
+/**
+ * Copy character data into a buffer of at least xml_value_length()
+ * bytes without terminating it
+ *
+ * @param e - element with character data
+ * @param d - destination
+ */
+int xml_value_copy(struct xml_element *e, char *d) {
+	const unsigned char *p;
+	size_t size;
+	size_t length;
+
+	if (!XML_COMPRESSED(e)) {
+		memcpy(d, e->value, strlen(e->value));
+		return 0;
+	}
+
+	if (!(p = xml_compress_header(e->value, &size, &length))) {
+		return -1;
+	}
+
+	return xml_lz_decompress(p, length, (unsigned char *) d, size);
+}
+
+/**
+ * Return character data of element, decompressed if necessary
+ *
+ * @param e - element
+ */
+const char *xml_value(struct xml_element *e) {
+	struct xml_value_cache_entry *c = xml_value_cache;
+	const unsigned char *p;
+	size_t size;
+	size_t length;
+	size_t n;
+	int i;
+
+	if (!e || !XML_COMPRESSED(e)) {
+		return e ? e->value : NULL;
+	}
+
+	/* n is the length of the compressed value including its header */
+	if (!(p = xml_compress_header(e->value, &size, &length))) {
+		return NULL;
+	}
+	n = p - (const unsigned char *) e->value + length;
+
+	/* find value or the least recently used entry */
+	for (i = 0; i < XML_VALUE_CACHE; ++i) {
+		struct xml_value_cache_entry *v = &xml_value_cache[i];
+
+		if (v->value == e->value &&
+				v->length == n &&
+				!memcmp(v->buf, e->value, n)) {
+			v->used = ++xml_value_clock;
+			return v->buf + n;
+		}
+
+		if (v->used < c->used) {
+			c = v;
+		}
+	}
+
+	c->value = NULL;
+
+	if (n + size + 1 > c->size) {
+		char *buf;
+
+		if (!(buf = realloc(c->buf, n + size + 1))) {
+			return NULL;
+		}
+
+		c->buf = buf;
+		c->size = n + size + 1;
+	}
+
+	if (xml_lz_decompress(p, length, (unsigned char *) c->buf + n, size)) {
+		return NULL;
+	}
+
+	memcpy(c->buf, e->value, n);
+	c->buf[n + size] = 0;
+	c->value = e->value;
+	c->length = n;
+	c->used = ++xml_value_clock;
+
+	return c->buf + n;
+}
+
+/*****************************************************************************
+ * PUBLIC INTERFACE
+ ****************************************************************************/
+
+/**
+ * Compress all character data of a tree built with malloc() that is
+ * at least threshold bytes long
+ *
+ * @param e - root element
+ * @param threshold - minimum length of character data
+ */
+int xml_compress(struct xml_element *e, size_t threshold) {
+	struct xml_element *c;
+
+	if (!e) {
+		return -1;
+	}
+
+	if (e->value && !XML_COMPRESSED(e)) {
+		return xml_value_compress(NULL, e, threshold);
+	}
+
+	for (c = e->first_child; c; c = c->next) {
+		if (xml_compress(c, threshold)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Free decompressed values cached by the calling thread
+ */
+void xml_compress_cache_free(void) {
+	int i;
+
+	for (i = 0; i < XML_VALUE_CACHE; ++i) {
+		free(xml_value_cache[i].buf);
+		memset(&xml_value_cache[i], 0, sizeof(struct xml_value_cache_entry));
+	}
+}
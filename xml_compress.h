@@ -0,0 +1,33 @@
+#ifndef _xml_compress_h_
+#define _xml_compress_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Compressed character data.
+ *
+ * Character data longer than a threshold can be kept compressed with
+ * a small LZ77 block codec in the style of LZ4, either while parsing
+ * by setting "compress" in xml_state or afterwards with xml_compress():
+ *
+ *	struct xml_state st;
+ *
+ *	memset(&st, 0, sizeof(st));
+ *	st.compress = 256;
+ *	... xml_parse_chunk(&st, chunk) ...
+ *
+ * Elements with compressed values have "compressed" set; the values
+ * start with a null byte, so code that reads e->value directly sees
+ * an empty string. Use xml_value() instead;
+ * xml_content() decompresses on its own. xml_value() keeps the last
+ * few decompressed values in a per-thread cache; its result stays
+ * valid until that many other compressed values have been accessed
+ * from the same thread or the element is freed. Threads that called
+ * xml_value() should call xml_compress_cache_free() before they
+ * exit. */
+
+int xml_compress(struct xml_element *, size_t);
+void xml_compress_cache_free(void);
+
+#endif
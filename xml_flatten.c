@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "xml.h"
+#include "xml_flatten.h"
+
+#define WHITESPACE " \t\r\n"
+
+#define CDATA_OPEN "![CDATA["
+#define CDATA_CLOSE "]]"
+
+struct xml_flatten {
+	int (*fn)(const char *, size_t, const char *, size_t, void *);
+	void *user;
+
+	/* path of current element */
+	char *path;
+	size_t len;
+	size_t size;
+
+	/* non-zero return value of callback */
+	int stopped;
+};
+
+/**
+ * Append to path
+ *
+ * @param f - flattener
+ * @param sep - separator, 0 for none
+ * @param s - text
+ * @param len - length of text
+ */
+static int xml_flatten_push(
+		struct xml_flatten *f,
+		char sep,
+		const char *s,
+		size_t len) {
+	size_t need = f->len + len + 2;
+
+	if (need > f->size) {
+		size_t size = f->size ? f->size : 256;
+		char *p;
+
+		while (size < need) {
+			size <<= 1;
+		}
+
+		if (!(p = realloc(f->path, size))) {
+			return -1;
+		}
+
+		f->path = p;
+		f->size = size;
+	}
+
+	if (sep) {
+		f->path[f->len++] = sep;
+	}
+
+	memcpy(f->path + f->len, s, len);
+	f->len += len;
+	f->path[f->len] = 0;
+
+	return 0;
+}
+
+/**
+ * Remove last element name from path
+ *
+ * @param f - flattener
+ */
+static void xml_flatten_pop(struct xml_flatten *f) {
+	while (f->len > 0 && f->path[--f->len] != '/');
+
+	f->path[f->len] = 0;
+}
+
+/**
+ * Pass row to callback
+ *
+ * @param f - flattener
+ * @param value - value
+ * @param len - length of value
+ */
+static int xml_flatten_emit(
+		struct xml_flatten *f,
+		const char *value,
+		size_t len) {
+	if (!f->stopped) {
+		f->stopped = f->fn(f->path ? f->path : "", f->len, value, len,
+			f->user);
+	}
+
+	return f->stopped ? -1 : 0;
+}
+
+/**
+ * Enter element and pass its attributes
+ *
+ * @param f - flattener
+ * @param e - element
+ */
+static int xml_flatten_enter(struct xml_flatten *f, struct xml_element *e) {
+	struct xml_attribute *a;
+
+	if (xml_flatten_push(f, f->len ? '/' : 0, e->key, strlen(e->key))) {
+		return -1;
+	}
+
+	for (a = e->first_attribute; a; a = a->next) {
+		size_t len = f->len;
+
+		if (xml_flatten_push(f, '@', a->key, strlen(a->key)) ||
+				xml_flatten_emit(f, a->value, strlen(a->value))) {
+			return -1;
+		}
+
+		f->len = len;
+		f->path[len] = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Pass character data, CDATA sections included, and return true if
+ * element is a tag element to enter
+ *
+ * @param f - flattener
+ * @param e - element
+ */
+static int xml_flatten_text(struct xml_flatten *f, struct xml_element *e) {
+	const char *s;
+
+	if (e->key) {
+		size_t len = strlen(e->key);
+
+		if (*e->key != '!' && *e->key != '?') {
+			return 1;
+		}
+
+		if (!strncmp(e->key, CDATA_OPEN, sizeof(CDATA_OPEN) - 1) &&
+				len >= sizeof(CDATA_OPEN) + sizeof(CDATA_CLOSE) - 2) {
+			return xml_flatten_emit(f,
+				e->key + sizeof(CDATA_OPEN) - 1,
+				len - sizeof(CDATA_OPEN) - sizeof(CDATA_CLOSE) + 2);
+		}
+
+		return 0;
+	}
+
+	if (!e->value || !(s = xml_value(e)) || !s[strspn(s, WHITESPACE)]) {
+		return 0;
+	}
+
+	return xml_flatten_emit(f, s, strlen(s));
+}
+
+/**
+ * Flatten element and its descendants
+ *
+ * @param f - flattener
+ * @param e - element
+ */
+static int xml_flatten_element(struct xml_flatten *f, struct xml_element *e) {
+	struct xml_element *c;
+	int r;
+
+	if ((r = xml_flatten_text(f, e)) < 1) {
+		return r;
+	}
+
+	if (xml_flatten_enter(f, e)) {
+		return -1;
+	}
+
+	for (c = e->first_child; c; c = c->next) {
+		if (xml_flatten_element(f, c)) {
+			return -1;
+		}
+	}
+
+	xml_flatten_pop(f);
+
+	return 0;
+}
+
+/**
+ * Enter element while parsing
+ *
+ * @param st - parser state
+ * @param e - element
+ */
+static int xml_flatten_open(struct xml_state *st, struct xml_element *e) {
+	return xml_flatten_enter(st->user, e);
+}
+
+/**
+ * Pass character data or leave element while parsing, then drop it
+ *
+ * @param st - parser state
+ * @param e - element
+ */
+static int xml_flatten_close(struct xml_state *st, struct xml_element *e) {
+	struct xml_flatten *f = st->user;
+	struct xml_element *p = e->parent;
+	int r;
+
+	if ((r = xml_flatten_text(f, e)) < 0) {
+		return -1;
+	}
+
+	/* only tag elements have been entered */
+	if (r) {
+		xml_flatten_pop(f);
+	}
+
+	if (p) {
+		/* all previous siblings have already been dropped */
+		p->first_child = p->last_child = NULL;
+		e->parent = NULL;
+		xml_free(e);
+	}
+
+	return 0;
+}
+
+/**
+ * Create flattener
+ *
+ * @param fn - callback for rows with path, length of path, value and
+ *             length of value; a non-zero return value stops
+ * @param user - user data for callback
+ */
+struct xml_flatten *xml_flatten_create(
+		int (*fn)(const char *, size_t, const char *, size_t, void *),
+		void *user) {
+	struct xml_flatten *f;
+
+	if (!fn || !(f = calloc(1, sizeof(*f)))) {
+		return NULL;
+	}
+
+	f->fn = fn;
+	f->user = user;
+
+	return f;
+}
+
+/**
+ * Free flattener
+ *
+ * @param f - flattener
+ */
+void xml_flatten_free(struct xml_flatten *f) {
+	if (!f) {
+		return;
+	}
+
+	free(f->path);
+	free(f);
+}
+
+/**
+ * Flatten tree; paths start with the name of the given element unless
+ * it's a root element without name; returns the non-zero return value
+ * of the callback if it stopped and -1 if memory ran out
+ *
+ * @param f - flattener
+ * @param e - element
+ */
+int xml_flatten_tree(struct xml_flatten *f, struct xml_element *e) {
+	struct xml_element *c;
+	int r = 0;
+
+	if (!f || !e) {
+		return -1;
+	}
+
+	f->len = 0;
+	f->stopped = 0;
+
+	if (e->key || e->value) {
+		r = xml_flatten_element(f, e);
+	} else {
+		for (c = e->first_child; c && !r; c = c->next) {
+			r = xml_flatten_element(f, c);
+		}
+	}
+
+	return f->stopped ? f->stopped : r;
+}
+
+/**
+ * Flatten the document parsed with the given state; parsing fails if
+ * the callback stops
+ *
+ * @param f - flattener
+ * @param st - parser state, "open", "close" and "user" are replaced
+ */
+void xml_flatten_attach(struct xml_flatten *f, struct xml_state *st) {
+	f->len = 0;
+	f->stopped = 0;
+
+	st->open = xml_flatten_open;
+	st->close = xml_flatten_close;
+	st->user = f;
+}
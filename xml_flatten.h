@@ -0,0 +1,52 @@
+#ifndef _xml_flatten_h_
+#define _xml_flatten_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Flattening into (path, value) rows.
+ *
+ * Every attribute and every run of character data that isn't just
+ * white space becomes a row. Paths are element names joined by '/',
+ * with "@name" appended for attributes:
+ *
+ *	<hello><world name="Earth">Hi</world></hello>
+ *
+ *	hello/world@name = Earth
+ *	hello/world = Hi
+ *
+ * Rows are passed to a callback in document order. Path and value are
+ * views with a length; the path is also null-terminated but only valid
+ * during the call. The path is kept in one buffer that grows and
+ * shrinks as elements are entered and left, so no row allocates
+ * memory. A non-zero return value of the callback stops flattening.
+ *
+ * A flattener works on trees and on documents while they're parsed:
+ *
+ *	struct xml_flatten *f = xml_flatten_create(row, user);
+ *
+ *	xml_flatten_tree(f, root);
+ *
+ *	memset(&st, 0, sizeof(st));
+ *	xml_flatten_attach(f, &st);
+ *	... xml_parse_chunk(&st, chunk) ...
+ *	xml_free(st.root);
+ *
+ * xml_flatten_attach() takes over the "open", "close" and "user" fields
+ * of the parser state and frees elements as soon as they are closed.
+ * Values are raw like in the tree. The content of CDATA sections is
+ * character data too; comments, processing instructions and document
+ * type declarations are left out. */
+
+struct xml_flatten;
+
+struct xml_flatten *xml_flatten_create(
+	int (*)(const char *, size_t, const char *, size_t, void *),
+	void *);
+void xml_flatten_free(struct xml_flatten *);
+
+int xml_flatten_tree(struct xml_flatten *, struct xml_element *);
+void xml_flatten_attach(struct xml_flatten *, struct xml_state *);
+
+#endif
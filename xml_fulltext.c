@@ -0,0 +1,682 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_fulltext.h"
+
+struct xml_fulltext_term {
+	/* lower case term */
+	char *s;
+	size_t length;
+
+	/* varint deltas of positions */
+	unsigned char *data;
+	size_t data_length;
+	size_t data_size;
+
+	/* last position and number of positions */
+	size_t last;
+	size_t count;
+};
+
+struct xml_fulltext_segment {
+	/* first position of text segment */
+	size_t start;
+
+	/* index of element that contains the segment */
+	size_t owner;
+};
+
+struct xml_fulltext {
+	struct xml_fulltext_term *terms;
+	size_t term_count;
+	size_t term_size;
+
+	/* hash of terms ignoring case */
+	struct xml_table table;
+
+	/* text segments in order of position */
+	struct xml_fulltext_segment *segments;
+	size_t segment_count;
+	size_t segment_size;
+
+	/* elements with character data */
+	struct xml_element **owners;
+	size_t owner_count;
+	size_t owner_size;
+
+	/* next free position */
+	size_t position;
+};
+
+/* a list of positions or owners */
+struct xml_fulltext_list {
+	size_t *items;
+	size_t count;
+};
+
+/*****************************************************************************
+ * TERMS
+ ****************************************************************************/
+
+/**
+ * Return true if byte is part of a term
+ *
+ * @param c - byte
+ */
+static int xml_fulltext_word(unsigned char c) {
+	return isalnum(c) || c >= 0x80;
+}
+
+/**
+ * Return term or NULL; probe is left at a free slot if the term isn't
+ * there
+ *
+ * @param ft - index
+ * @param s - term
+ * @param l - length of term
+ * @param hash - hash of term ignoring case
+ * @param probe - receives probe for xml_table_set()
+ */
+static struct xml_fulltext_term *xml_fulltext_find(
+		struct xml_fulltext *ft,
+		const char *s,
+		size_t l,
+		size_t hash,
+		size_t *probe) {
+	size_t n;
+
+	*probe = 0;
+
+	while ((n = xml_table_next(&ft->table, hash, probe))) {
+		struct xml_fulltext_term *t = &ft->terms[n - 1];
+		size_t j;
+
+		if (t->length != l) {
+			continue;
+		}
+
+		for (j = 0; j < l &&
+				t->s[j] == tolower((unsigned char) s[j]); ++j);
+
+		if (j == l) {
+			return t;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Return term, add it if it isn't there yet
+ *
+ * @param ft - index
+ * @param s - term
+ * @param l - length of term
+ */
+static struct xml_fulltext_term *xml_fulltext_term(
+		struct xml_fulltext *ft,
+		const char *s,
+		size_t l) {
+	struct xml_fulltext_term *t;
+	size_t hash = xml_hash_case(s, l);
+	size_t probe;
+	size_t i;
+
+	if (xml_table_reserve(&ft->table, ft->term_count + 1)) {
+		return NULL;
+	}
+
+	if ((t = xml_fulltext_find(ft, s, l, hash, &probe))) {
+		return t;
+	}
+
+	if (ft->term_count >= ft->term_size) {
+		size_t size = ft->term_size ? ft->term_size << 1 : 256;
+
+		if (!(t = realloc(
+				ft->terms,
+				size * sizeof(struct xml_fulltext_term)))) {
+			return NULL;
+		}
+
+		ft->terms = t;
+		ft->term_size = size;
+	}
+
+	t = &ft->terms[ft->term_count];
+	memset(t, 0, sizeof(struct xml_fulltext_term));
+
+	if (!(t->s = malloc(l + 1))) {
+		return NULL;
+	}
+
+	for (i = 0; i < l; ++i) {
+		t->s[i] = tolower((unsigned char) s[i]);
+	}
+
+	t->s[l] = 0;
+	t->length = l;
+	xml_table_set(&ft->table, hash, probe, ++ft->term_count);
+
+	return t;
+}
+
+/**
+ * Append position to posting list of term
+ *
+ * @param t - term
+ * @param position - word position
+ */
+static int xml_fulltext_post(struct xml_fulltext_term *t, size_t position) {
+	size_t v = position - t->last;
+
+	/* a varint of size_t takes at most 10 bytes */
+	if (t->data_length + 10 > t->data_size) {
+		size_t size = t->data_size ? t->data_size << 1 : 16;
+		unsigned char *n;
+
+		if (!(n = realloc(t->data, size))) {
+			return -1;
+		}
+
+		t->data = n;
+		t->data_size = size;
+	}
+
+	for (; v > 0x7f; v >>= 7) {
+		t->data[t->data_length++] = (v & 0x7f) | 0x80;
+	}
+
+	t->data[t->data_length++] = v;
+	t->last = position;
+	++t->count;
+
+	return 0;
+}
+
+/**
+ * Decode posting list of term
+ *
+ * @param t - term
+ * @param list - list to fill
+ */
+static int xml_fulltext_positions(
+		struct xml_fulltext_term *t,
+		struct xml_fulltext_list *list) {
+	const unsigned char *p = t->data;
+	size_t position = 0;
+	size_t i;
+
+	if (!(list->items = malloc((t->count + 1) * sizeof(size_t)))) {
+		return -1;
+	}
+
+	for (i = 0; i < t->count; ++i) {
+		size_t v = 0;
+		int shift = 0;
+
+		do {
+			v |= (size_t) (*p & 0x7f) << shift;
+			shift += 7;
+		} while (*p++ & 0x80);
+
+		position += v;
+		list->items[i] = position;
+	}
+
+	list->count = t->count;
+
+	return 0;
+}
+
+/*****************************************************************************
+ * INDEXING
+ ****************************************************************************/
+
+/**
+ * Add text segment and its terms
+ *
+ * @param ft - index
+ * @param s - character data
+ * @param owner - index of element that contains the segment
+ */
+static int xml_fulltext_segment(
+		struct xml_fulltext *ft,
+		const char *s,
+		size_t owner) {
+	struct xml_fulltext_segment *seg;
+
+	if (ft->segment_count >= ft->segment_size) {
+		size_t size = ft->segment_size ? ft->segment_size << 1 : 256;
+
+		if (!(seg = realloc(
+				ft->segments,
+				size * sizeof(struct xml_fulltext_segment)))) {
+			return -1;
+		}
+
+		ft->segments = seg;
+		ft->segment_size = size;
+	}
+
+	seg = &ft->segments[ft->segment_count++];
+	seg->start = ft->position;
+	seg->owner = owner;
+
+	while (*s) {
+		struct xml_fulltext_term *t;
+		const char *e;
+
+		/* skip entity references */
+		if (*s == '&') {
+			for (++s; xml_fulltext_word(*s); ++s);
+
+			if (*s == ';') {
+				++s;
+			}
+
+			continue;
+		}
+
+		if (!xml_fulltext_word(*s)) {
+			++s;
+			continue;
+		}
+
+		for (e = s; xml_fulltext_word(*e); ++e);
+
+		if (!(t = xml_fulltext_term(ft, s, e - s)) ||
+				xml_fulltext_post(t, ft->position++)) {
+			return -1;
+		}
+
+		s = e;
+	}
+
+	/* leave a gap so phrases don't span segments */
+	++ft->position;
+
+	return 0;
+}
+
+/**
+ * Add element to list of owners
+ *
+ * @param ft - index
+ * @param e - element
+ */
+static long xml_fulltext_owner(
+		struct xml_fulltext *ft,
+		struct xml_element *e) {
+	if (ft->owner_count >= ft->owner_size) {
+		size_t size = ft->owner_size ? ft->owner_size << 1 : 256;
+		struct xml_element **n;
+
+		if (!(n = realloc(
+				ft->owners,
+				size * sizeof(struct xml_element *)))) {
+			return -1;
+		}
+
+		ft->owners = n;
+		ft->owner_size = size;
+	}
+
+	ft->owners[ft->owner_count] = e;
+
+	return ft->owner_count++;
+}
+
+/**
+ * Index character data of element and its children
+ *
+ * @param ft - index
+ * @param e - element
+ */
+static int xml_fulltext_element(
+		struct xml_fulltext *ft,
+		struct xml_element *e) {
+	struct xml_element *c;
+	long owner = -1;
+
+	for (c = e->first_child; c; c = c->next) {
+		if (c->value) {
+			const char *v = xml_value(c);
+
+			if (!v ||
+					(owner < 0 &&
+						(owner = xml_fulltext_owner(ft, e)) < 0) ||
+					xml_fulltext_segment(ft, v, owner)) {
+				return -1;
+			}
+		} else if (c->key && xml_fulltext_element(ft, c)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*****************************************************************************
+ * QUERIES
+ ****************************************************************************/
+
+/**
+ * Compare two size_t values for qsort()
+ *
+ * @param a - first value
+ * @param b - second value
+ */
+static int xml_fulltext_compare(const void *a, const void *b) {
+	size_t x = *(const size_t *) a;
+	size_t y = *(const size_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Return true if sorted list contains value
+ *
+ * @param list - sorted list
+ * @param v - value
+ */
+static int xml_fulltext_contains(struct xml_fulltext_list *list, size_t v) {
+	size_t lo = 0;
+	size_t hi = list->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (list->items[mid] < v) {
+			lo = mid + 1;
+		} else if (list->items[mid] > v) {
+			hi = mid;
+		} else {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Return index of the owner of a position
+ *
+ * @param ft - index
+ * @param position - word position
+ */
+static size_t xml_fulltext_owner_of(
+		struct xml_fulltext *ft,
+		size_t position) {
+	size_t lo = 0;
+	size_t hi = ft->segment_count;
+
+	/* find last segment that starts at or before position */
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ft->segments[mid].start <= position) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return ft->segments[lo].owner;
+}
+
+/**
+ * Find owners of a phrase
+ *
+ * @param ft - index
+ * @param q - first character of phrase
+ * @param end - end of phrase
+ * @param owners - receives sorted list of owners without duplicates
+ *
+ * Returns 1 if the phrase has no terms.
+ */
+static int xml_fulltext_phrase(
+		struct xml_fulltext *ft,
+		const char *q,
+		const char *end,
+		struct xml_fulltext_list *owners) {
+	struct xml_fulltext_list *lists = NULL;
+	size_t count = 0;
+	size_t i;
+	size_t n = 0;
+	int r = -1;
+
+	owners->items = NULL;
+	owners->count = 0;
+
+	while (q < end) {
+		struct xml_fulltext_list *l;
+		struct xml_fulltext_term *t;
+		const char *e;
+		size_t probe;
+
+		if (!xml_fulltext_word(*q)) {
+			++q;
+			continue;
+		}
+
+		for (e = q; e < end && xml_fulltext_word(*e); ++e);
+
+		if (!(l = realloc(
+				lists,
+				(count + 1) * sizeof(struct xml_fulltext_list)))) {
+			goto done;
+		}
+
+		lists = l;
+
+		/* a missing term matches nothing */
+		if (!(t = xml_fulltext_find(ft, q, e - q,
+				xml_hash_case(q, e - q), &probe))) {
+			r = 0;
+			goto done;
+		}
+
+		if (xml_fulltext_positions(t, &lists[count])) {
+			goto done;
+		}
+
+		++count;
+		q = e;
+	}
+
+	if (!count) {
+		r = 1;
+		goto done;
+	}
+
+	if (!(owners->items = malloc(lists[0].count * sizeof(size_t)))) {
+		goto done;
+	}
+
+	for (i = 0; i < lists[0].count; ++i) {
+		size_t p = lists[0].items[i];
+		size_t k;
+
+		for (k = 1; k < count &&
+				xml_fulltext_contains(&lists[k], p + k); ++k);
+
+		if (k == count) {
+			owners->items[n++] = xml_fulltext_owner_of(ft, p);
+		}
+	}
+
+	qsort(owners->items, n, sizeof(size_t), xml_fulltext_compare);
+
+	/* remove duplicates */
+	for (i = 0; i < n; ++i) {
+		if (!owners->count ||
+				owners->items[owners->count - 1] != owners->items[i]) {
+			owners->items[owners->count++] = owners->items[i];
+		}
+	}
+
+	r = 0;
+
+done:
+	for (i = 0; i < count; ++i) {
+		free(lists[i].items);
+	}
+
+	free(lists);
+
+	return r;
+}
+
+/**
+ * Keep only owners that are in both sorted lists
+ *
+ * @param a - list to reduce
+ * @param b - other list
+ */
+static void xml_fulltext_intersect(
+		struct xml_fulltext_list *a,
+		struct xml_fulltext_list *b) {
+	size_t i = 0;
+	size_t j = 0;
+	size_t n = 0;
+
+	while (i < a->count && j < b->count) {
+		if (a->items[i] < b->items[j]) {
+			++i;
+		} else if (a->items[i] > b->items[j]) {
+			++j;
+		} else {
+			a->items[n++] = a->items[i++];
+			++j;
+		}
+	}
+
+	a->count = n;
+}
+
+/*****************************************************************************
+ * PUBLIC INTERFACE
+ ****************************************************************************/
+
+/**
+ * Build full-text index of all character data below an element
+ *
+ * @param root - root element
+ */
+struct xml_fulltext *xml_fulltext_create(struct xml_element *root) {
+	struct xml_fulltext *ft;
+
+	if (!root || !(ft = calloc(1, sizeof(struct xml_fulltext)))) {
+		return NULL;
+	}
+
+	if (xml_fulltext_element(ft, root)) {
+		xml_fulltext_free(ft);
+		return NULL;
+	}
+
+	return ft;
+}
+
+/**
+ * Free full-text index
+ *
+ * @param ft - index
+ */
+void xml_fulltext_free(struct xml_fulltext *ft) {
+	size_t i;
+
+	if (!ft) {
+		return;
+	}
+
+	for (i = 0; i < ft->term_count; ++i) {
+		free(ft->terms[i].s);
+		free(ft->terms[i].data);
+	}
+
+	free(ft->terms);
+	xml_table_free(&ft->table);
+	free(ft->segments);
+	free(ft->owners);
+	free(ft);
+}
+
+/**
+ * Find elements whose character data contains all terms and quoted
+ * phrases of a query; returns the number of matching elements, which
+ * may be larger than max
+ *
+ * @param ft - index
+ * @param query - terms and "quoted phrases"
+ * @param results - array for matching elements, may be NULL
+ * @param max - size of array
+ */
+size_t xml_fulltext_search(
+		struct xml_fulltext *ft,
+		const char *query,
+		struct xml_element **results,
+		size_t max) {
+	struct xml_fulltext_list found = {NULL, 0};
+	int first = 1;
+	size_t i;
+
+	if (!ft || !query) {
+		return 0;
+	}
+
+	while (*query) {
+		struct xml_fulltext_list owners;
+		const char *end;
+		int r;
+
+		if (*query == '"') {
+			/* phrase until closing quote */
+			if (!(end = strchr(++query, '"'))) {
+				end = query + strlen(query);
+			}
+		} else if (xml_fulltext_word(*query)) {
+			for (end = query; xml_fulltext_word(*end); ++end);
+		} else {
+			++query;
+			continue;
+		}
+
+		r = xml_fulltext_phrase(ft, query, end, &owners);
+		query = *end ? end + 1 : end;
+
+		if (r < 0) {
+			free(found.items);
+			return 0;
+		}
+
+		/* ignore phrases without terms */
+		if (r > 0) {
+			continue;
+		}
+
+		if (first) {
+			found = owners;
+			first = 0;
+		} else {
+			xml_fulltext_intersect(&found, &owners);
+			free(owners.items);
+		}
+
+		if (!found.count) {
+			break;
+		}
+	}
+
+	for (i = 0; results && i < found.count && i < max; ++i) {
+		results[i] = ft->owners[found.items[i]];
+	}
+
+	free(found.items);
+
+	return found.count;
+}
@@ -0,0 +1,38 @@
+#ifndef _xml_fulltext_h_
+#define _xml_fulltext_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Full-text index over the character data of an element tree.
+ *
+ * Terms are runs of letters and digits (and all bytes >= 0x80 so UTF-8
+ * sequences stay intact) folded to lower case. Every term gets a
+ * posting list of word positions in document order, stored as varint
+ * deltas. Positions of different text segments never touch, so phrases
+ * don't span elements.
+ *
+ * A query is a list of terms and quoted phrases that must all occur in
+ * the character data of the same element:
+ *
+ *	struct xml_fulltext *ft = xml_fulltext_create(root);
+ *	struct xml_element *hits[16];
+ *	size_t n = xml_fulltext_search(ft, "bridge \"new york\"", hits, 16);
+ *
+ * xml_fulltext_search() returns the total number of matching elements
+ * in order of their first text segment and stores up to the given
+ * number of them. The tree must not change while the index is used. */
+
+struct xml_fulltext;
+
+struct xml_fulltext *xml_fulltext_create(struct xml_element *);
+void xml_fulltext_free(struct xml_fulltext *);
+
+size_t xml_fulltext_search(
+	struct xml_fulltext *,
+	const char *,
+	struct xml_element **,
+	size_t);
+
+#endif
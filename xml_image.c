@@ -0,0 +1,1056 @@
+#ifndef WIN32
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_image.h"
+
+#define XML_IMAGE_MAGIC "XMLI"
+#define XML_IMAGE_VERSION 1
+
+/* strings up to this length are stored only once */
+#define XML_IMAGE_SHARE_MAX 64
+
+struct xml_image {
+	char magic[4];
+	uint32_t version;
+
+	/* total size of image in bytes */
+	uint32_t size;
+
+	/* number of nodes and attributes */
+	uint32_t nodes;
+	uint32_t attributes;
+
+	/* offset of string section */
+	uint32_t strings;
+};
+
+/* all references are byte offsets from the beginning of the image,
+ * 0 means "none" */
+struct xml_image_node {
+	uint32_t key;
+	uint32_t value;
+	uint32_t parent;
+	uint32_t first_child;
+	uint32_t next;
+	uint32_t first_attribute;
+	uint32_t attribute_count;
+};
+
+struct xml_image_attribute {
+	uint32_t key;
+	uint32_t value;
+};
+
+struct xml_image_builder {
+	struct xml_image *image;
+	struct xml_image_node *nodes;
+	struct xml_image_attribute *attributes;
+	size_t node;
+	size_t attribute;
+
+	/* string section */
+	char *strings;
+	size_t strings_length;
+	size_t strings_size;
+
+	/* short strings by content, entries are their offset in the
+	 * section plus one */
+	struct xml_table table;
+	size_t shared;
+};
+
+#define NODE(img, off) ((const struct xml_image_node *) \
+	((const char *) (img) + (off)))
+#define TEXT(img, off) ((const char *) (img) + (off))
+#define STRING(img, off) ((off) ? TEXT(img, off) : NULL)
+
+/*****************************************************************************
+ * BUILDING
+ ****************************************************************************/
+
+/**
+ * Count nodes and attributes of a tree
+ *
+ * @param e - element
+ * @param nodes - address of node counter
+ * @param attributes - address of attribute counter
+ */
+static void xml_image_count(
+		struct xml_element *e,
+		size_t *nodes,
+		size_t *attributes) {
+	struct xml_attribute *a;
+
+	++*nodes;
+
+	for (a = e->first_attribute; a; a = a->next) {
+		++*attributes;
+	}
+
+	for (e = e->first_child; e; e = e->next) {
+		xml_image_count(e, nodes, attributes);
+	}
+}
+
+/**
+ * Add string to string section and return its offset relative to
+ * the section plus one or 0 on error
+ *
+ * @param b - builder
+ * @param s - string
+ */
+static size_t xml_image_string(struct xml_image_builder *b, const char *s) {
+	size_t l = strlen(s);
+	int share = l <= XML_IMAGE_SHARE_MAX;
+	size_t hash = 0;
+	size_t probe = 0;
+	size_t off;
+
+	if (share) {
+		size_t n;
+
+		if (xml_table_reserve(&b->table, b->shared + 1)) {
+			return 0;
+		}
+
+		hash = xml_hash(s, l);
+
+		while ((n = xml_table_next(&b->table, hash, &probe))) {
+			const char *c = b->strings + n - 1;
+
+			if (!strncmp(c, s, l) && !c[l]) {
+				return n;
+			}
+		}
+	}
+
+	if (b->strings_length + l + 1 > b->strings_size) {
+		size_t size = b->strings_size ? b->strings_size : 4096;
+		char *n;
+
+		while (size < b->strings_length + l + 1) {
+			size <<= 1;
+		}
+
+		if (!(n = realloc(b->strings, size))) {
+			return 0;
+		}
+
+		b->strings = n;
+		b->strings_size = size;
+	}
+
+	off = b->strings_length;
+	memcpy(b->strings + off, s, l + 1);
+	b->strings_length += l + 1;
+
+	if (share) {
+		xml_table_set(&b->table, hash, probe, off + 1);
+		++b->shared;
+	}
+
+	return off + 1;
+}
+
+/**
+ * Add element and all of its children in document order
+ *
+ * @param b - builder
+ * @param e - element
+ * @param parent - index of parent node plus one or 0
+ */
+static int xml_image_add(
+		struct xml_image_builder *b,
+		struct xml_element *e,
+		size_t parent) {
+	size_t index = b->node++;
+	struct xml_image_node *n = b->nodes + index;
+	struct xml_attribute *a;
+	const char *value = xml_value(e);
+	size_t prev = 0;
+
+	n->parent = parent;
+
+	if ((e->key && !(n->key = xml_image_string(b, e->key))) ||
+			(e->value &&
+				(!value || !(n->value = xml_image_string(b, value))))) {
+		return -1;
+	}
+
+	if (e->first_attribute) {
+		n->first_attribute = b->attribute + 1;
+	}
+
+	for (a = e->first_attribute; a; a = a->next) {
+		struct xml_image_attribute *ia = b->attributes + b->attribute++;
+
+		if (!(ia->key = xml_image_string(b, a->key ? a->key : "")) ||
+				(a->value &&
+					!(ia->value = xml_image_string(b, a->value)))) {
+			return -1;
+		}
+
+		++n->attribute_count;
+	}
+
+	for (e = e->first_child; e; e = e->next) {
+		size_t child = b->node;
+
+		if (prev) {
+			b->nodes[prev - 1].next = child + 1;
+		} else {
+			b->nodes[index].first_child = child + 1;
+		}
+
+		if (xml_image_add(b, e, index + 1)) {
+			return -1;
+		}
+
+		prev = child + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Translate relative references of the builder into image offsets
+ *
+ * @param b - builder
+ */
+static void xml_image_relocate(struct xml_image_builder *b) {
+	struct xml_image *img = b->image;
+	uint32_t nodes = sizeof(struct xml_image);
+	uint32_t attributes = nodes + img->nodes * sizeof(struct xml_image_node);
+	uint32_t strings = img->strings - 1;
+	size_t i;
+
+#define NODE_OFFSET(i) ((i) ? nodes + ((i) - 1) * \
+	(uint32_t) sizeof(struct xml_image_node) : 0)
+#define STRING_OFFSET(s) ((s) ? strings + (s) : 0)
+
+	for (i = 0; i < img->nodes; ++i) {
+		struct xml_image_node *n = b->nodes + i;
+
+		n->key = STRING_OFFSET(n->key);
+		n->value = STRING_OFFSET(n->value);
+		n->parent = NODE_OFFSET(n->parent);
+		n->first_child = NODE_OFFSET(n->first_child);
+		n->next = NODE_OFFSET(n->next);
+
+		if (n->first_attribute) {
+			n->first_attribute = attributes + (n->first_attribute - 1) *
+				sizeof(struct xml_image_attribute);
+		}
+	}
+
+	for (i = 0; i < img->attributes; ++i) {
+		struct xml_image_attribute *a = b->attributes + i;
+
+		a->key = STRING_OFFSET(a->key);
+		a->value = STRING_OFFSET(a->value);
+	}
+
+#undef NODE_OFFSET
+#undef STRING_OFFSET
+}
+
+/**
+ * Build image of element tree
+ * (the returned buffer must be free()'d after use)
+ *
+ * @param root - root element
+ * @param len - address of length of image
+ */
+void *xml_image_build(struct xml_element *root, size_t *len) {
+	struct xml_image_builder b;
+	size_t nodes = 0;
+	size_t attributes = 0;
+	size_t head;
+	size_t size;
+	char *image = NULL;
+
+	if (!root || !len) {
+		return NULL;
+	}
+
+	xml_image_count(root, &nodes, &attributes);
+
+	memset(&b, 0, sizeof(b));
+
+	head = sizeof(struct xml_image) +
+		nodes * sizeof(struct xml_image_node) +
+		attributes * sizeof(struct xml_image_attribute);
+
+	if (!(b.nodes = calloc(nodes, sizeof(struct xml_image_node))) ||
+			(attributes && !(b.attributes = calloc(
+				attributes,
+				sizeof(struct xml_image_attribute)))) ||
+			xml_image_add(&b, root, 0) ||
+			(size = head + b.strings_length) > UINT32_MAX ||
+			!(image = malloc(size))) {
+		free(b.nodes);
+		free(b.attributes);
+		free(b.strings);
+		xml_table_free(&b.table);
+		return NULL;
+	}
+
+	b.image = (struct xml_image *) image;
+	memcpy(b.image->magic, XML_IMAGE_MAGIC, 4);
+	b.image->version = XML_IMAGE_VERSION;
+	b.image->size = size;
+	b.image->nodes = nodes;
+	b.image->attributes = attributes;
+	b.image->strings = head;
+
+	xml_image_relocate(&b);
+
+	memcpy(image + sizeof(struct xml_image),
+		b.nodes,
+		nodes * sizeof(struct xml_image_node));
+
+	if (attributes) {
+		memcpy(image + sizeof(struct xml_image) +
+				nodes * sizeof(struct xml_image_node),
+			b.attributes,
+			attributes * sizeof(struct xml_image_attribute));
+	}
+
+	if (b.strings_length) {
+		memcpy(image + head, b.strings, b.strings_length);
+	}
+
+	free(b.nodes);
+	free(b.attributes);
+	free(b.strings);
+	xml_table_free(&b.table);
+
+	*len = size;
+
+	return image;
+}
+
+/**
+ * Returns true if offset is 0 or refers to a string
+ *
+ * @param img - image
+ * @param off - offset
+ */
+static int xml_image_check_string(const struct xml_image *img, uint32_t off) {
+	return !off || (off >= img->strings && off < img->size);
+}
+
+/**
+ * Returns true if offset is 0 or refers to a node after the given one,
+ * so walking down the tree always ends
+ *
+ * @param img - image
+ * @param off - offset
+ * @param after - offset of given node
+ */
+static int xml_image_check_node(
+		const struct xml_image *img,
+		uint32_t off,
+		uint32_t after) {
+	return !off || (off > after &&
+		off < sizeof(struct xml_image) +
+			img->nodes * sizeof(struct xml_image_node) &&
+		(off - sizeof(struct xml_image)) %
+			sizeof(struct xml_image_node) == 0);
+}
+
+/**
+ * Check all references of an image, so accessors don't need to
+ *
+ * @param img - image with a valid header
+ */
+static int xml_image_check(const struct xml_image *img) {
+	const struct xml_image_node *n = NODE(img, sizeof(struct xml_image));
+	uint32_t attributes = sizeof(struct xml_image) +
+		img->nodes * sizeof(struct xml_image_node);
+	uint32_t i;
+
+	/* strings end in the last byte */
+	if (img->strings < img->size && TEXT(img, img->size - 1)[0]) {
+		return -1;
+	}
+
+	for (i = 0; i < img->nodes; ++i, ++n) {
+		uint32_t self = (const char *) n - (const char *) img;
+		uint32_t a = n->first_attribute;
+		uint32_t j;
+
+		if (!xml_image_check_string(img, n->key) ||
+				!xml_image_check_string(img, n->value) ||
+				!xml_image_check_node(img, n->first_child, self) ||
+				!xml_image_check_node(img, n->next, self) ||
+				(n->parent && (n->parent >= self ||
+					!xml_image_check_node(img, n->parent, 0)))) {
+			return -1;
+		}
+
+		if (!n->attribute_count) {
+			continue;
+		}
+
+		if (a < attributes || a > img->strings ||
+				(a - attributes) % sizeof(struct xml_image_attribute) ||
+				n->attribute_count > (img->strings - a) /
+					sizeof(struct xml_image_attribute)) {
+			return -1;
+		}
+
+		for (j = 0; j < n->attribute_count; ++j) {
+			const struct xml_image_attribute *at =
+				(const struct xml_image_attribute *) TEXT(img, a) + j;
+
+			if (!at->key ||
+					!xml_image_check_string(img, at->key) ||
+					!xml_image_check_string(img, at->value)) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Validate image in memory and return it
+ *
+ * @param data - image data, must be aligned to 4 bytes
+ * @param len - length of data
+ */
+const struct xml_image *xml_image_open(const void *data, size_t len) {
+	const struct xml_image *img = data;
+
+	if (!data ||
+			len < sizeof(struct xml_image) ||
+			memcmp(img->magic, XML_IMAGE_MAGIC, 4) ||
+			img->version != XML_IMAGE_VERSION ||
+			img->size != len ||
+			img->nodes < 1 ||
+			img->strings > len ||
+			(uint64_t) img->nodes * sizeof(struct xml_image_node) +
+				(uint64_t) img->attributes *
+					sizeof(struct xml_image_attribute) +
+				sizeof(struct xml_image) != img->strings ||
+			xml_image_check(img)) {
+		return NULL;
+	}
+
+	return img;
+}
+
+/*****************************************************************************
+ * SHARING
+ ****************************************************************************/
+
+#ifndef WIN32
+/**
+ * Create an anonymous memory file
+ */
+static int xml_image_memfd(void) {
+#ifdef MFD_ALLOW_SEALING
+	return memfd_create("xml_image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+	char name[64];
+	int fd;
+
+	snprintf(name, sizeof(name), "/xml_image.%ld.%ld",
+		(long) getpid(),
+		(long) clock());
+
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) > -1) {
+		shm_unlink(name);
+	}
+
+	return fd;
+#endif
+}
+
+/**
+ * Write image of element tree into a new memory file and return its
+ * file descriptor; the file is sealed against modification where the
+ * system supports it
+ *
+ * @param root - root element
+ */
+int xml_image_create(struct xml_element *root) {
+	size_t len;
+	size_t written = 0;
+	char *image;
+	int fd;
+
+	if (!(image = xml_image_build(root, &len))) {
+		return -1;
+	}
+
+	if ((fd = xml_image_memfd()) < 0) {
+		free(image);
+		return -1;
+	}
+
+	while (written < len) {
+		ssize_t n = write(fd, image + written, len - written);
+
+		if (n < 1) {
+			free(image);
+			close(fd);
+			return -1;
+		}
+
+		written += n;
+	}
+
+	free(image);
+
+#ifdef F_ADD_SEALS
+	fcntl(fd, F_ADD_SEALS,
+		F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+
+	return fd;
+}
+
+/**
+ * Map image file read-only
+ *
+ * @param fd - file descriptor of an image
+ */
+const struct xml_image *xml_image_map(int fd) {
+	const struct xml_image *img;
+	struct stat st;
+	void *p;
+
+	if (fstat(fd, &st) ||
+			st.st_size < (off_t) sizeof(struct xml_image) ||
+			(p = mmap(
+				NULL,
+				st.st_size,
+				PROT_READ,
+				MAP_SHARED,
+				fd,
+				0)) == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (!(img = xml_image_open(p, st.st_size))) {
+		munmap(p, st.st_size);
+	}
+
+	return img;
+}
+
+/**
+ * Unmap image
+ *
+ * @param img - image
+ */
+void xml_image_unmap(const struct xml_image *img) {
+	if (img) {
+		munmap((void *) img, img->size);
+	}
+}
+#endif
+
+/*****************************************************************************
+ * ACCESSORS
+ ****************************************************************************/
+
+/**
+ * Return root node
+ *
+ * @param img - image
+ */
+const struct xml_image_node *xml_image_root(const struct xml_image *img) {
+	return img ? NODE(img, sizeof(struct xml_image)) : NULL;
+}
+
+/**
+ * Return parent node or NULL
+ *
+ * @param img - image
+ * @param n - node
+ */
+const struct xml_image_node *xml_image_parent(
+		const struct xml_image *img,
+		const struct xml_image_node *n) {
+	return n && n->parent ? NODE(img, n->parent) : NULL;
+}
+
+/**
+ * Return first child node or NULL
+ *
+ * @param img - image
+ * @param n - node
+ */
+const struct xml_image_node *xml_image_first_child(
+		const struct xml_image *img,
+		const struct xml_image_node *n) {
+	return n && n->first_child ? NODE(img, n->first_child) : NULL;
+}
+
+/**
+ * Return next sibling or NULL
+ *
+ * @param img - image
+ * @param n - node
+ */
+const struct xml_image_node *xml_image_next(
+		const struct xml_image *img,
+		const struct xml_image_node *n) {
+	return n && n->next ? NODE(img, n->next) : NULL;
+}
+
+/**
+ * Return tag name or NULL if node represents character data
+ *
+ * @param img - image
+ * @param n - node
+ */
+const char *xml_image_key(
+		const struct xml_image *img,
+		const struct xml_image_node *n) {
+	return n ? STRING(img, n->key) : NULL;
+}
+
+/**
+ * Return character data or NULL if node is a tag
+ *
+ * @param img - image
+ * @param n - node
+ */
+const char *xml_image_value(
+		const struct xml_image *img,
+		const struct xml_image_node *n) {
+	return n ? STRING(img, n->value) : NULL;
+}
+
+/**
+ * Return value of attribute or NULL if there is no such attribute
+ * or the attribute has no value
+ *
+ * @param img - image
+ * @param n - node
+ * @param key - attribute key
+ */
+const char *xml_image_attribute(
+		const struct xml_image *img,
+		const struct xml_image_node *n,
+		const char *key) {
+	const struct xml_image_attribute *a;
+	uint32_t i;
+
+	if (!n || !n->first_attribute) {
+		return NULL;
+	}
+
+	a = (const struct xml_image_attribute *)
+		((const char *) img + n->first_attribute);
+
+	for (i = 0; i < n->attribute_count; ++i, ++a) {
+		if (!strcasecmp(TEXT(img, a->key), key)) {
+			return STRING(img, a->value);
+		}
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************
+ * NODE LOCATION
+ ****************************************************************************/
+
+/**
+ * Return key and value of next attribute of node
+ *
+ * @param c - cursor
+ * @param key - receives key
+ * @param value - receives value
+ */
+static int xml_image_attribute_next(
+		struct xml_attribute_cursor *c,
+		const char **key,
+		const char **value) {
+	const struct xml_image_attribute *a = c->at;
+
+	if (!c->left) {
+		return 0;
+	}
+
+	*key = TEXT(c->base, a->key);
+	*value = STRING(c->base, a->value);
+	c->at = a + 1;
+	--c->left;
+
+	return 1;
+}
+
+/**
+ * Returns true if node has a matching argument
+ *
+ * @param img - image
+ * @param n - node
+ * @param seg - path segment
+ * @param x - counters, may be NULL
+ * @param step - path step of segment
+ */
+static int xml_image_attribute_match(
+		const struct xml_image *img,
+		const struct xml_image_node *n,
+		struct xml_path_segment *seg,
+		struct xml_explain *x,
+		size_t step) {
+	struct xml_attribute_cursor c;
+
+	c.next = xml_image_attribute_next;
+	c.base = img;
+	c.at = (const char *) img + n->first_attribute;
+	c.left = n->first_attribute ? n->attribute_count : 0;
+
+	return xml_segment_match(seg, &c, x, step);
+}
+
+/**
+ * Returns true if node matches path segment
+ *
+ * @param img - image
+ * @param n - node
+ * @param name - tag name of segment
+ * @param seg - path segment
+ * @param x - counters, may be NULL
+ * @param i - path step of segment
+ */
+static int xml_image_match(
+		const struct xml_image *img,
+		const struct xml_image_node *n,
+		const char *name,
+		struct xml_path_segment *seg,
+		struct xml_explain *x,
+		size_t i) {
+	const char *key = STRING(img, n->key);
+
+	XML_EXPLAIN(x, i, visited);
+
+	if (!key) {
+		return 0;
+	}
+
+	XML_EXPLAIN(x, i, compared);
+
+	if (!xml_tag_match(key, name, seg->tag_len) ||
+			!xml_image_attribute_match(img, n, seg, x, i)) {
+		return 0;
+	}
+
+	XML_EXPLAIN(x, i, matches);
+
+	return 1;
+}
+
+/**
+ * Find first matching node for given path step
+ *
+ * @param img - image
+ * @param n - node to start from
+ * @param path - remaining path
+ * @param x - counters, may be NULL
+ * @param i - path step
+ */
+static const struct xml_image_node *xml_image_find_step(
+		const struct xml_image *img,
+		const struct xml_image_node *n,
+		const char *path,
+		struct xml_explain *x,
+		size_t i) {
+	struct xml_path_segment seg = {0, NULL};
+	const char *next;
+
+	if (!img || !n || !path || !*path) {
+		return NULL;
+	}
+
+	next = xml_first_path_segment(&seg, path);
+	xml_explain_segment(x, i, &seg);
+
+	for (n = xml_image_first_child(img, n); n; n = xml_image_next(img, n)) {
+		if (xml_image_match(img, n, path, &seg, x, i)) {
+			const struct xml_image_node *c;
+
+			if (!next) {
+				xml_free_query_strings(&seg);
+				return n;
+			}
+
+			if ((c = xml_image_find_step(img, n, next, x, i + 1))) {
+				xml_free_query_strings(&seg);
+				return c;
+			}
+		}
+	}
+
+	xml_free_query_strings(&seg);
+	return NULL;
+}
+
+/**
+ * Find first matching node
+ *
+ * @param img - image
+ * @param n - node to start from
+ * @param path - slash seperated element path with optional
+ *               "?key=value" restriction for attributes
+ */
+const struct xml_image_node *xml_image_find(
+		const struct xml_image *img,
+		const struct xml_image_node *n,
+		const char *path) {
+	return xml_image_find_step(img, n, path, NULL, 0);
+}
+
+/**
+ * Find first matching node and count the work done
+ *
+ * @param img - image
+ * @param n - node to start from
+ * @param path - slash seperated element path with optional
+ *               "?key=value" restriction for attributes
+ * @param x - counters to add to
+ */
+const struct xml_image_node *xml_image_find_explain(
+		const struct xml_image *img,
+		const struct xml_image_node *n,
+		const char *path,
+		struct xml_explain *x) {
+	xml_explain_path(x, path);
+
+	return xml_image_find_step(img, n, path, x, 0);
+}
+
+/**
+ * Find next node with the same key as last that matches the
+ * given path segment
+ *
+ * @param img - image
+ * @param from - first node to check
+ * @param key - key of last match
+ * @param seg - path segment
+ * @param x - counters, may be NULL
+ * @param i - path step of segment
+ */
+static const struct xml_image_node *xml_image_find_sibling(
+		const struct xml_image *img,
+		const struct xml_image_node *from,
+		const char *key,
+		struct xml_path_segment *seg,
+		struct xml_explain *x,
+		size_t i) {
+	for (; from; from = xml_image_next(img, from)) {
+		const char *k = STRING(img, from->key);
+
+		XML_EXPLAIN(x, i, visited);
+
+		if (!k) {
+			continue;
+		}
+
+		XML_EXPLAIN(x, i, compared);
+
+		if (xml_tag_match(k, key, strlen(key)) &&
+				xml_image_attribute_match(img, from, seg, x, i)) {
+			XML_EXPLAIN(x, i, matches);
+			return from;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Find next node
+ *
+ * @param img - image
+ * @param last - last matched node
+ * @param path - element path, may be NULL
+ * @param prev - previous position in path, may be NULL
+ * @param x - counters, may be NULL
+ */
+static const struct xml_image_node *xml_image_find_next_from(
+		const struct xml_image *img,
+		const struct xml_image_node *last,
+		const char *path,
+		const char *prev,
+		struct xml_explain *x) {
+	const struct xml_image_node *n;
+	const struct xml_image_node *p;
+	struct xml_path_segment seg = {0, NULL};
+	const char *key;
+	size_t i = 0;
+
+	if (!last || !(key = STRING(img, last->key))) {
+		return NULL;
+	}
+
+	if (path) {
+		prev = xml_last_path_segment(&seg, path, prev);
+
+		if (x) {
+			i = xml_explain_index(path, prev);
+			xml_explain_segment(x, i, &seg);
+		}
+	}
+
+	if ((n = xml_image_find_sibling(img, xml_image_next(img, last), key,
+			&seg, x, i))) {
+		xml_free_query_strings(&seg);
+		return n;
+	}
+
+	/* try other branches */
+	for (p = xml_image_parent(img, last); p && p->key;) {
+		if ((p = xml_image_find_next_from(img, p, path, prev, x)) &&
+				(n = xml_image_find_sibling(
+					img,
+					xml_image_first_child(img, p),
+					key,
+					&seg,
+					x,
+					i))) {
+			xml_free_query_strings(&seg);
+			return n;
+		}
+	}
+
+	xml_free_query_strings(&seg);
+	return NULL;
+}
+
+/**
+ * Find next node
+ *
+ * @param img - image
+ * @param last - last matched node
+ * @param path - slash seperated element path with optional
+ *               "?key=value" restriction for attributes, may be NULL
+ */
+const struct xml_image_node *xml_image_find_next(
+		const struct xml_image *img,
+		const struct xml_image_node *last,
+		const char *path) {
+	return img ?
+		xml_image_find_next_from(img, last, path, NULL, NULL) :
+		NULL;
+}
+
+/**
+ * Find next node and count the work done
+ *
+ * @param img - image
+ * @param last - last matched node
+ * @param path - slash seperated element path with optional
+ *               "?key=value" restriction for attributes, may be NULL
+ * @param x - counters to add to
+ */
+const struct xml_image_node *xml_image_find_next_explain(
+		const struct xml_image *img,
+		const struct xml_image_node *last,
+		const char *path,
+		struct xml_explain *x) {
+	xml_explain_path(x, path);
+
+	return img ? xml_image_find_next_from(img, last, path, NULL, x) : NULL;
+}
+
+/*****************************************************************************
+ * CONTENT CONCATENATION
+ ****************************************************************************/
+
+/**
+ * Calculate size of all child values
+ *
+ * @param img - image
+ * @param n - node
+ */
+static size_t xml_image_content_len(
+		const struct xml_image *img,
+		const struct xml_image_node *n) {
+	size_t s = 0;
+
+	for (n = xml_image_first_child(img, n); n; n = xml_image_next(img, n)) {
+		if (n->value) {
+			s += strlen(TEXT(img, n->value));
+		} else {
+			s += xml_image_content_len(img, n);
+		}
+	}
+
+	return s;
+}
+
+/**
+ * Copy values into pre-calculated buffer
+ *
+ * @param img - image
+ * @param n - node
+ * @param t - target
+ */
+static void xml_image_content_cpy(
+		const struct xml_image *img,
+		const struct xml_image_node *n,
+		char **t) {
+	for (n = xml_image_first_child(img, n); n; n = xml_image_next(img, n)) {
+		if (n->value) {
+			const char *v = TEXT(img, n->value);
+
+			strcpy(*t, v);
+			*t += strlen(v);
+		} else {
+			xml_image_content_cpy(img, n, t);
+		}
+	}
+}
+
+/**
+ * Return concatenated content of node and all of its children
+ * (the returned pointer must be free()'d after use)
+ *
+ * @param img - image
+ * @param n - node
+ */
+char *xml_image_content(
+		const struct xml_image *img,
+		const struct xml_image_node *n) {
+	size_t l;
+	char *s;
+	char *t;
+
+	if (!img ||
+			!n ||
+			(l = xml_image_content_len(img, n)) < 1 ||
+			!(s = malloc(++l))) {
+		return NULL;
+	}
+
+	t = s;
+	xml_image_content_cpy(img, n, &t);
+
+	return s;
+}
@@ -0,0 +1,81 @@
+#ifndef _xml_image_h_
+#define _xml_image_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Read-only, position-independent images of element trees.
+ *
+ * An image stores nodes, attributes and strings in one contiguous
+ * block that references its parts by offset only. It can be written
+ * into a memory file descriptor once and mapped into any number of
+ * processes, at any address, without parsing again:
+ *
+ *	int fd = xml_image_create(root);
+ *	...
+ *	const struct xml_image *img = xml_image_map(fd);
+ *	const struct xml_image_node *n = xml_image_find(
+ *		img, xml_image_root(img), "hello/world");
+ *
+ * Images are limited to 4 GiB. xml_image_open() and xml_image_map()
+ * check every offset in an image once, so the accessors don't have to
+ * and can't be led out of it. */
+
+struct xml_image;
+struct xml_image_node;
+
+void *xml_image_build(struct xml_element *, size_t *);
+const struct xml_image *xml_image_open(const void *, size_t);
+
+int xml_image_create(struct xml_element *);
+const struct xml_image *xml_image_map(int);
+void xml_image_unmap(const struct xml_image *);
+
+const struct xml_image_node *xml_image_root(const struct xml_image *);
+const struct xml_image_node *xml_image_parent(
+	const struct xml_image *,
+	const struct xml_image_node *);
+const struct xml_image_node *xml_image_first_child(
+	const struct xml_image *,
+	const struct xml_image_node *);
+const struct xml_image_node *xml_image_next(
+	const struct xml_image *,
+	const struct xml_image_node *);
+
+const char *xml_image_key(
+	const struct xml_image *,
+	const struct xml_image_node *);
+const char *xml_image_value(
+	const struct xml_image *,
+	const struct xml_image_node *);
+const char *xml_image_attribute(
+	const struct xml_image *,
+	const struct xml_image_node *,
+	const char *);
+
+const struct xml_image_node *xml_image_find(
+	const struct xml_image *,
+	const struct xml_image_node *,
+	const char *);
+const struct xml_image_node *xml_image_find_next(
+	const struct xml_image *,
+	const struct xml_image_node *,
+	const char *);
+
+const struct xml_image_node *xml_image_find_explain(
+	const struct xml_image *,
+	const struct xml_image_node *,
+	const char *,
+	struct xml_explain *);
+const struct xml_image_node *xml_image_find_next_explain(
+	const struct xml_image *,
+	const struct xml_image_node *,
+	const char *,
+	struct xml_explain *);
+
+char *xml_image_content(
+	const struct xml_image *,
+	const struct xml_image_node *);
+
+#endif
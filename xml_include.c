@@ -0,0 +1,490 @@
+#ifndef WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_compress.h"
+#include "xml_include.h"
+
+struct xml_include_job {
+	/* job of the including file, NULL for the tree given to
+	 * xml_include() */
+	struct xml_include_job *parent;
+
+	/* file name, may be NULL for the given tree */
+	char *path;
+
+	/* include element that is replaced */
+	struct xml_element *element;
+
+	/* parsed file and its document element */
+	struct xml_element *root;
+	struct xml_element *document;
+
+	/* identity of file to detect cycles */
+	dev_t dev;
+	ino_t ino;
+};
+
+struct xml_include_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+
+	/* all jobs in order of discovery, jobs[next] is the next one
+	 * to be parsed */
+	struct xml_include_job **jobs;
+	size_t count;
+	size_t capacity;
+	size_t next;
+
+	/* number of jobs being parsed */
+	int busy;
+
+	/* set on the first error, stops all workers */
+	int failed;
+	char *error;
+};
+
+/**
+ * Record the first error
+ *
+ * @param pool - include pool
+ * @param path - file name, may be NULL
+ * @param reason - what went wrong
+ */
+static void xml_include_fail(
+		struct xml_include_pool *pool,
+		const char *path,
+		const char *reason) {
+	pthread_mutex_lock(&pool->lock);
+
+	if (!pool->failed) {
+		size_t size;
+
+		pool->failed = 1;
+
+		if (!path) {
+			path = "-";
+		}
+
+		size = strlen(path) + strlen(reason) + 3;
+
+		if ((pool->error = malloc(size))) {
+			snprintf(pool->error, size, "%s: %s", path, reason);
+		}
+	}
+
+	pthread_cond_broadcast(&pool->changed);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Resolve href against the directory of the including file
+ *
+ * @param base - file name of including file, may be NULL
+ * @param href - referenced file
+ */
+static char *xml_include_path(const char *base, const char *href) {
+	const char *slash = base ? strrchr(base, '/') : NULL;
+	size_t dir = *href == '/' || !slash ? 0 : slash - base + 1;
+	size_t len = strlen(href);
+	char *path = malloc(dir + len + 1);
+
+	if (path) {
+		if (dir) {
+			memcpy(path, base, dir);
+		}
+
+		memcpy(path + dir, href, len + 1);
+	}
+
+	return path;
+}
+
+/**
+ * Queue a job for every include element below given element
+ *
+ * @param pool - include pool
+ * @param job - job of the file the element belongs to
+ * @param e - XML element
+ */
+static int xml_include_scan(
+		struct xml_include_pool *pool,
+		struct xml_include_job *job,
+		struct xml_element *e) {
+	struct xml_element *c;
+
+	for (c = e->first_child; c; c = c->next) {
+		struct xml_include_job *n;
+		struct xml_attribute *href;
+
+		if (!c->key) {
+			continue;
+		}
+
+		if (strcasecmp(c->key, "include")) {
+			if (xml_include_scan(pool, job, c)) {
+				return -1;
+			}
+
+			continue;
+		}
+
+		if (!(href = xml_find_attribute(c->first_attribute, "href")) ||
+				!*href->value) {
+			xml_include_fail(pool, job->path, "include without href");
+			return -1;
+		}
+
+		if (strstr(href->value, "://")) {
+			xml_include_fail(pool, href->value, "not a local file");
+			return -1;
+		}
+
+		if (!(n = calloc(1, sizeof(*n))) ||
+				!(n->path = xml_include_path(job->path, href->value))) {
+			free(n);
+			xml_include_fail(pool, job->path, "out of memory");
+			return -1;
+		}
+
+		n->parent = job;
+		n->element = c;
+
+		pthread_mutex_lock(&pool->lock);
+
+		if (pool->count >= pool->capacity) {
+			size_t capacity = pool->capacity ? pool->capacity << 1 : 16;
+			struct xml_include_job **jobs = realloc(pool->jobs,
+				capacity * sizeof(*jobs));
+
+			if (!jobs) {
+				pthread_mutex_unlock(&pool->lock);
+				free(n->path);
+				free(n);
+				xml_include_fail(pool, job->path, "out of memory");
+				return -1;
+			}
+
+			pool->jobs = jobs;
+			pool->capacity = capacity;
+		}
+
+		pool->jobs[pool->count++] = n;
+		pthread_cond_signal(&pool->changed);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return 0;
+}
+
+/**
+ * Read and parse the file of a job and queue the files it includes
+ *
+ * @param pool - include pool
+ * @param job - job to run
+ */
+static int xml_include_parse(
+		struct xml_include_pool *pool,
+		struct xml_include_job *job) {
+	struct xml_include_job *p;
+	struct xml_element *c;
+	struct xml_state st;
+	struct stat sb;
+	char *buf;
+	size_t size;
+	ssize_t bytes;
+	int fd;
+
+	if ((fd = open(job->path, O_RDONLY | O_CLOEXEC)) < 0) {
+		xml_include_fail(pool, job->path, "cannot open file");
+		return -1;
+	}
+
+	if (fstat(fd, &sb)) {
+		close(fd);
+		xml_include_fail(pool, job->path, "cannot open file");
+		return -1;
+	}
+
+	job->dev = sb.st_dev;
+	job->ino = sb.st_ino;
+
+	/* ancestors have been identified before this job was queued */
+	for (p = job->parent; p; p = p->parent) {
+		if (p->dev == job->dev && p->ino == job->ino) {
+			close(fd);
+			xml_include_fail(pool, job->path, "include cycle");
+			return -1;
+		}
+	}
+
+	size = sb.st_size;
+
+	if (!(buf = malloc(size + 1))) {
+		close(fd);
+		xml_include_fail(pool, job->path, "out of memory");
+		return -1;
+	}
+
+	memset(&st, 0, sizeof(st));
+
+	/* file may still grow while being read */
+	while ((bytes = read(fd, buf, size + 1)) > 0) {
+		if (xml_parse_chunk_len(&st, buf, bytes)) {
+			break;
+		}
+	}
+
+	close(fd);
+	free(buf);
+
+	if (bytes < 0) {
+		xml_free(st.root);
+		xml_include_fail(pool, job->path, "cannot read file");
+		return -1;
+	}
+
+	/* all elements must be closed, trailing character data is still
+	 * current, and there must be exactly one document element */
+	if (bytes > 0 || !st.root || (st.current != st.root &&
+			(st.current->key || st.current->parent != st.root))) {
+		xml_free(st.root);
+		xml_include_fail(pool, job->path, "malformed XML document");
+		return -1;
+	}
+
+	for (c = st.root->first_child; c; c = c->next) {
+		if (c->key && *c->key != '!' && *c->key != '?') {
+			if (job->document) {
+				job->document = NULL;
+				break;
+			}
+
+			job->document = c;
+		}
+	}
+
+	job->root = st.root;
+
+	if (!job->document) {
+		xml_include_fail(pool, job->path, "malformed XML document");
+		return -1;
+	}
+
+	return xml_include_scan(pool, job, job->document);
+}
+
+/**
+ * Parse queued files until there are none left
+ *
+ * @param pool - include pool
+ */
+static void xml_include_work(struct xml_include_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		struct xml_include_job *job;
+
+		/* jobs may still be queued while others are parsed */
+		while (!pool->failed && pool->next >= pool->count &&
+				pool->busy > 0) {
+			pthread_cond_wait(&pool->changed, &pool->lock);
+		}
+
+		if (pool->failed || pool->next >= pool->count) {
+			break;
+		}
+
+		job = pool->jobs[pool->next++];
+		++pool->busy;
+		pthread_mutex_unlock(&pool->lock);
+
+		xml_include_parse(pool, job);
+
+		pthread_mutex_lock(&pool->lock);
+		--pool->busy;
+		pthread_cond_broadcast(&pool->changed);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Run worker on a thread of its own
+ *
+ * @param p - include pool
+ */
+static void *xml_include_thread(void *p) {
+	xml_include_work(p);
+
+	/* values decompressed here are only used by this thread; the
+	 * calling thread works too but its callers may still hold some
+	 * of its values, so it keeps its cache */
+	xml_compress_cache_free();
+
+	return NULL;
+}
+
+/**
+ * Replace include element of job with the parsed document element
+ *
+ * @param job - parsed job
+ */
+static void xml_include_splice(struct xml_include_job *job) {
+	struct xml_element *e = job->element;
+	struct xml_element *parent = e->parent;
+	struct xml_element *d = job->document;
+	struct xml_element *prev = NULL;
+	struct xml_element *c, *n;
+
+	for (c = parent->first_child; c != e; c = c->next) {
+		prev = c;
+	}
+
+	/* free everything around the document element */
+	for (c = job->root->first_child; c; c = n) {
+		n = c->next;
+
+		if (c != d) {
+			c->next = NULL;
+			xml_free(c);
+		}
+	}
+
+	job->root->first_child = job->root->last_child = NULL;
+	xml_free(job->root);
+	job->root = NULL;
+
+	d->parent = parent;
+	d->next = e->next;
+
+	if (prev) {
+		prev->next = d;
+	} else {
+		parent->first_child = d;
+	}
+
+	if (parent->last_child == e) {
+		parent->last_child = d;
+	}
+
+	xml_child_index_drop(parent);
+
+	e->parent = NULL;
+	e->next = NULL;
+	xml_free(e);
+}
+
+/**
+ * Replace include elements with the document elements of the
+ * referenced files, recursively
+ *
+ * @param root - root element
+ * @param file - file name of root element, may be NULL
+ * @param threads - number of threads, 0 for one per processor
+ * @param error - receives an error message that must be freed,
+ *                may be NULL
+ */
+int xml_include(
+		struct xml_element *root,
+		const char *file,
+		int threads,
+		char **error) {
+	struct xml_include_pool pool;
+	struct xml_include_job top;
+	pthread_t *workers = NULL;
+	int started = 0;
+	size_t i;
+	int r;
+
+	if (error) {
+		*error = NULL;
+	}
+
+	if (!root) {
+		return -1;
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	memset(&top, 0, sizeof(top));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.changed, NULL);
+
+	/* the given tree takes part in cycle detection if it's a file */
+	top.path = (char *) file;
+	top.dev = (dev_t) -1;
+	top.ino = (ino_t) -1;
+
+	if (file) {
+		struct stat sb;
+
+		if (!stat(file, &sb)) {
+			top.dev = sb.st_dev;
+			top.ino = sb.st_ino;
+		}
+	}
+
+	if (!xml_include_scan(&pool, &top, root) && pool.count > 0) {
+		if (threads < 1) {
+			long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+			threads = n > 0 ? (int) n : 1;
+		}
+
+		/* this thread is a worker too */
+		if (threads > 1 &&
+				(workers = malloc((threads - 1) * sizeof(*workers)))) {
+			for (; started < threads - 1; ++started) {
+				if (pthread_create(&workers[started], NULL,
+						xml_include_thread, &pool)) {
+					break;
+				}
+			}
+		}
+
+		xml_include_work(&pool);
+
+		while (started > 0) {
+			pthread_join(workers[--started], NULL);
+		}
+
+		free(workers);
+	}
+
+	r = pool.failed ? -1 : 0;
+
+	for (i = 0; i < pool.count; ++i) {
+		struct xml_include_job *job = pool.jobs[i];
+
+		/* subtrees are moved, so order doesn't matter */
+		if (!r) {
+			xml_include_splice(job);
+		}
+
+		xml_free(job->root);
+		free(job->path);
+		free(job);
+	}
+
+	free(pool.jobs);
+
+	if (error) {
+		*error = pool.error;
+	} else {
+		free(pool.error);
+	}
+
+	pthread_cond_destroy(&pool.changed);
+	pthread_mutex_destroy(&pool.lock);
+
+	return r;
+}
+#endif
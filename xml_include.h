@@ -0,0 +1,39 @@
+#ifndef _xml_include_h_
+#define _xml_include_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Include resolution for documents spread over multiple files.
+ *
+ * Every element like
+ *
+ *	<include href="network.xml"/>
+ *
+ * is replaced by the document element of the referenced file. Relative
+ * paths are resolved against the directory of the including file and
+ * included files may include other files in turn:
+ *
+ *	struct xml_element *root = ... parse "conf/main.xml" ...
+ *	char *error;
+ *
+ *	if (xml_include(root, "conf/main.xml", 0, &error)) {
+ *		fprintf(stderr, "%s\n", error);
+ *		free(error);
+ *	}
+ *
+ * Referenced files are read and parsed concurrently on a pool of the
+ * given number of threads (0 for one per processor), so resolving a
+ * wide tree of includes takes about as long as parsing its largest
+ * file. The parsed subtrees are spliced into the tree only after all
+ * files have been parsed successfully; on errors the tree is left
+ * alone. A file that includes itself, directly or through other
+ * files, is an error.
+ *
+ * Trees must have been built with malloc() since include elements are
+ * freed with xml_free(). */
+
+int xml_include(struct xml_element *, const char *, int, char **);
+
+#endif
@@ -0,0 +1,289 @@
+#ifndef WIN32
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xml.h"
+#include "xml_mapped.h"
+
+/* the file grows by this much at first and doubles up to
+ * XML_MAPPED_STEP_MAX */
+#define XML_MAPPED_STEP (64 << 20)
+#define XML_MAPPED_STEP_MAX ((size_t) 1 << 30)
+
+#define XML_MAPPED_ALIGN(n) (((n) + sizeof(void *) - 1) & \
+	~(sizeof(void *) - 1))
+
+struct xml_mapped {
+	/* must be first so the allocator can be cast back */
+	struct xml_allocator allocator;
+
+	int fd;
+
+	/* reserved address range */
+	char *base;
+	size_t reserve;
+
+	/* size of file and mapping */
+	size_t size;
+
+	/* size of next growth */
+	size_t step;
+
+	/* allocated bytes */
+	size_t used;
+
+	/* last allocation, may be grown in place */
+	char *last;
+
+	/* end of region that is already marked cold */
+	size_t cold;
+};
+
+/**
+ * Open an unlinked temporary file
+ *
+ * @param dir - directory, may be NULL for $TMPDIR or /tmp
+ */
+static int xml_mapped_tmpfile(const char *dir) {
+	char path[PATH_MAX];
+	int fd;
+
+	if (!dir && !(dir = getenv("TMPDIR"))) {
+		dir = "/tmp";
+	}
+
+#ifdef O_TMPFILE
+	if ((fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) > -1) {
+		return fd;
+	}
+#endif
+
+	if (snprintf(path, sizeof(path), "%s/xml_mapped.XXXXXX", dir) >=
+			(int) sizeof(path) ||
+			(fd = mkstemp(path)) < 0) {
+		return -1;
+	}
+
+	unlink(path);
+
+	return fd;
+}
+
+/**
+ * Mark the filled part of the mapping before the current growth step
+ * as cold so the kernel prefers to reclaim it
+ *
+ * @param m - arena
+ * @param end - end of cold region
+ */
+static void xml_mapped_cool(struct xml_mapped *m, size_t end) {
+#ifdef MADV_COLD
+	if (end > m->cold) {
+		madvise(m->base + m->cold, end - m->cold, MADV_COLD);
+		m->cold = end;
+	}
+#else
+	(void) m;
+	(void) end;
+#endif
+}
+
+/**
+ * Grow file and mapping to hold at least size bytes
+ *
+ * @param m - arena
+ * @param size - required size
+ */
+static int xml_mapped_grow(struct xml_mapped *m, size_t size) {
+	size_t old = m->size;
+	size_t n = old;
+
+	while (n < size) {
+		n += m->step;
+
+		if (m->step < XML_MAPPED_STEP_MAX) {
+			m->step <<= 1;
+		}
+	}
+
+	if (n > m->reserve) {
+		n = m->reserve;
+
+		if (n < size) {
+			return -1;
+		}
+	}
+
+	if (ftruncate(m->fd, n) ||
+			mmap(m->base + old,
+				n - old,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED,
+				m->fd,
+				old) == MAP_FAILED) {
+		return -1;
+	}
+
+	m->size = n;
+
+	/* everything up to the previous step has been written */
+	xml_mapped_cool(m, old & ~((size_t) sysconf(_SC_PAGESIZE) - 1));
+
+	return 0;
+}
+
+/**
+ * Allocate zero-filled memory
+ *
+ * @param a - allocator
+ * @param size - number of bytes
+ */
+static void *xml_mapped_alloc(struct xml_allocator *a, size_t size) {
+	struct xml_mapped *m = (struct xml_mapped *) a;
+	size_t n = XML_MAPPED_ALIGN(size);
+
+	if (m->used + n > m->size && xml_mapped_grow(m, m->used + n)) {
+		return NULL;
+	}
+
+	/* file pages are zero-filled and memory is never reused */
+	m->last = m->base + m->used;
+	m->used += n;
+
+	return m->last;
+}
+
+/**
+ * Resize memory block; the last block grows in place
+ *
+ * @param a - allocator
+ * @param p - memory block
+ * @param old_size - current size of block
+ * @param size - new size of block
+ */
+static void *xml_mapped_resize(
+		struct xml_allocator *a,
+		void *p,
+		size_t old_size,
+		size_t size) {
+	struct xml_mapped *m = (struct xml_mapped *) a;
+	void *n;
+
+	if (p == m->last) {
+		size_t end = m->last - m->base + XML_MAPPED_ALIGN(size);
+
+		if (end > m->size && xml_mapped_grow(m, end)) {
+			return NULL;
+		}
+
+		m->used = end;
+
+		return p;
+	}
+
+	if ((n = xml_mapped_alloc(a, size))) {
+		memcpy(n, p, old_size < size ? old_size : size);
+	}
+
+	return n;
+}
+
+/**
+ * Create a new file-backed arena
+ *
+ * @param dir - directory for the temporary file, may be NULL
+ * @param reserve - maximum size of the arena, 0 for a default
+ */
+struct xml_mapped *xml_mapped_create(const char *dir, size_t reserve) {
+	struct xml_mapped *m;
+
+	if (!reserve) {
+		reserve = sizeof(size_t) > 4 ? (size_t) 1 << 40 : (size_t) 1 << 30;
+	}
+
+	if (!(m = calloc(1, sizeof(struct xml_mapped)))) {
+		return NULL;
+	}
+
+	m->allocator.alloc = xml_mapped_alloc;
+	m->allocator.resize = xml_mapped_resize;
+	m->allocator.release = NULL;
+	m->reserve = reserve;
+	m->step = XML_MAPPED_STEP;
+
+	/* reserve address space so the mapping can grow without
+	 * moving any pointers */
+	if ((m->base = mmap(
+			NULL,
+			reserve,
+			PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			-1,
+			0)) == MAP_FAILED) {
+		free(m);
+		return NULL;
+	}
+
+	if ((m->fd = xml_mapped_tmpfile(dir)) < 0) {
+		munmap(m->base, reserve);
+		free(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+/**
+ * Free arena and all trees in it
+ *
+ * @param m - arena
+ */
+void xml_mapped_free(struct xml_mapped *m) {
+	if (!m) {
+		return;
+	}
+
+	munmap(m->base, m->reserve);
+	close(m->fd);
+	free(m);
+}
+
+/**
+ * Return allocator interface for xml_state
+ *
+ * @param m - arena
+ */
+struct xml_allocator *xml_mapped_allocator(struct xml_mapped *m) {
+	return m ? &m->allocator : NULL;
+}
+
+/**
+ * Tell the kernel how the tree is going to be accessed
+ *
+ * @param m - arena
+ * @param mode - XML_MAPPED_SEQUENTIAL or XML_MAPPED_RANDOM
+ */
+void xml_mapped_advise(struct xml_mapped *m, int mode) {
+	if (m && m->size) {
+		madvise(m->base,
+			m->size,
+			mode == XML_MAPPED_RANDOM ? MADV_RANDOM : MADV_SEQUENTIAL);
+	}
+}
+
+/**
+ * Return number of allocated bytes
+ *
+ * @param m - arena
+ */
+size_t xml_mapped_size(struct xml_mapped *m) {
+	return m ? m->used : 0;
+}
+#endif
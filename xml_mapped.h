@@ -0,0 +1,38 @@
+#ifndef _xml_mapped_h_
+#define _xml_mapped_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Arena that allocates elements, attributes and strings from a growing
+ * temporary file mapped into memory, so trees larger than physical
+ * memory are paged by the kernel's page cache instead of swap:
+ *
+ *	struct xml_mapped *m = xml_mapped_create(NULL, 0);
+ *	struct xml_state st;
+ *
+ *	memset(&st, 0, sizeof(st));
+ *	st.allocator = xml_mapped_allocator(m);
+ *	... xml_parse_chunk(&st, chunk) ...
+ *	xml_mapped_advise(m, XML_MAPPED_RANDOM);
+ *	... xml_find(st.root, path) ...
+ *	xml_mapped_free(m);
+ *
+ * Filled regions are marked cold while parsing. Don't call xml_free()
+ * on trees built in the arena; xml_mapped_free() releases everything
+ * since lookups don't build child indexes for them outside the arena. */
+
+#define XML_MAPPED_SEQUENTIAL 0
+#define XML_MAPPED_RANDOM 1
+
+struct xml_mapped;
+
+struct xml_mapped *xml_mapped_create(const char *, size_t);
+void xml_mapped_free(struct xml_mapped *);
+
+struct xml_allocator *xml_mapped_allocator(struct xml_mapped *);
+void xml_mapped_advise(struct xml_mapped *, int);
+size_t xml_mapped_size(struct xml_mapped *);
+
+#endif
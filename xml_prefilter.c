@@ -0,0 +1,559 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_prefilter.h"
+
+struct xml_prefilter_literal {
+	/* lower case bytes */
+	char *s;
+	size_t length;
+};
+
+struct xml_prefilter_group {
+	/* indices of literals that must all occur */
+	size_t *literals;
+	size_t count;
+};
+
+struct xml_prefilter {
+	struct xml_prefilter_literal *literals;
+	size_t literal_count;
+
+	struct xml_prefilter_group *groups;
+	size_t group_count;
+
+	/* automaton; "delta" holds 256 transitions per state, "output"
+	 * the literal ending in a state or -1 and "dict" the next state
+	 * along the failure links that ends a literal or -1 */
+	int *delta;
+	int *output;
+	int *dict;
+	int states;
+	int compiled;
+
+	/* "delta" with each target premultiplied by 256 and inverted
+	 * if the target state ends at least one literal */
+	int *next;
+
+	/* the byte all literals start with or -1 */
+	int first;
+
+	/* scan state */
+	int state;
+	int candidate;
+	unsigned char *found;
+};
+
+/*****************************************************************************
+ * LITERALS AND GROUPS
+ ****************************************************************************/
+
+/**
+ * Return index of literal, add it if it isn't there yet; returns -1
+ * on error
+ *
+ * @param pf - prefilter
+ * @param s - literal
+ * @param l - length of literal
+ */
+static long xml_prefilter_literal(
+		struct xml_prefilter *pf,
+		const char *s,
+		size_t l) {
+	struct xml_prefilter_literal *lit;
+	size_t i;
+	char *c;
+
+	if (!(c = malloc(l + 1))) {
+		return -1;
+	}
+
+	for (i = 0; i < l; ++i) {
+		c[i] = tolower((unsigned char) s[i]);
+	}
+
+	c[l] = 0;
+
+	for (i = 0; i < pf->literal_count; ++i) {
+		if (pf->literals[i].length == l &&
+				!memcmp(pf->literals[i].s, c, l)) {
+			free(c);
+			return i;
+		}
+	}
+
+	if (!(lit = realloc(
+			pf->literals,
+			(pf->literal_count + 1) *
+				sizeof(struct xml_prefilter_literal)))) {
+		free(c);
+		return -1;
+	}
+
+	pf->literals = lit;
+	lit += pf->literal_count;
+	lit->s = c;
+	lit->length = l;
+	pf->compiled = 0;
+
+	return pf->literal_count++;
+}
+
+/**
+ * Add a literal to a group
+ *
+ * @param pf - prefilter
+ * @param g - group
+ * @param s - literal
+ * @param l - length of literal
+ */
+static int xml_prefilter_group_add(
+		struct xml_prefilter *pf,
+		struct xml_prefilter_group *g,
+		const char *s,
+		size_t l) {
+	size_t *n;
+	long i;
+
+	if (l < 1) {
+		return 0;
+	}
+
+	if ((i = xml_prefilter_literal(pf, s, l)) < 0 ||
+			!(n = realloc(g->literals, (g->count + 1) * sizeof(size_t)))) {
+		return -1;
+	}
+
+	g->literals = n;
+	g->literals[g->count++] = i;
+
+	return 0;
+}
+
+/**
+ * Append a new, empty group
+ *
+ * @param pf - prefilter
+ */
+static struct xml_prefilter_group *xml_prefilter_group(
+		struct xml_prefilter *pf) {
+	struct xml_prefilter_group *g;
+
+	if (!(g = realloc(
+			pf->groups,
+			(pf->group_count + 1) *
+				sizeof(struct xml_prefilter_group)))) {
+		return NULL;
+	}
+
+	pf->groups = g;
+	g += pf->group_count++;
+	g->literals = NULL;
+	g->count = 0;
+	pf->compiled = 0;
+
+	return g;
+}
+
+/*****************************************************************************
+ * AUTOMATON
+ ****************************************************************************/
+
+/**
+ * Free automaton
+ *
+ * @param pf - prefilter
+ */
+static void xml_prefilter_release(struct xml_prefilter *pf) {
+	free(pf->delta);
+	free(pf->output);
+	free(pf->dict);
+	free(pf->found);
+	free(pf->next);
+
+	pf->delta = pf->output = pf->dict = pf->next = NULL;
+	pf->found = NULL;
+	pf->states = 0;
+}
+
+/**
+ * Build the automaton from all literals
+ *
+ * @param pf - prefilter
+ */
+static int xml_prefilter_compile(struct xml_prefilter *pf) {
+	int *fail = NULL;
+	int *queue = NULL;
+	size_t max = 1;
+	size_t i;
+	int head = 0;
+	int tail = 0;
+	int c;
+
+	xml_prefilter_release(pf);
+
+	for (i = 0; i < pf->literal_count; ++i) {
+		max += pf->literals[i].length;
+	}
+
+	if (!(pf->delta = malloc(max * 256 * sizeof(int))) ||
+			!(pf->output = malloc(max * sizeof(int))) ||
+			!(pf->dict = malloc(max * sizeof(int))) ||
+			!(pf->found = calloc(pf->literal_count + 1, 1)) ||
+			!(pf->next = malloc(max * 256 * sizeof(int))) ||
+			!(fail = malloc(max * sizeof(int))) ||
+			!(queue = malloc(max * sizeof(int)))) {
+		free(fail);
+		xml_prefilter_release(pf);
+		return -1;
+	}
+
+	memset(pf->delta, 0xff, 256 * sizeof(int));
+	pf->output[0] = pf->dict[0] = -1;
+	pf->states = 1;
+
+	/* build trie of lower case literals */
+	for (i = 0; i < pf->literal_count; ++i) {
+		const unsigned char *s = (const unsigned char *)
+			pf->literals[i].s;
+		const unsigned char *e = s + pf->literals[i].length;
+		int state = 0;
+
+		for (; s < e; ++s) {
+			int *t = &pf->delta[state * 256 + *s];
+
+			if (*t < 0) {
+				*t = pf->states++;
+				memset(&pf->delta[*t * 256], 0xff, 256 * sizeof(int));
+				pf->output[*t] = pf->dict[*t] = -1;
+			}
+
+			state = *t;
+		}
+
+		pf->output[state] = i;
+	}
+
+	/* turn trie into a complete automaton in breadth first order */
+	for (c = 0; c < 256; ++c) {
+		int *t = &pf->delta[c];
+
+		if (*t < 0) {
+			*t = 0;
+		} else {
+			fail[*t] = 0;
+			queue[tail++] = *t;
+		}
+	}
+
+	while (head < tail) {
+		int state = queue[head++];
+
+		for (c = 0; c < 256; ++c) {
+			int *t = &pf->delta[state * 256 + c];
+
+			if (*t < 0) {
+				*t = pf->delta[fail[state] * 256 + c];
+			} else {
+				int f = pf->delta[fail[state] * 256 + c];
+
+				fail[*t] = f;
+				pf->dict[*t] = pf->output[f] > -1 ? f : pf->dict[f];
+				queue[tail++] = *t;
+			}
+		}
+	}
+
+	/* upper case input takes the same transitions */
+	for (i = 0; i < (size_t) pf->states; ++i) {
+		int *row = &pf->delta[i * 256];
+
+		for (c = 'A'; c <= 'Z'; ++c) {
+			row[c] = row[tolower(c)];
+		}
+	}
+
+	for (i = 0; i < (size_t) pf->states * 256; ++i) {
+		int t = pf->delta[i];
+
+		pf->next[i] = pf->output[t] > -1 || pf->dict[t] > -1 ?
+			~(t * 256) :
+			t * 256;
+	}
+
+	/* a single first byte without case lets the scanner skip
+	 * to candidates with memchr() */
+	pf->first = -1;
+
+	for (i = 0; i < pf->literal_count; ++i) {
+		c = (unsigned char) *pf->literals[i].s;
+
+		if (toupper(c) != c || (pf->first > -1 && pf->first != c)) {
+			pf->first = -1;
+			break;
+		}
+
+		pf->first = c;
+	}
+
+	free(fail);
+	free(queue);
+
+	pf->compiled = 1;
+
+	return 0;
+}
+
+/**
+ * Return true if all literals of any group have been found
+ *
+ * @param pf - prefilter
+ */
+static int xml_prefilter_satisfied(struct xml_prefilter *pf) {
+	size_t i;
+
+	for (i = 0; i < pf->group_count; ++i) {
+		struct xml_prefilter_group *g = &pf->groups[i];
+		size_t j;
+
+		for (j = 0; j < g->count && pf->found[g->literals[j]]; ++j);
+
+		if (j == g->count) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*****************************************************************************
+ * PUBLIC INTERFACE
+ ****************************************************************************/
+
+/**
+ * Create a new, empty prefilter
+ */
+struct xml_prefilter *xml_prefilter_create(void) {
+	return calloc(1, sizeof(struct xml_prefilter));
+}
+
+/**
+ * Free prefilter
+ *
+ * @param pf - prefilter
+ */
+void xml_prefilter_free(struct xml_prefilter *pf) {
+	size_t i;
+
+	if (!pf) {
+		return;
+	}
+
+	xml_prefilter_release(pf);
+
+	for (i = 0; i < pf->literal_count; ++i) {
+		free(pf->literals[i].s);
+	}
+
+	for (i = 0; i < pf->group_count; ++i) {
+		free(pf->groups[i].literals);
+	}
+
+	free(pf->literals);
+	free(pf->groups);
+	free(pf);
+}
+
+/**
+ * Add path; a document is a candidate if it contains the start of
+ * every tag and all attribute names and values of the path
+ *
+ * @param pf - prefilter
+ * @param path - slash seperated element path with optional
+ *               "?key=value" restriction for attributes
+ */
+int xml_prefilter_add(struct xml_prefilter *pf, const char *path) {
+	struct xml_prefilter_group *g;
+
+	if (!pf || !path || !(g = xml_prefilter_group(pf))) {
+		return -1;
+	}
+
+	while (path && *path) {
+		struct xml_path_segment seg = {0, NULL};
+		struct xml_query_string *q;
+		const char *next = xml_first_path_segment(&seg, path);
+		char *tag;
+		int r = 0;
+
+		if (seg.tag_len > 0) {
+			if (!(tag = malloc(seg.tag_len + 1))) {
+				xml_free_query_strings(&seg);
+				return -1;
+			}
+
+			*tag = '<';
+			memcpy(tag + 1, path, seg.tag_len);
+			r = xml_prefilter_group_add(pf, g, tag, seg.tag_len + 1);
+			free(tag);
+		}
+
+		for (q = seg.query; q && !r; q = q->next) {
+			r = xml_prefilter_group_add(pf, g, q->key, q->key_len) ||
+				xml_prefilter_group_add(
+					pf,
+					g,
+					q->value,
+					q->value_len);
+		}
+
+		xml_free_query_strings(&seg);
+
+		if (r) {
+			return -1;
+		}
+
+		path = next;
+	}
+
+	return 0;
+}
+
+/**
+ * Add a single literal; a document is a candidate if it contains
+ * the literal
+ *
+ * @param pf - prefilter
+ * @param s - literal
+ * @param l - length of literal
+ */
+int xml_prefilter_add_literal(
+		struct xml_prefilter *pf,
+		const char *s,
+		size_t l) {
+	struct xml_prefilter_group *g;
+
+	if (!pf || !s || !(g = xml_prefilter_group(pf))) {
+		return -1;
+	}
+
+	return xml_prefilter_group_add(pf, g, s, l);
+}
+
+/**
+ * Start scanning a new document
+ *
+ * @param pf - prefilter
+ */
+void xml_prefilter_reset(struct xml_prefilter *pf) {
+	pf->state = 0;
+	pf->candidate = 0;
+
+	if (pf->found) {
+		memset(pf->found, 0, pf->literal_count);
+
+		/* paths without literals match everything */
+		pf->candidate = xml_prefilter_satisfied(pf);
+	}
+}
+
+/**
+ * Scan next chunk of a document; returns 1 as soon as the document
+ * is a candidate, 0 if it isn't (yet) and -1 on error
+ *
+ * @param pf - prefilter
+ * @param d - chunk of raw bytes
+ * @param len - length of chunk
+ */
+int xml_prefilter_feed(struct xml_prefilter *pf, const char *d, size_t len) {
+	const unsigned char *p = (const unsigned char *) d;
+	const unsigned char *end = p + len;
+	const int *next;
+	int state;
+
+	if (!pf) {
+		return -1;
+	}
+
+	if (!pf->compiled) {
+		if (xml_prefilter_compile(pf)) {
+			return -1;
+		}
+
+		xml_prefilter_reset(pf);
+	}
+
+	if (pf->candidate) {
+		return 1;
+	}
+
+	next = pf->next;
+
+	/* scan with premultiplied state */
+	state = pf->state * 256;
+
+	while (p < end) {
+		int s;
+
+		if (pf->first < 0) {
+			/* find next state that ends a literal */
+			while (p < end && (state = next[state + *p++]) > -1);
+
+			if (state > -1) {
+				break;
+			}
+		} else if (!state &&
+				!(p = memchr(p, pf->first, end - p))) {
+			break;
+		} else if ((state = next[state + *p++]) > -1) {
+			continue;
+		}
+
+		state = ~state;
+		s = state / 256;
+
+		for (s = pf->output[s] > -1 ? s : pf->dict[s];
+				s > -1;
+				s = pf->dict[s]) {
+			if (!pf->found[pf->output[s]]) {
+				pf->found[pf->output[s]] = 1;
+
+				if (xml_prefilter_satisfied(pf)) {
+					pf->candidate = 1;
+					pf->state = state / 256;
+					return 1;
+				}
+			}
+		}
+	}
+
+	pf->state = state / 256;
+
+	return 0;
+}
+
+/**
+ * Return 1 if a complete document may contain a path, 0 if it doesn't
+ * and -1 on error
+ *
+ * @param pf - prefilter
+ * @param d - raw bytes of document
+ * @param len - length of document
+ */
+int xml_prefilter_match(
+		struct xml_prefilter *pf,
+		const char *d,
+		size_t len) {
+	if (!pf) {
+		return -1;
+	}
+
+	if (pf->compiled) {
+		xml_prefilter_reset(pf);
+	}
+
+	return xml_prefilter_feed(pf, d, len);
+}
@@ -0,0 +1,39 @@
+#ifndef _xml_prefilter_h_
+#define _xml_prefilter_h_
+
+#include <stddef.h>
+
+/* Raw byte prefilter that tells if a document may contain an element
+ * of a given path before it is parsed.
+ *
+ * Every path contributes the literals "<tag" for each segment and the
+ * names and values of its attribute restrictions. A document is a
+ * candidate if all literals of at least one path occur anywhere in it.
+ * All literals are searched in a single pass with an Aho-Corasick
+ * automaton. Matching ignores case so it never rejects a document
+ * xml_find() would match in:
+ *
+ *	struct xml_prefilter *pf = xml_prefilter_create();
+ *
+ *	xml_prefilter_add(pf, "hello/world?name=England");
+ *	...
+ *	if (xml_prefilter_match(pf, data, len)) {
+ *		... xml_parse(data) and xml_find(root, path) ...
+ *	}
+ *
+ * Chunked input can be fed with xml_prefilter_reset() and
+ * xml_prefilter_feed(). */
+
+struct xml_prefilter;
+
+struct xml_prefilter *xml_prefilter_create(void);
+void xml_prefilter_free(struct xml_prefilter *);
+
+int xml_prefilter_add(struct xml_prefilter *, const char *);
+int xml_prefilter_add_literal(struct xml_prefilter *, const char *, size_t);
+
+void xml_prefilter_reset(struct xml_prefilter *);
+int xml_prefilter_feed(struct xml_prefilter *, const char *, size_t);
+int xml_prefilter_match(struct xml_prefilter *, const char *, size_t);
+
+#endif
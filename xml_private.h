@@ -0,0 +1,158 @@
+#ifndef _xml_private_h_
+#define _xml_private_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Internal functions shared between the translation units of libxml.
+ * Don't include this header from application code. */
+
+/* true if character data of element is compressed */
+#define XML_COMPRESSED(e) ((e)->value && (e)->compressed)
+
+struct xml_path_segment {
+	size_t tag_len;
+	struct xml_query_string {
+		const char *key;
+		size_t key_len;
+		const char *value;
+		size_t value_len;
+		struct xml_query_string *next;
+	} *query;
+};
+
+void *xml_alloc(struct xml_allocator *, size_t);
+void *xml_resize(struct xml_allocator *, void *, size_t, size_t);
+void xml_release(struct xml_allocator *, void *);
+
+char *xml_string_append(
+	struct xml_allocator *,
+	char **,
+	size_t *,
+	const char *,
+	size_t);
+
+struct xml_element *xml_element_create(
+	struct xml_allocator *,
+	struct xml_element *);
+struct xml_attribute *xml_attribute_create(
+	struct xml_allocator *,
+	struct xml_element *);
+void xml_child_index_drop(struct xml_element *);
+
+size_t xml_hash(const char *, size_t);
+size_t xml_hash_case(const char *, size_t);
+
+/* open addressing hash table for entries of an array; slots hold the
+ * index of an entry plus one, 0 if the slot is free, and its hash, so
+ * the table can grow without looking at entries:
+ *
+ *	size_t probe = 0;
+ *	size_t n;
+ *
+ *	while ((n = xml_table_next(&t, hash, &probe))) {
+ *		if (entries[n - 1] is the one) return n - 1;
+ *	}
+ *	xml_table_set(&t, hash, probe, count + 1);
+ *
+ * Call xml_table_reserve() before looking up an entry that may be
+ * added, since growing moves entries to other slots. An entry found
+ * by xml_table_next() is removed by passing its probe on to
+ * xml_table_remove(). */
+struct xml_table {
+	struct xml_table_slot {
+		size_t entry;
+		size_t hash;
+	} *slots;
+	size_t size;
+};
+
+int xml_table_reserve(struct xml_table *, size_t);
+size_t xml_table_next(const struct xml_table *, size_t, size_t *);
+void xml_table_set(struct xml_table *, size_t, size_t, size_t);
+void xml_table_remove(struct xml_table *, size_t, size_t);
+void xml_table_clear(struct xml_table *);
+void xml_table_free(struct xml_table *);
+
+/* string that isn't necessarily terminated */
+struct xml_string {
+	const char *s;
+	size_t length;
+};
+
+/* feed tokens decoded from something else than XML text through the
+ * events of the tokenizer, so they build a tree or call a builder just
+ * like parsing does */
+int xml_feed_begin(struct xml_state *, const char *);
+int xml_feed_text(struct xml_state *, const char *, size_t);
+int xml_feed_open(
+	struct xml_state *,
+	const char *,
+	const struct xml_string *,
+	const struct xml_string *,
+	size_t);
+int xml_feed_close(
+	struct xml_state *,
+	const char *,
+	const struct xml_string *);
+int xml_feed_special(
+	struct xml_state *,
+	const char *,
+	const struct xml_string *);
+int xml_feed_end(struct xml_state *, const char *);
+
+int xml_value_compress(
+	struct xml_allocator *,
+	struct xml_element *,
+	size_t);
+size_t xml_value_length(struct xml_element *);
+int xml_value_copy(struct xml_element *, char *);
+
+int xml_validator_text(
+	struct xml_validator *,
+	const char *,
+	size_t,
+	size_t);
+int xml_validator_open(struct xml_validator *, struct xml_element *, size_t);
+int xml_validator_close(struct xml_validator *, struct xml_element *, size_t);
+
+const char *xml_first_path_segment(struct xml_path_segment *, const char *);
+const char *xml_last_path_segment(
+	struct xml_path_segment *,
+	const char *,
+	const char *);
+void xml_free_query_strings(struct xml_path_segment *);
+
+/* attributes of a node for xml_segment_match(); "next" returns 0 after
+ * the last attribute and starts over from a copy for every predicate */
+struct xml_attribute_cursor {
+	int (*next)(struct xml_attribute_cursor *, const char **, const char **);
+	const void *base;
+	const void *at;
+	size_t left;
+};
+
+int xml_tag_match(const char *, const char *, size_t);
+int xml_segment_match(
+	struct xml_path_segment *,
+	struct xml_attribute_cursor *,
+	struct xml_explain *,
+	size_t);
+
+/* count work of path step i if x isn't NULL */
+#define XML_EXPLAIN(x, i, counter) do {\
+	if (x) {\
+		++(x)->step[(i) < XML_EXPLAIN_STEPS ?\
+			(i) : XML_EXPLAIN_STEPS - 1].counter;\
+	}\
+} while (0)
+
+void xml_explain_path(struct xml_explain *, const char *);
+size_t xml_explain_index(const char *, const char *);
+void xml_explain_segment(
+	struct xml_explain *,
+	size_t,
+	struct xml_path_segment *);
+
+#endif
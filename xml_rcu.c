@@ -0,0 +1,322 @@
+#ifndef WIN32
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xml.h"
+#include "xml_rcu.h"
+
+/* readers write their epoch on every lock, so every reader gets a
+ * cache line of its own */
+#define XML_RCU_LINE 64
+
+struct xml_rcu_reader {
+	/* epoch the outermost lock was entered in, 0 while outside */
+	uint64_t epoch;
+
+	/* number of nested locks, only used by the reading thread */
+	unsigned long depth;
+
+	struct xml_rcu *rcu;
+	struct xml_rcu_reader *next;
+
+	char padding[XML_RCU_LINE - sizeof(uint64_t) - sizeof(unsigned long) -
+		2 * sizeof(void *)];
+};
+
+/* replaced tree that may still be in use */
+struct xml_rcu_retired {
+	struct xml_rcu_retired *next;
+	struct xml_element *root;
+
+	/* epoch after the tree was replaced; readers that entered in
+	 * this epoch or later can't see it */
+	uint64_t epoch;
+};
+
+struct xml_rcu {
+	/* written by writers only */
+	struct xml_element *root;
+	uint64_t epoch;
+
+	void (*release)(struct xml_element *);
+
+	/* protects readers and retired trees */
+	pthread_mutex_t lock;
+	struct xml_rcu_reader *readers;
+	struct xml_rcu_retired *retired;
+};
+
+/**
+ * Free tree
+ *
+ * @param rcu - published tree
+ * @param root - root element
+ */
+static void xml_rcu_release(struct xml_rcu *rcu, struct xml_element *root) {
+	if (rcu->release) {
+		rcu->release(root);
+	} else {
+		xml_free(root);
+	}
+}
+
+/**
+ * Return the oldest epoch a reader is in or UINT64_MAX if no reader
+ * holds a lock; must be called with lock held
+ *
+ * @param rcu - published tree
+ */
+static uint64_t xml_rcu_oldest(struct xml_rcu *rcu) {
+	uint64_t oldest = UINT64_MAX;
+	struct xml_rcu_reader *r;
+
+	for (r = rcu->readers; r; r = r->next) {
+		uint64_t e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+
+		if (e && e < oldest) {
+			oldest = e;
+		}
+	}
+
+	return oldest;
+}
+
+/**
+ * Take retired trees no reader can see anymore from list; must be
+ * called with lock held
+ *
+ * @param rcu - published tree
+ */
+static struct xml_rcu_retired *xml_rcu_collect(struct xml_rcu *rcu) {
+	uint64_t oldest = xml_rcu_oldest(rcu);
+	struct xml_rcu_retired **p = &rcu->retired;
+	struct xml_rcu_retired *done = NULL;
+
+	while (*p) {
+		struct xml_rcu_retired *t = *p;
+
+		if (t->epoch <= oldest) {
+			*p = t->next;
+			t->next = done;
+			done = t;
+		} else {
+			p = &t->next;
+		}
+	}
+
+	return done;
+}
+
+/**
+ * Free collected trees
+ *
+ * @param rcu - published tree
+ * @param t - list of retired trees
+ */
+static void xml_rcu_reclaim(struct xml_rcu *rcu, struct xml_rcu_retired *t) {
+	struct xml_rcu_retired *n;
+
+	for (; t; t = n) {
+		n = t->next;
+		xml_rcu_release(rcu, t->root);
+		free(t);
+	}
+}
+
+/**
+ * Create published tree
+ *
+ * @param root - root element of first tree
+ * @param release - function that frees trees, NULL for xml_free()
+ */
+struct xml_rcu *xml_rcu_create(
+		struct xml_element *root,
+		void (*release)(struct xml_element *)) {
+	struct xml_rcu *rcu;
+
+	if (!root || !(rcu = calloc(1, sizeof(*rcu)))) {
+		return NULL;
+	}
+
+	rcu->root = root;
+	rcu->epoch = 1;
+	rcu->release = release;
+	pthread_mutex_init(&rcu->lock, NULL);
+
+	return rcu;
+}
+
+/**
+ * Free published tree, all replaced trees and all readers; no reader
+ * may hold a lock anymore
+ *
+ * @param rcu - published tree
+ */
+void xml_rcu_free(struct xml_rcu *rcu) {
+	struct xml_rcu_reader *r, *n;
+
+	if (!rcu) {
+		return;
+	}
+
+	xml_rcu_reclaim(rcu, rcu->retired);
+	xml_rcu_release(rcu, rcu->root);
+
+	for (r = rcu->readers; r; r = n) {
+		n = r->next;
+		free(r);
+	}
+
+	pthread_mutex_destroy(&rcu->lock);
+	free(rcu);
+}
+
+/**
+ * Register reader for the calling thread
+ *
+ * @param rcu - published tree
+ */
+struct xml_rcu_reader *xml_rcu_register(struct xml_rcu *rcu) {
+	struct xml_rcu_reader *r;
+
+	if (!rcu || posix_memalign((void **) &r, XML_RCU_LINE, sizeof(*r))) {
+		return NULL;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->rcu = rcu;
+
+	pthread_mutex_lock(&rcu->lock);
+	r->next = rcu->readers;
+	rcu->readers = r;
+	pthread_mutex_unlock(&rcu->lock);
+
+	return r;
+}
+
+/**
+ * Unregister reader; it must not hold a lock
+ *
+ * @param r - reader
+ */
+void xml_rcu_unregister(struct xml_rcu_reader *r) {
+	struct xml_rcu_reader **p;
+	struct xml_rcu *rcu;
+
+	if (!r) {
+		return;
+	}
+
+	rcu = r->rcu;
+	pthread_mutex_lock(&rcu->lock);
+
+	for (p = &rcu->readers; *p && *p != r; p = &(*p)->next);
+
+	if (*p) {
+		*p = r->next;
+	}
+
+	pthread_mutex_unlock(&rcu->lock);
+	free(r);
+}
+
+/**
+ * Enter read-side critical section and return the current tree
+ *
+ * @param r - reader
+ */
+struct xml_element *xml_rcu_lock(struct xml_rcu_reader *r) {
+	struct xml_rcu *rcu = r->rcu;
+
+	/* the epoch must be visible before the tree is loaded, so a
+	 * writer that doesn't see it yet has replaced the tree before */
+	if (r->depth++ == 0) {
+		__atomic_store_n(&r->epoch,
+			__atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST),
+			__ATOMIC_SEQ_CST);
+	}
+
+	return __atomic_load_n(&rcu->root, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Leave read-side critical section
+ *
+ * @param r - reader
+ */
+void xml_rcu_unlock(struct xml_rcu_reader *r) {
+	if (r->depth > 0 && --r->depth == 0) {
+		__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Replace the current tree and free replaced trees that no reader can
+ * see anymore
+ *
+ * @param rcu - published tree
+ * @param root - root element of new tree
+ */
+int xml_rcu_publish(struct xml_rcu *rcu, struct xml_element *root) {
+	struct xml_rcu_retired *t;
+	struct xml_rcu_retired *done;
+
+	if (!rcu || !root) {
+		return -1;
+	}
+
+	if (!(t = malloc(sizeof(*t)))) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&rcu->lock);
+
+	t->root = __atomic_exchange_n(&rcu->root, root, __ATOMIC_SEQ_CST);
+	t->epoch = __atomic_add_fetch(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+	t->next = rcu->retired;
+	rcu->retired = t;
+
+	done = xml_rcu_collect(rcu);
+
+	pthread_mutex_unlock(&rcu->lock);
+
+	/* trees are freed without blocking other writers */
+	xml_rcu_reclaim(rcu, done);
+
+	return 0;
+}
+
+/**
+ * Wait until all replaced trees have been freed
+ *
+ * @param rcu - published tree
+ */
+void xml_rcu_wait(struct xml_rcu *rcu) {
+	struct timespec ts = {0, 100000};
+
+	if (!rcu) {
+		return;
+	}
+
+	for (;;) {
+		struct xml_rcu_retired *done;
+		int pending;
+
+		pthread_mutex_lock(&rcu->lock);
+		done = xml_rcu_collect(rcu);
+		pending = rcu->retired != NULL;
+		pthread_mutex_unlock(&rcu->lock);
+
+		xml_rcu_reclaim(rcu, done);
+
+		if (!pending) {
+			break;
+		}
+
+		nanosleep(&ts, NULL);
+	}
+}
+#endif
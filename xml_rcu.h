@@ -0,0 +1,52 @@
+#ifndef _xml_rcu_h_
+#define _xml_rcu_h_
+
+#include "xml.h"
+
+/* Published trees for configuration that is read by many threads and
+ * reloaded now and then.
+ *
+ * Every reading thread registers once and brackets its reads with
+ * xml_rcu_lock() and xml_rcu_unlock(). These never block and never
+ * write anything but the reader's own epoch. A writer parses the new
+ * document on its own and publishes it; the old tree is freed as soon
+ * as no reader can still see it:
+ *
+ *	struct xml_rcu *rcu = xml_rcu_create(xml_parse(conf), NULL);
+ *
+ *	reader thread:
+ *	struct xml_rcu_reader *r = xml_rcu_register(rcu);
+ *	root = xml_rcu_lock(r);
+ *	... xml_find(root, path) ...
+ *	xml_rcu_unlock(r);
+ *	...
+ *	xml_rcu_unregister(r);
+ *
+ *	writer thread:
+ *	xml_rcu_publish(rcu, xml_parse(new_conf));
+ *
+ * A tree stays valid until the xml_rcu_unlock() that matches the
+ * xml_rcu_lock() that returned it; calls may be nested. Replaced trees
+ * that are still in use are freed by a later xml_rcu_publish() or
+ * xml_rcu_wait(), which waits until all of them are freed, or by
+ * xml_rcu_free(). The release function frees trees; NULL means
+ * xml_free(). Published trees must not be changed. */
+
+struct xml_rcu;
+struct xml_rcu_reader;
+
+struct xml_rcu *xml_rcu_create(
+	struct xml_element *,
+	void (*)(struct xml_element *));
+void xml_rcu_free(struct xml_rcu *);
+
+struct xml_rcu_reader *xml_rcu_register(struct xml_rcu *);
+void xml_rcu_unregister(struct xml_rcu_reader *);
+
+struct xml_element *xml_rcu_lock(struct xml_rcu_reader *);
+void xml_rcu_unlock(struct xml_rcu_reader *);
+
+int xml_rcu_publish(struct xml_rcu *, struct xml_element *);
+void xml_rcu_wait(struct xml_rcu *);
+
+#endif
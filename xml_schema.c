@@ -0,0 +1,784 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_schema.h"
+
+#define XML_SCHEMA_BLANK " \t\r"
+#define XML_SCHEMA_SPECIAL " \t\r\n:()|?*+@#"
+#define XML_SCHEMA_TEXT "#text"
+
+#define WHITESPACE " \t\r\n"
+
+struct xml_schema_type {
+	char *name;
+
+	/* non-zero if character data is allowed */
+	int text;
+
+	/* names of required attributes */
+	char **required;
+	size_t required_count;
+	size_t required_size;
+
+	/* content automaton with one row of successor states per state
+	 * and a column per element type; -1 rejects */
+	int *next;
+	unsigned char *accept;
+};
+
+struct xml_schema {
+	struct xml_schema_type *types;
+	size_t count;
+	size_t size;
+
+	/* types by name */
+	struct xml_table index;
+};
+
+/* a term of a content model while compiling */
+struct xml_schema_particle {
+	/* range of element types in the list of members */
+	size_t first;
+	size_t count;
+
+	/* minimum of one, maximum of many */
+	int required;
+	int many;
+};
+
+struct xml_schema_model {
+	struct xml_schema_particle *particles;
+	size_t count;
+	size_t size;
+
+	long *members;
+	size_t member_count;
+	size_t member_size;
+};
+
+struct xml_validator_frame {
+	long type;
+	int state;
+};
+
+struct xml_validator {
+	const struct xml_schema *schema;
+
+	/* one frame per open element */
+	struct xml_validator_frame *stack;
+	size_t depth;
+	size_t size;
+
+	/* number of root elements */
+	int roots;
+
+	/* first error and where it occurred */
+	const char *error;
+	size_t offset;
+};
+
+/*****************************************************************************
+ * ELEMENT TYPES
+ ****************************************************************************/
+
+/**
+ * Grow array to hold at least one more item
+ *
+ * @param p - address of array
+ * @param size - address of number of allocated items
+ * @param count - number of items in use
+ * @param item - size of one item
+ */
+static int xml_schema_grow(void **p, size_t *size, size_t count, size_t item) {
+	size_t n;
+	void *a;
+
+	if (count < *size) {
+		return 0;
+	}
+
+	n = *size ? *size << 1 : 16;
+
+	if (!(a = realloc(*p, n * item))) {
+		return -1;
+	}
+
+	*p = a;
+	*size = n;
+
+	return 0;
+}
+
+/**
+ * Return index of element type or -1 if there's none
+ *
+ * @param s - schema
+ * @param name - name of element
+ * @param l - length of name
+ */
+static long xml_schema_find(
+		const struct xml_schema *s,
+		const char *name,
+		size_t l) {
+	size_t hash = xml_hash_case(name, l);
+	size_t probe = 0;
+	size_t n;
+
+	while ((n = xml_table_next(&s->index, hash, &probe))) {
+		const char *t = s->types[n - 1].name;
+
+		if (!strncasecmp(t, name, l) && !t[l]) {
+			return n - 1;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Declare element type; fails for duplicates
+ *
+ * @param s - schema
+ * @param name - name of element
+ * @param l - length of name
+ */
+static int xml_schema_declare(
+		struct xml_schema *s,
+		const char *name,
+		size_t l) {
+	struct xml_schema_type *t;
+	size_t hash = xml_hash_case(name, l);
+	size_t probe = 0;
+
+	if (xml_schema_find(s, name, l) > -1 ||
+			xml_table_reserve(&s->index, s->count + 1) ||
+			xml_schema_grow(
+				(void **) &s->types,
+				&s->size,
+				s->count,
+				sizeof(struct xml_schema_type))) {
+		return -1;
+	}
+
+	t = s->types + s->count;
+	memset(t, 0, sizeof(struct xml_schema_type));
+
+	if (!(t->name = malloc(l + 1))) {
+		return -1;
+	}
+
+	memcpy(t->name, name, l);
+	t->name[l] = 0;
+	++s->count;
+
+	while (xml_table_next(&s->index, hash, &probe));
+	xml_table_set(&s->index, hash, probe, s->count);
+
+	return 0;
+}
+
+/*****************************************************************************
+ * COMPILING
+ ****************************************************************************/
+
+/**
+ * Return true if element type is member of particle
+ *
+ * @param m - content model
+ * @param p - particle
+ * @param type - element type
+ */
+static int xml_schema_member(
+		struct xml_schema_model *m,
+		struct xml_schema_particle *p,
+		long type) {
+	size_t i;
+
+	for (i = 0; i < p->count; ++i) {
+		if (m->members[p->first + i] == type) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Return state after an element of given type when all particles
+ * before the given one are satisfied, or -1
+ *
+ * @param m - content model
+ * @param from - index of first particle that may take the element
+ * @param type - element type
+ */
+static int xml_schema_enter(struct xml_schema_model *m, size_t from, long type) {
+	size_t j;
+
+	for (j = from; j < m->count; ++j) {
+		if (xml_schema_member(m, m->particles + j, type)) {
+			return m->count + 1 + j;
+		}
+
+		if (m->particles[j].required) {
+			break;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Build content automaton of element type
+ *
+ * There are two states per particle, one before it and one within it,
+ * and a final state after the last particle. Elements are taken by the
+ * first particle that has them, skipping optional ones.
+ *
+ * @param s - schema
+ * @param t - element type
+ * @param m - content model
+ */
+static int xml_schema_automaton(
+		struct xml_schema *s,
+		struct xml_schema_type *t,
+		struct xml_schema_model *m) {
+	size_t states = m->count * 2 + 1;
+	size_t n = s->count;
+	size_t k;
+	long x;
+
+	if (!(t->next = malloc(states * n * sizeof(int))) ||
+			!(t->accept = malloc(states))) {
+		return -1;
+	}
+
+	/* states before a particle, from last to first */
+	for (k = m->count + 1; k-- > 0;) {
+		for (x = 0; x < (long) n; ++x) {
+			t->next[k * n + x] = xml_schema_enter(m, k, x);
+		}
+
+		t->accept[k] = k == m->count ||
+			(!m->particles[k].required && t->accept[k + 1]);
+	}
+
+	/* states within a particle repeat it or continue after it */
+	for (k = 0; k < m->count; ++k) {
+		size_t state = m->count + 1 + k;
+		struct xml_schema_particle *p = m->particles + k;
+
+		for (x = 0; x < (long) n; ++x) {
+			t->next[state * n + x] =
+				p->many && xml_schema_member(m, p, x) ?
+					(int) state :
+					t->next[(k + 1) * n + x];
+		}
+
+		t->accept[state] = t->accept[k + 1];
+	}
+
+	return 0;
+}
+
+/**
+ * Return length of name at given position
+ *
+ * @param p - position
+ */
+static size_t xml_schema_name(const char *p) {
+	return strcspn(p, XML_SCHEMA_SPECIAL);
+}
+
+/**
+ * Add element type of name at given position to content model;
+ * returns position after name or NULL
+ *
+ * @param s - schema
+ * @param m - content model
+ * @param p - position
+ */
+static const char *xml_schema_add_member(
+		struct xml_schema *s,
+		struct xml_schema_model *m,
+		const char *p) {
+	size_t l = xml_schema_name(p);
+	long type;
+
+	if (!l ||
+			(type = xml_schema_find(s, p, l)) < 0 ||
+			xml_schema_grow(
+				(void **) &m->members,
+				&m->member_size,
+				m->member_count,
+				sizeof(long))) {
+		return NULL;
+	}
+
+	m->members[m->member_count++] = type;
+
+	return p + l;
+}
+
+/**
+ * Parse content model; returns position after it or NULL
+ *
+ * @param s - schema
+ * @param t - element type
+ * @param m - content model
+ * @param p - first character after ':'
+ */
+static const char *xml_schema_content(
+		struct xml_schema *s,
+		struct xml_schema_type *t,
+		struct xml_schema_model *m,
+		const char *p) {
+	for (;;) {
+		struct xml_schema_particle *particle;
+
+		p += strspn(p, XML_SCHEMA_BLANK);
+
+		if (!*p || *p == '\n') {
+			return p;
+		}
+
+		if (!strncmp(p, XML_SCHEMA_TEXT, sizeof(XML_SCHEMA_TEXT) - 1)) {
+			t->text = 1;
+			p += sizeof(XML_SCHEMA_TEXT) - 1;
+			continue;
+		}
+
+		if (xml_schema_grow(
+				(void **) &m->particles,
+				&m->size,
+				m->count,
+				sizeof(struct xml_schema_particle))) {
+			return NULL;
+		}
+
+		particle = m->particles + m->count++;
+		particle->first = m->member_count;
+
+		if (*p == '(') {
+			do {
+				p += strspn(p + 1, XML_SCHEMA_BLANK) + 1;
+
+				if (!(p = xml_schema_add_member(s, m, p))) {
+					return NULL;
+				}
+
+				p += strspn(p, XML_SCHEMA_BLANK);
+			} while (*p == '|');
+
+			if (*p++ != ')') {
+				return NULL;
+			}
+		} else if (!(p = xml_schema_add_member(s, m, p))) {
+			return NULL;
+		}
+
+		particle->count = m->member_count - particle->first;
+		particle->required = *p != '?' && *p != '*';
+		particle->many = *p == '*' || *p == '+';
+
+		if (*p == '?' || *p == '*' || *p == '+') {
+			++p;
+		}
+	}
+}
+
+/**
+ * Parse rule; returns position after it or NULL
+ *
+ * @param s - schema
+ * @param m - content model, reused between rules
+ * @param p - first character of rule
+ */
+static const char *xml_schema_rule(
+		struct xml_schema *s,
+		struct xml_schema_model *m,
+		const char *p) {
+	size_t l = xml_schema_name(p);
+	struct xml_schema_type *t = s->types + xml_schema_find(s, p, l);
+
+	m->count = 0;
+	m->member_count = 0;
+
+	for (p += l;;) {
+		p += strspn(p, XML_SCHEMA_BLANK);
+
+		if (*p != '@') {
+			break;
+		}
+
+		if (!(l = xml_schema_name(++p)) ||
+				xml_schema_grow(
+					(void **) &t->required,
+					&t->required_size,
+					t->required_count,
+					sizeof(char *))) {
+			return NULL;
+		}
+
+		if (!(t->required[t->required_count] = malloc(l + 1))) {
+			return NULL;
+		}
+
+		memcpy(t->required[t->required_count], p, l);
+		t->required[t->required_count++][l] = 0;
+		p += l;
+	}
+
+	if (*p == ':' && !(p = xml_schema_content(s, t, m, p + 1))) {
+		return NULL;
+	}
+
+	if (*p && *p != '\n') {
+		return NULL;
+	}
+
+	return xml_schema_automaton(s, t, m) ? NULL : p;
+}
+
+/*****************************************************************************
+ * VALIDATION
+ ****************************************************************************/
+
+/**
+ * Record error
+ *
+ * @param v - validator
+ * @param error - description
+ * @param offset - offset of offending byte
+ */
+static int xml_validator_fail(
+		struct xml_validator *v,
+		const char *error,
+		size_t offset) {
+	v->error = error;
+	v->offset = offset;
+
+	return -1;
+}
+
+/**
+ * Check character data of open element
+ *
+ * @param v - validator
+ * @param d - character data
+ * @param l - length of character data
+ * @param offset - offset of first byte of character data
+ */
+int xml_validator_text(
+		struct xml_validator *v,
+		const char *d,
+		size_t l,
+		size_t offset) {
+	size_t i;
+
+	v->offset = offset + l;
+
+	if (v->depth > 0 &&
+			v->schema->types[v->stack[v->depth - 1].type].text) {
+		return 0;
+	}
+
+	for (i = 0; i < l && strchr(WHITESPACE, d[i]); ++i);
+
+	if (i < l) {
+		return xml_validator_fail(v, "unexpected character data", offset + i);
+	}
+
+	return 0;
+}
+
+/**
+ * Check element with a complete start tag and enter it
+ *
+ * @param v - validator
+ * @param e - element
+ * @param offset - offset of the '>' that ends the start tag
+ */
+int xml_validator_open(
+		struct xml_validator *v,
+		struct xml_element *e,
+		size_t offset) {
+	const struct xml_schema *s = v->schema;
+	struct xml_validator_frame *f;
+	struct xml_schema_type *t;
+	long type = xml_schema_find(s, e->key, strlen(e->key));
+	size_t i;
+
+	v->offset = offset;
+
+	if (type < 0) {
+		return xml_validator_fail(v, "undeclared element", offset);
+	}
+
+	if (!v->depth) {
+		if (v->roots++ || type != 0) {
+			return xml_validator_fail(v, "unexpected root element", offset);
+		}
+	} else {
+		int state;
+
+		f = v->stack + v->depth - 1;
+		state = s->types[f->type].next[f->state * s->count + type];
+
+		if (state < 0) {
+			return xml_validator_fail(v, "unexpected element", offset);
+		}
+
+		f->state = state;
+	}
+
+	t = s->types + type;
+
+	for (i = 0; i < t->required_count; ++i) {
+		if (!xml_find_attribute(e->first_attribute, t->required[i])) {
+			return xml_validator_fail(
+				v,
+				"missing required attribute",
+				offset);
+		}
+	}
+
+	if (xml_schema_grow(
+			(void **) &v->stack,
+			&v->size,
+			v->depth,
+			sizeof(struct xml_validator_frame))) {
+		return xml_validator_fail(v, "out of memory", offset);
+	}
+
+	f = v->stack + v->depth++;
+	f->type = type;
+	f->state = 0;
+
+	return 0;
+}
+
+/**
+ * Check and leave closed element
+ *
+ * @param v - validator
+ * @param e - element
+ * @param offset - offset of the '>' that ends the tag
+ */
+int xml_validator_close(
+		struct xml_validator *v,
+		struct xml_element *e,
+		size_t offset) {
+	struct xml_validator_frame *f;
+
+	v->offset = offset;
+
+	/* character data has been checked already */
+	if (!e->key) {
+		return 0;
+	}
+
+	if (*e->key == '!' || *e->key == '?') {
+		static const char cdata[] = "![CDATA[";
+		size_t l;
+
+		if (strncmp(e->key, cdata, sizeof(cdata) - 1)) {
+			return 0;
+		}
+
+		/* the key ends with "]]" of the terminating pattern */
+		l = strlen(e->key) - (sizeof(cdata) - 1) - 2;
+
+		return xml_validator_text(
+			v,
+			e->key + sizeof(cdata) - 1,
+			l,
+			offset - 2 - l);
+	}
+
+	if (!v->depth) {
+		return xml_validator_fail(v, "unexpected end tag", offset);
+	}
+
+	f = v->stack + v->depth - 1;
+
+	if (!v->schema->types[f->type].accept[f->state]) {
+		return xml_validator_fail(v, "missing child element", offset);
+	}
+
+	--v->depth;
+
+	return 0;
+}
+
+/*****************************************************************************
+ * PUBLIC INTERFACE
+ ****************************************************************************/
+
+/**
+ * Compile schema; returns NULL if it's malformed or refers to
+ * undeclared elements
+ *
+ * @param source - schema source
+ */
+struct xml_schema *xml_schema_compile(const char *source) {
+	struct xml_schema_model m;
+	struct xml_schema *s;
+	const char *p;
+
+	if (!source || !(s = calloc(1, sizeof(struct xml_schema)))) {
+		return NULL;
+	}
+
+	memset(&m, 0, sizeof(m));
+
+	/* declare all element types first so rules can refer to
+	 * elements of later rules */
+	for (p = source; *p; p += strcspn(p, "\n"), p += !!*p) {
+		size_t l;
+
+		p += strspn(p, XML_SCHEMA_BLANK);
+
+		if (*p == '#' || *p == '\n' || !*p) {
+			continue;
+		}
+
+		if (!(l = xml_schema_name(p)) || xml_schema_declare(s, p, l)) {
+			goto fail;
+		}
+	}
+
+	if (!s->count) {
+		goto fail;
+	}
+
+	for (p = source; *p; p += !!*p) {
+		p += strspn(p, XML_SCHEMA_BLANK);
+
+		if (*p == '#') {
+			p += strcspn(p, "\n");
+		} else if (*p != '\n' && *p &&
+				!(p = xml_schema_rule(s, &m, p))) {
+			goto fail;
+		}
+	}
+
+	free(m.particles);
+	free(m.members);
+
+	return s;
+
+fail:
+	free(m.particles);
+	free(m.members);
+	xml_schema_free(s);
+
+	return NULL;
+}
+
+/**
+ * Free schema
+ *
+ * @param s - schema
+ */
+void xml_schema_free(struct xml_schema *s) {
+	size_t i;
+
+	if (!s) {
+		return;
+	}
+
+	for (i = 0; i < s->count; ++i) {
+		struct xml_schema_type *t = s->types + i;
+		size_t j;
+
+		for (j = 0; j < t->required_count; ++j) {
+			free(t->required[j]);
+		}
+
+		free(t->required);
+		free(t->next);
+		free(t->accept);
+		free(t->name);
+	}
+
+	free(s->types);
+	xml_table_free(&s->index);
+	free(s);
+}
+
+/**
+ * Create validator for schema
+ *
+ * @param s - compiled schema
+ */
+struct xml_validator *xml_validator_create(const struct xml_schema *s) {
+	struct xml_validator *v;
+
+	if (!s || !(v = calloc(1, sizeof(struct xml_validator)))) {
+		return NULL;
+	}
+
+	v->schema = s;
+
+	return v;
+}
+
+/**
+ * Free validator
+ *
+ * @param v - validator
+ */
+void xml_validator_free(struct xml_validator *v) {
+	if (!v) {
+		return;
+	}
+
+	free(v->stack);
+	free(v);
+}
+
+/**
+ * Prepare validator for next document
+ *
+ * @param v - validator
+ */
+void xml_validator_reset(struct xml_validator *v) {
+	v->depth = 0;
+	v->roots = 0;
+	v->error = NULL;
+	v->offset = 0;
+}
+
+/**
+ * Check that document is complete after all chunks have been parsed
+ *
+ * @param v - validator
+ */
+int xml_validator_finish(struct xml_validator *v) {
+	if (v->error) {
+		return -1;
+	}
+
+	if (!v->roots || v->depth > 0) {
+		return xml_validator_fail(v, "incomplete document", v->offset);
+	}
+
+	return 0;
+}
+
+/**
+ * Return description of first error or NULL if there was none
+ *
+ * @param v - validator
+ * @param offset - receives offset of offending byte, may be NULL
+ */
+const char *xml_validator_error(struct xml_validator *v, size_t *offset) {
+	if (offset) {
+		*offset = v->error ? v->offset : 0;
+	}
+
+	return v->error;
+}
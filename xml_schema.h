@@ -0,0 +1,64 @@
+#ifndef _xml_schema_h_
+#define _xml_schema_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Structural validation while parsing.
+ *
+ * A schema has one rule per line that names an element, its required
+ * attributes and its content model. The first rule describes the root
+ * element; lines starting with '#' are comments:
+ *
+ *	hello: world*
+ *	world @name: country*
+ *	country: #text city*
+ *	city @name: #text
+ *
+ * A content model is a sequence of element names or groups of
+ * alternatives like "(LINE|STAGEDIR)", each optionally followed by '?'
+ * (zero or one), '*' (any number) or '+' (at least one). It's matched
+ * greedily from left to right, so models must be unambiguous like in a
+ * DTD. "#text" allows character data other than white space. Elements
+ * without ':' must be empty. Names are compared ignoring case like in
+ * xml_find().
+ *
+ * Every rule is compiled into an automaton over the declared element
+ * types. A validator runs these automata from within the parser as
+ * elements open and close, without looking at the tree, and makes
+ * xml_parse_chunk() fail as soon as the schema is violated. The error
+ * offset is that of the first byte of unexpected character data or of
+ * the '>' that ends the offending tag:
+ *
+ *	struct xml_schema *schema = xml_schema_compile(source);
+ *	struct xml_validator *v = xml_validator_create(schema);
+ *	struct xml_state st;
+ *	size_t offset;
+ *
+ *	memset(&st, 0, sizeof(st));
+ *	st.validator = v;
+ *
+ *	if (... xml_parse_chunk(&st, chunk) ... ||
+ *			xml_validator_finish(v)) {
+ *		printf("%s at byte %lu\n", xml_validator_error(v, &offset),
+ *			(unsigned long) offset);
+ *	}
+ *
+ * The validator never looks at elements after they are closed, so the
+ * "close" callback may free them. A schema can be shared by any number
+ * of validators; a validator can be reused after xml_validator_reset(). */
+
+struct xml_schema;
+struct xml_validator;
+
+struct xml_schema *xml_schema_compile(const char *);
+void xml_schema_free(struct xml_schema *);
+
+struct xml_validator *xml_validator_create(const struct xml_schema *);
+void xml_validator_free(struct xml_validator *);
+void xml_validator_reset(struct xml_validator *);
+int xml_validator_finish(struct xml_validator *);
+const char *xml_validator_error(struct xml_validator *, size_t *);
+
+#endif
@@ -0,0 +1,930 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_skeleton.h"
+
+#define PIECE_LITERAL 0
+#define PIECE_TEXT 1
+#define PIECE_VALUE 2
+
+#define OP_OPEN 1
+#define OP_ATTRIBUTE 2
+#define OP_CLOSE 3
+#define OP_TEXT 4
+#define OP_SPECIAL 5
+
+#define VALUE_LITERAL -1
+#define VALUE_NONE -2
+
+/* a run of document bytes; literal runs must match exactly, text and
+ * attribute values may vary unless they were the same in all learned
+ * documents */
+struct xml_skeleton_piece {
+	int type;
+	const char *s;
+	size_t length;
+	int variable;
+};
+
+/* tree construction step */
+struct xml_skeleton_op {
+	int type;
+
+	/* element name, attribute name or key of a special element */
+	const char *s;
+	size_t length;
+
+	/* index of the piece holding the value or VALUE_LITERAL or
+	 * VALUE_NONE */
+	long piece;
+
+	/* literal value */
+	const char *value;
+	size_t value_length;
+};
+
+struct xml_skeleton_segment {
+	/* literal bytes or NULL for a captured value */
+	const char *s;
+	size_t length;
+	size_t piece;
+	int type;
+};
+
+struct xml_skeleton_list {
+	void *items;
+	size_t count;
+	size_t size;
+};
+
+struct xml_skeleton {
+	/* number of documents to learn from */
+	unsigned learn;
+
+	/* number of documents matching the current base */
+	unsigned learned;
+
+	/* number of consecutive divergences */
+	unsigned misses;
+
+	/* skeleton learned from the base document */
+	struct xml_skeleton_list pieces;
+	struct xml_skeleton_list ops;
+	char *pool;
+
+	/* pieces and ops of the document being learned */
+	struct xml_skeleton_list scan_pieces;
+	struct xml_skeleton_list scan_ops;
+
+	/* compiled matching program */
+	struct xml_skeleton_segment *segments;
+	size_t segments_count;
+	char *program;
+
+	/* captured values, one per piece */
+	struct xml_skeleton_piece *spans;
+
+	/* statistics */
+	size_t learning;
+	size_t matched;
+	size_t diverged;
+};
+
+/*****************************************************************************
+ * LISTS
+ ****************************************************************************/
+
+/**
+ * Append an item to a list and return its address
+ *
+ * @param l - list
+ * @param item_size - size of an item
+ */
+static void *xml_skeleton_list_add(
+		struct xml_skeleton_list *l,
+		size_t item_size) {
+	void *item;
+
+	if (l->count >= l->size) {
+		size_t size = l->size ? l->size << 1 : 32;
+		void *n = realloc(l->items, size * item_size);
+
+		if (!n) {
+			return NULL;
+		}
+
+		l->items = n;
+		l->size = size;
+	}
+
+	item = (char *) l->items + l->count * item_size;
+	memset(item, 0, item_size);
+	++l->count;
+
+	return item;
+}
+
+/**
+ * Append a piece; adjacent literal pieces are merged
+ *
+ * @param sk - skeleton
+ * @param type - piece type
+ * @param s - begin of piece
+ * @param l - length of piece
+ */
+static int xml_skeleton_piece_add(
+		struct xml_skeleton *sk,
+		int type,
+		const char *s,
+		size_t l) {
+	struct xml_skeleton_list *list = &sk->scan_pieces;
+	struct xml_skeleton_piece *p;
+
+	if (type == PIECE_LITERAL) {
+		if (l < 1) {
+			return 0;
+		}
+
+		if (list->count > 0 &&
+				(p = (struct xml_skeleton_piece *) list->items +
+					list->count - 1)->type == PIECE_LITERAL &&
+				p->s + p->length == s) {
+			p->length += l;
+			return 0;
+		}
+	}
+
+	if (!(p = xml_skeleton_list_add(
+			list,
+			sizeof(struct xml_skeleton_piece)))) {
+		return -1;
+	}
+
+	p->type = type;
+	p->s = s;
+	p->length = l;
+
+	return 0;
+}
+
+/**
+ * Append a tree construction step
+ *
+ * @param sk - skeleton
+ * @param type - op type
+ * @param s - name
+ * @param l - length of name
+ */
+static struct xml_skeleton_op *xml_skeleton_op_add(
+		struct xml_skeleton *sk,
+		int type,
+		const char *s,
+		size_t l) {
+	struct xml_skeleton_op *op = xml_skeleton_list_add(
+		&sk->scan_ops,
+		sizeof(struct xml_skeleton_op));
+
+	if (op) {
+		op->type = type;
+		op->s = s;
+		op->length = l;
+		op->piece = VALUE_NONE;
+	}
+
+	return op;
+}
+
+/*****************************************************************************
+ * SCANNING
+ ****************************************************************************/
+
+/**
+ * Returns true if an attribute value can be captured speculatively,
+ * that is, the generic parser would end it at the very same quote
+ *
+ * @param s - value
+ * @param l - length of value
+ */
+static int xml_skeleton_capturable(const char *s, size_t l) {
+	return l > 0 &&
+		!memchr(s, '\\', l) &&
+		!memchr(s, '>', l);
+}
+
+/* forward declarations */
+static int xml_skeleton_scan_children(
+		struct xml_skeleton *,
+		struct xml_element *,
+		const char **);
+
+/**
+ * Scan tag element and its children
+ *
+ * @param sk - skeleton
+ * @param e - element
+ * @param pos - address of current position in document
+ */
+static int xml_skeleton_scan_tag(
+		struct xml_skeleton *sk,
+		struct xml_element *e,
+		const char **pos) {
+	const char *p = *pos;
+	const char *end;
+	const char *t;
+	size_t l = strlen(e->key);
+	struct xml_attribute *a;
+	int empty = 0;
+
+	if (*p != '<' ||
+			strncmp(p + 1, e->key, l) ||
+			!(end = strchr(p, '>')) ||
+			!xml_skeleton_op_add(sk, OP_OPEN, e->key, l)) {
+		return -1;
+	}
+
+	for (a = e->first_attribute; a; a = a->next) {
+		struct xml_skeleton_op *op;
+
+		if (!(op = xml_skeleton_op_add(
+				sk,
+				OP_ATTRIBUTE,
+				a->key,
+				strlen(a->key)))) {
+			return -1;
+		}
+
+		if (a->value) {
+			/* the key buffer is a copy of the tag so offsets
+			 * into it are offsets into the document */
+			const char *v = p + 1 + (a->value - e->key);
+			size_t vl = strlen(a->value);
+
+			if (v < end &&
+					(v[-1] == '"' || v[-1] == '\'') &&
+					v[vl] == v[-1] &&
+					!strncmp(v, a->value, vl) &&
+					xml_skeleton_capturable(v, vl)) {
+				if (xml_skeleton_piece_add(
+						sk,
+						PIECE_LITERAL,
+						*pos,
+						v - *pos) ||
+						xml_skeleton_piece_add(
+							sk,
+							PIECE_VALUE,
+							v,
+							vl)) {
+					return -1;
+				}
+
+				op->piece = sk->scan_pieces.count - 1;
+				*pos = v + vl;
+			} else {
+				op->piece = VALUE_LITERAL;
+				op->value = a->value;
+				op->value_length = vl;
+			}
+		}
+	}
+
+	/* find empty element marker */
+	for (t = end - 1; t > p && strchr(" \t\r\n", *t); --t);
+
+	if (*t == '/') {
+		empty = 1;
+
+		if (e->first_child) {
+			return -1;
+		}
+	}
+
+	if (xml_skeleton_piece_add(sk, PIECE_LITERAL, *pos, end + 1 - *pos)) {
+		return -1;
+	}
+
+	*pos = end + 1;
+
+	if (!empty) {
+		if (xml_skeleton_scan_children(sk, e, pos)) {
+			return -1;
+		}
+
+		p = *pos;
+
+		if (strncmp(p, "</", 2) ||
+				!(end = strchr(p, '>')) ||
+				xml_skeleton_piece_add(
+					sk,
+					PIECE_LITERAL,
+					p,
+					end + 1 - p)) {
+			return -1;
+		}
+
+		*pos = end + 1;
+	}
+
+	return xml_skeleton_op_add(sk, OP_CLOSE, NULL, 0) ? 0 : -1;
+}
+
+/**
+ * Scan children of element
+ *
+ * @param sk - skeleton
+ * @param e - parent element
+ * @param pos - address of current position in document
+ */
+static int xml_skeleton_scan_children(
+		struct xml_skeleton *sk,
+		struct xml_element *e,
+		const char **pos) {
+	for (e = e->first_child; e; e = e->next) {
+		const char *p = *pos;
+
+		if (e->value) {
+			size_t l = strlen(e->value);
+			struct xml_skeleton_op *op;
+
+			if (strncmp(p, e->value, l) ||
+					xml_skeleton_piece_add(sk, PIECE_TEXT, p, l) ||
+					!(op = xml_skeleton_op_add(sk, OP_TEXT, NULL, 0))) {
+				return -1;
+			}
+
+			op->piece = sk->scan_pieces.count - 1;
+			*pos = p + l;
+		} else if (!e->key) {
+			return -1;
+		} else if (*e->key == '?' || *e->key == '!') {
+			size_t l = strlen(e->key);
+
+			if (*p != '<' ||
+					strncmp(p + 1, e->key, l) ||
+					p[l + 1] != '>' ||
+					xml_skeleton_piece_add(
+						sk,
+						PIECE_LITERAL,
+						p,
+						l + 2) ||
+					!xml_skeleton_op_add(sk, OP_SPECIAL, e->key, l)) {
+				return -1;
+			}
+
+			*pos = p + l + 2;
+		} else if (xml_skeleton_scan_tag(sk, e, pos)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Scan document and its tree into pieces and tree construction steps
+ *
+ * @param sk - skeleton
+ * @param root - root element of document
+ * @param d - document
+ */
+static int xml_skeleton_scan(
+		struct xml_skeleton *sk,
+		struct xml_element *root,
+		const char *d) {
+	sk->scan_pieces.count = 0;
+	sk->scan_ops.count = 0;
+
+	if (xml_skeleton_scan_children(sk, root, &d) || *d) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*****************************************************************************
+ * LEARNING
+ ****************************************************************************/
+
+/**
+ * Copy string into pool and return the copy
+ *
+ * @param p - address of pool cursor
+ * @param s - string
+ * @param l - length of string
+ */
+static const char *xml_skeleton_pool_copy(
+		char **p,
+		const char *s,
+		size_t l) {
+	char *r = *p;
+
+	if (l > 0) {
+		memcpy(r, s, l);
+		*p += l;
+	}
+
+	return r;
+}
+
+/**
+ * Make scanned document the new base of the skeleton
+ *
+ * @param sk - skeleton
+ */
+static int xml_skeleton_adopt(struct xml_skeleton *sk) {
+	struct xml_skeleton_list l;
+	struct xml_skeleton_piece *pieces = sk->scan_pieces.items;
+	struct xml_skeleton_op *ops = sk->scan_ops.items;
+	size_t size = 0;
+	size_t i;
+	char *pool;
+	char *p;
+
+	for (i = 0; i < sk->scan_pieces.count; ++i) {
+		size += pieces[i].length;
+	}
+
+	for (i = 0; i < sk->scan_ops.count; ++i) {
+		size += ops[i].length;
+
+		if (ops[i].piece == VALUE_LITERAL) {
+			size += ops[i].value_length;
+		}
+	}
+
+	if (!(p = pool = malloc(size + 1))) {
+		return -1;
+	}
+
+	for (i = 0; i < sk->scan_pieces.count; ++i) {
+		pieces[i].s = xml_skeleton_pool_copy(
+			&p,
+			pieces[i].s,
+			pieces[i].length);
+		pieces[i].variable = 0;
+	}
+
+	for (i = 0; i < sk->scan_ops.count; ++i) {
+		ops[i].s = xml_skeleton_pool_copy(&p, ops[i].s, ops[i].length);
+
+		if (ops[i].piece == VALUE_LITERAL) {
+			ops[i].value = xml_skeleton_pool_copy(
+				&p,
+				ops[i].value,
+				ops[i].value_length);
+		}
+	}
+
+	free(sk->pool);
+	sk->pool = pool;
+
+	/* swap scan lists into place */
+	l = sk->pieces;
+	sk->pieces = sk->scan_pieces;
+	sk->scan_pieces = l;
+
+	l = sk->ops;
+	sk->ops = sk->scan_ops;
+	sk->scan_ops = l;
+
+	sk->learned = 1;
+
+	return 0;
+}
+
+/**
+ * Merge scanned document into skeleton; returns -1 if the document
+ * has a different structure
+ *
+ * @param sk - skeleton
+ */
+static int xml_skeleton_merge(struct xml_skeleton *sk) {
+	struct xml_skeleton_piece *a = sk->pieces.items;
+	struct xml_skeleton_piece *b = sk->scan_pieces.items;
+	size_t i;
+
+	if (sk->pieces.count != sk->scan_pieces.count) {
+		return -1;
+	}
+
+	/* compare structure before touching any flags */
+	for (i = 0; i < sk->pieces.count; ++i) {
+		if (a[i].type != b[i].type ||
+				(a[i].type == PIECE_LITERAL &&
+					(a[i].length != b[i].length ||
+						memcmp(a[i].s, b[i].s, a[i].length)))) {
+			return -1;
+		}
+	}
+
+	for (i = 0; i < sk->pieces.count; ++i) {
+		if (a[i].type != PIECE_LITERAL &&
+				(a[i].length != b[i].length ||
+					memcmp(a[i].s, b[i].s, a[i].length))) {
+			a[i].variable = 1;
+		}
+	}
+
+	++sk->learned;
+
+	return 0;
+}
+
+/**
+ * Compile skeleton into a matching program
+ *
+ * @param sk - skeleton
+ */
+static int xml_skeleton_compile(struct xml_skeleton *sk) {
+	struct xml_skeleton_piece *pieces = sk->pieces.items;
+	struct xml_skeleton_segment *seg = NULL;
+	size_t count = sk->pieces.count;
+	size_t size = 0;
+	size_t n = 0;
+	size_t i;
+	char *p;
+
+	free(sk->segments);
+	free(sk->program);
+	free(sk->spans);
+
+	sk->segments = NULL;
+	sk->program = NULL;
+
+	if (!(sk->spans = calloc(
+			count + 1,
+			sizeof(struct xml_skeleton_piece))) ||
+			!(sk->segments = calloc(
+				count + 1,
+				sizeof(struct xml_skeleton_segment)))) {
+		return -1;
+	}
+
+	for (i = 0; i < count; ++i) {
+		size += pieces[i].length;
+	}
+
+	if (!(p = sk->program = malloc(size + 1))) {
+		return -1;
+	}
+
+	for (i = 0; i < count; ++i) {
+		/* values that never changed keep their learned content */
+		sk->spans[i] = pieces[i];
+
+		if (pieces[i].variable) {
+			seg = sk->segments + n++;
+			seg->piece = i;
+			seg->type = pieces[i].type;
+
+			seg = NULL;
+			continue;
+		}
+
+		/* merge literals and constant values into one segment */
+		if (!seg) {
+			seg = sk->segments + n++;
+			seg->s = p;
+		}
+
+		memcpy(p, pieces[i].s, pieces[i].length);
+		p += pieces[i].length;
+		seg->length += pieces[i].length;
+	}
+
+	sk->segments_count = n;
+
+	return 0;
+}
+
+/**
+ * Learn from document
+ *
+ * @param sk - skeleton
+ * @param d - XML document
+ */
+static struct xml_element *xml_skeleton_learn(
+		struct xml_skeleton *sk,
+		const char *d) {
+	struct xml_element *root = xml_parse(d);
+
+	/* documents the skeleton cannot describe just don't count */
+	if (!root || xml_skeleton_scan(sk, root, d)) {
+		return root;
+	}
+
+	if (!sk->learned || xml_skeleton_merge(sk)) {
+		if (xml_skeleton_adopt(sk)) {
+			sk->learned = 0;
+			return root;
+		}
+	}
+
+	if (sk->learned >= sk->learn && xml_skeleton_compile(sk)) {
+		sk->learned = 0;
+	}
+
+	return root;
+}
+
+/*****************************************************************************
+ * SPECULATIVE PARSING
+ ****************************************************************************/
+
+/**
+ * Match document against compiled skeleton and capture all variable
+ * values; returns -1 at the first divergence
+ *
+ * @param sk - skeleton
+ * @param d - XML document
+ */
+static int xml_skeleton_match(struct xml_skeleton *sk, const char *d) {
+	const char *end = d + strlen(d);
+	struct xml_skeleton_segment *seg = sk->segments;
+	struct xml_skeleton_segment *last = seg + sk->segments_count;
+
+	for (; seg < last; ++seg) {
+		const char *stop;
+
+		if (seg->s) {
+			if ((size_t) (end - d) < seg->length ||
+					memcmp(d, seg->s, seg->length)) {
+				return -1;
+			}
+
+			d += seg->length;
+			continue;
+		}
+
+		/* a value ends where the next literal begins */
+		if (seg + 1 < last) {
+			if (!seg[1].s ||
+					!(stop = memchr(d, *seg[1].s, end - d))) {
+				return -1;
+			}
+		} else {
+			stop = end;
+		}
+
+		if (stop == d ||
+				(seg->type == PIECE_VALUE &&
+					!xml_skeleton_capturable(d, stop - d))) {
+			return -1;
+		}
+
+		sk->spans[seg->piece].s = d;
+		sk->spans[seg->piece].length = stop - d;
+		d = stop;
+	}
+
+	return d == end ? 0 : -1;
+}
+
+/**
+ * Return zero terminated copy of given string
+ *
+ * @param s - string
+ * @param l - length of string
+ */
+static char *xml_skeleton_strndup(const char *s, size_t l) {
+	char *r = malloc(l + 1);
+
+	if (r) {
+		memcpy(r, s, l);
+		r[l] = 0;
+	}
+
+	return r;
+}
+
+/**
+ * Create element with attributes from an OP_OPEN step and return
+ * the number of consumed steps or 0 on error
+ *
+ * @param sk - skeleton
+ * @param op - OP_OPEN step
+ * @param parent - parent element
+ * @param e - address of created element
+ */
+static size_t xml_skeleton_build_element(
+		struct xml_skeleton *sk,
+		struct xml_skeleton_op *op,
+		struct xml_element *parent,
+		struct xml_element **e) {
+	struct xml_skeleton_op *a = op + 1;
+	size_t size = op->length + 1;
+	size_t n = 1;
+	char *p;
+
+	for (; a->type == OP_ATTRIBUTE; ++a, ++n) {
+		size += a->length + 1;
+
+		if (a->piece >= 0) {
+			size += sk->spans[a->piece].length + 1;
+		} else if (a->piece == VALUE_LITERAL) {
+			size += a->value_length + 1;
+		}
+	}
+
+	if (!(*e = xml_element_create(NULL, parent)) ||
+			!((*e)->key = p = malloc(size))) {
+		return 0;
+	}
+
+	memcpy(p, op->s, op->length);
+	p += op->length;
+	*p++ = 0;
+
+	for (a = op + 1; a->type == OP_ATTRIBUTE; ++a) {
+		struct xml_attribute *attr;
+		const char *v = NULL;
+		size_t vl = 0;
+
+		if (!(attr = xml_attribute_create(NULL, *e))) {
+			return 0;
+		}
+
+		attr->key = p;
+		memcpy(p, a->s, a->length);
+		p += a->length;
+		*p++ = 0;
+
+		if (a->piece >= 0) {
+			v = sk->spans[a->piece].s;
+			vl = sk->spans[a->piece].length;
+		} else if (a->piece == VALUE_LITERAL) {
+			v = a->value;
+			vl = a->value_length;
+		}
+
+		if (v) {
+			attr->value = p;
+			memcpy(p, v, vl);
+			p += vl;
+			*p++ = 0;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * Build element tree from captured values
+ *
+ * @param sk - skeleton
+ */
+static struct xml_element *xml_skeleton_build(struct xml_skeleton *sk) {
+	struct xml_element *root;
+	struct xml_element *current;
+	struct xml_skeleton_op *op = sk->ops.items;
+	struct xml_skeleton_op *last = op + sk->ops.count;
+
+	if (!(current = root = xml_element_create(NULL, NULL))) {
+		return NULL;
+	}
+
+	while (op < last) {
+		struct xml_element *e;
+		size_t n = 1;
+
+		switch (op->type) {
+		case OP_OPEN:
+			if (!(n = xml_skeleton_build_element(sk, op, current, &e))) {
+				xml_free(root);
+				return NULL;
+			}
+			current = e;
+			break;
+		case OP_CLOSE:
+			current = current->parent;
+			break;
+		case OP_TEXT:
+			if (!(e = xml_element_create(NULL, current)) ||
+					!(e->value = xml_skeleton_strndup(
+						sk->spans[op->piece].s,
+						sk->spans[op->piece].length))) {
+				xml_free(root);
+				return NULL;
+			}
+			break;
+		case OP_SPECIAL:
+			if (!(e = xml_element_create(NULL, current)) ||
+					!(e->key = xml_skeleton_strndup(op->s, op->length))) {
+				xml_free(root);
+				return NULL;
+			}
+			break;
+		}
+
+		op += n;
+	}
+
+	return root;
+}
+
+/*****************************************************************************
+ * INTERFACE
+ ****************************************************************************/
+
+/**
+ * Create a new skeleton parser
+ *
+ * @param learn - number of documents to learn the skeleton from
+ */
+struct xml_skeleton *xml_skeleton_create(unsigned learn) {
+	struct xml_skeleton *sk = calloc(1, sizeof(struct xml_skeleton));
+
+	if (sk) {
+		sk->learn = learn > 0 ? learn : 1;
+	}
+
+	return sk;
+}
+
+/**
+ * Free skeleton parser
+ *
+ * @param sk - skeleton
+ */
+void xml_skeleton_free(struct xml_skeleton *sk) {
+	if (!sk) {
+		return;
+	}
+
+	free(sk->pieces.items);
+	free(sk->ops.items);
+	free(sk->pool);
+	free(sk->scan_pieces.items);
+	free(sk->scan_ops.items);
+	free(sk->segments);
+	free(sk->program);
+	free(sk->spans);
+	free(sk);
+}
+
+/**
+ * Parse XML document; falls back to the generic parser if the document
+ * diverges from the learned skeleton
+ *
+ * @param sk - skeleton
+ * @param d - XML document
+ */
+struct xml_element *xml_skeleton_parse(struct xml_skeleton *sk, const char *d) {
+	struct xml_element *root;
+
+	if (!sk || !d) {
+		return NULL;
+	}
+
+	if (sk->learned < sk->learn) {
+		++sk->learning;
+		return xml_skeleton_learn(sk, d);
+	}
+
+	if (!xml_skeleton_match(sk, d) &&
+			(root = xml_skeleton_build(sk))) {
+		++sk->matched;
+		sk->misses = 0;
+		return root;
+	}
+
+	++sk->diverged;
+
+	/* start learning over when the stream changed for good */
+	if (++sk->misses >= sk->learn) {
+		sk->learned = 0;
+		sk->misses = 0;
+
+		return xml_skeleton_learn(sk, d);
+	}
+
+	return xml_parse(d);
+}
+
+/**
+ * Return number of documents parsed while learning, matched against
+ * the skeleton and diverged from it
+ *
+ * @param sk - skeleton
+ * @param learning - optional, receives documents parsed for learning
+ * @param matched - optional, receives documents built from the skeleton
+ * @param diverged - optional, receives documents that didn't match
+ */
+void xml_skeleton_stats(
+		struct xml_skeleton *sk,
+		size_t *learning,
+		size_t *matched,
+		size_t *diverged) {
+	if (learning) {
+		*learning = sk ? sk->learning : 0;
+	}
+
+	if (matched) {
+		*matched = sk ? sk->matched : 0;
+	}
+
+	if (diverged) {
+		*diverged = sk ? sk->diverged : 0;
+	}
+}
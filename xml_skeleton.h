@@ -0,0 +1,44 @@
+#ifndef _xml_skeleton_h_
+#define _xml_skeleton_h_
+
+#include "xml.h"
+
+/* Speculative parser for streams of documents that share the same tag
+ * skeleton and differ in attribute values and character data only.
+ *
+ * The first documents are parsed normally and used to learn the
+ * skeleton: the fixed byte runs of all tags plus the positions of the
+ * values that vary between them. Once learned, a document is matched
+ * against the fixed runs with memcmp() and only the variable values
+ * are captured. At the first divergence the document is handed to the
+ * generic parser instead.
+ *
+ * The returned trees are indistinguishable from trees returned by
+ * xml_parse() and must be freed with xml_free():
+ *
+ *	struct xml_skeleton *sk = xml_skeleton_create(4);
+ *
+ *	for (...) {
+ *		struct xml_element *root = xml_skeleton_parse(sk, doc);
+ *		...
+ *		xml_free(root);
+ *	}
+ *
+ *	xml_skeleton_free(sk);
+ *
+ * xml_skeleton_create() takes the number of documents with the same
+ * skeleton to learn from; values that differ between them are
+ * captured, all other bytes must match. As many divergences in a row
+ * start learning over. A skeleton must not be shared between threads.
+ * xml_skeleton_stats() tells how many documents were parsed while
+ * learning, built from the skeleton and handed over after diverging. */
+
+struct xml_skeleton;
+
+struct xml_skeleton *xml_skeleton_create(unsigned);
+void xml_skeleton_free(struct xml_skeleton *);
+
+struct xml_element *xml_skeleton_parse(struct xml_skeleton *, const char *);
+void xml_skeleton_stats(struct xml_skeleton *, size_t *, size_t *, size_t *);
+
+#endif
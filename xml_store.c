@@ -0,0 +1,697 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xml.h"
+#include "xml_private.h"
+#include "xml_store.h"
+
+struct xml_store_posting {
+	long document;
+	unsigned long generation;
+	struct xml_element *element;
+};
+
+struct xml_store_list {
+	/* lower case element name, attribute name and value, each
+	 * prefixed by a type byte and terminated by a null byte */
+	char *key;
+	size_t key_length;
+	size_t hash;
+
+	/* postings in order of insertion */
+	struct xml_store_posting *postings;
+	size_t count;
+	size_t size;
+};
+
+struct xml_store_document {
+	/* NULL if the document has been removed */
+	struct xml_element *root;
+
+	/* generation of the current postings, changed whenever the
+	 * document is indexed or removed so old postings can be told
+	 * apart */
+	unsigned long generation;
+
+	/* number of postings of the current generation */
+	size_t postings;
+
+	/* next free document or -1 */
+	long next_free;
+};
+
+struct xml_store {
+	struct xml_store_list *lists;
+	size_t list_count;
+	size_t list_size;
+
+	/* hash of lists by key */
+	struct xml_table table;
+
+	struct xml_store_document *documents;
+	size_t document_count;
+	size_t document_size;
+	long free_document;
+
+	/* number of postings of present and removed documents */
+	size_t live;
+	size_t stale;
+
+	/* last generation handed out */
+	unsigned long generation;
+
+	/* buffer for keys */
+	char *key;
+	size_t key_size;
+};
+
+/*****************************************************************************
+ * KEYS
+ ****************************************************************************/
+
+/**
+ * Append part of a key to the key buffer
+ *
+ * @param st - store
+ * @param length - current length of key
+ * @param type - type byte
+ * @param s - string
+ * @param fold - true to fold to lower case
+ */
+static long xml_store_key_append(
+		struct xml_store *st,
+		size_t length,
+		char type,
+		const char *s,
+		int fold) {
+	size_t l = strlen(s);
+	char *p;
+
+	if (length + l + 2 > st->key_size) {
+		size_t size = (length + l + 2) * 2;
+
+		if (!(p = realloc(st->key, size))) {
+			return -1;
+		}
+
+		st->key = p;
+		st->key_size = size;
+	}
+
+	p = st->key + length;
+	*p++ = type;
+
+	if (fold) {
+		const char *e = s + l;
+
+		for (; s < e; ++s) {
+			*p++ = tolower((unsigned char) *s);
+		}
+	} else {
+		memcpy(p, s, l);
+		p += l;
+	}
+
+	*p = 0;
+
+	return length + l + 2;
+}
+
+/**
+ * Build key in the key buffer and return its length or -1
+ *
+ * @param st - store
+ * @param name - element name
+ * @param attribute - attribute name, may be NULL
+ * @param value - attribute value, may be NULL
+ */
+static long xml_store_key(
+		struct xml_store *st,
+		const char *name,
+		const char *attribute,
+		const char *value) {
+	long l = xml_store_key_append(st, 0, 'e', name, 1);
+
+	if (l > -1 && attribute) {
+		l = xml_store_key_append(st, l, 'a', attribute, 0);
+
+		if (l > -1 && value) {
+			l = xml_store_key_append(st, l, 'v', value, 0);
+		}
+	}
+
+	return l;
+}
+
+/**
+ * Return posting list of key or NULL; probe is left at a free slot
+ * if the key isn't there
+ *
+ * @param st - store
+ * @param key - key
+ * @param l - length of key
+ * @param hash - hash of key
+ * @param probe - receives probe for xml_table_set()
+ */
+static struct xml_store_list *xml_store_find(
+		struct xml_store *st,
+		const char *key,
+		size_t l,
+		size_t hash,
+		size_t *probe) {
+	size_t n;
+
+	*probe = 0;
+
+	while ((n = xml_table_next(&st->table, hash, probe))) {
+		struct xml_store_list *list = &st->lists[n - 1];
+
+		if (list->key_length == l && !memcmp(list->key, key, l)) {
+			return list;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Return posting list of the key in the key buffer, add an empty one
+ * if it isn't there yet
+ *
+ * @param st - store
+ * @param l - length of key
+ */
+static struct xml_store_list *xml_store_list(struct xml_store *st, size_t l) {
+	struct xml_store_list *list;
+	size_t hash = xml_hash(st->key, l);
+	size_t probe;
+
+	if (xml_table_reserve(&st->table, st->list_count + 1)) {
+		return NULL;
+	}
+
+	if ((list = xml_store_find(st, st->key, l, hash, &probe))) {
+		return list;
+	}
+
+	if (st->list_count >= st->list_size) {
+		size_t size = st->list_size ? st->list_size << 1 : 256;
+
+		if (!(list = realloc(
+				st->lists,
+				size * sizeof(struct xml_store_list)))) {
+			return NULL;
+		}
+
+		st->lists = list;
+		st->list_size = size;
+	}
+
+	list = &st->lists[st->list_count];
+	memset(list, 0, sizeof(struct xml_store_list));
+
+	if (!(list->key = malloc(l))) {
+		return NULL;
+	}
+
+	memcpy(list->key, st->key, l);
+	list->key_length = l;
+	list->hash = hash;
+	xml_table_set(&st->table, hash, probe, ++st->list_count);
+
+	return list;
+}
+
+/*****************************************************************************
+ * INDEXING
+ ****************************************************************************/
+
+/**
+ * Add posting for element
+ *
+ * @param st - store
+ * @param id - document
+ * @param e - element
+ * @param attribute - attribute name, may be NULL
+ * @param value - attribute value, may be NULL
+ */
+static int xml_store_post(
+		struct xml_store *st,
+		long id,
+		struct xml_element *e,
+		const char *attribute,
+		const char *value) {
+	struct xml_store_document *doc = &st->documents[id];
+	struct xml_store_posting *p;
+	struct xml_store_list *list;
+	long l;
+
+	if ((l = xml_store_key(st, e->key, attribute, value)) < 0 ||
+			!(list = xml_store_list(st, l))) {
+		return -1;
+	}
+
+	if (list->count >= list->size) {
+		size_t size = list->size ? list->size << 1 : 4;
+
+		if (!(p = realloc(
+				list->postings,
+				size * sizeof(struct xml_store_posting)))) {
+			return -1;
+		}
+
+		list->postings = p;
+		list->size = size;
+	}
+
+	p = &list->postings[list->count++];
+	p->document = id;
+	p->generation = doc->generation;
+	p->element = e;
+
+	++doc->postings;
+	++st->live;
+
+	return 0;
+}
+
+/**
+ * Index element and its children
+ *
+ * @param st - store
+ * @param id - document
+ * @param e - element
+ */
+static int xml_store_index(
+		struct xml_store *st,
+		long id,
+		struct xml_element *e) {
+	struct xml_element *c;
+
+	if (e->key && *e->key != '?' && *e->key != '!') {
+		struct xml_attribute *a;
+
+		if (xml_store_post(st, id, e, NULL, NULL)) {
+			return -1;
+		}
+
+		for (a = e->first_attribute; a; a = a->next) {
+			if (xml_store_post(st, id, e, a->key, NULL) ||
+					(a->value &&
+						xml_store_post(st, id, e, a->key, a->value))) {
+				return -1;
+			}
+		}
+	}
+
+	for (c = e->first_child; c; c = c->next) {
+		if (c->key && xml_store_index(st, id, c)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Drop postings of removed documents from all lists, then drop lists
+ * that became empty along with their keys
+ *
+ * @param st - store
+ */
+static void xml_store_compact(struct xml_store *st) {
+	struct xml_table table;
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < st->list_count; ++i) {
+		struct xml_store_list *list = &st->lists[i];
+		size_t j;
+		size_t n = 0;
+
+		for (j = 0; j < list->count; ++j) {
+			struct xml_store_posting *p = &list->postings[j];
+			struct xml_store_document *doc = &st->documents[p->document];
+
+			if (doc->root && doc->generation == p->generation) {
+				list->postings[n++] = *p;
+			}
+		}
+
+		if (!(list->count = n)) {
+			free(list->key);
+			free(list->postings);
+			continue;
+		}
+
+		/* give back space of lists that shrank a lot */
+		if (n * 4 < list->size) {
+			struct xml_store_posting *p = realloc(
+				list->postings,
+				n * 2 * sizeof(struct xml_store_posting));
+
+			if (p) {
+				list->postings = p;
+				list->size = n * 2;
+			}
+		}
+
+		st->lists[count++] = *list;
+	}
+
+	st->list_count = count;
+	st->stale = 0;
+
+	/* keys of dropped lists must go from the table too, which may
+	 * shrink to fit the remaining ones; the old table is refilled
+	 * if there's no memory for a new one */
+	memset(&table, 0, sizeof(table));
+
+	if (xml_table_reserve(&table, count)) {
+		table = st->table;
+		xml_table_clear(&table);
+	} else {
+		xml_table_free(&st->table);
+	}
+
+	for (i = 0; i < count; ++i) {
+		size_t hash = st->lists[i].hash;
+		size_t probe = 0;
+
+		while (xml_table_next(&table, hash, &probe));
+		xml_table_set(&table, hash, probe, i + 1);
+	}
+
+	st->table = table;
+}
+
+/**
+ * Invalidate all postings of a document
+ *
+ * @param st - store
+ * @param id - document
+ */
+static void xml_store_unindex(struct xml_store *st, long id) {
+	struct xml_store_document *doc = &st->documents[id];
+
+	doc->generation = ++st->generation;
+	st->live -= doc->postings;
+	st->stale += doc->postings;
+	doc->postings = 0;
+}
+
+/**
+ * Index new root of a document under a new generation; on errors the
+ * document keeps its previous root and postings
+ *
+ * @param st - store
+ * @param id - document
+ * @param root - root element
+ */
+static int xml_store_set(
+		struct xml_store *st,
+		long id,
+		struct xml_element *root) {
+	struct xml_store_document *doc = &st->documents[id];
+	unsigned long generation = doc->generation;
+	size_t postings = doc->postings;
+
+	/* generations are never handed out twice, so postings of a
+	 * failed attempt can't become valid later */
+	doc->generation = ++st->generation;
+	doc->postings = 0;
+
+	if (xml_store_index(st, id, root)) {
+		xml_store_unindex(st, id);
+		doc->generation = generation;
+		doc->postings = postings;
+		return -1;
+	}
+
+	st->live -= postings;
+	st->stale += postings;
+	doc->root = root;
+
+	return 0;
+}
+
+/**
+ * Return document if it is in the store
+ *
+ * @param st - store
+ * @param id - document
+ */
+static struct xml_store_document *xml_store_get(
+		struct xml_store *st,
+		long id) {
+	if (!st || id < 0 || (size_t) id >= st->document_count ||
+			!st->documents[id].root) {
+		return NULL;
+	}
+
+	return &st->documents[id];
+}
+
+/*****************************************************************************
+ * PUBLIC INTERFACE
+ ****************************************************************************/
+
+/**
+ * Create a new, empty store
+ */
+struct xml_store *xml_store_create(void) {
+	struct xml_store *st;
+
+	if (!(st = calloc(1, sizeof(struct xml_store)))) {
+		return NULL;
+	}
+
+	st->free_document = -1;
+
+	return st;
+}
+
+/**
+ * Free store; documents aren't freed
+ *
+ * @param st - store
+ */
+void xml_store_free(struct xml_store *st) {
+	size_t i;
+
+	if (!st) {
+		return;
+	}
+
+	for (i = 0; i < st->list_count; ++i) {
+		free(st->lists[i].key);
+		free(st->lists[i].postings);
+	}
+
+	free(st->lists);
+	xml_table_free(&st->table);
+	free(st->documents);
+	free(st->key);
+	free(st);
+}
+
+/**
+ * Add document and return its id or -1 on error
+ *
+ * @param st - store
+ * @param root - root element
+ */
+long xml_store_add(struct xml_store *st, struct xml_element *root) {
+	struct xml_store_document *doc;
+	long id;
+
+	if (!st || !root) {
+		return -1;
+	}
+
+	if (st->free_document > -1) {
+		id = st->free_document;
+		st->free_document = st->documents[id].next_free;
+	} else {
+		if (st->document_count >= st->document_size) {
+			size_t size = st->document_size ?
+				st->document_size << 1 :
+				256;
+
+			if (!(doc = realloc(
+					st->documents,
+					size * sizeof(struct xml_store_document)))) {
+				return -1;
+			}
+
+			st->documents = doc;
+			st->document_size = size;
+		}
+
+		id = st->document_count++;
+		memset(&st->documents[id], 0, sizeof(struct xml_store_document));
+	}
+
+	if (xml_store_set(st, id, root)) {
+		st->documents[id].next_free = st->free_document;
+		st->free_document = id;
+		return -1;
+	}
+
+	return id;
+}
+
+/**
+ * Remove document and return its root
+ *
+ * @param st - store
+ * @param id - document
+ */
+struct xml_element *xml_store_remove(struct xml_store *st, long id) {
+	struct xml_store_document *doc;
+	struct xml_element *root;
+
+	if (!(doc = xml_store_get(st, id))) {
+		return NULL;
+	}
+
+	root = doc->root;
+	xml_store_unindex(st, id);
+	doc->root = NULL;
+	doc->next_free = st->free_document;
+	st->free_document = id;
+
+	if (st->stale > st->live) {
+		xml_store_compact(st);
+	}
+
+	return root;
+}
+
+/**
+ * Replace document under the same id and return the old root; returns
+ * NULL and keeps the old document if the id isn't in the store or the
+ * new document can't be indexed
+ *
+ * @param st - store
+ * @param id - document
+ * @param root - new root element
+ */
+struct xml_element *xml_store_replace(
+		struct xml_store *st,
+		long id,
+		struct xml_element *root) {
+	struct xml_store_document *doc;
+	struct xml_element *old;
+
+	if (!root || !(doc = xml_store_get(st, id))) {
+		return NULL;
+	}
+
+	old = doc->root;
+
+	if (xml_store_set(st, id, root)) {
+		old = NULL;
+	}
+
+	if (st->stale > st->live) {
+		xml_store_compact(st);
+	}
+
+	return old;
+}
+
+/**
+ * Return number of keys and of postings of present and removed
+ * documents
+ *
+ * @param st - store
+ * @param keys - optional, receives number of keys
+ * @param live - optional, receives postings of present documents
+ * @param stale - optional, receives postings of removed documents
+ */
+void xml_store_stats(
+		struct xml_store *st,
+		size_t *keys,
+		size_t *live,
+		size_t *stale) {
+	if (keys) {
+		*keys = st ? st->list_count : 0;
+	}
+
+	if (live) {
+		*live = st ? st->live : 0;
+	}
+
+	if (stale) {
+		*stale = st ? st->stale : 0;
+	}
+}
+
+/**
+ * Return root of document or NULL
+ *
+ * @param st - store
+ * @param id - document
+ */
+struct xml_element *xml_store_document(struct xml_store *st, long id) {
+	struct xml_store_document *doc = xml_store_get(st, id);
+
+	return doc ? doc->root : NULL;
+}
+
+/**
+ * Find elements by name, attribute and value in all documents;
+ * returns the number of hits, which may be larger than max
+ *
+ * @param st - store
+ * @param name - element name
+ * @param attribute - attribute name, may be NULL
+ * @param value - attribute value, may be NULL
+ * @param hits - array for hits, may be NULL
+ * @param max - size of array
+ */
+size_t xml_store_query(
+		struct xml_store *st,
+		const char *name,
+		const char *attribute,
+		const char *value,
+		struct xml_store_hit *hits,
+		size_t max) {
+	struct xml_store_list *list;
+	size_t probe;
+	size_t n = 0;
+	size_t i;
+	long l;
+
+	if (!st || !name ||
+			(l = xml_store_key(st, name, attribute, value)) < 0 ||
+			!(list = xml_store_find(
+				st,
+				st->key,
+				l,
+				xml_hash(st->key, l),
+				&probe))) {
+		return 0;
+	}
+
+
+	for (i = 0; i < list->count; ++i) {
+		struct xml_store_posting *p = &list->postings[i];
+		struct xml_store_document *doc = &st->documents[p->document];
+
+		if (!doc->root || doc->generation != p->generation) {
+			continue;
+		}
+
+		if (hits && n < max) {
+			hits[n].document = p->document;
+			hits[n].element = p->element;
+		}
+
+		++n;
+	}
+
+	return n;
+}
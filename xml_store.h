@@ -0,0 +1,57 @@
+#ifndef _xml_store_h_
+#define _xml_store_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* In-memory store of many documents with one shared inverted index on
+ * element names, attribute names and attribute values:
+ *
+ *	struct xml_store *st = xml_store_create();
+ *	long id = xml_store_add(st, xml_parse(data));
+ *	struct xml_store_hit hits[64];
+ *	size_t n = xml_store_query(st, "ACTION", "NAME", "x", hits, 64);
+ *
+ * Queries match element names ignoring case and attributes exactly
+ * like xml_find() does. The attribute and the value may be NULL to
+ * match every element of a name or every element that has an
+ * attribute. xml_store_query() returns the total number of hits and
+ * stores up to the given number of them in order of insertion.
+ *
+ * The store doesn't own documents: xml_store_remove() and
+ * xml_store_replace() hand back the old root and documents must not
+ * change while they are in the store. If the new document can't be
+ * indexed, xml_store_replace() returns NULL and keeps the old one.
+ * Postings of removed documents are skipped by queries and dropped
+ * once they make up half of the index, together with keys that have
+ * no postings left. */
+
+struct xml_store;
+
+struct xml_store_hit {
+	long document;
+	struct xml_element *element;
+};
+
+struct xml_store *xml_store_create(void);
+void xml_store_free(struct xml_store *);
+
+long xml_store_add(struct xml_store *, struct xml_element *);
+struct xml_element *xml_store_remove(struct xml_store *, long);
+struct xml_element *xml_store_replace(
+	struct xml_store *,
+	long,
+	struct xml_element *);
+struct xml_element *xml_store_document(struct xml_store *, long);
+void xml_store_stats(struct xml_store *, size_t *, size_t *, size_t *);
+
+size_t xml_store_query(
+	struct xml_store *,
+	const char *,
+	const char *,
+	const char *,
+	struct xml_store_hit *,
+	size_t);
+
+#endif
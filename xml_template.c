@@ -0,0 +1,640 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#endif
+
+#include "xml.h"
+#include "xml_template.h"
+
+#define XML_TEMPLATE_OPEN "{{"
+#define XML_TEMPLATE_CLOSE "}}"
+
+#define XML_TEMPLATE_TEXT 0
+#define XML_TEMPLATE_ATTRIBUTE 1
+
+/* number of vectors and escaped bytes that are kept on the stack */
+#define XML_TEMPLATE_VECTORS 64
+#define XML_TEMPLATE_SCRATCH 4096
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define WHITESPACE " \t\r\n"
+
+struct xml_template_part {
+	/* static run in source before the slot */
+	size_t offset;
+	size_t length;
+
+	/* index of slot or -1 for the run at the end */
+	long slot;
+	int context;
+};
+
+struct xml_template {
+	char *source;
+
+	struct xml_template_part *parts;
+	size_t count;
+	size_t size;
+
+	char **names;
+	size_t slot_count;
+	size_t slot_size;
+};
+
+/* characters that need escaping by context */
+static const char *xml_template_special[] = {
+	"&<>",
+	"&<>\"'"
+};
+
+/*****************************************************************************
+ * COMPILING
+ ****************************************************************************/
+
+/**
+ * Return index of named slot, adding it if it doesn't exist yet
+ *
+ * @param t - template
+ * @param name - name of slot
+ * @param l - length of name
+ */
+static long xml_template_add_slot(
+		struct xml_template *t,
+		const char *name,
+		size_t l) {
+	size_t i;
+	char *s;
+
+	for (i = 0; i < t->slot_count; ++i) {
+		if (!strncmp(t->names[i], name, l) && !t->names[i][l]) {
+			return i;
+		}
+	}
+
+	if (t->slot_count >= t->slot_size) {
+		size_t size = t->slot_size ? t->slot_size << 1 : 16;
+		char **n = realloc(t->names, size * sizeof(char *));
+
+		if (!n) {
+			return -1;
+		}
+
+		t->names = n;
+		t->slot_size = size;
+	}
+
+	if (!(s = malloc(l + 1))) {
+		return -1;
+	}
+
+	memcpy(s, name, l);
+	s[l] = 0;
+	t->names[t->slot_count] = s;
+
+	return t->slot_count++;
+}
+
+/**
+ * Add static run that is followed by given slot
+ *
+ * @param t - template
+ * @param from - start of run
+ * @param to - end of run
+ * @param slot - index of slot or -1
+ * @param context - XML_TEMPLATE_TEXT or XML_TEMPLATE_ATTRIBUTE
+ */
+static int xml_template_add_part(
+		struct xml_template *t,
+		const char *from,
+		const char *to,
+		long slot,
+		int context) {
+	struct xml_template_part *p;
+
+	if (t->count >= t->size) {
+		size_t size = t->size ? t->size << 1 : 16;
+		struct xml_template_part *n = realloc(
+			t->parts,
+			size * sizeof(struct xml_template_part));
+
+		if (!n) {
+			return -1;
+		}
+
+		t->parts = n;
+		t->size = size;
+	}
+
+	p = t->parts + t->count++;
+	p->offset = from - t->source;
+	p->length = to - from;
+	p->slot = slot;
+	p->context = context;
+
+	return 0;
+}
+
+/**
+ * Add placeholder at given position; returns position after it or
+ * NULL
+ *
+ * @param t - template
+ * @param run - start of static run before placeholder
+ * @param p - first character of placeholder
+ * @param context - XML_TEMPLATE_TEXT or XML_TEMPLATE_ATTRIBUTE
+ */
+static const char *xml_template_placeholder(
+		struct xml_template *t,
+		const char *run,
+		const char *p,
+		int context) {
+	const char *name = p + sizeof(XML_TEMPLATE_OPEN) - 1;
+	const char *close = strstr(name, XML_TEMPLATE_CLOSE);
+	const char *end;
+	long slot;
+
+	if (!close) {
+		return NULL;
+	}
+
+	name += strspn(name, WHITESPACE);
+
+	for (end = close; end > name && strchr(WHITESPACE, end[-1]); --end);
+
+	if (end == name ||
+			(slot = xml_template_add_slot(t, name, end - name)) < 0 ||
+			xml_template_add_part(t, run, p, slot, context)) {
+		return NULL;
+	}
+
+	return close + sizeof(XML_TEMPLATE_CLOSE) - 1;
+}
+
+/**
+ * Split source into static runs and slots
+ *
+ * @param t - template
+ */
+static int xml_template_scan(struct xml_template *t) {
+	static const char *skip[][2] = {
+		{"<!--", "-->"},
+		{"<![CDATA[", "]]>"},
+		{"<?", "?>"},
+		{NULL, NULL}
+	};
+	const char *p = t->source;
+	const char *run = p;
+	const char *until = NULL;
+	char quote = 0;
+	int tag = 0;
+
+	while (*p) {
+		int placeholder = !strncmp(
+			p,
+			XML_TEMPLATE_OPEN,
+			sizeof(XML_TEMPLATE_OPEN) - 1);
+
+		if (until) {
+			/* copy comments, CDATA sections and processing
+			 * instructions as they are */
+			if (!strncmp(p, until, strlen(until))) {
+				p += strlen(until);
+				until = NULL;
+			} else {
+				++p;
+			}
+		} else if (quote) {
+			if (placeholder) {
+				if (!(p = xml_template_placeholder(
+						t,
+						run,
+						p,
+						XML_TEMPLATE_ATTRIBUTE))) {
+					return -1;
+				}
+
+				run = p;
+			} else {
+				quote = *p++ == quote ? 0 : quote;
+			}
+		} else if (tag) {
+			/* placeholders outside of values could add markup */
+			if (placeholder) {
+				return -1;
+			}
+
+			if (*p == '"' || *p == '\'') {
+				quote = *p;
+			} else if (*p == '>') {
+				tag = 0;
+			}
+
+			++p;
+		} else if (placeholder) {
+			if (!(p = xml_template_placeholder(
+					t,
+					run,
+					p,
+					XML_TEMPLATE_TEXT))) {
+				return -1;
+			}
+
+			run = p;
+		} else if (*p == '<') {
+			int i;
+
+			for (i = 0; skip[i][0]; ++i) {
+				if (!strncmp(p, skip[i][0], strlen(skip[i][0]))) {
+					until = skip[i][1];
+					p += strlen(skip[i][0]);
+					break;
+				}
+			}
+
+			if (!until) {
+				tag = 1;
+				++p;
+			}
+		} else {
+			++p;
+		}
+	}
+
+	return xml_template_add_part(t, run, p, -1, XML_TEMPLATE_TEXT);
+}
+
+/*****************************************************************************
+ * RENDERING
+ ****************************************************************************/
+
+/**
+ * Return entity for character or NULL if it doesn't need escaping
+ *
+ * @param c - character
+ * @param context - XML_TEMPLATE_TEXT or XML_TEMPLATE_ATTRIBUTE
+ */
+static const char *xml_template_entity(char c, int context) {
+	switch (c) {
+	case '&':
+		return "&amp;";
+	case '<':
+		return "&lt;";
+	case '>':
+		return "&gt;";
+	case '"':
+		return context == XML_TEMPLATE_ATTRIBUTE ? "&quot;" : NULL;
+	case '\'':
+		return context == XML_TEMPLATE_ATTRIBUTE ? "&apos;" : NULL;
+	}
+
+	return NULL;
+}
+
+/**
+ * Return length of escaped value
+ *
+ * @param v - value
+ * @param context - XML_TEMPLATE_TEXT or XML_TEMPLATE_ATTRIBUTE
+ */
+static size_t xml_template_escaped_length(const char *v, int context) {
+	size_t l = 0;
+
+	for (; *v; ++v) {
+		const char *entity = xml_template_entity(*v, context);
+
+		l += entity ? strlen(entity) : 1;
+	}
+
+	return l;
+}
+
+/**
+ * Copy bytes into buffer as far as they fit; returns new position
+ *
+ * @param buf - buffer
+ * @param size - size of buffer
+ * @param pos - position in output
+ * @param d - data
+ * @param l - length of data
+ */
+static size_t xml_template_put(
+		char *buf,
+		size_t size,
+		size_t pos,
+		const char *d,
+		size_t l) {
+	if (pos < size) {
+		memcpy(buf + pos, d, size - pos < l ? size - pos : l);
+	}
+
+	return pos + l;
+}
+
+/**
+ * Escape value into buffer; returns new position
+ *
+ * @param buf - buffer
+ * @param size - size of buffer
+ * @param pos - position in output
+ * @param v - value
+ * @param context - XML_TEMPLATE_TEXT or XML_TEMPLATE_ATTRIBUTE
+ */
+static size_t xml_template_escape(
+		char *buf,
+		size_t size,
+		size_t pos,
+		const char *v,
+		int context) {
+	const char *special = xml_template_special[context];
+
+	for (;;) {
+		size_t l = strcspn(v, special);
+		const char *entity;
+
+		pos = xml_template_put(buf, size, pos, v, l);
+		v += l;
+
+		if (!*v) {
+			return pos;
+		}
+
+		entity = xml_template_entity(*v++, context);
+		pos = xml_template_put(buf, size, pos, entity, strlen(entity));
+	}
+}
+
+#ifndef WIN32
+/**
+ * Write all vectors
+ *
+ * @param fd - file descriptor
+ * @param iov - vectors
+ * @param count - number of vectors
+ */
+static int xml_template_writev(int fd, struct iovec *iov, size_t count) {
+	while (count > 0) {
+		ssize_t w = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+
+		if (w < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		/* skip what has been written */
+		for (; count > 0 && (size_t) w >= iov->iov_len; ++iov, --count) {
+			w -= iov->iov_len;
+		}
+
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/*****************************************************************************
+ * PUBLIC INTERFACE
+ ****************************************************************************/
+
+/**
+ * Compile template; returns NULL if it isn't a document or has
+ * unterminated or misplaced placeholders
+ *
+ * @param source - template document
+ */
+struct xml_template *xml_template_compile(const char *source) {
+	struct xml_template *t;
+	struct xml_element *root;
+	size_t l;
+
+	if (!source || !(root = xml_parse(source))) {
+		return NULL;
+	}
+
+	xml_free(root);
+
+	if (!(t = calloc(1, sizeof(struct xml_template)))) {
+		return NULL;
+	}
+
+	l = strlen(source);
+
+	if (!(t->source = malloc(l + 1))) {
+		free(t);
+		return NULL;
+	}
+
+	memcpy(t->source, source, l + 1);
+
+	if (xml_template_scan(t)) {
+		xml_template_free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+/**
+ * Free template
+ *
+ * @param t - template
+ */
+void xml_template_free(struct xml_template *t) {
+	size_t i;
+
+	if (!t) {
+		return;
+	}
+
+	for (i = 0; i < t->slot_count; ++i) {
+		free(t->names[i]);
+	}
+
+	free(t->names);
+	free(t->parts);
+	free(t->source);
+	free(t);
+}
+
+/**
+ * Return index of named slot or -1 if there's none
+ *
+ * @param t - template
+ * @param name - name of slot
+ */
+long xml_template_slot(struct xml_template *t, const char *name) {
+	size_t i;
+
+	for (i = 0; i < t->slot_count; ++i) {
+		if (!strcmp(t->names[i], name)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Return number of slots
+ *
+ * @param t - template
+ */
+size_t xml_template_slot_count(struct xml_template *t) {
+	return t->slot_count;
+}
+
+/**
+ * Return name of slot
+ *
+ * @param t - template
+ * @param slot - index of slot
+ */
+const char *xml_template_slot_name(struct xml_template *t, size_t slot) {
+	return slot < t->slot_count ? t->names[slot] : NULL;
+}
+
+/**
+ * Render template into buffer; returns length of the whole output and
+ * terminates the buffer like snprintf() if there's room
+ *
+ * @param t - template
+ * @param values - one value per slot, NULL values are empty
+ * @param buf - buffer, may be NULL if size is 0
+ * @param size - size of buffer
+ */
+size_t xml_template_render(
+		struct xml_template *t,
+		const char **values,
+		char *buf,
+		size_t size) {
+	size_t pos = 0;
+	size_t i;
+
+	for (i = 0; i < t->count; ++i) {
+		struct xml_template_part *p = t->parts + i;
+
+		pos = xml_template_put(
+			buf,
+			size,
+			pos,
+			t->source + p->offset,
+			p->length);
+
+		if (p->slot > -1 && values[p->slot]) {
+			pos = xml_template_escape(
+				buf,
+				size,
+				pos,
+				values[p->slot],
+				p->context);
+		}
+	}
+
+	if (size > 0) {
+		buf[pos < size ? pos : size - 1] = 0;
+	}
+
+	return pos;
+}
+
+#ifndef WIN32
+/**
+ * Write rendered template to file descriptor
+ *
+ * @param t - template
+ * @param fd - file descriptor
+ * @param values - one value per slot, NULL values are empty
+ */
+int xml_template_write(struct xml_template *t, int fd, const char **values) {
+	struct iovec vectors[XML_TEMPLATE_VECTORS];
+	char scratch[XML_TEMPLATE_SCRATCH];
+	struct iovec *iov = vectors;
+	char *escaped = scratch;
+	size_t extra = 0;
+	size_t n = 0;
+	size_t i;
+	int r;
+
+	/* find out how much escaping there is to do */
+	for (i = 0; i < t->count; ++i) {
+		struct xml_template_part *p = t->parts + i;
+		const char *v;
+
+		if (p->slot > -1 &&
+				(v = values[p->slot]) &&
+				v[strcspn(v, xml_template_special[p->context])]) {
+			extra += xml_template_escaped_length(v, p->context);
+		}
+	}
+
+	if (t->count * 2 > XML_TEMPLATE_VECTORS &&
+			!(iov = malloc(t->count * 2 * sizeof(struct iovec)))) {
+		return -1;
+	}
+
+	if (extra > sizeof(scratch) && !(escaped = malloc(extra))) {
+		if (iov != vectors) {
+			free(iov);
+		}
+
+		return -1;
+	}
+
+	for (extra = 0, i = 0; i < t->count; ++i) {
+		struct xml_template_part *p = t->parts + i;
+		const char *v;
+		size_t l;
+
+		if (p->length > 0) {
+			iov[n].iov_base = t->source + p->offset;
+			iov[n++].iov_len = p->length;
+		}
+
+		if (p->slot < 0 || !(v = values[p->slot]) || !*v) {
+			continue;
+		}
+
+		if (!v[l = strcspn(v, xml_template_special[p->context])]) {
+			/* values that don't need escaping are written
+			 * as they are */
+			iov[n].iov_base = (char *) v;
+			iov[n++].iov_len = l;
+		} else {
+			l = xml_template_escape(
+				escaped + extra,
+				(size_t) -1 - extra,
+				0,
+				v,
+				p->context);
+			iov[n].iov_base = escaped + extra;
+			iov[n++].iov_len = l;
+			extra += l;
+		}
+	}
+
+	r = xml_template_writev(fd, iov, n);
+
+	if (iov != vectors) {
+		free(iov);
+	}
+
+	if (escaped != scratch) {
+		free(escaped);
+	}
+
+	return r;
+}
+#endif
@@ -0,0 +1,52 @@
+#ifndef _xml_template_h_
+#define _xml_template_h_
+
+#include <stddef.h>
+
+#include "xml.h"
+
+/* Precompiled document templates.
+ *
+ * A template is a document with placeholders like "{{name}}" in
+ * character data and quoted attribute values:
+ *
+ *	<user id="{{id}}"><name>{{name}}</name></user>
+ *
+ * xml_template_compile() splits it once into static byte runs and
+ * slots. Slots are numbered in order of their first appearance and a
+ * name may appear more than once. Rendering takes one value per slot,
+ * escapes it for its context and copies nothing else:
+ *
+ *	struct xml_template *t = xml_template_compile(source);
+ *	const char *values[2];
+ *
+ *	values[xml_template_slot(t, "id")] = "42";
+ *	values[xml_template_slot(t, "name")] = "Jane & John";
+ *	xml_template_write(t, STDOUT_FILENO, values);
+ *
+ * xml_template_write() hands static runs and values to writev() as
+ * they are; only values with characters that need escaping are copied.
+ * xml_template_render() renders into a buffer like snprintf().
+ * Placeholders in comments, CDATA sections and processing instructions
+ * are left alone; placeholders elsewhere in tags are rejected. */
+
+struct xml_template;
+
+struct xml_template *xml_template_compile(const char *);
+void xml_template_free(struct xml_template *);
+
+long xml_template_slot(struct xml_template *, const char *);
+size_t xml_template_slot_count(struct xml_template *);
+const char *xml_template_slot_name(struct xml_template *, size_t);
+
+size_t xml_template_render(
+	struct xml_template *,
+	const char **,
+	char *,
+	size_t);
+
+#ifndef WIN32
+int xml_template_write(struct xml_template *, int, const char **);
+#endif
+
+#endif